@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+# Check that --ipset adds every address of a reply to the set, also when
+# some of them are there already. dnsmasq sends the addresses of a reply
+# as one batch; the kernel must not stop at the first one which exists.
+#
+# Needs root and a kernel with hash:ip sets, but not the ipset tool. Run
+# it in a network namespace of its own, so the set and port are private:
+#
+#   unshare -n ./ipset-test.py ../../src/dnsmasq
+
+import os, socket, struct, subprocess, sys, threading, time
+
+SETNAME = b'dnsmasqtest'
+DOMAIN = 'ipset.test'
+UPSTREAM = 5399
+PORT = 5398
+PRESENT = '10.0.0.1'		# in the set before the query
+ADDRESSES = [PRESENT, '10.0.0.2', '10.0.0.3']
+
+NETLINK_NETFILTER = 12
+NFNL_SUBSYS_IPSET = 6
+IPSET_CMD_CREATE, IPSET_CMD_LIST, IPSET_CMD_ADD = 2, 7, 9
+IPSET_ATTR_PROTOCOL, IPSET_ATTR_SETNAME, IPSET_ATTR_TYPENAME = 1, 2, 3
+IPSET_ATTR_REVISION, IPSET_ATTR_FAMILY, IPSET_ATTR_DATA = 4, 5, 7
+IPSET_ATTR_ADT, IPSET_ATTR_IP, IPSET_ATTR_IPADDR_IPV4 = 8, 1, 1
+NLA_F_NESTED, NLA_F_NET_BYTEORDER = 1 << 15, 1 << 14
+NLM_F_REQUEST, NLM_F_ACK, NLM_F_DUMP = 1, 4, 0x300
+NLMSG_ERROR, NLMSG_DONE = 2, 3
+
+def attr(type, data):
+    a = struct.pack('=HH', 4 + len(data), type) + data
+    return a + b'\0' * (-len(a) % 4)
+
+def element(addr):
+    ip = attr(IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER, socket.inet_aton(addr))
+    return attr(IPSET_ATTR_DATA | NLA_F_NESTED, attr(IPSET_ATTR_IP | NLA_F_NESTED, ip))
+
+def ipset(cmd, flags, attrs):
+    s = socket.socket(socket.AF_NETLINK, socket.SOCK_RAW, NETLINK_NETFILTER)
+    body = struct.pack('=BBH', socket.AF_INET, 0, 0)
+    body += attr(IPSET_ATTR_PROTOCOL, b'\x06') + attr(IPSET_ATTR_SETNAME, SETNAME + b'\0') + attrs
+    s.send(struct.pack('=IHHII', 16 + len(body), (NFNL_SUBSYS_IPSET << 8) | cmd,
+                       NLM_F_REQUEST | flags, 1, 0) + body)
+    msgs = []
+    while True:
+        d = s.recv(65536)
+        while d:
+            length, type = struct.unpack('=IH', d[:6])
+            if type == NLMSG_ERROR:
+                err = struct.unpack('=i', d[16:20])[0]
+                if err:
+                    sys.exit('ipset command %d failed: %s' % (cmd, os.strerror(-err)))
+                return msgs
+            if type == NLMSG_DONE:
+                return msgs
+            msgs.append(d[20:length])
+            d = d[(length + 3) & ~3:]
+
+def members(data, found, adt=False):
+    while len(data) >= 4:
+        length, type = struct.unpack('=HH', data[:4])
+        value = data[4:length]
+        if type & NLA_F_NESTED:
+            members(value, found, adt or (type & 0xff) == IPSET_ATTR_ADT)
+        elif adt and (type & 0xff) == IPSET_ATTR_IPADDR_IPV4:
+            found.add(socket.inet_ntoa(value))
+        data = data[(length + 3) & ~3:]
+    return found
+
+def upstream(s):
+    while True:
+        d, a = s.recvfrom(2048)
+        i = 12
+        while d[i]:
+            i += d[i] + 1
+        q = d[12:i + 5]
+        r = struct.pack('!HHHHHH', struct.unpack('!H', d[:2])[0], 0x8180, 1, len(ADDRESSES), 0, 0) + q
+        for addr in ADDRESSES:
+            r += b'\xc0\x0c' + struct.pack('!HHIH', 1, 1, 300, 4) + socket.inet_aton(addr)
+        s.sendto(r, a)
+
+def query(name):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(1)
+    q = struct.pack('!HHHHHH', 1234, 0x0100, 1, 0, 0, 0)
+    q += b''.join(bytes([len(l)]) + l.encode() for l in name.split('.')) + b'\0\0\1\0\1'
+    for i in range(5):
+        s.sendto(q, ('127.0.0.1', PORT))
+        try:
+            return s.recv(2048)
+        except socket.timeout:
+            pass
+    sys.exit('no answer from dnsmasq')
+
+dnsmasq = sys.argv[1] if len(sys.argv) > 1 else '../../src/dnsmasq'
+
+subprocess.run(['ip', 'link', 'set', 'lo', 'up'], check=True)
+ipset(IPSET_CMD_CREATE, NLM_F_ACK,
+      attr(IPSET_ATTR_TYPENAME, b'hash:ip\0') + attr(IPSET_ATTR_REVISION, b'\0') +
+      attr(IPSET_ATTR_FAMILY, bytes([socket.AF_INET])))
+ipset(IPSET_CMD_ADD, NLM_F_ACK, element(PRESENT))
+
+u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+u.bind(('127.0.0.1', UPSTREAM))
+threading.Thread(target=upstream, args=(u,), daemon=True).start()
+
+p = subprocess.Popen([dnsmasq, '-d', '-C', '/dev/null', '--no-resolv', '--no-hosts',
+                      '-p', str(PORT), '--listen-address=127.0.0.1', '--bind-interfaces',
+                      '--server=127.0.0.1#%d' % UPSTREAM,
+                      '--ipset=/%s/%s' % (DOMAIN, SETNAME.decode())],
+                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+try:
+    time.sleep(0.5)
+    query('www.' + DOMAIN)
+    time.sleep(0.2)
+finally:
+    p.terminate()
+    p.wait()
+
+found = set()
+for m in ipset(IPSET_CMD_LIST, NLM_F_DUMP, b''):
+    members(m, found)
+missing = [a for a in ADDRESSES if a not in found]
+if missing:
+    sys.exit('FAIL: not in the set: %s' % ' '.join(missing))
+print('OK: %s all in the set' % ' '.join(ADDRESSES))
@@ -0,0 +1,117 @@
+/* Measure the cost of one trip round the dnsmasq event loop, as done
+   by src/poll.c, against the number of fds being listened to.
+
+   Each iteration does what dnsmasq's main loop does: poll_reset(),
+   poll_listen() on every fd, do_poll() and then poll_check() on every fd,
+   with one fd made readable beforehand. Build with "make" and compare the
+   output of poll-bench (poll()) and poll-bench-epoll (epoll).
+
+   usage: poll-bench [<iterations> [<nfds> ...]] */
+
+#include "dnsmasq.h"
+#include <sys/resource.h>
+
+struct daemon *daemon;
+
+void *whine_malloc(size_t size)
+{
+  void *ret = calloc(1, size);
+
+  if (!ret)
+    perror("poll-bench");
+
+  return ret;
+}
+
+void die(char *message, char *arg1, int exit_code)
+{
+  fprintf(stderr, message, arg1 ? arg1 : "", strerror(errno));
+  fprintf(stderr, "\n");
+  exit(exit_code);
+}
+
+static double bench(int nfds, int iterations)
+{
+  int (*pairs)[2] = calloc(nfds, sizeof(*pairs));
+  struct timespec start, end;
+  char c = 0;
+  int i, j;
+
+  if (!pairs)
+    die("out of memory", NULL, 1);
+
+  for (i = 0; i < nfds; i++)
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pairs[i]) == -1)
+      die("socketpair: %s%s", NULL, 1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (j = 0; j < iterations; j++)
+    {
+      int ready = rand() % nfds, hits = 0;
+
+      if (write(pairs[ready][1], &c, 1) != 1)
+	die("write: %s%s", NULL, 1);
+
+      poll_reset();
+      for (i = 0; i < nfds; i++)
+	poll_listen(pairs[i][0], POLLIN);
+
+      if (do_poll(-1) != 1)
+	die("do_poll: %s%s", NULL, 1);
+
+      for (i = 0; i < nfds; i++)
+	if (poll_check(pairs[i][0], POLLIN))
+	  {
+	    if (read(pairs[i][0], &c, 1) != 1)
+	      die("read: %s%s", NULL, 1);
+	    hits++;
+	  }
+
+      if (hits != 1)
+	die("wrong number of fds ready%s%s", NULL, 1);
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < nfds; i++)
+    {
+      poll_forget(pairs[i][0]);
+      close(pairs[i][0]);
+      close(pairs[i][1]);
+    }
+  free(pairs);
+
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  static int defaults[] = { 8, 64, 256, 1024, 4096, 0 };
+  int iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+  struct rlimit rl;
+  int i;
+
+  /* two fds per pair */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+#ifdef HAVE_EPOLL
+  printf("backend: epoll\n");
+#else
+  printf("backend: poll\n");
+#endif
+  printf("%8s %14s\n", "fds", "ns/iteration");
+
+  if (argc > 2)
+    for (i = 2; i < argc; i++)
+      printf("%8d %14.0f\n", atoi(argv[i]), bench(atoi(argv[i]), iterations));
+  else
+    for (i = 0; defaults[i]; i++)
+      printf("%8d %14.0f\n", defaults[i], bench(defaults[i], iterations));
+
+  return 0;
+}
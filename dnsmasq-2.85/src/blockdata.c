@@ -16,48 +16,15 @@
 
 #include "dnsmasq.h"
 
-static struct blockdata *keyblock_free;
-static unsigned int blockdata_count, blockdata_hwm, blockdata_alloced;
-
-static void blockdata_expand(int n)
-{
-  struct blockdata *new = whine_malloc(n * sizeof(struct blockdata));
-  
-  if (new)
-    {
-      int i;
-      
-      new[n-1].next = keyblock_free;
-      keyblock_free = new;
-
-      for (i = 0; i < n - 1; i++)
-	new[i].next = &new[i+1];
-
-      blockdata_alloced += n;
-    }
-}
-
-/* Preallocate some blocks, proportional to cachesize, to reduce heap fragmentation. */
+/* Preallocate some blocks, proportional to cachesize. Blocks come from
+   the slab allocator, which keeps them together and reports their use. */
 void blockdata_init(void)
 {
-  keyblock_free = NULL;
-  blockdata_alloced = 0;
-  blockdata_count = 0;
-  blockdata_hwm = 0;
-
   /* Note that daemon->cachesize is enforced to have non-zero size if OPT_DNSSEC_VALID is set */  
   if (option_bool(OPT_DNSSEC_VALID))
-    blockdata_expand(daemon->cachesize);
+    slab_reserve(SLAB_BLOCKDATA, daemon->cachesize);
 }
 
-void blockdata_report(void)
-{
-  my_syslog(LOG_INFO, _("pool memory in use %u, max %u, allocated %u"), 
-	    blockdata_count * sizeof(struct blockdata),  
-	    blockdata_hwm * sizeof(struct blockdata),  
-	    blockdata_alloced * sizeof(struct blockdata));
-} 
-
 static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
 {
   struct blockdata *block, *ret = NULL;
@@ -66,24 +33,12 @@ static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
 
   while (len > 0)
     {
-      if (!keyblock_free)
-	blockdata_expand(50);
-      
-      if (keyblock_free)
-	{
-	  block = keyblock_free;
-	  keyblock_free = block->next;
-	  blockdata_count++; 
-	}
-      else
+      if (!(block = slab_alloc(SLAB_BLOCKDATA)))
 	{
 	  /* failed to alloc, free partial chain */
 	  blockdata_free(ret);
 	  return NULL;
 	}
-       
-      if (blockdata_hwm < blockdata_count)
-	blockdata_hwm = blockdata_count; 
       
       blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
       if (data)
@@ -115,13 +70,10 @@ void blockdata_free(struct blockdata *blocks)
 {
   struct blockdata *tmp;
   
-  if (blocks)
+  for (; blocks; blocks = tmp)
     {
-      for (tmp = blocks; tmp->next; tmp = tmp->next)
-	blockdata_count--;
-      tmp->next = keyblock_free;
-      keyblock_free = blocks; 
-      blockdata_count--;
+      tmp = blocks->next;
+      slab_free(blocks);
     }
 }
 
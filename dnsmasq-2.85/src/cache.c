@@ -17,12 +17,14 @@
 #include "dnsmasq.h"
 
 static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
+/* Entries with F_REVERSE are also chained on rev_next, in a table of the same size
+   hashed on address, so that reverse lookups don't have to visit every hash chain. */
+static struct crec **rev_table = NULL;
 #ifdef HAVE_DHCP
 static struct crec *dhcp_spare = NULL;
 #endif
 static struct crec *new_chain = NULL;
 static int insert_error;
-static union bigname *big_free = NULL;
 static int bignames_left, hash_size;
 
 static void make_non_terminals(struct crec *source);
@@ -81,6 +83,9 @@ static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
 static void rehash(int size);
 static void cache_hash(struct crec *crecp);
+static void rev_hash(struct crec *crecp);
+static void rev_unhash(struct crec *crecp);
+static void cache_unhash_name(struct crec *crecp);
 
 void next_uid(struct crec *crecp)
 {
@@ -127,7 +132,7 @@ void cache_init(void)
    expand the table. */
 static void rehash(int size)
 {
-  struct crec **new, **old, *p, *tmp;
+  struct crec **new, **new_rev, **old, *p, *tmp;
   int i, new_size, old_size;
 
   /* hash_size is a power of two. */
@@ -135,17 +140,27 @@ static void rehash(int size)
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
-    new = safe_malloc(new_size * sizeof(struct crec *));
+    {
+      new = safe_malloc(new_size * sizeof(struct crec *));
+      new_rev = safe_malloc(new_size * sizeof(struct crec *));
+    }
   else if (new_size <= hash_size || !(new = whine_malloc(new_size * sizeof(struct crec *))))
     return;
+  else if (!(new_rev = whine_malloc(new_size * sizeof(struct crec *))))
+    {
+      free(new);
+      return;
+    }
 
   for(i = 0; i < new_size; i++)
-    new[i] = NULL;
+    new[i] = new_rev[i] = NULL;
 
   old = hash_table;
   old_size = hash_size;
   hash_table = new;
   hash_size = new_size;
+  free(rev_table);
+  rev_table = new_rev;
   
   if (old)
     {
@@ -176,6 +191,57 @@ static struct crec **hash_bucket(char *name)
   return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
 }
 
+static struct crec **rev_bucket(const union all_addr *addr, unsigned int flags)
+{
+  unsigned int val = 017465;
+  int i, addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
+  const unsigned char *mix_tab = (const unsigned char*)typestr, *a = (const unsigned char *)addr;
+
+  for (i = 0; i < addrlen; i++)
+    val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + a[i]) & 0x3F] ^ a[i]);
+
+  /* hash_size is a power of two */
+  return rev_table + ((val ^ (val >> 16)) & (hash_size - 1));
+}
+
+static void rev_hash(struct crec *crecp)
+{
+  struct crec **up;
+
+  if (crecp->flags & F_REVERSE)
+    {
+      up = rev_bucket(&crecp->addr, crecp->flags);
+      crecp->rev_next = *up;
+      *up = crecp;
+    }
+}
+
+static void rev_unhash(struct crec *crecp)
+{
+  struct crec **up;
+
+  if (crecp->flags & F_REVERSE)
+    for (up = rev_bucket(&crecp->addr, crecp->flags); *up; up = &((*up)->rev_next))
+      if (*up == crecp)
+	{
+	  *up = crecp->rev_next;
+	  break;
+	}
+}
+
+/* Remove from the hash chain for its name, when found via rev_table. */
+static void cache_unhash_name(struct crec *crecp)
+{
+  struct crec **up;
+
+  for (up = hash_bucket(cache_get_name(crecp)); *up; up = &((*up)->hash_next))
+    if (*up == crecp)
+      {
+	*up = crecp->hash_next;
+	break;
+      }
+}
+
 static void cache_hash(struct crec *crecp)
 {
   /* maintain an invariant that all entries with F_REVERSE set
@@ -196,6 +262,8 @@ static void cache_hash(struct crec *crecp)
     }
   crecp->hash_next = *up;
   *up = crecp;
+
+  rev_hash(crecp);
 }
 
 static void cache_blockdata_free(struct crec *crecp)
@@ -230,9 +298,10 @@ static void cache_free(struct crec *crecp)
   /* retrieve big name for further use. */
   if (crecp->flags & F_BIGNAME)
     {
-      crecp->name.bname->next = big_free;
-      big_free = crecp->name.bname;
+      slab_free(crecp->name.bname);
       crecp->flags &= ~F_BIGNAME;
+      if (bignames_left < daemon->cachesize/10)
+	bignames_left++;
     }
 
   cache_blockdata_free(crecp);
@@ -329,10 +398,65 @@ static int is_expired(time_t now, struct crec *crecp)
 
   if (difftime(now, crecp->ttd) < 0)
     return 0;
+
+  /* --serve-stale keeps answers from upstream for a while after they expire,
+     but not DHCP names or the DNSSEC keys needed to validate new answers.
+     Nor negative answers: those are never refreshed when served. */
+  if (daemon->serve_stale != 0 && !(crecp->flags & (F_DHCP | F_DNSKEY | F_DS | F_NEG)) &&
+      difftime(now, crecp->ttd) < daemon->serve_stale)
+    return 0;
   
   return 1;
 }
 
+/* Past its TTL, but kept for --serve-stale. */
+static int is_stale(time_t now, struct crec *crecp)
+{
+  return !(crecp->flags & (F_IMMORTAL | F_HOSTS | F_DHCP | F_CONFIG)) &&
+    difftime(now, crecp->ttd) >= 0 && !is_expired(now, crecp);
+}
+
+/* The cache is full: give up the stale entries which expired longest ago,
+   those in the oldest quarter of the range found, to make room for new
+   answers. Returns the number freed. */
+static int cache_free_stale(time_t now)
+{
+  struct crec *crecp, **up;
+  time_t oldest = 0, newest = 0, cutoff;
+  int i, found = 0, freed = 0;
+
+  for (i = 0; i < hash_size; i++)
+    for (crecp = hash_table[i]; crecp; crecp = crecp->hash_next)
+      if (is_stale(now, crecp))
+	{
+	  if (!found || difftime(oldest, crecp->ttd) > 0)
+	    oldest = crecp->ttd;
+	  if (!found || difftime(crecp->ttd, newest) > 0)
+	    newest = crecp->ttd;
+	  found = 1;
+	}
+
+  if (!found)
+    return 0;
+
+  cutoff = oldest + (newest - oldest) / 4;
+  
+  for (i = 0; i < hash_size; i++)
+    for (up = &hash_table[i], crecp = *up; crecp; crecp = *up)
+      if (is_stale(now, crecp) && difftime(crecp->ttd, cutoff) <= 0)
+	{
+	  *up = crecp->hash_next;
+	  rev_unhash(crecp);
+	  cache_unlink(crecp);
+	  cache_free(crecp);
+	  freed++;
+	}
+      else
+	up = &crecp->hash_next;
+
+  return freed;
+}
+
 static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned short class, time_t now,
 				    unsigned int flags, struct crec **target_crec, unsigned int *target_uid)
 {
@@ -340,7 +464,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
      If (flags & F_FORWARD) then remove any forward entries for name and any expired
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
-     entries in the whole cache.
+     entries in the same address hash chain as addr.
      If (flags == 0) remove any expired entries in the whole cache. 
 
      In the flags & F_FORWARD case, the return code is valid, and returns a non-NULL pointer
@@ -369,6 +493,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		    return crecp;
 		  *up = crecp->hash_next;
+		  rev_unhash(crecp);
 		  /* If this record is for the name we're inserting and is the target
 		     of a CNAME record. Make the new record for the same name, in the same
 		     crec, with the same uid to avoid breaking the existing CNAME. */
@@ -391,6 +516,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 		  if (crecp->flags & F_CONFIG)
 		    return crecp;
 		  *up = crecp->hash_next;
+		  rev_unhash(crecp);
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		  continue;
@@ -401,6 +527,7 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 	  if (is_expired(now, crecp) || is_outdated_cname_pointer(crecp))
 	    { 
 	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{
 		  cache_unlink(crecp);
@@ -412,18 +539,20 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 	  up = &crecp->hash_next;
 	}
     }
-  else
+  else if (flags & F_REVERSE)
     {
-      int i;
+      struct crec *next;
       int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 
-      for (i = 0; i < hash_size; i++)
-	for (crecp = hash_table[i], up = &hash_table[i]; 
-	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
-	     crecp = crecp->hash_next)
+      /* Only entries which share the address hash chain are visited. */
+      for (up = rev_bucket(addr, flags), crecp = *up; crecp; crecp = next)
+	{
+	  next = crecp->rev_next;
+	  
 	  if (is_expired(now, crecp))
 	    {
-	      *up = crecp->hash_next;
+	      *up = next;
+	      cache_unhash_name(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{ 
 		  cache_unlink(crecp);
@@ -431,14 +560,36 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
 		}
 	    }
 	  else if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
-		   (flags & crecp->flags & F_REVERSE) && 
 		   (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
 		   memcmp(&crecp->addr, addr, addrlen) == 0)
 	    {
-	      *up = crecp->hash_next;
+	      *up = next;
+	      cache_unhash_name(crecp);
 	      cache_unlink(crecp);
 	      cache_free(crecp);
 	    }
+	  else
+	    up = &crecp->rev_next;
+	}
+    }
+  else
+    {
+      int i;
+
+      for (i = 0; i < hash_size; i++)
+	for (crecp = hash_table[i], up = &hash_table[i]; 
+	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
+	     crecp = crecp->hash_next)
+	  if (is_expired(now, crecp))
+	    {
+	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
+	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
+		{ 
+		  cache_unlink(crecp);
+		  cache_free(crecp);
+		}
+	    }
 	  else
 	    up = &crecp->hash_next;
     }
@@ -505,7 +656,7 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
 {
   struct crec *new, *target_crec = NULL;
   union bigname *big_name = NULL;
-  int freed_all = flags & F_REVERSE;
+  int freed_all = 0, freed_stale = 0;
   int free_avail = 0;
   unsigned int target_uid;
   
@@ -542,6 +693,14 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
       insert_error = 1;
       return NULL;
     }
+
+  /* Likewise for names in a hosts image. */
+  if ((flags & F_FORWARD) && (flags & (F_IPV4 | F_IPV6)) &&
+      hosts_image_exists(name, flags & (F_IPV4 | F_IPV6)))
+    {
+      insert_error = 1;
+      return NULL;
+    }
   
   /* Now get a cache entry from the end of the LRU list */
   if (!target_crec)
@@ -576,7 +735,15 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
 	  return NULL;
 	}
       
-      if (freed_all)
+      /* With --serve-stale nothing may have expired, but stale
+	 entries can go before live ones. */
+      if (freed_all && !freed_stale && daemon->serve_stale != 0)
+	{
+	  freed_stale = 1;
+	  if (cache_free_stale(now) != 0)
+	    free_avail = 1;
+	}
+      else if (freed_all)
 	{
 	  /* For DNSSEC records, uid holds class. */
 	  free_avail = 1; /* Must be free space now. */
@@ -594,13 +761,8 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
      If that fails, give up now, always succeed for DNSSEC records. */
   if (name && (strlen(name) > SMALLDNAME-1))
     {
-      if (big_free)
-	{ 
-	  big_name = big_free;
-	  big_free = big_free->next;
-	}
-      else if ((bignames_left == 0 && !(flags & (F_DS | F_DNSKEY))) ||
-	       !(big_name = (union bigname *)whine_malloc(sizeof(union bigname))))
+      if ((bignames_left == 0 && !(flags & (F_DS | F_DNSKEY))) ||
+	  !(big_name = (union bigname *)slab_alloc(SLAB_BIGNAME)))
 	{
 	  insert_error = 1;
 	  return NULL;
@@ -642,6 +804,8 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
     new->addr = *addr;	
 
   new->ttd = now + (time_t)ttl;
+  new->ttl = ttl;
+  new->hits = 0;
   new->next = new_chain;
   new_chain = new;
 
@@ -816,7 +980,7 @@ int cache_find_non_terminal(char *name, time_t now)
 	hostname_isequal(name, cache_get_name(crecp)))
       return 1;
 
-  return 0;
+  return hosts_image_exists(name, 0);
 }
 
 struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsigned int prot)
@@ -886,6 +1050,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    {
 	      /* expired entry, free it */
 	      *up = crecp->hash_next;
+	      rev_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		{ 
 		  cache_unlink(crecp);
@@ -894,6 +1059,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    }
 	}
 	  
+      chainp = hosts_image_find_name(chainp, name, prot);
       *chainp = cache_head;
     }
 
@@ -917,16 +1083,14 @@ struct crec *cache_find_by_addr(struct crec *crecp, union all_addr *addr,
   else
     {  
       /* first search, look for relevant entries and push to top of list
-	 also free anything which has expired. All the reverse entries are at the
-	 start of the hash chain, so we can give up when we find the first 
-	 non-REVERSE one.  */
-       int i;
-       struct crec **up, **chainp = &ans;
+	 also free anything which has expired. Only the chain in rev_table
+	 for the address needs to be searched. */
+       struct crec **up, **chainp = &ans, *next;
        
-       for (i=0; i<hash_size; i++)
-	 for (crecp = hash_table[i], up = &hash_table[i]; 
-	      crecp && (crecp->flags & F_REVERSE);
-	      crecp = crecp->hash_next)
+       for (up = rev_bucket(addr, prot), crecp = *up; crecp; crecp = next)
+	 {
+	   next = crecp->rev_next;
+	   
 	   if (!is_expired(now, crecp))
 	     {      
 	       if ((crecp->flags & prot) &&
@@ -943,18 +1107,21 @@ struct crec *cache_find_by_addr(struct crec *crecp, union all_addr *addr,
 		       cache_link(crecp);
 		     }
 		 }
-	       up = &crecp->hash_next;
+	       up = &crecp->rev_next;
 	     }
 	   else
 	     {
-	       *up = crecp->hash_next;
+	       *up = next;
+	       cache_unhash_name(crecp);
 	       if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
 		 {
 		   cache_unlink(crecp);
 		   cache_free(crecp);
 		 }
 	     }
+	 }
        
+       chainp = hosts_image_find_addr(chainp, addr, prot);
        *chainp = cache_head;
     }
   
@@ -977,7 +1144,7 @@ static void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrle
   /* Remove duplicates in hosts files. */
   if (lookup && (lookup->flags & F_HOSTS) && memcmp(&lookup->addr, addr, addrlen) == 0)
     {
-      free(cache);
+      slab_free(cache);
       return;
     }
     
@@ -1094,6 +1261,8 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
       my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
       return cache_size;
     }
+
+  daemon->cache_gen++;
   
   lineno += eatspace(f);
   
@@ -1144,7 +1313,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	    {
 	      /* If set, add a version of the name with a default domain appended */
 	      if (option_bool(OPT_EXPAND) && domain_suffix && !fqdn && 
-		  (cache = whine_malloc(SIZEOF_BARE_CREC + strlen(canon) + 2 + strlen(domain_suffix))))
+		  (cache = slab_alloc_crec(strlen(canon) + 1 + strlen(domain_suffix))))
 		{
 		  strcpy(cache->name.sname, canon);
 		  strcat(cache->name.sname, ".");
@@ -1154,7 +1323,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 		  add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
 		  name_count++;
 		}
-	      if ((cache = whine_malloc(SIZEOF_BARE_CREC + strlen(canon) + 1)))
+	      if ((cache = slab_alloc_crec(strlen(canon))))
 		{
 		  strcpy(cache->name.sname, canon);
 		  cache->flags = flags;
@@ -1202,6 +1371,14 @@ void cache_reload(void)
 
   daemon->metrics[METRIC_DNS_CACHE_INSERTED] = 0;
   daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED] = 0;
+  daemon->cache_gen++;
+
+  /* Hosts images are mapped, not read into the cache. */
+  hosts_image_load();
+  
+  /* Only DHCP entries survive, they are put back as we find them. */
+  for (i=0; i<hash_size; i++)
+    rev_table[i] = NULL;
   
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
@@ -1212,26 +1389,30 @@ void cache_reload(void)
 	if (cache->flags & (F_HOSTS | F_CONFIG))
 	  {
 	    *up = cache->hash_next;
-	    free(cache);
+	    slab_free(cache);
 	  }
 	else if (!(cache->flags & F_DHCP))
 	  {
 	    *up = cache->hash_next;
 	    if (cache->flags & F_BIGNAME)
 	      {
-		cache->name.bname->next = big_free;
-		big_free = cache->name.bname;
+		slab_free(cache->name.bname);
+		if (bignames_left < daemon->cachesize/10)
+		  bignames_left++;
 	      }
 	    cache->flags = 0;
 	  }
 	else
-	  up = &cache->hash_next;
+	  {
+	    rev_hash(cache);
+	    up = &cache->hash_next;
+	  }
       }
   
   /* Add locally-configured CNAMEs to the cache */
   for (a = daemon->cnames; a; a = a->next)
     if (a->alias[1] != '*' &&
-	((cache = whine_malloc(SIZEOF_POINTER_CREC))))
+	((cache = slab_alloc(SLAB_CREC))))
       {
 	cache->flags = F_FORWARD | F_NAMEP | F_CNAME | F_IMMORTAL | F_CONFIG;
 	cache->ttd = a->ttl;
@@ -1245,7 +1426,7 @@ void cache_reload(void)
   
 #ifdef HAVE_DNSSEC
   for (ds = daemon->ds; ds; ds = ds->next)
-    if ((cache = whine_malloc(SIZEOF_POINTER_CREC)) &&
+    if ((cache = slab_alloc(SLAB_CREC)) &&
 	(cache->addr.ds.keydata = blockdata_alloc(ds->digest, ds->digestlen)))
       {
 	cache->flags = F_FORWARD | F_IMMORTAL | F_DS | F_CONFIG | F_NAMEP;
@@ -1272,7 +1453,7 @@ void cache_reload(void)
     for (nl = hr->names; nl; nl = nl->next)
       {
 	if ((hr->flags & HR_4) &&
-	    (cache = whine_malloc(SIZEOF_POINTER_CREC)))
+	    (cache = slab_alloc(SLAB_CREC)))
 	  {
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
@@ -1281,7 +1462,7 @@ void cache_reload(void)
 	  }
 
 	if ((hr->flags & HR_6) &&
-	    (cache = whine_malloc(SIZEOF_POINTER_CREC)))
+	    (cache = slab_alloc(SLAB_CREC)))
 	  {
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
@@ -1342,7 +1523,9 @@ void cache_reload(void)
 #ifdef HAVE_INOTIFY
   set_dynamic_inotify(AH_HOSTS, total_size, (struct crec **)daemon->packet, revhashsz);
 #endif
-  
+
+  /* Give back memory from the old contents of the hosts files. */
+  slab_compact();
 } 
 
 #ifdef HAVE_DHCP
@@ -1366,11 +1549,14 @@ void cache_unhash_dhcp(void)
   struct crec *cache, **up;
   int i;
 
+  daemon->cache_gen++;
+
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = cache->hash_next)
       if (cache->flags & F_DHCP)
 	{
 	  *up = cache->hash_next;
+	  rev_unhash(cache);
 	  cache->next = dhcp_spare;
 	  dhcp_spare = cache;
 	}
@@ -1446,7 +1632,7 @@ void cache_add_dhcp_entry(char *host_name, int prot,
   if ((crec = dhcp_spare))
     dhcp_spare = dhcp_spare->next;
   else /* need new one */
-    crec = whine_malloc(SIZEOF_POINTER_CREC);
+    crec = slab_alloc(SLAB_CREC);
   
   if (crec) /* malloc may fail */
     {
@@ -1495,6 +1681,7 @@ static void make_non_terminals(struct crec *source)
 	  hostname_isequal(name, cache_get_name(crecp)))
 	{
 	  *up = crecp->hash_next;
+	  rev_unhash(crecp);
 #ifdef HAVE_DHCP
 	  if (type & F_DHCP)
 	    {
@@ -1503,7 +1690,7 @@ static void make_non_terminals(struct crec *source)
 	    }
 	  else
 #endif
-	    free(crecp);
+	    slab_free(crecp);
 	  break;
 	}
       else
@@ -1544,7 +1731,7 @@ static void make_non_terminals(struct crec *source)
 	}
       else
 #endif
-	crecp = whine_malloc(SIZEOF_POINTER_CREC);
+	crecp = slab_alloc(SLAB_CREC);
 
       if (crecp)
 	{
@@ -1681,8 +1868,16 @@ void dump_cache(time_t now)
 #ifdef HAVE_AUTH
   my_syslog(LOG_INFO, _("queries for authoritative zones %u"), daemon->metrics[METRIC_DNS_AUTH_ANSWERED]);
 #endif
-
-  blockdata_report();
+  if (daemon->prefetch != 0 || daemon->serve_stale != 0)
+    my_syslog(LOG_INFO, _("cache entries refreshed %u, answers from expired entries %u"),
+	      daemon->metrics[METRIC_DNS_PREFETCHED], daemon->metrics[METRIC_DNS_STALE_ANSWERED]);
+
+  slab_report();
+  hosts_image_report();
+  domain_index_report(daemon->server_index, _("server"));
+#ifdef HAVE_IPSET
+  domain_index_report(daemon->ipset_index, _("ipset"));
+#endif
 
   /* sum counts from different records for same server */
   for (serv = daemon->servers; serv; serv = serv->next)
@@ -1803,6 +1998,10 @@ char *record_source(unsigned int index)
     if (ah->index == index)
       return ah->fname;
 
+  for (ah = daemon->hosts_images; ah; ah = ah->next)
+    if (ah->index == index)
+      return ah->fname;
+
 #ifdef HAVE_INOTIFY
   for (ah = daemon->dynamic_dirs; ah; ah = ah->next)
      if (ah->index == index)
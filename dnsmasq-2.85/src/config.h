@@ -17,11 +17,16 @@
 #define FTABSIZ 150 /* max number of outstanding requests (default) */
 #define MAX_PROCS 20 /* max no children for TCP requests */
 #define CHILD_LIFETIME 150 /* secs 'till terminated (RFC1035 suggests > 120s) */
+#define MAX_WORKERS 16 /* max --dns-workers processes */
+#define WORKER_REFRESH 1 /* min secs between refreshing the workers' copy of the cache */
+#define WORKER_CHURN 10 /* percent of the cache inserted since the workers' copy which makes it stale */
 #define TCP_MAX_QUERIES 100 /* Maximum number of queries per incoming TCP connection */
 #define TCP_BACKLOG 32  /* kernel backlog limit for TCP connections */
+#define UDP_BATCH 16 /* max UDP DNS packets read from a socket per wakeup (recvmmsg) */
 #define EDNS_PKTSZ 4096 /* default max EDNS.0 UDP packet from RFC5625 */
 #define SAFE_PKTSZ 1280 /* "go anywhere" UDP packet size */
 #define KEYBLOCK_LEN 40 /* choose to minimise fragmentation when storing DNSSEC keys */
+#define SLAB_SIZE 8192 /* blocks in which cache entries, long names and key data are allocated */
 #define DNSSEC_WORK 50 /* Max number of queries to validate one question */
 #define TIMEOUT 10 /* drop UDP queries after TIMEOUT seconds */
 #define FORWARD_TEST 50 /* try all servers every 50 queries */
@@ -30,6 +35,8 @@
 #define SERVERS_LOGGED 30 /* Only log this many servers when logging state */
 #define LOCALS_LOGGED 8 /* Only log this many local addresses when logging state */
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
+#define LEASE_JOURNAL_MAX 1048576 /* default size at which --leasefile-journal is compacted */
+#define LEASE_COMPACT_TIME 3600 /* compact the lease journal at least this often */
 #define CACHESIZ 150 /* default cache size */
 #define TTL_FLOOR_LIMIT 3600 /* don't allow --min-cache-ttl to raise TTL above this under any circumstances */
 #define MAXLEASES 1000 /* maximum number of DHCP leases */
@@ -40,6 +47,11 @@
 #define SMALLDNAME 50 /* most domain names are smaller than this */
 #define CNAME_CHAIN 10 /* chains longer than this atr dropped for loop protection */
 #define DNSSEC_MIN_TTL 60 /* DNSKEY and DS records in cache last at least this long */
+#define PREFETCH_PERCENT 10 /* default --prefetch: refresh in the last 10% of the TTL */
+#define PREFETCH_HITS 2 /* and only entries used this often */
+#define SERVE_STALE 86400 /* default --serve-stale: answer from expired entries for a day */
+#define STALE_TTL 30 /* TTL of answers from expired entries, from RFC 8767 */
+#define REFRESH_MAX 64 /* max cache refreshes queued in one trip round the main loop */
 #define HOSTSFILE "/etc/hosts"
 #define ETHERSFILE "/etc/ethers"
 #define DEFLEASE 3600 /* default DHCPv4 lease time, one hour */
@@ -134,6 +146,10 @@ HAVE_LOOP
 HAVE_INOTIFY
    use the Linux inotify facility to efficiently re-read configuration files.
 
+HAVE_EPOLL
+   use the Linux epoll facility, rather than poll(), in the main loop. This
+   is faster when there are many sockets open, eg with a large --dns-forward-max.
+
 NO_ID
    Don't report *.bind CHAOS info to clients, forward such requests upstream instead.
 NO_TFTP
@@ -144,6 +160,7 @@ NO_LARGEFILE
 NO_AUTH
 NO_DUMPFILE
 NO_INOTIFY
+NO_MMSG
    these are available to explicitly disable compile time options which would 
    otherwise be enabled automatically or which are enabled  by default 
    in the distributed source tree. Building dnsmasq
@@ -176,6 +193,7 @@ RESOLVFILE
 #define HAVE_IPSET 
 #define HAVE_LOOP
 #define HAVE_DUMPFILE
+/* #define HAVE_EPOLL */
 
 /* Build options which require external libraries.
    
@@ -355,6 +373,15 @@ HAVE_SOCKADDR_SA_LEN
 #define HAVE_INOTIFY
 #endif
 
+/* recvmmsg() and sendmmsg() */
+#if defined (HAVE_LINUX_NETWORK) && !defined(NO_MMSG)
+#define HAVE_MMSG
+#endif
+
+#if defined(HAVE_EPOLL) && !defined(HAVE_LINUX_NETWORK)
+#undef HAVE_EPOLL
+#endif
+
 /* Define a string indicating which options are in use.
    DNSMASQ_COMPILE_OPTS is only defined in dnsmasq.c */
 
@@ -442,6 +469,9 @@ static char *compile_opts =
 "no-"
 #endif
 "inotify "
+#ifdef HAVE_EPOLL
+"epoll "
+#endif
 #ifndef HAVE_DUMPFILE
 "no-"
 #endif
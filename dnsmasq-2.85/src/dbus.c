@@ -122,6 +122,8 @@ static void remove_watch(DBusWatch *watch, void *data)
 {
   struct watch **up, *w, *tmp;  
   
+  poll_forget(dbus_watch_get_unix_fd(watch));
+
   for (up = &(daemon->watches), w = daemon->watches; w; w = tmp)
     {
       tmp = w->next;
@@ -800,6 +800,10 @@ int address_allocate(struct dhcp_context *context,
 	  addr = start;
 	  
 	  do {
+	    /* step over leased addresses without probing them one at a time. */
+	    if (!lease_skip_used(c, &addr, start))
+	      break;
+	    
 	    /* eliminate addresses in use by the server. */
 	    for (d = context; d; d = d->current)
 	      if (addr.s_addr == d->router.s_addr)
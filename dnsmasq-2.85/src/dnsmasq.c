@@ -135,6 +135,17 @@ int main (int argc, char **argv)
     }
 #endif
 
+  if (daemon->image_dst)
+    {
+      /* --make-hosts-image: log to stderr, write the image and stop. */
+      daemon->log_file = "-";
+      log_start(NULL, -1);
+      cache_init();
+      hosts_image_make(daemon->image_src, daemon->image_dst);
+      flush_log();
+      exit(0);
+    }
+
 #ifdef HAVE_DHCP
   if (!daemon->lease_file)
     {
@@ -236,6 +247,15 @@ int main (int argc, char **argv)
   if (option_bool(OPT_UBUS))
     die(_("Ubus not available: set HAVE_UBUS in src/config.h"), NULL, EC_BADCONF);
 #endif
+
+  if (daemon->dns_workers != 0)
+    {
+#ifndef HAVE_LINUX_NETWORK
+      die(_("--dns-workers is not available on this platform"), NULL, EC_BADCONF);
+#endif
+      if (daemon->dump_file)
+	die(_("--dns-workers is not compatible with --dumpfile"), NULL, EC_BADCONF);
+    }
   
   /* Handle only one of min_port/max_port being set. */
   if (daemon->min_port != 0 && daemon->max_port == 0)
@@ -327,7 +347,20 @@ int main (int argc, char **argv)
 #ifdef HAVE_IPSET
   if (daemon->ipsets)
     {
+      struct ipsets *ipset_pos;
+      
       ipset_init();
+      
+      /* On failure, process_reply() falls back to walking the list. */
+      if ((daemon->ipset_index = domain_index_new()))
+	for (ipset_pos = daemon->ipsets; ipset_pos; ipset_pos = ipset_pos->next)
+	  if (!domain_index_add(daemon->ipset_index, ipset_pos->domain, ipset_pos))
+	    {
+	      domain_index_free(daemon->ipset_index);
+	      daemon->ipset_index = NULL;
+	      break;
+	    }
+
 #  ifdef HAVE_LINUX_NETWORK
       need_cap_net_admin = 1;
 #  endif
@@ -384,6 +417,11 @@ int main (int argc, char **argv)
     }
   else 
     create_wildcard_listeners();
+
+#ifdef HAVE_LINUX_NETWORK
+  if (daemon->dns_workers != 0)
+    workers_init();
+#endif
  
 #ifdef HAVE_DHCP6
   /* after enumerate_interfaces() */
@@ -399,6 +437,7 @@ int main (int argc, char **argv)
       cache_init();
       blockdata_init();
       hash_questions_init();
+      frec_hash_init();
 
       /* Scale random socket pool by ftabsize, but
 	 limit it based on available fds. */
@@ -1059,6 +1098,13 @@ int main (int argc, char **argv)
       else if (is_dad_listeners())
 	timeout = 1000;
 
+#ifdef HAVE_LINUX_NETWORK
+      /* Start the workers, or give them a fresh copy of the cache. */
+      if (daemon->dns_workers != 0 && (t = check_workers(now)) != 0 &&
+	  (timeout == -1 || timeout > t * 1000))
+	timeout = t * 1000;
+#endif
+
 #ifdef HAVE_DBUS
       set_dbus_listeners();
 #endif
@@ -1212,6 +1258,7 @@ int main (int argc, char **argv)
 #endif
 
       check_dns_listeners(now);
+      send_refreshes(now);
 
 #ifdef HAVE_TFTP
       check_tftp_listeners(now);
@@ -1478,9 +1525,15 @@ static void async_event(int pipe, time_t now)
 		break;
 	    }      
 	  else 
-	    for (i = 0 ; i < MAX_PROCS; i++)
-	      if (daemon->tcp_pids[i] == p)
-		daemon->tcp_pids[i] = 0;
+	    {
+	      for (i = 0 ; i < MAX_PROCS; i++)
+		if (daemon->tcp_pids[i] == p)
+		  daemon->tcp_pids[i] = 0;
+#ifdef HAVE_LINUX_NETWORK
+	      if (daemon->dns_workers != 0)
+		worker_reaped(p);
+#endif
+	    }
 	break;
 	
 #if defined(HAVE_SCRIPT)	
@@ -1545,6 +1598,11 @@ static void async_event(int pipe, time_t now)
 	for (i = 0; i < MAX_PROCS; i++)
 	  if (daemon->tcp_pids[i] != 0)
 	    kill(daemon->tcp_pids[i], SIGALRM);
+
+#ifdef HAVE_LINUX_NETWORK
+	if (daemon->dns_workers != 0)
+	  kill_workers();
+#endif
 	
 #if defined(HAVE_SCRIPT) && defined(HAVE_DHCP)
 	/* handle pending lease transitions */
@@ -1662,6 +1720,11 @@ void clear_cache_and_reload(time_t now)
 
   if (daemon->port != 0)
     cache_reload();
+
+#ifdef HAVE_LINUX_NETWORK
+  if (daemon->dns_workers != 0)
+    workers_restart();
+#endif
   
 #ifdef HAVE_DHCP
   if (daemon->dhcp || daemon->doing_dhcp6)
@@ -1744,6 +1807,12 @@ static int set_dns_listeners(time_t now)
     for (i = 0; i < MAX_PROCS; i++)
       if (daemon->tcp_pipes[i] != -1)
 	poll_listen(daemon->tcp_pipes[i], POLLIN);
+
+#ifdef HAVE_LINUX_NETWORK
+  /* queries handed on by the workers need resources too. */
+  if (daemon->dns_workers != 0 && wait == 0)
+    set_worker_listeners();
+#endif
   
   return wait;
 }
@@ -1759,6 +1828,11 @@ static void check_dns_listeners(time_t now)
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     if (poll_check(serverfdp->fd, POLLIN))
       reply_query(serverfdp->fd, now);
+
+#ifdef HAVE_LINUX_NETWORK
+  if (daemon->dns_workers != 0)
+    check_worker_listeners(now);
+#endif
   
   for (i = 0; i < daemon->numrrand; i++)
     if (daemon->randomsocks[i].refcount != 0 && 
@@ -1783,6 +1857,7 @@ static void check_dns_listeners(time_t now)
 	  poll_check(daemon->tcp_pipes[i], POLLIN | POLLHUP) &&
 	  !cache_recv_insert(now, daemon->tcp_pipes[i]))
 	{
+	  poll_forget(daemon->tcp_pipes[i]);
 	  close(daemon->tcp_pipes[i]);
 	  daemon->tcp_pipes[i] = -1;	
 	}
@@ -2055,6 +2130,7 @@ int icmp_ping(struct in_addr addr)
   gotreply = delay_dhcp(dnsmasq_time(), PING_WAIT, fd, addr.s_addr, id);
 
 #if defined(HAVE_LINUX_NETWORK) || defined(HAVE_SOLARIS_NETWORK)
+  poll_forget(fd);
   close(fd);
 #else
   opt = 1;
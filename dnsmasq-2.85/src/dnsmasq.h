@@ -453,11 +453,13 @@ struct blockdata {
 
 struct crec { 
   struct crec *next, *prev, *hash_next;
+  struct crec *rev_next; /* chain in the by-address table, F_REVERSE only */
   union all_addr addr;
   time_t ttd; /* time to die */
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
   unsigned int flags;
+  unsigned int ttl, hits; /* TTL when inserted and uses since, for --prefetch */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -499,6 +501,7 @@ struct crec {
 #define F_SERVFAIL  (1u<<28) /* currently unused. */
 #define F_RCODE     (1u<<29)
 #define F_SRV       (1u<<30)
+#define F_REFRESH   (1u<<31) /* --prefetch refresh already asked for */
 
 #define UID_NONE      0
 /* Values of uid in crecs with F_CONFIG bit set. */
@@ -574,6 +577,15 @@ struct server {
   struct server *next; 
 };
 
+/* Longest domain, in labels, considered by domain_index_lookup() */
+#define DOMAIN_INDEX_DEPTH 128
+
+struct dom_entry {
+  void *data;
+  unsigned int order; /* position in the list the index was built from */
+  struct dom_entry *next;
+};
+
 struct ipsets {
   char **sets;
   char *domain;
@@ -590,6 +602,7 @@ struct irec {
 
 struct listener {
   int fd, tcpfd, tftpfd, used;
+  int *workerfds; /* one UDP socket per --dns-workers process, or NULL */
   union mysockaddr addr;
   struct irec *iface; /* only sometimes valid for non-wildcard */
   struct listener *next;
@@ -674,7 +687,7 @@ struct hostsfile {
 #define FREC_HAS_PHEADER     1024
 #define FREC_NO_CACHE        2048
 
-#define HASH_SIZE 32 /* SHA-256 digest size */
+#define HASH_SIZE 16 /* SipHash-2-4-128 digest size */
 
 struct frec {
   struct frec_src {
@@ -690,7 +703,9 @@ struct frec {
   unsigned short new_id;
   int forwardall, flags;
   time_t time;
-  unsigned char *hash[HASH_SIZE];
+  unsigned char hash[HASH_SIZE];
+  struct frec *id_next, **id_prev; /* hash chains for lookup_frec() */
+  struct frec *hash_next, **hash_prev; /* and lookup_frec_by_query() */
 #ifdef HAVE_DNSSEC 
   int class, work_counter;
   struct blockdata *stash; /* Saved reply, whilst we validate */
@@ -728,6 +743,14 @@ struct frec {
 #define LEASE_TA            64  /* IPv6 temporary lease */
 #define LEASE_HAVE_HWADDR  128  /* Have set hwaddress */
 #define LEASE_EXP_CHANGED  256  /* Lease expiry time changed */
+#define LEASE_JOURNAL      512  /* not yet written to the lease file or journal */
+#define LEASE_DROPPED     1024  /* removed by the journal, see lease_sweep() */
+
+/* indexes kept by lease.c, see struct dhcp_lease hash_next */
+#define LEASE_HASH_ADDR      0
+#define LEASE_HASH_CLID      1
+#define LEASE_HASH_HWADDR    2
+#define LEASE_HASHES         3
 
 struct dhcp_lease {
   int clid_len;          /* length of client identifier */
@@ -758,6 +781,8 @@ struct dhcp_lease {
   } *slaac_address;
   int vendorclass_count;
 #endif
+  unsigned int serial;   /* allocation order, newest highest */
+  struct dhcp_lease *hash_next[LEASE_HASHES];
   struct dhcp_lease *next;
 };
 
@@ -936,6 +961,7 @@ struct dhcp_context {
   char *template_interface;
 #endif
   int flags;
+  unsigned int *lease_map; /* bit per address from start to end, set when leased */
   struct dhcp_netid netid, *filter;
   struct dhcp_context *next, *current;
 };
@@ -1053,15 +1079,19 @@ extern struct daemon {
   struct iname *if_names, *if_addrs, *if_except, *dhcp_except, *auth_peers, *tftp_interfaces;
   struct bogus_addr *bogus_addr, *ignore_addr;
   struct server *servers;
+  struct dom_index *server_index; /* rebuilt from servers by cleanup_servers() */
   struct ipsets *ipsets;
+  struct dom_index *ipset_index;
   int log_fac; /* log facility */
   char *log_file; /* optional log file */
   int max_logs;  /* queue limit */
   int cachesize, ftabsize;
   int port, query_port, min_port, max_port;
   unsigned long local_ttl, neg_ttl, max_ttl, min_cache_ttl, max_cache_ttl, auth_ttl, dhcp_ttl, use_dhcp_ttl;
+  int prefetch, prefetch_hits, serve_stale; /* --prefetch percent of TTL and uses, --serve-stale secs */
   char *dns_client_id;
-  struct hostsfile *addn_hosts;
+  struct hostsfile *addn_hosts, *hosts_images;
+  char *image_src, *image_dst; /* --make-hosts-image */
   struct dhcp_context *dhcp, *dhcp6;
   struct ra_interface *ra_interfaces;
   struct dhcp_config *dhcp_conf;
@@ -1083,6 +1113,8 @@ extern struct daemon {
   struct dhcp_netid_list *force_broadcast, *bootp_dynamic;
   struct hostsfile *dhcp_hosts_file, *dhcp_opts_file, *dynamic_dirs;
   int dhcp_max, tftp_max, tftp_mtu;
+  int lease_journal_max;
+  int dns_workers;
   int dhcp_server_port, dhcp_client_port;
   int start_tftp_port, end_tftp_port; 
   unsigned int min_leasetime;
@@ -1136,6 +1168,7 @@ extern struct daemon {
   int v6pktinfo; 
   struct addrlist *interface_addrs; /* list of all addresses/prefix lengths associated with all local interfaces */
   int log_id, log_display_id; /* ids of transactions for logging */
+  unsigned int cache_gen; /* bumped when the cache is invalidated, to refresh the workers */
   union mysockaddr *log_source_addr;
 
   /* DHCP state */
@@ -1216,15 +1249,43 @@ struct crec *cache_enumerate(int init);
 int read_hostsfile(char *filename, unsigned int index, int cache_size, 
 		   struct crec **rhash, int hashsz);
 
+/* slab.c */
+#define SLAB_CREC       0 /* SIZEOF_POINTER_CREC, others sized by slab_alloc_crec() */
+#define SLAB_CREC_MAX   5
+#define SLAB_BIGNAME    6
+#define SLAB_BLOCKDATA  7
+void *slab_alloc(int type);
+struct crec *slab_alloc_crec(size_t namelen);
+void slab_free(void *obj);
+void slab_reserve(int type, unsigned int n);
+void slab_compact(void);
+void slab_report(void);
+
+/* hosts-image.c */
+void hosts_image_make(char *src, char *dst);
+void hosts_image_load(void);
+int hosts_image_exists(char *name, unsigned int prot);
+struct crec **hosts_image_find_name(struct crec **chainp, char *name, unsigned int prot);
+struct crec **hosts_image_find_addr(struct crec **chainp, union all_addr *addr, unsigned int prot);
+void hosts_image_report(void);
+
 /* blockdata.c */
 void blockdata_init(void);
-void blockdata_report(void);
 struct blockdata *blockdata_alloc(char *data, size_t len);
 void *blockdata_retrieve(struct blockdata *block, size_t len, void *data);
 struct blockdata *blockdata_read(int fd, size_t len);
 void blockdata_write(struct blockdata *block, size_t len, int fd);
 void blockdata_free(struct blockdata *blocks);
 
+/* domain-index.c */
+struct dom_index *domain_index_new(void);
+void domain_index_free(struct dom_index *idx);
+int domain_index_add(struct dom_index *idx, const char *domain, void *data);
+int domain_index_lookup(struct dom_index *idx, const char *name, int unqualified,
+			struct dom_entry **heads);
+void *domain_index_next(struct dom_entry **heads, int n);
+void domain_index_report(struct dom_index *idx, char *what);
+
 /* domain.c */
 char *get_domain(struct in_addr addr);
 char *get_domain6(struct in6_addr *addr);
@@ -1361,12 +1422,19 @@ unsigned char *tcp_request(int confd, time_t now,
 			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
 void server_gone(struct server *server);
 struct frec *get_new_frec(time_t now, int *wait, struct frec *force);
+void frec_hash_init(void);
 int send_from(int fd, int nowild, char *packet, size_t len, 
 	       union mysockaddr *to, union all_addr *source,
 	       unsigned int iface);
 void resend_query(void);
 int allocate_rfd(struct randfd_list **fdlp, struct server *serv);
 void free_rfds(struct randfd_list **fdlp);
+void queue_refresh(struct dns_header *header, size_t qlen, unsigned char *p);
+void send_refreshes(time_t now);
+#ifdef HAVE_LINUX_NETWORK
+void worker_query(struct listener *listen, int fd, int handoff, time_t now);
+void receive_handoff(int fd, time_t now);
+#endif
 
 /* network.c */
 int indextoname(int fd, int index, char *name);
@@ -1452,6 +1520,7 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
 					unsigned char *clid, int clid_len);
 struct dhcp_lease *lease_find_by_addr(struct in_addr addr);
 struct in_addr lease_find_max_addr(struct dhcp_context *context);
+int lease_skip_used(struct dhcp_context *context, struct in_addr *addrp, struct in_addr stop);
 void lease_prune(struct dhcp_lease *target, time_t now);
 void lease_update_from_configs(void);
 int do_script_run(time_t now);
@@ -1523,6 +1592,7 @@ void ubus_event_bcast(const char *type, const char *mac, const char *ip, const c
 #ifdef HAVE_IPSET
 void ipset_init(void);
 int add_to_ipset(const char *setname, const union all_addr *ipaddr, int flags, int remove);
+void ipset_flush(void);
 #endif
 
 /* helper.c */
@@ -1660,8 +1730,20 @@ int inotify_check(time_t now);
 void set_dynamic_inotify(int flag, int total_size, struct crec **rhash, int revhashsz);
 #endif
 
+/* workers.c */
+#ifdef HAVE_LINUX_NETWORK
+void workers_init(void);
+void workers_restart(void);
+int check_workers(time_t now);
+void set_worker_listeners(void);
+void check_worker_listeners(time_t now);
+void worker_reaped(pid_t pid);
+void kill_workers(void);
+#endif
+
 /* poll.c */
 void poll_reset(void);
+void poll_forget(int fd);
 int poll_check(int fd, short event);
 void poll_listen(int fd, short event);
 int do_poll(int timeout);
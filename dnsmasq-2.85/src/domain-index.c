@@ -0,0 +1,302 @@
+/* dnsmasq is Copyright (c) 2000-2021 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Suffix index for the --server=/domain/, --address=/domain/ and
+   similar lists. Domains are stored as a tree of labels, read right-to-left,
+   so that all the entries which match a name are found on the path from
+   the root to that name, in O(labels) time, rather than by comparing the
+   name against every entry in a list.
+
+   The tree is flattened into a single hash table keyed on (parent, label).
+   Each entry remembers its position in the original list, so callers can
+   visit the matches in list order and keep any order-dependent rules. */
+
+#include "dnsmasq.h"
+
+struct dom_node {
+  struct dom_node *hash_next;
+  struct dom_entry *entries, *last;
+  unsigned int id, hash;
+  unsigned int parent; /* id of parent, zero for labels directly below the root */
+  size_t len;
+  char *label;
+};
+
+struct dom_index {
+  struct dom_node root, unqualified;
+  struct dom_node **hash_table;
+  unsigned int hash_size, nodes, domains, count;
+};
+
+static unsigned int label_hash(unsigned int parent, const char *label, size_t len)
+{
+  unsigned int c, val = 017465 ^ (parent * 2654435761u);
+
+  while (len--)
+    {
+      /* don't use tolower and friends here - they may be messed up by LOCALE */
+      c = (unsigned char) *label++;
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = ((val << 7) | (val >> (32 - 7))) + (val ^ c);
+    }
+
+  return val ^ (val >> 16);
+}
+
+static int label_isequal(const char *a, const char *b, size_t len)
+{
+  unsigned int c1, c2;
+
+  while (len--)
+    {
+      c1 = (unsigned char) *a++;
+      c2 = (unsigned char) *b++;
+
+      if (c1 >= 'A' && c1 <= 'Z')
+	c1 += 'a' - 'A';
+      if (c2 >= 'A' && c2 <= 'Z')
+	c2 += 'a' - 'A';
+
+      if (c1 != c2)
+	return 0;
+    }
+
+  return 1;
+}
+
+static struct dom_node *find_child(struct dom_index *idx, struct dom_node *parent,
+				   const char *label, size_t len, unsigned int hash)
+{
+  struct dom_node *node;
+
+  for (node = idx->hash_table[hash & (idx->hash_size - 1)]; node; node = node->hash_next)
+    if (node->hash == hash && node->parent == parent->id &&
+	node->len == len && label_isequal(node->label, label, len))
+      return node;
+
+  return NULL;
+}
+
+static int expand_hash(struct dom_index *idx)
+{
+  struct dom_node **new, *node, *tmp;
+  unsigned int i, new_size = idx->hash_size << 1;
+
+  if (!(new = whine_malloc(new_size * sizeof(struct dom_node *))))
+    return 0;
+
+  for (i = 0; i < idx->hash_size; i++)
+    for (node = idx->hash_table[i]; node; node = tmp)
+      {
+	tmp = node->hash_next;
+	node->hash_next = new[node->hash & (new_size - 1)];
+	new[node->hash & (new_size - 1)] = node;
+      }
+
+  free(idx->hash_table);
+  idx->hash_table = new;
+  idx->hash_size = new_size;
+
+  return 1;
+}
+
+static void free_entries(struct dom_node *node)
+{
+  struct dom_entry *ent, *tmp;
+
+  for (ent = node->entries; ent; ent = tmp)
+    {
+      tmp = ent->next;
+      free(ent);
+    }
+}
+
+struct dom_index *domain_index_new(void)
+{
+  struct dom_index *idx;
+
+  if (!(idx = whine_malloc(sizeof(struct dom_index))))
+    return NULL;
+
+  idx->hash_size = 64;
+  if (!(idx->hash_table = whine_malloc(idx->hash_size * sizeof(struct dom_node *))))
+    {
+      free(idx);
+      return NULL;
+    }
+
+  idx->root.label = idx->unqualified.label = "";
+  idx->nodes = 1;
+
+  return idx;
+}
+
+void domain_index_free(struct dom_index *idx)
+{
+  struct dom_node *node, *tmp;
+  unsigned int i;
+
+  if (!idx)
+    return;
+
+  for (i = 0; i < idx->hash_size; i++)
+    for (node = idx->hash_table[i]; node; node = tmp)
+      {
+	tmp = node->hash_next;
+	free_entries(node);
+	free(node);
+      }
+
+  free_entries(&idx->root);
+  free_entries(&idx->unqualified);
+  free(idx->hash_table);
+  free(idx);
+}
+
+/* Add an entry for domain, which matches domain and all its subdomains.
+   The empty string matches everything, NULL is for names with no domain
+   part and matches only when the caller asks for it in domain_index_lookup().
+   Entries must be added in list order. Returns zero on allocation failure. */
+int domain_index_add(struct dom_index *idx, const char *domain, void *data)
+{
+  struct dom_node *node, *child;
+  struct dom_entry *ent;
+  const char *end, *start;
+
+  if (!domain)
+    node = &idx->unqualified;
+  else
+    {
+      node = &idx->root;
+
+      for (end = domain + strlen(domain); *domain; end = start - 1)
+	{
+	  size_t len;
+	  unsigned int hash;
+
+	  for (start = end; start != domain && *(start-1) != '.'; start--);
+	  len = end - start;
+	  hash = label_hash(node->id, start, len);
+
+	  if (!(child = find_child(idx, node, start, len, hash)))
+	    {
+	      if (idx->nodes >= idx->hash_size && !expand_hash(idx))
+		return 0;
+
+	      if (!(child = whine_malloc(sizeof(struct dom_node) + len + 1)))
+		return 0;
+
+	      child->label = (char *)(child + 1);
+	      memcpy(child->label, start, len);
+	      child->len = len;
+	      child->hash = hash;
+	      child->parent = node->id;
+	      child->id = idx->nodes++;
+	      child->hash_next = idx->hash_table[hash & (idx->hash_size - 1)];
+	      idx->hash_table[hash & (idx->hash_size - 1)] = child;
+	    }
+
+	  node = child;
+
+	  if (start == domain)
+	    break;
+	}
+    }
+
+  if (!(ent = whine_malloc(sizeof(struct dom_entry))))
+    return 0;
+
+  ent->data = data;
+  ent->order = idx->count++;
+
+  if (!node->entries)
+    {
+      node->entries = ent;
+      if (node != &idx->unqualified)
+	idx->domains++;
+    }
+  else
+    node->last->next = ent;
+  node->last = ent;
+
+  return 1;
+}
+
+/* Find the entries matching name. heads is filled with one list of entries per
+   matching domain, from the root down to the longest match, followed by the entries for
+   unqualified names when unqualified is set. Returns the number of lists, at most
+   DOMAIN_INDEX_DEPTH + 1 */
+int domain_index_lookup(struct dom_index *idx, const char *name, int unqualified,
+			struct dom_entry **heads)
+{
+  struct dom_node *node = &idx->root;
+  const char *end, *start;
+  int n = 0;
+
+  if (node->entries)
+    heads[n++] = node->entries;
+
+  for (end = name + strlen(name); *name && n < DOMAIN_INDEX_DEPTH; end = start - 1)
+    {
+      size_t len;
+
+      for (start = end; start != name && *(start-1) != '.'; start--);
+      len = end - start;
+
+      if (!(node = find_child(idx, node, start, len, label_hash(node->id, start, len))))
+	break;
+
+      if (node->entries)
+	heads[n++] = node->entries;
+
+      if (start == name)
+	break;
+    }
+
+  if (unqualified && idx->unqualified.entries)
+    heads[n++] = idx->unqualified.entries;
+
+  return n;
+}
+
+/* Return the data for the next entry, in list order, from the lists
+   found by domain_index_lookup(), or NULL when there are no more. */
+void *domain_index_next(struct dom_entry **heads, int n)
+{
+  struct dom_entry **best = NULL;
+  void *data;
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (heads[i] && (!best || heads[i]->order < (*best)->order))
+      best = &heads[i];
+
+  if (!best)
+    return NULL;
+
+  data = (*best)->data;
+  *best = (*best)->next;
+
+  return data;
+}
+
+void domain_index_report(struct dom_index *idx, char *what)
+{
+  if (idx)
+    my_syslog(LOG_INFO, _("%s index: %u entries for %u domains, %u nodes"),
+	      what, idx->count, idx->domains, idx->nodes);
+}
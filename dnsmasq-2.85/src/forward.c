@@ -21,43 +21,42 @@ static struct frec *lookup_frec_by_query(void *hash, unsigned int flags);
 
 static unsigned short get_id(void);
 static void free_frec(struct frec *f);
+static void frec_link(struct frec *f);
 static void query_full(time_t now);
+static void forward_refresh(struct dns_header *header, size_t plen, time_t now);
 
-/* Send a UDP packet with its source address set as "source" 
-   unless nowild is true, when we just send it with the kernel default */
-int send_from(int fd, int nowild, char *packet, size_t len, 
-	      union mysockaddr *to, union all_addr *source,
-	      unsigned int iface)
-{
-  struct msghdr msg;
-  struct iovec iov[1]; 
-  union {
-    struct cmsghdr align; /* this ensures alignment */
+union send_control {
+  struct cmsghdr align; /* this ensures alignment */
 #if defined(HAVE_LINUX_NETWORK)
-    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+  char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
 #elif defined(IP_SENDSRCADDR)
-    char control[CMSG_SPACE(sizeof(struct in_addr))];
+  char control[CMSG_SPACE(sizeof(struct in_addr))];
 #endif
-    char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-  } control_u;
-  
-  iov[0].iov_base = packet;
-  iov[0].iov_len = len;
+  char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+};
 
-  msg.msg_control = NULL;
-  msg.msg_controllen = 0;
-  msg.msg_flags = 0;
-  msg.msg_name = to;
-  msg.msg_namelen = sa_len(to);
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
+static void send_msg_init(struct msghdr *msg, struct iovec *iov, union send_control *control_u,
+			  int nowild, char *packet, size_t len, 
+			  union mysockaddr *to, union all_addr *source,
+			  unsigned int iface)
+{
+  iov->iov_base = packet;
+  iov->iov_len = len;
+
+  msg->msg_control = NULL;
+  msg->msg_controllen = 0;
+  msg->msg_flags = 0;
+  msg->msg_name = to;
+  msg->msg_namelen = sa_len(to);
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 1;
   
   if (!nowild)
     {
       struct cmsghdr *cmptr;
-      msg.msg_control = &control_u;
-      msg.msg_controllen = sizeof(control_u);
-      cmptr = CMSG_FIRSTHDR(&msg);
+      msg->msg_control = control_u;
+      msg->msg_controllen = sizeof(*control_u);
+      cmptr = CMSG_FIRSTHDR(msg);
 
       if (to->sa.sa_family == AF_INET)
 	{
@@ -65,13 +64,13 @@ int send_from(int fd, int nowild, char *packet, size_t len,
 	  struct in_pktinfo p;
 	  p.ipi_ifindex = 0;
 	  p.ipi_spec_dst = source->addr4;
-	  msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+	  msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
 	  memcpy(CMSG_DATA(cmptr), &p, sizeof(p));
 	  cmptr->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
 	  cmptr->cmsg_level = IPPROTO_IP;
 	  cmptr->cmsg_type = IP_PKTINFO;
 #elif defined(IP_SENDSRCADDR)
-	  msg.msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
+	  msg->msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
 	  memcpy(CMSG_DATA(cmptr), &(source->addr4), sizeof(source->addr4));
 	  cmptr->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
 	  cmptr->cmsg_level = IPPROTO_IP;
@@ -83,29 +82,176 @@ int send_from(int fd, int nowild, char *packet, size_t len,
 	  struct in6_pktinfo p;
 	  p.ipi6_ifindex = iface; /* Need iface for IPv6 to handle link-local addrs */
 	  p.ipi6_addr = source->addr6;
-	  msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+	  msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
 	  memcpy(CMSG_DATA(cmptr), &p, sizeof(p));
 	  cmptr->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
 	  cmptr->cmsg_type = daemon->v6pktinfo;
 	  cmptr->cmsg_level = IPPROTO_IPV6;
 	}
     }
+}
+
+static void send_error(void)
+{
+#ifdef HAVE_LINUX_NETWORK
+  /* If interface is still in DAD, EINVAL results - ignore that. */
+  if (errno != EINVAL)
+    my_syslog(LOG_ERR, _("failed to send packet: %s"), strerror(errno));
+#endif
+}
+
+/* Send a UDP packet with its source address set as "source" 
+   unless nowild is true, when we just send it with the kernel default */
+int send_from(int fd, int nowild, char *packet, size_t len, 
+	      union mysockaddr *to, union all_addr *source,
+	      unsigned int iface)
+{
+  struct msghdr msg;
+  struct iovec iov[1]; 
+  union send_control control_u;
+
+  send_msg_init(&msg, iov, &control_u, nowild, packet, len, to, source, iface);
   
   while (retry_send(sendmsg(fd, &msg, 0)));
 
   if (errno != 0)
     {
-#ifdef HAVE_LINUX_NETWORK
-      /* If interface is still in DAD, EINVAL results - ignore that. */
-      if (errno != EINVAL)
-	my_syslog(LOG_ERR, _("failed to send packet: %s"), strerror(errno));
-#endif
+      send_error();
       return 0;
     }
   
   return 1;
 }
-          
+
+#ifdef HAVE_MMSG
+/* Batched UDP I/O. receive_query() and reply_query() read up to UDP_BATCH
+   packets with one recvmmsg(), and handle them one at a time, copied into
+   daemon->packet. Answers to clients made meanwhile are queued by
+   send_reply() and sent with one sendmmsg() per socket by flush_replies(). */
+
+struct udp_batch {
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  union mysockaddr addr[UDP_BATCH];
+  union all_addr source[UDP_BATCH];
+  union send_control control[UDP_BATCH];
+  char *buff[UDP_BATCH];
+};
+
+static struct udp_batch *recv_batch, *send_batch;
+static int send_fd = -1, send_queued = 0, batching = 0;
+
+static struct udp_batch *batch_alloc(size_t buffsize)
+{
+  struct udp_batch *b;
+  int i;
+
+  if (!(b = whine_malloc(sizeof(struct udp_batch) + UDP_BATCH * buffsize)))
+    return NULL;
+
+  for (i = 0; i < UDP_BATCH; i++)
+    b->buff[i] = ((char *)(b + 1)) + i * buffsize;
+
+  return b;
+}
+
+static int batch_init(void)
+{
+  if (!recv_batch && !(recv_batch = batch_alloc(daemon->packet_buff_sz)))
+    return 0;
+
+  if (!send_batch && !(send_batch = batch_alloc(daemon->edns_pktsz)))
+    return 0;
+
+  return 1;
+}
+
+/* Read up to UDP_BATCH packets from fd, with control messages if control
+   is set. Returns the number read, or -1. */
+static int recv_packets(int fd, size_t size, int control)
+{
+  struct mmsghdr *m = recv_batch->msgs;
+  int i;
+  
+  for (i = 0; i < UDP_BATCH; i++)
+    {
+      recv_batch->iov[i].iov_base = recv_batch->buff[i];
+      recv_batch->iov[i].iov_len = size;
+      m[i].msg_hdr.msg_iov = &recv_batch->iov[i];
+      m[i].msg_hdr.msg_iovlen = 1;
+      m[i].msg_hdr.msg_name = &recv_batch->addr[i];
+      m[i].msg_hdr.msg_namelen = sizeof(union mysockaddr);
+      m[i].msg_hdr.msg_control = control ? &recv_batch->control[i] : NULL;
+      m[i].msg_hdr.msg_controllen = control ? sizeof(union send_control) : 0;
+      m[i].msg_hdr.msg_flags = 0;
+    }
+
+  return recvmmsg(fd, m, UDP_BATCH, MSG_DONTWAIT, NULL);
+}
+
+static void flush_replies(void)
+{
+  int i = 0, rc;
+
+  while (i < send_queued)
+    {
+      if (retry_send(rc = sendmmsg(send_fd, &send_batch->msgs[i], send_queued - i, 0)))
+	continue;
+
+      /* skip the packet which failed */
+      if (rc == -1)
+	{
+	  send_error();
+	  rc = 1;
+	}
+      
+      i += rc;
+    }
+
+  send_queued = 0;
+}
+
+/* Like send_from(), but when reading a batch, queue the packet to go with the rest. */
+static void send_reply(int fd, int nowild, char *packet, size_t len, 
+		       union mysockaddr *to, union all_addr *source,
+		       unsigned int iface)
+{
+  int i = send_queued;
+
+  if (!batching || len > daemon->edns_pktsz)
+    {
+      send_from(fd, nowild, packet, len, to, source, iface);
+      return;
+    }
+  
+  if (send_queued != 0 && (send_fd != fd || send_queued == UDP_BATCH))
+    {
+      flush_replies();
+      i = 0;
+    }
+
+  send_fd = fd;
+  memcpy(send_batch->buff[i], packet, len);
+  memcpy(&send_batch->addr[i], to, sa_len(to));
+  send_batch->source[i] = *source;
+  send_msg_init(&send_batch->msgs[i].msg_hdr, &send_batch->iov[i], &send_batch->control[i], nowild,
+		send_batch->buff[i], len, &send_batch->addr[i], &send_batch->source[i], iface);
+  send_queued++;
+}
+#else
+#  define send_reply send_from
+#endif
+
+/* Next server to be considered by search_servers(). With the index, these are
+   only the servers whose domain matches, in list order, otherwise all of them. */
+static struct server *next_search_server(struct server *serv, struct dom_entry **heads, int n)
+{
+  if (daemon->server_index)
+    return domain_index_next(heads, n);
+  
+  return serv ? serv->next : daemon->servers;
+}
+
 static unsigned int search_servers(time_t now, union all_addr **addrpp, unsigned int qtype,
 				   char *qdomain, int *type, char **domain, int *norebind)
 			      
@@ -119,8 +265,13 @@ static unsigned int search_servers(time_t now, union all_addr **addrpp, unsigned
   struct server *serv;
   unsigned int flags = 0;
   static union all_addr zero;
+  struct dom_entry *heads[DOMAIN_INDEX_DEPTH + 1];
+  int nheads = 0;
+
+  if (daemon->server_index)
+    nheads = domain_index_lookup(daemon->server_index, qdomain, !strchr(qdomain, '.') && namelen != 0, heads);
   
-  for (serv = daemon->servers; serv; serv=serv->next)
+  for (serv = next_search_server(NULL, heads, nheads); serv; serv = next_search_server(serv, heads, nheads))
     if (qtype == F_DNSSECOK && !(serv->flags & SERV_DO_DNSSEC))
       continue;
     /* domain matches take priority over NODOTS matches */
@@ -461,6 +612,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	  forward->frec_src.fd = udpfd;
 	  forward->new_id = get_id();
 	  memcpy(forward->hash, hash, HASH_SIZE);
+	  frec_link(forward);
 	  forward->forwardall = 0;
 	  forward->flags = fwd_flags;
 	  if (norebind)
@@ -667,18 +819,32 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
       struct ipsets *ipset_pos;
       unsigned int namelen = strlen(daemon->namebuff);
       unsigned int matchlen = 0;
-      for (ipset_pos = daemon->ipsets; ipset_pos; ipset_pos = ipset_pos->next) 
+
+      if (daemon->ipset_index)
 	{
-	  unsigned int domainlen = strlen(ipset_pos->domain);
-	  char *matchstart = daemon->namebuff + namelen - domainlen;
-	  if (namelen >= domainlen && hostname_isequal(matchstart, ipset_pos->domain) &&
-	      (domainlen == 0 || namelen == domainlen || *(matchstart - 1) == '.' ) &&
-	      domainlen >= matchlen) 
+	  struct dom_entry *heads[DOMAIN_INDEX_DEPTH + 1], *ent;
+	  int nheads = domain_index_lookup(daemon->ipset_index, daemon->namebuff, 0, heads);
+
+	  /* Longest match wins, and the last in the list among equals. */
+	  if (nheads != 0)
 	    {
-	      matchlen = domainlen;
-	      sets = ipset_pos->sets;
+	      for (ent = heads[nheads - 1]; ent->next; ent = ent->next);
+	      sets = ((struct ipsets *)ent->data)->sets;
 	    }
 	}
+      else
+	for (ipset_pos = daemon->ipsets; ipset_pos; ipset_pos = ipset_pos->next) 
+	  {
+	    unsigned int domainlen = strlen(ipset_pos->domain);
+	    char *matchstart = daemon->namebuff + namelen - domainlen;
+	    if (namelen >= domainlen && hostname_isequal(matchstart, ipset_pos->domain) &&
+		(domainlen == 0 || namelen == domainlen || *(matchstart - 1) == '.' ) &&
+		domainlen >= matchlen) 
+	      {
+		matchlen = domainlen;
+		sets = ipset_pos->sets;
+	      }
+	  }
     }
 #endif
 
@@ -789,6 +955,11 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
 	  cache_secure = 0;
 	}
 
+#ifdef HAVE_IPSET
+      if (sets)
+	ipset_flush();
+#endif
+
       if (doctored)
 	cache_secure = 0;
     }
@@ -832,15 +1003,13 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
 }
 
 /* sets new last_server */
-void reply_query(int fd, time_t now)
+static void reply_packet(int fd, time_t now, union mysockaddr *from, ssize_t n)
 {
   /* packet from peer server, extract data for cache, and send to
      original requester */
   struct dns_header *header;
-  union mysockaddr serveraddr;
+  union mysockaddr serveraddr = *from;
   struct frec *forward;
-  socklen_t addrlen = sizeof(serveraddr);
-  ssize_t n = recvfrom(fd, daemon->packet, daemon->packet_buff_sz, 0, &serveraddr.sa, &addrlen);
   size_t nn;
   struct server *server;
   void *hash;
@@ -1145,6 +1314,7 @@ void reply_query(int fd, time_t now)
 
 		      memcpy(new->hash, hash_questions(header, nn, daemon->namebuff), HASH_SIZE);
 		      new->new_id = get_id();
+		      frec_link(new);
 		      header->id = htons(new->new_id);
 		      /* Save query for retransmission */
 		      new->stash = blockdata_alloc((char *)header, nn);
@@ -1257,8 +1427,10 @@ void reply_query(int fd, time_t now)
 	      dump_packet(DUMP_REPLY, daemon->packet, (size_t)nn, NULL, &src->source);
 #endif
 	      
-	      send_from(src->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
-			&src->source, &src->dest, src->iface);
+	      /* fd is -1 for a refresh of the cache, which has no one to answer. */
+	      if (src->fd != -1)
+		send_reply(src->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn, 
+			   &src->source, &src->dest, src->iface);
 
 	      if (option_bool(OPT_EXTRALOG) && src != &forward->frec_src)
 		{
@@ -1273,8 +1445,91 @@ void reply_query(int fd, time_t now)
     }
 }
 
+void reply_query(int fd, time_t now)
+{
+  union mysockaddr serveraddr;
+  socklen_t addrlen = sizeof(serveraddr);
+  ssize_t n;
+
+#ifdef HAVE_MMSG
+  if (batch_init())
+    {
+      int i, count;
+      
+      if ((count = recv_packets(fd, daemon->packet_buff_sz, 0)) == -1)
+	return;
+
+      batching = 1;
+      for (i = 0; i < count; i++)
+	{
+	  memcpy(daemon->packet, recv_batch->buff[i], recv_batch->msgs[i].msg_len);
+	  reply_packet(fd, now, &recv_batch->addr[i], recv_batch->msgs[i].msg_len);
+	}
+      flush_replies();
+      batching = 0;
+      
+      return;
+    }
+#endif
+
+  n = recvfrom(fd, daemon->packet, daemon->packet_buff_sz, 0, &serveraddr.sa, &addrlen);
+  reply_packet(fd, now, &serveraddr, n);
+}
+
 
-void receive_query(struct listener *listen, time_t now)
+#ifdef HAVE_LINUX_NETWORK
+/* Queries which a --dns-workers process cannot answer from its copy of the
+   cache are passed, as received, to the main process over a datagram
+   socketpair: this header, followed by the packet. */
+struct handoff {
+  union mysockaddr listen_addr, source_addr;
+  int log_id, refresh; /* refresh is set for a query made by send_refreshes() */
+  size_t controllen;
+  union send_control control;
+};
+
+/* Socket to the main process, only set in a worker process. */
+static int handoff_fd = -1;
+
+static void handoff_query(struct listener *listen, struct msghdr *msg, ssize_t n, int log_id)
+{
+  struct handoff h;
+  struct iovec iov[2];
+  struct msghdr hmsg;
+
+  memset(&h, 0, sizeof(h));
+  h.listen_addr = listen->addr;
+  memcpy(&h.source_addr, msg->msg_name, sizeof(h.source_addr));
+  h.log_id = log_id;
+  if ((h.controllen = msg->msg_controllen) > sizeof(h.control))
+    h.controllen = sizeof(h.control);
+  memcpy(&h.control, msg->msg_control, h.controllen);
+
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = msg->msg_iov[0].iov_base;
+  iov[1].iov_len = n;
+
+  memset(&hmsg, 0, sizeof(hmsg));
+  hmsg.msg_iov = iov;
+  hmsg.msg_iovlen = 2;
+
+  /* If the main process is behind, drop the query as a full socket
+     buffer would, rather than stop answering from the cache. */
+  while (sendmsg(handoff_fd, &hmsg, MSG_DONTWAIT) == -1 && errno == EINTR);
+}
+
+#  define HANDOFF(log_id) do { if (handoff_fd != -1) { handoff_query(listen, msg, n, log_id); return; } } while (0)
+#else
+#  define HANDOFF(log_id) do { } while (0)
+#endif
+
+/* Answer or forward the query in daemon->packet, as received on listen.
+   In a worker process, msg->msg_iov still holds the query as received,
+   to pass on to the main process if needed. fd is the socket to reply on. log_id is
+   non-zero for a query from a worker which has already been logged. */
+static void query_packet(struct listener *listen, int fd, time_t now, struct msghdr *msg, ssize_t n,
+			 int log_id)
 {
   struct dns_header *header = (struct dns_header *)daemon->packet;
   union mysockaddr source_addr;
@@ -1283,27 +1538,11 @@ void receive_query(struct listener *listen, time_t now)
   union all_addr dst_addr;
   struct in_addr netmask, dst_addr_4;
   size_t m;
-  ssize_t n;
   int if_index = 0, auth_dns = 0, do_bit = 0, have_pseudoheader = 0;
 #ifdef HAVE_AUTH
   int local_auth = 0;
 #endif
-  struct iovec iov[1];
-  struct msghdr msg;
   struct cmsghdr *cmptr;
-  union {
-    struct cmsghdr align; /* this ensures alignment */
-    char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-#if defined(HAVE_LINUX_NETWORK)
-    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#elif defined(IP_RECVDSTADDR) && defined(HAVE_SOLARIS_NETWORK)
-    char control[CMSG_SPACE(sizeof(struct in_addr)) +
-		 CMSG_SPACE(sizeof(unsigned int))];
-#elif defined(IP_RECVDSTADDR)
-    char control[CMSG_SPACE(sizeof(struct in_addr)) +
-		 CMSG_SPACE(sizeof(struct sockaddr_dl))];
-#endif
-  } control_u;
   int family = listen->addr.sa.sa_family;
    /* Can always get recvd interface for IPv6 */
   int check_dst = !option_bool(OPT_NOWILD) || family == AF_INET6;
@@ -1325,25 +1564,13 @@ void receive_query(struct listener *listen, time_t now)
 	}
     }
   
-  iov[0].iov_base = daemon->packet;
-  iov[0].iov_len = daemon->edns_pktsz;
-    
-  msg.msg_control = control_u.control;
-  msg.msg_controllen = sizeof(control_u);
-  msg.msg_flags = 0;
-  msg.msg_name = &source_addr;
-  msg.msg_namelen = sizeof(source_addr);
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
-  
-  if ((n = recvmsg(listen->fd, &msg, 0)) == -1)
-    return;
-  
   if (n < (int)sizeof(struct dns_header) || 
-      (msg.msg_flags & MSG_TRUNC) ||
+      (msg->msg_flags & MSG_TRUNC) ||
       (header->hb3 & HB3_QR))
     return;
 
+  memcpy(&source_addr, msg->msg_name, sizeof(source_addr));
+
   /* Clear buffer beyond request to avoid risk of
      information disclosure. */
   memset(daemon->packet + n, 0, daemon->edns_pktsz - n);
@@ -1391,6 +1618,10 @@ void receive_query(struct listener *listen, time_t now)
       if (!addr)
 	{
 	  static int warned = 0;
+
+	  /* our copy of the interface addresses may be out of date. */
+	  HANDOFF(0);
+
 	  if (!warned)
 	    {
 	      my_syslog(LOG_WARNING, _("Ignoring query from non-local network"));
@@ -1404,12 +1635,12 @@ void receive_query(struct listener *listen, time_t now)
     {
       struct ifreq ifr;
 
-      if (msg.msg_controllen < sizeof(struct cmsghdr))
+      if (msg->msg_controllen < sizeof(struct cmsghdr))
 	return;
 
 #if defined(HAVE_LINUX_NETWORK)
       if (family == AF_INET)
-	for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	  if (cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_PKTINFO)
 	    {
 	      union {
@@ -1423,7 +1654,7 @@ void receive_query(struct listener *listen, time_t now)
 #elif defined(IP_RECVDSTADDR) && defined(IP_RECVIF)
       if (family == AF_INET)
 	{
-	  for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	  for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	    {
 	      union {
 		unsigned char *c;
@@ -1448,7 +1679,7 @@ void receive_query(struct listener *listen, time_t now)
       
       if (family == AF_INET6)
 	{
-	  for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	  for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	    if (cmptr->cmsg_level == IPPROTO_IPV6 && cmptr->cmsg_type == daemon->v6pktinfo)
 	      {
 		union {
@@ -1469,6 +1700,7 @@ void receive_query(struct listener *listen, time_t now)
       
       if (!iface_check(family, &dst_addr, ifr.ifr_name, &auth_dns))
 	{
+	   HANDOFF(0);
 	   if (!option_bool(OPT_CLEVERBIND))
 	     enumerate_interfaces(0); 
 	   if (!loopback_exception(listen->fd, family, &dst_addr, ifr.ifr_name) &&
@@ -1489,6 +1721,8 @@ void receive_query(struct listener *listen, time_t now)
 	      break;
 	  
 	  /* interface may be new */
+	  if (!iface)
+	    HANDOFF(0);
 	  if (!iface && !option_bool(OPT_CLEVERBIND))
 	    enumerate_interfaces(0); 
 	  
@@ -1507,7 +1741,7 @@ void receive_query(struct listener *listen, time_t now)
    
   /* log_query gets called indirectly all over the place, so 
      pass these in global variables - sorry. */
-  daemon->log_display_id = ++daemon->log_id;
+  daemon->log_display_id = log_id != 0 ? log_id : ++daemon->log_id;
   daemon->log_source_addr = &source_addr;
 
 #ifdef HAVE_DUMPFILE
@@ -1521,8 +1755,9 @@ void receive_query(struct listener *listen, time_t now)
 #endif
       char *types = querystr(auth_dns ? "auth" : "query", type);
 
-      log_query_mysockaddr(F_QUERY | F_FORWARD, daemon->namebuff,
-			   &source_addr, types);
+      if (log_id == 0)
+	log_query_mysockaddr(F_QUERY | F_FORWARD, daemon->namebuff,
+			     &source_addr, types);
 
 #ifdef HAVE_AUTH
       /* find queries for zones we're authoritative for, and answer them directly */
@@ -1537,11 +1772,18 @@ void receive_query(struct listener *listen, time_t now)
 #endif
       
 #ifdef HAVE_LOOP
+      /* Loop detection changes the server state, which lives in the main process. */
+      if (option_bool(OPT_LOOP_DETECT) && type == LOOP_TEST_TYPE)
+	HANDOFF(daemon->log_display_id);
+
       /* Check for forwarding loop */
       if (detect_loop(daemon->namebuff, type))
 	return;
 #endif
     }
+
+  if (auth_dns)
+    HANDOFF(daemon->log_display_id);
   
   if (find_pseudoheader(header, (size_t)n, NULL, &pheader, NULL, NULL))
     { 
@@ -1571,8 +1813,8 @@ void receive_query(struct listener *listen, time_t now)
 		      local_auth, do_bit, have_pseudoheader);
       if (m >= 1)
 	{
-	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
-		    (char *)header, m, &source_addr, &dst_addr, if_index);
+	  send_reply(fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
+		     (char *)header, m, &source_addr, &dst_addr, if_index);
 	  daemon->metrics[METRIC_DNS_AUTH_ANSWERED]++;
 	}
     }
@@ -1589,18 +1831,278 @@ void receive_query(struct listener *listen, time_t now)
       
       if (m >= 1)
 	{
-	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
-		    (char *)header, m, &source_addr, &dst_addr, if_index);
+	  send_reply(fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
+		     (char *)header, m, &source_addr, &dst_addr, if_index);
 	  daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
 	}
-      else if (forward_query(listen->fd, &source_addr, &dst_addr, if_index,
-			     header, (size_t)n, now, NULL, ad_reqd, do_bit))
-	daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
       else
-	daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+	{
+	  HANDOFF(daemon->log_display_id);
+	  
+	  if (forward_query(fd, &source_addr, &dst_addr, if_index,
+			    header, (size_t)n, now, NULL, ad_reqd, do_bit))
+	    daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
+	  else
+	    daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+	}
     }
 }
 
+/* Read queries from fd, which is listen->fd or, in a worker, one of listen->workerfds. */
+static void read_queries(struct listener *listen, int fd, time_t now)
+{
+  union mysockaddr source_addr;
+  struct iovec iov[1];
+  struct msghdr msg;
+  union {
+    struct cmsghdr align; /* this ensures alignment */
+    char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#if defined(HAVE_LINUX_NETWORK)
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#elif defined(IP_RECVDSTADDR) && defined(HAVE_SOLARIS_NETWORK)
+    char control[CMSG_SPACE(sizeof(struct in_addr)) +
+		 CMSG_SPACE(sizeof(unsigned int))];
+#elif defined(IP_RECVDSTADDR)
+    char control[CMSG_SPACE(sizeof(struct in_addr)) +
+		 CMSG_SPACE(sizeof(struct sockaddr_dl))];
+#endif
+  } control_u;
+  ssize_t n;
+#ifdef HAVE_LINUX_NETWORK
+  static char *received = NULL;
+#endif
+
+#ifdef HAVE_MMSG
+  if (batch_init())
+    {
+      int i, count;
+      
+      if ((count = recv_packets(fd, daemon->edns_pktsz, 1)) == -1)
+	return;
+
+      batching = 1;
+      for (i = 0; i < count; i++)
+	{
+	  memcpy(daemon->packet, recv_batch->buff[i], recv_batch->msgs[i].msg_len);
+	  query_packet(listen, fd, now, &recv_batch->msgs[i].msg_hdr, recv_batch->msgs[i].msg_len, 0);
+	}
+      flush_replies();
+      batching = 0;
+      
+      return;
+    }
+#endif
+  
+  iov[0].iov_base = daemon->packet;
+  iov[0].iov_len = daemon->edns_pktsz;
+
+#ifdef HAVE_LINUX_NETWORK
+  /* A worker keeps the query as received, to hand it off. */
+  if (handoff_fd != -1)
+    {
+      if (!received && !(received = whine_malloc(daemon->edns_pktsz)))
+	return;
+      iov[0].iov_base = received;
+    }
+#endif
+    
+  msg.msg_control = control_u.control;
+  msg.msg_controllen = sizeof(control_u);
+  msg.msg_flags = 0;
+  msg.msg_name = &source_addr;
+  msg.msg_namelen = sizeof(source_addr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  
+  if ((n = recvmsg(fd, &msg, 0)) == -1)
+    return;
+
+  if (iov[0].iov_base != daemon->packet)
+    memcpy(daemon->packet, iov[0].iov_base, n);
+
+  query_packet(listen, fd, now, &msg, n, 0);
+}
+
+void receive_query(struct listener *listen, time_t now)
+{
+  read_queries(listen, listen->fd, now);
+}
+
+#ifdef HAVE_LINUX_NETWORK
+/* In a --dns-workers process, answer what we can of the queries on fd, and
+   pass the rest to the main process on handoff. */
+void worker_query(struct listener *listen, int fd, int handoff, time_t now)
+{
+  handoff_fd = handoff;
+  read_queries(listen, fd, now);
+}
+
+/* In the main process, take queries passed on by the workers. */
+void receive_handoff(int fd, time_t now)
+{
+  struct handoff h;
+  struct listener *listen;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+  int count;
+
+  for (count = 0; count < UDP_BATCH; count++)
+    {
+      iov[0].iov_base = &h;
+      iov[0].iov_len = sizeof(h);
+      iov[1].iov_base = daemon->packet;
+      iov[1].iov_len = daemon->edns_pktsz;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = 2;
+
+      if ((n = recvmsg(fd, &msg, MSG_DONTWAIT)) < (ssize_t)sizeof(h))
+	break;
+
+      if (h.refresh)
+	{
+	  forward_refresh((struct dns_header *)daemon->packet, n - sizeof(h), now);
+	  continue;
+	}
+      
+      /* The listener may have gone since. */
+      for (listen = daemon->listeners; listen; listen = listen->next)
+	if (listen->fd != -1 && sockaddr_isequal(&listen->addr, &h.listen_addr))
+	  break;
+
+      if (!listen)
+	continue;
+
+      msg.msg_name = &h.source_addr;
+      msg.msg_namelen = sizeof(h.source_addr);
+      msg.msg_control = &h.control;
+      msg.msg_controllen = h.controllen;
+      msg.msg_iov = &iov[1];
+      msg.msg_iovlen = 1;
+      
+      query_packet(listen, listen->fd, now, &msg, n - sizeof(h), h.log_id);
+    }
+}
+#endif
+
+/* --prefetch and --serve-stale: questions whose answers from the cache are
+   due for a refresh, queued by answer_request() and asked upstream by
+   send_refreshes() once the queries which used them are done with daemon->packet. */
+struct refresh {
+  unsigned short type, class;
+  char name[MAXDNAME];
+};
+
+static struct refresh *refreshes;
+static int refresh_count;
+
+/* Queue the question at p in the query in header. */
+void queue_refresh(struct dns_header *header, size_t qlen, unsigned char *p)
+{
+  struct refresh *r;
+
+  if (!refreshes && !(refreshes = whine_malloc(REFRESH_MAX * sizeof(struct refresh))))
+    return;
+
+  /* If too many are due at once, the rest expire as without --prefetch. */
+  if (refresh_count == REFRESH_MAX)
+    return;
+
+  r = &refreshes[refresh_count];
+
+  if (extract_name(header, qlen, &p, r->name, 1, 4))
+    {
+      GETSHORT(r->type, p);
+      GETSHORT(r->class, p);
+      refresh_count++;
+    }
+}
+
+/* Forward a refresh as a query from localhost which has no one to answer:
+   the reply just goes into the cache. */
+static void forward_refresh(struct dns_header *header, size_t plen, time_t now)
+{
+  union mysockaddr source_addr;
+  union all_addr dst_addr;
+  unsigned short type;
+
+  memset(&source_addr, 0, sizeof(source_addr));
+  source_addr.in.sin_family = AF_INET;
+  source_addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef HAVE_SOCKADDR_SA_LEN
+  source_addr.in.sin_len = sizeof(struct sockaddr_in);
+#endif
+  memset(&dst_addr, 0, sizeof(dst_addr));
+
+  daemon->log_display_id = ++daemon->log_id;
+  daemon->log_source_addr = &source_addr;
+
+  if (!extract_request(header, plen, daemon->namebuff, &type))
+    return;
+
+  log_query_mysockaddr(F_QUERY | F_FORWARD, daemon->namebuff, &source_addr, querystr("refresh", type));
+
+  if (forward_query(-1, &source_addr, &dst_addr, 0, header, plen, now, NULL, 0, 0))
+    daemon->metrics[METRIC_DNS_PREFETCHED]++;
+}
+
+void send_refreshes(time_t now)
+{
+  struct dns_header *header = (struct dns_header *)daemon->packet;
+  unsigned char *p;
+  size_t plen;
+  int i;
+
+  for (i = 0; i < refresh_count; i++)
+    {
+      /* packet buffer overwritten */
+      daemon->srv_save = NULL;
+
+      memset(header, 0, sizeof(struct dns_header));
+      header->id = rand16();
+      header->qdcount = htons(1);
+      header->hb3 = HB3_RD;
+      SET_OPCODE(header, QUERY);
+
+      if (!(p = do_rfc1035_name((unsigned char *)(header+1), refreshes[i].name, NULL)))
+	continue;
+      *p++ = 0;
+      PUTSHORT(refreshes[i].type, p);
+      PUTSHORT(refreshes[i].class, p);
+      plen = p - (unsigned char *)header;
+
+#ifdef HAVE_LINUX_NETWORK
+      /* In a worker, the refresh is done by the main process, whose cache it updates. */
+      if (handoff_fd != -1)
+	{
+	  struct handoff h;
+	  struct iovec iov[2];
+	  struct msghdr hmsg;
+
+	  memset(&h, 0, sizeof(h));
+	  h.refresh = 1;
+	  iov[0].iov_base = &h;
+	  iov[0].iov_len = sizeof(h);
+	  iov[1].iov_base = header;
+	  iov[1].iov_len = plen;
+
+	  memset(&hmsg, 0, sizeof(hmsg));
+	  hmsg.msg_iov = iov;
+	  hmsg.msg_iovlen = 2;
+
+	  while (sendmsg(handoff_fd, &hmsg, MSG_DONTWAIT) == -1 && errno == EINTR);
+	  continue;
+	}
+#endif
+
+      forward_refresh(header, plen, now);
+    }
+
+  refresh_count = 0;
+}
+
 #ifdef HAVE_DNSSEC
 /* Recurse up the key hierarchy */
 static int tcp_key_recurse(time_t now, int status, struct dns_header *header, size_t n, 
@@ -2146,6 +2648,71 @@ unsigned char *tcp_request(int confd, time_t now,
     }
 }
 
+/* Frecs in use are found by id, to match replies, and by question hash,
+   to spot retransmitted queries, in two tables of frec_hash_sz chains. The
+   ids are random, and the question hash is keyed, so neither needs more mixing. */
+static struct frec **frec_by_id, **frec_by_hash;
+static unsigned int frec_hash_sz;
+
+void frec_hash_init(void)
+{
+  for (frec_hash_sz = 64; frec_hash_sz < (unsigned int)daemon->ftabsize; frec_hash_sz <<= 1);
+
+  /* safe_malloc returns zero'd memory */
+  frec_by_id = safe_malloc(frec_hash_sz * sizeof(struct frec *));
+  frec_by_hash = safe_malloc(frec_hash_sz * sizeof(struct frec *));
+}
+
+static struct frec **id_bucket(unsigned short id)
+{
+  return &frec_by_id[id & (frec_hash_sz - 1)];
+}
+
+static struct frec **hash_bucket(unsigned char *hash)
+{
+  u32 val;
+
+  memcpy(&val, hash, sizeof(val));
+  return &frec_by_hash[val & (frec_hash_sz - 1)];
+}
+
+static void frec_unlink(struct frec *f)
+{
+  if (f->id_prev)
+    {
+      if ((*f->id_prev = f->id_next))
+	f->id_next->id_prev = f->id_prev;
+      f->id_prev = NULL;
+    }
+
+  if (f->hash_prev)
+    {
+      if ((*f->hash_prev = f->hash_next))
+	f->hash_next->hash_prev = f->hash_prev;
+      f->hash_prev = NULL;
+    }
+}
+
+/* Call when new_id and hash are set. */
+static void frec_link(struct frec *f)
+{
+  struct frec **up;
+
+  frec_unlink(f);
+
+  up = id_bucket(f->new_id);
+  if ((f->id_next = *up))
+    f->id_next->id_prev = &f->id_next;
+  f->id_prev = up;
+  *up = f;
+
+  up = hash_bucket(f->hash);
+  if ((f->hash_next = *up))
+    f->hash_next->hash_prev = &f->hash_next;
+  f->hash_prev = up;
+  *up = f;
+}
+
 static struct frec *allocate_frec(time_t now)
 {
   struct frec *f;
@@ -2157,6 +2724,7 @@ static struct frec *allocate_frec(time_t now)
       f->sentto = NULL;
       f->rfds = NULL;
       f->flags = 0;
+      f->id_prev = f->hash_prev = NULL;
 #ifdef HAVE_DNSSEC
       f->dependent = NULL;
       f->blocking_query = NULL;
@@ -2324,7 +2892,10 @@ void free_rfds(struct randfd_list **fdlp)
   for (rfl = *fdlp; rfl; rfl = tmp)
     {
       if (rfl->rfd->refcount == 0xffff || --(rfl->rfd->refcount) == 0)
-	close(rfl->rfd->fd);
+	{
+	  poll_forget(rfl->rfd->fd);
+	  close(rfl->rfd->fd);
+	}
 
       /* temporary overflow record */
       if (rfl->rfd->refcount == 0xffff)
@@ -2370,6 +2941,7 @@ static void free_frec(struct frec *f)
     
   f->frec_src.next = NULL;    
   free_rfds(&f->rfds);
+  frec_unlink(f);
   f->sentto = NULL;
   f->flags = 0;
 
@@ -2491,7 +3063,7 @@ static struct frec *lookup_frec(unsigned short id, int fd, void *hash)
   int type;
   struct randfd_list *fdl;
   
-  for(f = daemon->frec_list; f; f = f->next)
+  for (f = *id_bucket(id); f; f = f->id_next)
     if (f->sentto && f->new_id == id && 
 	(memcmp(hash, f->hash, HASH_SIZE) == 0))
       {
@@ -2530,7 +3102,7 @@ static struct frec *lookup_frec_by_query(void *hash, unsigned int flags)
 #define FLAGMASK (FREC_CHECKING_DISABLED | FREC_AD_QUESTION | FREC_DO_QUESTION \
 		  | FREC_HAS_PHEADER | FREC_DNSKEY_QUERY | FREC_DS_QUERY | FREC_NO_CACHE)
   
-  for(f = daemon->frec_list; f; f = f->next)
+  for (f = *hash_bucket(hash); f; f = f->hash_next)
     if (f->sentto &&
 	(f->flags & FLAGMASK) == flags &&
 	memcmp(hash, f->hash, HASH_SIZE) == 0)
@@ -2581,7 +3153,7 @@ static unsigned short get_id(void)
       ret = rand16();
 
       /* ensure id is unique. */
-      for (f = daemon->frec_list; f; f = f->next)
+      for (f = *id_bucket(ret); f; f = f->id_next)
 	if (f->sentto && f->new_id == ret)
 	  break;
 
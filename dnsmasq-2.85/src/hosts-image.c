@@ -0,0 +1,647 @@
+/* dnsmasq is Copyright (c) 2000-2021 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hosts images: hosts files compiled by --make-hosts-image into a table
+   which is answered from in place, through mmap(), rather than being read
+   into the cache. Loading one at startup or on SIGHUP is an mmap() and a
+   pointer swap, so that huge block lists don't stop the daemon whilst they
+   are parsed, and an image which hasn't changed costs nothing at all.
+
+   The image is in host byte order, and laid out as
+
+     header
+     buckets   u32[buckets + 1], the index of the first name in each bucket
+     names     struct image_name[names], in bucket order
+     addrs     struct image_addr[addrs], the addresses of each name together
+     rev       u32[rev], the addresses which give PTR answers, sorted
+     strings   the names, each NUL terminated
+
+   Images are made by the code which reads hosts files, so --expand-hosts
+   and "first name wins" for reverse lookups work as they do for hosts files,
+   and the empty non-terminals appear as names with no addresses.
+
+   A new image must be moved into place with rename(): truncating a file
+   which is mapped makes the next access to it fatal. */
+
+#include "dnsmasq.h"
+
+#include <sys/mman.h>
+
+#define IMAGE_MAGIC   0x64686931 /* "dhi1" */
+#define IMAGE_VERSION 1
+
+struct image_header {
+  u32 magic, version, size;
+  u32 buckets, names, addrs, rev, strings;
+  u32 bucket_off, name_off, addr_off, rev_off, str_off;
+};
+
+struct image_name {
+  u32 hash, name;  /* name is an offset into strings */
+  u32 addr, count; /* index of first address, number of addresses */
+};
+
+struct image_addr {
+  u32 family, name; /* 4 or 6, offset of name as given in the hosts file */
+  unsigned char addr[IN6ADDRSZ];
+};
+
+struct hosts_image {
+  struct hosts_image *next;
+  struct hostsfile *file;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  size_t size;
+  struct image_header *hdr; /* start of the mapping */
+  u32 *buckets, *rev;
+  struct image_name *names;
+  struct image_addr *addrs;
+  char *strings;
+};
+
+/* Answers are returned as cache entries, which are good until the next lookup. */
+struct answers {
+  struct crec *crecs;
+  int size;
+};
+
+static struct hosts_image *images = NULL;
+static struct answers name_answers, addr_answers;
+
+static u32 image_hash(const char *name)
+{
+  u32 c, val = 2166136261u;
+
+  while ((c = (unsigned char) *name++))
+    {
+      /* don't use tolower and friends here - they may be messed up by LOCALE */
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = (val ^ c) * 16777619u;
+    }
+
+  return val;
+}
+
+static struct image_name *find_name(struct hosts_image *im, char *name, u32 hash)
+{
+  u32 i, b = hash & (im->hdr->buckets - 1);
+
+  for (i = im->buckets[b]; i < im->buckets[b+1]; i++)
+    {
+      struct image_name *n = &im->names[i];
+
+      if (n->hash == hash && n->name < im->hdr->strings &&
+	  n->count <= im->hdr->addrs && n->addr <= im->hdr->addrs - n->count &&
+	  hostname_isequal(im->strings + n->name, name))
+	return n;
+    }
+
+  return NULL;
+}
+
+static struct crec *add_answer(struct answers *a, int n)
+{
+  if (n >= a->size)
+    {
+      int new_size = a->size == 0 ? 8 : a->size * 2;
+      struct crec *new = whine_malloc(new_size * sizeof(struct crec));
+
+      if (!new)
+	return NULL;
+
+      if (a->crecs)
+	{
+	  memcpy(new, a->crecs, a->size * sizeof(struct crec));
+	  free(a->crecs);
+	}
+
+      a->crecs = new;
+      a->size = new_size;
+    }
+
+  return &a->crecs[n];
+}
+
+static struct crec **link_answers(struct crec **chainp, struct answers *a, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      *chainp = &a->crecs[i];
+      chainp = &a->crecs[i].next;
+    }
+
+  return chainp;
+}
+
+static int fill_answer(struct crec *crecp, struct hosts_image *im, struct image_addr *a, unsigned int flags)
+{
+  if (a->name >= im->hdr->strings)
+    return 0;
+
+  crecp->flags = flags | F_HOSTS | F_IMMORTAL | F_FORWARD | F_NAMEP | (a->family == 6 ? F_IPV6 : F_IPV4);
+  crecp->name.namep = im->strings + a->name;
+  crecp->ttd = daemon->local_ttl;
+  crecp->uid = im->file->index;
+  memcpy(&crecp->addr, a->addr, a->family == 6 ? IN6ADDRSZ : INADDRSZ);
+
+  return 1;
+}
+
+/* Is there a name in the images, with an address of the type in prot, if prot is set? */
+int hosts_image_exists(char *name, unsigned int prot)
+{
+  struct hosts_image *im;
+  struct image_name *n;
+  u32 i, hash;
+
+  if (!images)
+    return 0;
+
+  hash = image_hash(name);
+
+  for (im = images; im; im = im->next)
+    if ((n = find_name(im, name, hash)))
+      {
+	if (prot == 0)
+	  return 1;
+
+	for (i = 0; i < n->count; i++)
+	  if (prot & (im->addrs[n->addr + i].family == 6 ? F_IPV6 : F_IPV4))
+	    return 1;
+      }
+
+  return 0;
+}
+
+/* Add entries for name which match prot to the chain of answers
+   being built by cache_find_by_name() and return the new end of the chain. */
+struct crec **hosts_image_find_name(struct crec **chainp, char *name, unsigned int prot)
+{
+  struct hosts_image *im;
+  struct image_name *n;
+  struct crec *crecp;
+  u32 i, hash;
+  int count = 0;
+
+  if (!images)
+    return chainp;
+
+  hash = image_hash(name);
+
+  for (im = images; im; im = im->next)
+    if ((n = find_name(im, name, hash)))
+      for (i = 0; i < n->count; i++)
+	{
+	  struct image_addr *a = &im->addrs[n->addr + i];
+
+	  if ((crecp = add_answer(&name_answers, count)) &&
+	      fill_answer(crecp, im, a, 0) && (crecp->flags & prot))
+	    count++;
+	}
+
+  return link_answers(chainp, &name_answers, count);
+}
+
+static int addr_cmp(u32 family, const unsigned char *addr, struct image_addr *a)
+{
+  if (family != a->family)
+    return family < a->family ? -1 : 1;
+
+  return memcmp(addr, a->addr, family == 6 ? IN6ADDRSZ : INADDRSZ);
+}
+
+/* As above, for cache_find_by_addr(). */
+struct crec **hosts_image_find_addr(struct crec **chainp, union all_addr *addr, unsigned int prot)
+{
+  struct hosts_image *im;
+  struct crec *crecp;
+  u32 family = (prot & F_IPV6) ? 6 : 4;
+  int count = 0;
+
+  if (!images)
+    return chainp;
+
+  for (im = images; im; im = im->next)
+    {
+      u32 lo = 0, hi = im->hdr->rev;
+
+      while (lo < hi)
+	{
+	  u32 mid = lo + (hi - lo)/2;
+	  struct image_addr *a;
+	  int res;
+
+	  if (im->rev[mid] >= im->hdr->addrs)
+	    break;
+
+	  a = &im->addrs[im->rev[mid]];
+
+	  if ((res = addr_cmp(family, (unsigned char *)addr, a)) < 0)
+	    hi = mid;
+	  else if (res > 0)
+	    lo = mid + 1;
+	  else
+	    {
+	      if ((crecp = add_answer(&addr_answers, count)) &&
+		  fill_answer(crecp, im, a, F_REVERSE))
+		count++;
+	      break;
+	    }
+	}
+    }
+
+  return link_answers(chainp, &addr_answers, count);
+}
+
+static struct hosts_image *map_image(struct hostsfile *hf, int fd, struct stat *st)
+{
+  struct hosts_image *im;
+  struct image_header *hdr;
+  u64 size = st->st_size;
+  void *map;
+  u32 i;
+
+  if (size < sizeof(struct image_header) || size > 0xffffffff)
+    {
+      my_syslog(LOG_ERR, _("bad hosts image %s"), hf->fname);
+      return NULL;
+    }
+
+  if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), hf->fname, strerror(errno));
+      return NULL;
+    }
+
+  hdr = map;
+
+#define SECTION_OK(off, len) \
+  ((off) % 4 == 0 && (u64)(off) + (u64)(len) <= size)
+
+  if (hdr->magic != IMAGE_MAGIC || hdr->version != IMAGE_VERSION || hdr->size != size ||
+      hdr->buckets == 0 || (hdr->buckets & (hdr->buckets - 1)) != 0 || hdr->strings == 0 ||
+      !SECTION_OK(hdr->bucket_off, ((u64)hdr->buckets + 1) * sizeof(u32)) ||
+      !SECTION_OK(hdr->name_off, (u64)hdr->names * sizeof(struct image_name)) ||
+      !SECTION_OK(hdr->addr_off, (u64)hdr->addrs * sizeof(struct image_addr)) ||
+      !SECTION_OK(hdr->rev_off, (u64)hdr->rev * sizeof(u32)) ||
+      !SECTION_OK(hdr->str_off, hdr->strings) ||
+      ((char *)map)[hdr->str_off + hdr->strings - 1] != 0)
+    goto bad;
+
+  if (!(im = whine_malloc(sizeof(struct hosts_image))))
+    {
+      munmap(map, size);
+      return NULL;
+    }
+
+  im->file = hf;
+  im->dev = st->st_dev;
+  im->ino = st->st_ino;
+  im->mtime = st->st_mtime;
+  im->size = size;
+  im->hdr = hdr;
+  im->buckets = (u32 *)((char *)map + hdr->bucket_off);
+  im->names = (struct image_name *)((char *)map + hdr->name_off);
+  im->addrs = (struct image_addr *)((char *)map + hdr->addr_off);
+  im->rev = (u32 *)((char *)map + hdr->rev_off);
+  im->strings = (char *)map + hdr->str_off;
+
+  /* The lookups trust the buckets to stay inside the names. */
+  for (i = 0; i < hdr->buckets; i++)
+    if (im->buckets[i] > im->buckets[i+1])
+      break;
+
+  if (i == hdr->buckets && im->buckets[0] == 0 && im->buckets[hdr->buckets] == hdr->names)
+    return im;
+
+  free(im);
+
+ bad:
+  my_syslog(LOG_ERR, _("bad hosts image %s"), hf->fname);
+  munmap(map, size);
+  return NULL;
+}
+
+static void unmap_image(struct hosts_image *im)
+{
+  munmap(im->hdr, im->size);
+  free(im);
+}
+
+/* Map each --hosts-image which is new or has changed since it was last mapped. */
+void hosts_image_load(void)
+{
+  struct hostsfile *hf;
+  struct hosts_image *im, *new, *list = NULL, **up;
+
+  for (hf = daemon->hosts_images; hf; hf = hf->next)
+    {
+      struct stat st;
+      int fd;
+
+      for (up = &images, im = images; im; up = &im->next, im = im->next)
+	if (im->file == hf)
+	  {
+	    *up = im->next;
+	    break;
+	  }
+
+      new = NULL;
+
+      if ((fd = open(hf->fname, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+	my_syslog(LOG_ERR, _("failed to load names from %s: %s"), hf->fname, strerror(errno));
+      else if (im && im->dev == st.st_dev && im->ino == st.st_ino &&
+	       im->mtime == st.st_mtime && im->size == (size_t)st.st_size)
+	new = im;
+      else if ((new = map_image(hf, fd, &st)))
+	my_syslog(LOG_INFO, _("mapped %s - %u names, %u addresses"),
+		  hf->fname, new->hdr->names, new->hdr->addrs);
+
+      if (fd != -1)
+	close(fd);
+
+      if (!new)
+	{
+	  /* Keep answering from the old image rather than none. */
+	  if (!(new = im))
+	    continue;
+	}
+      else if (im && im != new)
+	unmap_image(im);
+
+      new->next = list;
+      list = new;
+    }
+
+  /* Images no longer configured */
+  for (im = images; im; im = new)
+    {
+      new = im->next;
+      unmap_image(im);
+    }
+
+  images = list;
+}
+
+void hosts_image_report(void)
+{
+  struct hosts_image *im;
+
+  for (im = images; im; im = im->next)
+    my_syslog(LOG_INFO, _("hosts image %s: %u names, %u addresses, %u bytes"),
+	      im->file->fname, im->hdr->names, im->hdr->addrs, im->hdr->size);
+}
+
+/* --make-hosts-image */
+
+struct make_entry {
+  struct crec *crecp;
+  u32 hash, family;
+};
+
+static u32 make_buckets;
+static struct image_addr *make_addrs;
+
+static int name_cmp(const char *a, const char *b)
+{
+  unsigned int c1, c2;
+
+  do {
+    c1 = (unsigned char) *a++;
+    c2 = (unsigned char) *b++;
+
+    if (c1 >= 'A' && c1 <= 'Z')
+      c1 += 'a' - 'A';
+    if (c2 >= 'A' && c2 <= 'Z')
+      c2 += 'a' - 'A';
+  } while (c1 == c2 && c1);
+
+  return (int)c1 - (int)c2;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+  const struct make_entry *e1 = a, *e2 = b;
+  u32 b1 = e1->hash & (make_buckets - 1), b2 = e2->hash & (make_buckets - 1);
+  int res;
+
+  if (b1 != b2)
+    return b1 < b2 ? -1 : 1;
+
+  if (e1->hash != e2->hash)
+    return e1->hash < e2->hash ? -1 : 1;
+
+  if ((res = name_cmp(cache_get_name(e1->crecp), cache_get_name(e2->crecp))))
+    return res;
+
+  /* names without addresses first */
+  if (e1->family != e2->family)
+    return e1->family < e2->family ? -1 : 1;
+
+  if (e1->family == 0)
+    return 0;
+
+  return memcmp(&e1->crecp->addr, &e2->crecp->addr, e1->family == 6 ? IN6ADDRSZ : INADDRSZ);
+}
+
+static int rev_cmp(const void *a, const void *b)
+{
+  struct image_addr *a1 = &make_addrs[*((const u32 *)a)];
+
+  return addr_cmp(a1->family, a1->addr, &make_addrs[*((const u32 *)b)]);
+}
+
+/* Read the hosts file src into the cache, exactly as for --addn-hosts, and
+   write what ends up there as an image in dst. Called instead of running
+   the daemon. */
+void hosts_image_make(char *src, char *dst)
+{
+  struct make_entry *entries, *last;
+  char *group = NULL;
+  struct image_header *hdr;
+  struct image_name *nametab;
+  struct crec *crecp;
+  unsigned char *image;
+  char *tmp;
+  u32 i, n = 0, b, names = 0, addrs = 0, rev = 0, strings = 0;
+  u32 *buckets, *revp;
+  u64 size;
+  FILE *f;
+  int fd, err;
+
+  if (!(f = fopen(src, "r")))
+    die(_("cannot read %s: %s"), src, EC_FILE);
+  fclose(f);
+
+  /* borrow the packet buffer for a temporary by-address hash, like cache_reload() */
+  memset(daemon->packet, 0, daemon->packet_buff_sz);
+  read_hostsfile(src, SRC_AH, 0, (struct crec **)daemon->packet, daemon->packet_buff_sz / sizeof(struct crec *));
+
+  for (cache_enumerate(1); (crecp = cache_enumerate(0)); )
+    if (crecp->flags & F_HOSTS)
+      n++;
+
+  entries = safe_malloc((n ? n : 1) * sizeof(struct make_entry));
+
+  for (i = 0, cache_enumerate(1); (crecp = cache_enumerate(0)); )
+    if (crecp->flags & F_HOSTS)
+      {
+	entries[i].crecp = crecp;
+	entries[i].hash = image_hash(cache_get_name(crecp));
+	entries[i].family = (crecp->flags & F_IPV4) ? 4 : ((crecp->flags & F_IPV6) ? 6 : 0);
+	i++;
+      }
+
+  for (make_buckets = 64; make_buckets < n; make_buckets <<= 1);
+  qsort(entries, n, sizeof(struct make_entry), entry_cmp);
+
+  for (last = NULL, i = 0; i < n; i++)
+    {
+      crecp = entries[i].crecp;
+
+      if (last && entry_cmp(last, &entries[i]) == 0)
+	{
+	  entries[i].crecp = NULL; /* duplicate */
+	  continue;
+	}
+
+      if (!last || name_cmp(group, cache_get_name(crecp)) != 0)
+	{
+	  names++;
+	  group = cache_get_name(crecp);
+	  strings += strlen(group) + 1;
+	}
+
+      if (entries[i].family != 0)
+	{
+	  /* Keep the spelling of each line of the hosts file for PTR answers. */
+	  if (strcmp(group, cache_get_name(crecp)) != 0)
+	    strings += strlen(cache_get_name(crecp)) + 1;
+
+	  addrs++;
+	  if (crecp->flags & F_REVERSE)
+	    rev++;
+	}
+
+      last = &entries[i];
+    }
+
+  if (strings == 0)
+    strings = 1;
+
+  size = sizeof(struct image_header) + ((u64)make_buckets + 1) * sizeof(u32) +
+    (u64)names * sizeof(struct image_name) + (u64)addrs * sizeof(struct image_addr) +
+    (u64)rev * sizeof(u32) + strings;
+
+  if (size > 0xffffffff)
+    die(_("hosts image %s would be too big"), dst, EC_BADCONF);
+
+  image = safe_malloc(size);
+  hdr = (struct image_header *)image;
+  hdr->magic = IMAGE_MAGIC;
+  hdr->version = IMAGE_VERSION;
+  hdr->size = size;
+  hdr->buckets = make_buckets;
+  hdr->names = names;
+  hdr->addrs = addrs;
+  hdr->rev = rev;
+  hdr->strings = strings;
+  hdr->bucket_off = sizeof(struct image_header);
+  hdr->name_off = hdr->bucket_off + (make_buckets + 1) * sizeof(u32);
+  hdr->addr_off = hdr->name_off + names * sizeof(struct image_name);
+  hdr->rev_off = hdr->addr_off + addrs * sizeof(struct image_addr);
+  hdr->str_off = hdr->rev_off + rev * sizeof(u32);
+
+  buckets = (u32 *)(image + hdr->bucket_off);
+  nametab = (struct image_name *)(image + hdr->name_off);
+  make_addrs = (struct image_addr *)(image + hdr->addr_off);
+  revp = (u32 *)(image + hdr->rev_off);
+
+  for (b = 0, i = 0, names = 0, addrs = 0, strings = 0; i < n; i++)
+    {
+      char *name;
+
+      if (!(crecp = entries[i].crecp))
+	continue;
+
+      name = cache_get_name(crecp);
+
+      if (names == 0 || name_cmp((char *)image + hdr->str_off + nametab[names-1].name, name) != 0)
+	{
+	  for (; b <= (entries[i].hash & (make_buckets - 1)); b++)
+	    buckets[b] = names;
+
+	  nametab[names].hash = entries[i].hash;
+	  nametab[names].name = strings;
+	  nametab[names].addr = addrs;
+	  strcpy((char *)image + hdr->str_off + strings, name);
+	  strings += strlen(name) + 1;
+	  names++;
+	}
+
+      if (entries[i].family != 0)
+	{
+	  struct image_addr *a = &make_addrs[addrs];
+
+	  a->family = entries[i].family;
+	  a->name = nametab[names-1].name;
+
+	  if (strcmp((char *)image + hdr->str_off + a->name, name) != 0)
+	    {
+	      a->name = strings;
+	      strcpy((char *)image + hdr->str_off + strings, name);
+	      strings += strlen(name) + 1;
+	    }
+	  memcpy(a->addr, &crecp->addr, a->family == 6 ? IN6ADDRSZ : INADDRSZ);
+
+	  if (crecp->flags & F_REVERSE)
+	    *revp++ = addrs;
+
+	  nametab[names-1].count++;
+	  addrs++;
+	}
+    }
+
+  for (; b <= make_buckets; b++)
+    buckets[b] = names;
+
+  qsort(image + hdr->rev_off, rev, sizeof(u32), rev_cmp);
+
+  /* Write a new file and rename it, so a running dnsmasq never sees a partial image. */
+  tmp = safe_malloc(strlen(dst) + 5);
+  sprintf(tmp, "%s.new", dst);
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+      !read_write(fd, image, (int)size, 0) ||
+      close(fd) == -1 ||
+      rename(tmp, dst) == -1)
+    {
+      err = errno;
+      unlink(tmp);
+      errno = err;
+      die(_("cannot write hosts image %s: %s"), dst, EC_FILE);
+    }
+
+  my_syslog(LOG_INFO, _("wrote %s - %u names, %u addresses"), dst, names, addrs);
+
+  free(tmp);
+  free(image);
+  free(entries);
+}
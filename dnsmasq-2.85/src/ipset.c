@@ -31,11 +31,15 @@
 #define NFNL_SUBSYS_IPSET 6
 
 #define IPSET_ATTR_DATA 7
+#define IPSET_ATTR_ADT 8
 #define IPSET_ATTR_IP 1
 #define IPSET_ATTR_IPADDR_IPV4 1
 #define IPSET_ATTR_IPADDR_IPV6 2
 #define IPSET_ATTR_PROTOCOL 1
 #define IPSET_ATTR_SETNAME 2
+#define IPSET_ATTR_FLAGS 6
+#define IPSET_ATTR_LINENO 9
+#define IPSET_FLAG_EXIST 1
 #define IPSET_CMD_ADD 9
 #define IPSET_CMD_DEL 10
 #define IPSET_MAXNAMELEN 32
@@ -68,11 +72,26 @@ struct my_nfgenmsg {
 /* data structure size in here is fixed */
 #define BUFF_SZ 256
 
+/* Additions are queued, one message for each set and address family, and each
+   message carries a list of elements. The messages are sent when full or
+   when ipset_flush() is called, so the answers in a reply cost one
+   sendto() per set rather than one per address. */
+#define BATCH_SZ 1024
+#define BATCH_MAX 8
+
 #define NL_ALIGN(len) (((len)+3) & ~(3))
 static const struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
 static int ipset_sock, old_kernel;
 static char *buffer;
 
+static struct ipset_batch {
+  const char *setname;
+  int af;
+  struct my_nlattr *adt;
+  char *buffer;
+} batches[BATCH_MAX];
+static int batches_used;
+
 static inline void add_attr(struct nlmsghdr *nlh, uint16_t type, size_t len, const void *data)
 {
   struct my_nlattr *attr = (void *)nlh + NL_ALIGN(nlh->nlmsg_len);
@@ -83,8 +102,23 @@ static inline void add_attr(struct nlmsghdr *nlh, uint16_t type, size_t len, con
   nlh->nlmsg_len += NL_ALIGN(payload_len);
 }
 
+static inline struct my_nlattr *start_nested(struct nlmsghdr *nlh, uint16_t type)
+{
+  struct my_nlattr *attr = (void *)nlh + NL_ALIGN(nlh->nlmsg_len);
+  attr->nla_type = NLA_F_NESTED | type;
+  nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nlattr));
+  return attr;
+}
+
+static inline void end_nested(struct nlmsghdr *nlh, struct my_nlattr *attr)
+{
+  attr->nla_len = (void *)nlh + NL_ALIGN(nlh->nlmsg_len) - (void *)attr;
+}
+
 void ipset_init(void)
 {
+  int i;
+  
   old_kernel = (daemon->kernel_version < KERNEL_VERSION(2,6,32));
   
   if (old_kernel && (ipset_sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) != -1)
@@ -94,33 +128,30 @@ void ipset_init(void)
       (buffer = safe_malloc(BUFF_SZ)) &&
       (ipset_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) != -1 &&
       (bind(ipset_sock, (struct sockaddr *)&snl, sizeof(snl)) != -1))
-    return;
+    {
+      for (i = 0; i < BATCH_MAX; i++)
+	batches[i].buffer = safe_malloc(BATCH_SZ);
+      return;
+    }
   
   die (_("failed to create IPset control socket: %s"), NULL, EC_MISC);
 }
 
-static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, int af, int remove)
+/* Start a message in buff, up to and including the setname. */
+static struct nlmsghdr *ipset_header(char *buff, size_t size, const char *setname, int af, int remove)
 {
   struct nlmsghdr *nlh;
   struct my_nfgenmsg *nfg;
-  struct my_nlattr *nested[2];
   uint8_t proto;
-  int addrsz = (af == AF_INET6) ? IN6ADDRSZ : INADDRSZ;
-
-  if (strlen(setname) >= IPSET_MAXNAMELEN) 
-    {
-      errno = ENAMETOOLONG;
-      return -1;
-    }
   
-  memset(buffer, 0, BUFF_SZ);
+  memset(buff, 0, size);
 
-  nlh = (struct nlmsghdr *)buffer;
+  nlh = (struct nlmsghdr *)buff;
   nlh->nlmsg_len = NL_ALIGN(sizeof(struct nlmsghdr));
   nlh->nlmsg_type = (remove ? IPSET_CMD_DEL : IPSET_CMD_ADD) | (NFNL_SUBSYS_IPSET << 8);
   nlh->nlmsg_flags = NLM_F_REQUEST;
   
-  nfg = (struct my_nfgenmsg *)(buffer + nlh->nlmsg_len);
+  nfg = (struct my_nfgenmsg *)(buff + nlh->nlmsg_len);
   nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nfgenmsg));
   nfg->nfgen_family = af;
   nfg->version = NFNETLINK_V0;
@@ -129,24 +160,126 @@ static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, i
   proto = IPSET_PROTOCOL;
   add_attr(nlh, IPSET_ATTR_PROTOCOL, sizeof(proto), &proto);
   add_attr(nlh, IPSET_ATTR_SETNAME, strlen(setname) + 1, setname);
-  nested[0] = (struct my_nlattr *)(buffer + NL_ALIGN(nlh->nlmsg_len));
-  nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nlattr));
-  nested[0]->nla_type = NLA_F_NESTED | IPSET_ATTR_DATA;
-  nested[1] = (struct my_nlattr *)(buffer + NL_ALIGN(nlh->nlmsg_len));
-  nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nlattr));
-  nested[1]->nla_type = NLA_F_NESTED | IPSET_ATTR_IP;
+
+  return nlh;
+}
+
+/* Add an IPSET_ATTR_DATA element holding ipaddr. */
+static void ipset_element(struct nlmsghdr *nlh, const union all_addr *ipaddr, int af)
+{
+  struct my_nlattr *nested[2];
+  int addrsz = (af == AF_INET6) ? IN6ADDRSZ : INADDRSZ;
+
+  nested[0] = start_nested(nlh, IPSET_ATTR_DATA);
+  nested[1] = start_nested(nlh, IPSET_ATTR_IP);
   add_attr(nlh, 
 	   (af == AF_INET ? IPSET_ATTR_IPADDR_IPV4 : IPSET_ATTR_IPADDR_IPV6) | NLA_F_NET_BYTEORDER,
 	   addrsz, ipaddr);
-  nested[1]->nla_len = (void *)buffer + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[1];
-  nested[0]->nla_len = (void *)buffer + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[0];
-	
-  while (retry_send(sendto(ipset_sock, buffer, nlh->nlmsg_len, 0,
+  end_nested(nlh, nested[1]);
+  end_nested(nlh, nested[0]);
+}
+
+static int ipset_send(struct nlmsghdr *nlh)
+{
+  while (retry_send(sendto(ipset_sock, nlh, nlh->nlmsg_len, 0,
 			   (struct sockaddr *)&snl, sizeof(snl))));
 								    
   return errno == 0 ? 0 : -1;
 }
 
+static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, int af, int remove)
+{
+  struct nlmsghdr *nlh;
+
+  if (strlen(setname) >= IPSET_MAXNAMELEN) 
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  
+  nlh = ipset_header(buffer, BUFF_SZ, setname, af, remove);
+  ipset_element(nlh, ipaddr, af);
+  
+  return ipset_send(nlh);
+}
+
+static int send_batch(struct ipset_batch *batch)
+{
+  int ret;
+  
+  end_nested((struct nlmsghdr *)batch->buffer, batch->adt);
+  
+  if ((ret = ipset_send((struct nlmsghdr *)batch->buffer)) == -1)
+    my_syslog(LOG_ERR, _("failed to update ipset %s: %s"), batch->setname, strerror(errno));
+  
+  return ret;
+}
+
+static void start_batch(struct ipset_batch *batch, const char *setname, int af)
+{
+  struct nlmsghdr *nlh = ipset_header(batch->buffer, BATCH_SZ, setname, af, 0);
+  uint32_t flags = htonl(IPSET_FLAG_EXIST), lineno = 0;
+  
+  /* An address already in the set must not end the list: the kernel
+     stops at the first element which fails. The kernel only takes a list
+     of elements together with a line number, which it uses to say which
+     element failed. */
+  add_attr(nlh, IPSET_ATTR_FLAGS | NLA_F_NET_BYTEORDER, sizeof(flags), &flags);
+  add_attr(nlh, IPSET_ATTR_LINENO, sizeof(lineno), &lineno);
+  
+  batch->setname = setname;
+  batch->af = af;
+  batch->adt = start_nested(nlh, IPSET_ATTR_ADT);
+}
+
+static int batch_add_to_ipset(const char *setname, const union all_addr *ipaddr, int af)
+{
+  struct ipset_batch *batch = NULL;
+  /* DATA and IP nests, plus the address attribute */
+  size_t elemsz = 3 * NL_ALIGN(sizeof(struct my_nlattr)) + ((af == AF_INET6) ? IN6ADDRSZ : INADDRSZ);
+  int i;
+  
+  if (strlen(setname) >= IPSET_MAXNAMELEN) 
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  for (i = 0; i < batches_used; i++)
+    if (batches[i].af == af && strcmp(batches[i].setname, setname) == 0)
+      {
+	batch = &batches[i];
+	break;
+      }
+
+  if (!batch)
+    {
+      if (batches_used == BATCH_MAX)
+	ipset_flush();
+      batch = &batches[batches_used++];
+      start_batch(batch, setname, af);
+    }
+  else if (((struct nlmsghdr *)batch->buffer)->nlmsg_len + elemsz > BATCH_SZ)
+    {
+      send_batch(batch);
+      start_batch(batch, setname, af);
+    }
+  
+  ipset_element((struct nlmsghdr *)batch->buffer, ipaddr, af);
+
+  return 0;
+}
+
+void ipset_flush(void)
+{
+  int i;
+
+  for (i = 0; i < batches_used; i++)
+    send_batch(&batches[i]);
+
+  batches_used = 0;
+}
+
 
 static int old_add_to_ipset(const char *setname, const union all_addr *ipaddr, int remove)
 {
@@ -205,7 +338,14 @@ int add_to_ipset(const char *setname, const union all_addr *ipaddr, int flags, i
     }
   
   if (ret != -1) 
-    ret = old_kernel ? old_add_to_ipset(setname, ipaddr, remove) : new_add_to_ipset(setname, ipaddr, af, remove);
+    {
+      if (old_kernel)
+	ret = old_add_to_ipset(setname, ipaddr, remove);
+      else if (remove)
+	ret = new_add_to_ipset(setname, ipaddr, af, remove);
+      else
+	ret = batch_add_to_ipset(setname, ipaddr, af);
+    }
 
   if (ret == -1)
      my_syslog(LOG_ERR, _("failed to update ipset %s: %s"), setname, strerror(errno));
@@ -21,7 +21,232 @@
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
-static int read_leases(time_t now, FILE *leasestream)
+/* Hash tables indexing the leases list by address, client-id and hardware address.
+   Chains are kept in the same order as the list, so lookups find the same lease as
+   a walk of the list would. Only DHCPv4 leases are indexed by client-id and
+   hardware address. */
+static struct dhcp_lease **lease_hash_table[LEASE_HASHES];
+static unsigned int lease_hash_size, lease_serial;
+
+/* Don't keep a bitmap of used addresses for absurdly large dhcp-ranges. */
+#define LEASE_MAP_MAX (1u<<24)
+
+/* With --leasefile-journal, the lease file is a snapshot and changes since
+   are appended to one of two journal files. When the active journal gets
+   large or old, the other one becomes active and a child process rewrites
+   the snapshot and then empties the old journal, so the event loop only
+   ever writes changed leases. Each journal starts with a generation number
+   so that they can be replayed in the right order after a crash. */
+static FILE *journal[2];
+static int journal_active, journal_rewrite;
+static unsigned int journal_gen;
+static time_t journal_start; /* time of first record in the active journal */
+static pid_t journal_pid;    /* compaction in progress */
+
+static void journal_init(time_t now);
+
+static void lease_dirty(struct dhcp_lease *lease)
+{
+  lease->flags |= LEASE_JOURNAL;
+  file_dirty = 1;
+}
+
+static unsigned int hash_bytes(unsigned int val, const unsigned char *p, int len)
+{
+  /* SDBM, as in address_allocate() */
+  while (len-- > 0)
+    val = *p++ + (val << 6) + (val << 16) - val;
+  
+  return val;
+}
+
+/* Return zero if lease has no key in index h */
+static int lease_key(struct dhcp_lease *lease, int h, unsigned int *hashp)
+{
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    {
+      if (h != LEASE_HASH_ADDR)
+	return 0;
+      
+      *hashp = hash_bytes(0, lease->addr6.s6_addr, IN6ADDRSZ);
+      return 1;
+    }
+#endif
+
+  if (h == LEASE_HASH_ADDR)
+    *hashp = hash_bytes(0, (unsigned char *)&lease->addr, INADDRSZ);
+  else if (h == LEASE_HASH_CLID)
+    {
+      if (!lease->clid)
+	return 0;
+      *hashp = hash_bytes(0, lease->clid, lease->clid_len);
+    }
+  else
+    {
+      if (lease->hwaddr_len <= 0 || lease->hwaddr_len > DHCP_CHADDR_MAX)
+	return 0;
+      *hashp = hash_bytes(lease->hwaddr_type, lease->hwaddr, lease->hwaddr_len);
+    }
+  
+  return 1;
+}
+
+static void lease_hash(struct dhcp_lease *lease, int h)
+{
+  struct dhcp_lease **up;
+  unsigned int hash;
+
+  if (lease_key(lease, h, &hash))
+    {
+      /* newest first, like the leases list */
+      for (up = &lease_hash_table[h][hash & (lease_hash_size - 1)]; *up; up = &(*up)->hash_next[h])
+	if ((*up)->serial < lease->serial)
+	  break;
+      
+      lease->hash_next[h] = *up;
+      *up = lease;
+    }
+}
+
+static void lease_unhash(struct dhcp_lease *lease, int h)
+{
+  struct dhcp_lease **up;
+  unsigned int hash;
+  
+  if (lease_key(lease, h, &hash))
+    for (up = &lease_hash_table[h][hash & (lease_hash_size - 1)]; *up; up = &(*up)->hash_next[h])
+      if (*up == lease)
+	{
+	  *up = lease->hash_next[h];
+	  break;
+	}
+}
+
+static int lease_hash_grow(void)
+{
+  struct dhcp_lease **new[LEASE_HASHES], *lease;
+  unsigned int new_size = lease_hash_size ? lease_hash_size << 1 : 64;
+  int h;
+
+  for (h = 0; h < LEASE_HASHES; h++)
+    if (!(new[h] = whine_malloc(new_size * sizeof(struct dhcp_lease *))))
+      {
+	while (h--)
+	  free(new[h]);
+	return 0;
+      }
+  
+  for (h = 0; h < LEASE_HASHES; h++)
+    {
+      free(lease_hash_table[h]);
+      lease_hash_table[h] = new[h];
+    }
+  
+  lease_hash_size = new_size;
+
+  for (lease = leases; lease; lease = lease->next)
+    for (h = 0; h < LEASE_HASHES; h++)
+      lease_hash(lease, h);
+  
+  return 1;
+}
+
+/* Mark addr as used or free in the bitmap of each context which contains it. */
+static void lease_map_set(struct in_addr addr, int used)
+{
+  struct dhcp_context *context;
+  unsigned int off;
+
+  for (context = daemon->dhcp; context; context = context->next)
+    if (context->lease_map &&
+	ntohl(addr.s_addr) >= ntohl(context->start.s_addr) &&
+	ntohl(addr.s_addr) <= ntohl(context->end.s_addr))
+      {
+	off = ntohl(addr.s_addr) - ntohl(context->start.s_addr);
+	if (used)
+	  context->lease_map[off / 32] |= 1u << (off % 32);
+	else
+	  context->lease_map[off / 32] &= ~(1u << (off % 32));
+      }
+}
+
+static void lease_map_init(void)
+{
+  struct dhcp_context *context;
+  unsigned int size;
+
+  for (context = daemon->dhcp; context; context = context->next)
+    if (!(context->flags & (CONTEXT_STATIC | CONTEXT_PROXY)) && !context->lease_map)
+      {
+	size = ntohl(context->end.s_addr) - ntohl(context->start.s_addr) + 1;
+	if (size != 0 && size <= LEASE_MAP_MAX)
+	  context->lease_map = safe_malloc(((size + 31) / 32) * sizeof(unsigned int));
+      }
+}
+
+/* Drop the name and client-id of a lease, without telling the lease-change script. */
+static void lease_forget(struct dhcp_lease *lease)
+{
+  free(lease->hostname);
+  free(lease->fqdn);
+  lease->hostname = lease->fqdn = NULL;
+  
+  lease_unhash(lease, LEASE_HASH_CLID);
+  free(lease->clid);
+  lease->clid = NULL;
+  lease->clid_len = 0;
+}
+
+/* Remove a lease which the journal says has gone. It stays on the list,
+   invisible to lookups, until lease_sweep(), to avoid walking the list each time. */
+static void lease_drop(struct dhcp_lease *lease)
+{
+  int h;
+
+  lease_forget(lease);
+
+  for (h = 0; h < LEASE_HASHES; h++)
+    lease_unhash(lease, h);
+  
+#ifdef HAVE_DHCP6
+  if (!(lease->flags & (LEASE_TA | LEASE_NA)))
+#endif
+    if (!lease_find_by_addr(lease->addr))
+      lease_map_set(lease->addr, 0);
+  
+  lease->flags |= LEASE_DROPPED;
+  /* Give the slot back now: a long journal may drop more leases than
+     dhcp-lease-max before lease_sweep() runs. */
+  leases_left++;
+}
+
+static void lease_sweep(void)
+{
+  struct dhcp_lease *lease, *tmp, **up;
+
+  for (lease = leases, up = &leases; lease; lease = tmp)
+    {
+      tmp = lease->next;
+
+      /* hostnames which moved between leases in the journal */
+      free(lease->old_hostname);
+      lease->old_hostname = NULL;
+      
+      if (lease->flags & LEASE_DROPPED)
+	{
+	  *up = lease->next;
+	  free(lease->extradata);
+	  free(lease);
+	}
+      else
+	up = &lease->next;
+    }
+}
+
+/* When replaying a journal, a record replaces any lease with the same address,
+   and "del" records remove leases quietly, without running the lease-change script. */
+static int read_leases(time_t now, FILE *leasestream, int replay)
 {
   unsigned long ei;
   union all_addr addr;
@@ -57,6 +282,23 @@ static int read_leases(time_t now, FILE *leasestream)
 	    continue;
 	  }
 #endif
+
+	if (replay && strcmp(daemon->dhcp_buff3, "gen") == 0)
+	  continue;
+
+	if (replay && strcmp(daemon->dhcp_buff3, "del") == 0)
+	  {
+	    lease = NULL;
+	    if (inet_pton(AF_INET, daemon->dhcp_buff2, &addr.addr4))
+	      lease = lease_find_by_addr(addr.addr4);
+#ifdef HAVE_DHCP6
+	    else if (inet_pton(AF_INET6, daemon->dhcp_buff2, &addr.addr6))
+	      lease = lease6_find_by_addr(&addr.addr6, 128, 0);
+#endif
+	    if (lease)
+	      lease_drop(lease);
+	    continue;
+	  }
 	
 	if (fscanf(leasestream, " %64s %255s %764s",
 		   daemon->namebuff, daemon->dhcp_buff, daemon->packet) != 3)
@@ -69,7 +311,8 @@ static int read_leases(time_t now, FILE *leasestream)
 		
 	if (inet_pton(AF_INET, daemon->namebuff, &addr.addr4))
 	  {
-	    if ((lease = lease4_allocate(addr.addr4)))
+	    if ((replay && (lease = lease_find_by_addr(addr.addr4))) ||
+		(lease = lease4_allocate(addr.addr4)))
 	      domain = get_domain(lease->addr);
 	    
 	    hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
@@ -89,7 +332,13 @@ static int read_leases(time_t now, FILE *leasestream)
 		s++;
 	      }
 	    
-	    if ((lease = lease6_allocate(&addr.addr6, lease_type)))
+	    /* The record replaces the lease for its address, whatever type that had. */
+	    if (replay && (lease = lease6_find_by_addr(&addr.addr6, 128, 0)))
+	      lease->flags = (lease->flags & ~(LEASE_TA | LEASE_NA)) | lease_type;
+	    else
+	      lease = lease6_allocate(&addr.addr6, lease_type);
+	    
+	    if (lease)
 	      {
 		lease_set_iaid(lease, strtoul(s, NULL, 10));
 		domain = get_domain6(&lease->addr6);
@@ -107,6 +356,10 @@ static int read_leases(time_t now, FILE *leasestream)
 	if (!lease)
 	  die (_("too many stored leases"), NULL, EC_MISC);
 
+	/* The record holds the whole lease, forget what we had. */
+	if (replay)
+	  lease_forget(lease);
+	
 	if (strcmp(daemon->packet, "*") != 0)
 	  clid_len = parse_hex(daemon->packet, (unsigned char *)daemon->packet, 255, NULL, NULL);
 	
@@ -143,11 +396,15 @@ static int read_leases(time_t now, FILE *leasestream)
 void lease_init(time_t now)
 {
   FILE *leasestream;
+  struct dhcp_lease *lease;
 
   leases_left = daemon->dhcp_max;
+  lease_map_init();
 
   if (option_bool(OPT_LEASE_RO))
     {
+      daemon->lease_journal_max = 0; /* no lease file to journal */
+      
       /* run "<lease_change_script> init" once to get the
 	 initial state of the database. If leasefile-ro is
 	 set without a script, we just do without any
@@ -181,12 +438,15 @@ void lease_init(time_t now)
 
   if (leasestream)
     {
-      if (!read_leases(now, leasestream))
+      if (!read_leases(now, leasestream, 0))
 	my_syslog(MS_DHCP | LOG_ERR, _("failed to parse lease database cleanly"));
       
       if (ferror(leasestream))
 	die(_("failed to read lease file %s: %s"), daemon->lease_file, EC_FILE);
     }
+
+  if (daemon->lease_journal_max != 0)
+    journal_init(now);
   
 #ifdef HAVE_SCRIPT
   if (!daemon->lease_stream)
@@ -212,6 +472,10 @@ void lease_init(time_t now)
     }
 #endif
 
+  /* Everything we read is already on disk. */
+  for (lease = leases; lease; lease = lease->next)
+    lease->flags &= ~LEASE_JOURNAL;
+  
   /* Some leases may have expired */
   file_dirty = 0;
   lease_prune(NULL, now);
@@ -238,116 +502,306 @@ void lease_update_from_configs(void)
       lease_set_hostname(lease, name, 1, get_domain(lease->addr), NULL); /* updates auth flag only */
 }
 
-static void ourprintf(int *errp, char *format, ...)
+static void ourprintf(FILE *f, int *errp, char *format, ...)
 {
   va_list ap;
   
   va_start(ap, format);
-  if (!(*errp) && vfprintf(daemon->lease_stream, format, ap) < 0)
+  if (!(*errp) && vfprintf(f, format, ap) < 0)
     *errp = errno;
   va_end(ap);
 }
 
-void lease_update_file(time_t now)
+static void write_lease(FILE *f, int *errp, struct dhcp_lease *lease)
 {
-  struct dhcp_lease *lease;
-  time_t next_event;
-  int i, err = 0;
+  int i;
+  
+#ifdef HAVE_BROKEN_RTC
+  ourprintf(f, errp, "%u ", lease->length);
+#else
+  ourprintf(f, errp, "%lu ", (unsigned long)lease->expires);
+#endif
 
-  if (file_dirty != 0 && daemon->lease_stream)
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
     {
-      errno = 0;
-      rewind(daemon->lease_stream);
-      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
-	err = errno;
+      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
       
-      for (lease = leases; lease; lease = lease->next)
+      ourprintf(f, errp, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
+		lease->iaid, daemon->addrbuff);
+    }
+  else
+#endif
+    {
+      if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
+	ourprintf(f, errp, "%.2x-", lease->hwaddr_type);
+      for (i = 0; i < lease->hwaddr_len; i++)
 	{
+	  ourprintf(f, errp, "%.2x", lease->hwaddr[i]);
+	  if (i != lease->hwaddr_len - 1)
+	    ourprintf(f, errp, ":");
+	}
+      
+      inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
+      
+      ourprintf(f, errp, " %s ", daemon->addrbuff);
+    }
+  
+  ourprintf(f, errp, "%s ", lease->hostname ? lease->hostname : "*");
+  
+  if (lease->clid && lease->clid_len != 0)
+    {
+      for (i = 0; i < lease->clid_len - 1; i++)
+	ourprintf(f, errp, "%.2x:", lease->clid[i]);
+      ourprintf(f, errp, "%.2x\n", lease->clid[i]);
+    }
+  else
+    ourprintf(f, errp, "*\n");	  
+}
 
+/* Rewrite the whole lease file, return errno or zero. */
+static int write_leases(void)
+{
+  FILE *f = daemon->lease_stream;
+  struct dhcp_lease *lease;
+  int err = 0;
 #ifdef HAVE_DHCP6
-	  if (lease->flags & (LEASE_TA | LEASE_NA))
-	    continue;
+  int i;
 #endif
+  
+  errno = 0;
+  rewind(f);
+  if (errno != 0 || ftruncate(fileno(f), 0) != 0)
+    err = errno;
+  
+  for (lease = leases; lease; lease = lease->next)
+    {
+#ifdef HAVE_DHCP6
+      if (lease->flags & (LEASE_TA | LEASE_NA))
+	continue;
+#endif
+      write_lease(f, &err, lease);
+    }
+  
+#ifdef HAVE_DHCP6  
+  if (daemon->duid)
+    {
+      ourprintf(f, &err, "duid ");
+      for (i = 0; i < daemon->duid_len - 1; i++)
+	ourprintf(f, &err, "%.2x:", daemon->duid[i]);
+      ourprintf(f, &err, "%.2x\n", daemon->duid[i]);
+      
+      for (lease = leases; lease; lease = lease->next)
+	if (lease->flags & (LEASE_TA | LEASE_NA))
+	  write_lease(f, &err, lease);
+    }
+#endif      
+  
+  if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+    err = errno;
 
-#ifdef HAVE_BROKEN_RTC
-	  ourprintf(&err, "%u ", lease->length);
-#else
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires);
+  return err;
+}
+
+static int journal_truncate(int i)
+{
+  if (fflush(journal[i]) != 0 ||
+      ftruncate(fileno(journal[i]), 0) != 0 ||
+      fsync(fileno(journal[i])) < 0)
+    return errno;
+
+  clearerr(journal[i]);
+  return 0;
+}
+
+static off_t journal_size(int i)
+{
+  struct stat buf;
+
+  if (fstat(fileno(journal[i]), &buf) == -1)
+    return -1;
+
+  return buf.st_size;
+}
+
+/* Start a record in the active journal. */
+static FILE *journal_record(time_t now, int *errp)
+{
+  FILE *f = journal[journal_active];
+  
+  if (journal_start == 0)
+    {
+      ourprintf(f, errp, "gen %u\n", journal_gen);
+      journal_start = now;
+    }
+
+  return f;
+}
+
+static void journal_del(struct dhcp_lease *lease, time_t now)
+{
+  FILE *f;
+  int err = 0;
+  
+  if (!journal[0])
+    return;
+
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
+  else
 #endif
+    inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN);
+  
+  f = journal_record(now, &err);
+  ourprintf(f, &err, "del %s\n", daemon->addrbuff);
 
-	  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
-	    ourprintf(&err, "%.2x-", lease->hwaddr_type);
-	  for (i = 0; i < lease->hwaddr_len; i++)
-	    {
-	      ourprintf(&err, "%.2x", lease->hwaddr[i]);
-	      if (i != lease->hwaddr_len - 1)
-		ourprintf(&err, ":");
-	    }
-	  
-	  inet_ntop(AF_INET, &lease->addr, daemon->addrbuff, ADDRSTRLEN); 
+  /* picked up by the fflush() in journal_update() */
+  if (err)
+    journal_rewrite = 1;
+}
 
-	  ourprintf(&err, " %s ", daemon->addrbuff);
-	  ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	  	  
-	  if (lease->clid && lease->clid_len != 0)
-	    {
-	      for (i = 0; i < lease->clid_len - 1; i++)
-		ourprintf(&err, "%.2x:", lease->clid[i]);
-	      ourprintf(&err, "%.2x\n", lease->clid[i]);
-	    }
-	  else
-	    ourprintf(&err, "*\n");	  
-	}
+/* Append the changed leases to the journal. */
+static int journal_update(time_t now)
+{
+  struct dhcp_lease *lease;
+  FILE *f;
+  int err = 0;
+  
+  for (lease = leases; lease; lease = lease->next)
+    if (lease->flags & LEASE_JOURNAL)
+      {
+	f = journal_record(now, &err);
+	write_lease(f, &err, lease);
+	lease->flags &= ~LEASE_JOURNAL;
+      }
+
+  f = journal[journal_active];
+  if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+    err = errno;
+
+  /* we don't know what got written, so write everything */
+  if (err)
+    journal_rewrite = 1;
+  
+  return err;
+}
+
+/* Fold the journal into the lease file. Normally this is done by a child process,
+   while the parent switches to the other journal; but if the last compaction
+   failed, or journal_rewrite is set, it's done here. Returns errno or zero. */
+static int journal_compact(void)
+{
+  int err, old = journal_active;
+  pid_t pid = -1;
+  
+  if (journal_pid != 0)
+    {
+      if (waitpid(journal_pid, NULL, WNOHANG) == 0)
+	return 0; /* try again later */
+      journal_pid = 0;
+    }
+  
+  if (!journal_rewrite && journal_size(1 - old) == 0)
+    {
+      journal_active = 1 - old;
+      journal_start = 0;
+      journal_gen++;
       
-#ifdef HAVE_DHCP6  
-      if (daemon->duid)
+      if ((pid = fork()) > 0)
 	{
-	  ourprintf(&err, "duid ");
-	  for (i = 0; i < daemon->duid_len - 1; i++)
-	    ourprintf(&err, "%.2x:", daemon->duid[i]);
-	  ourprintf(&err, "%.2x\n", daemon->duid[i]);
-	  
-	  for (lease = leases; lease; lease = lease->next)
-	    {
-	      
-	      if (!(lease->flags & (LEASE_TA | LEASE_NA)))
-		continue;
-
-#ifdef HAVE_BROKEN_RTC
-	      ourprintf(&err, "%u ", lease->length);
-#else
-	      ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-    
-	      inet_ntop(AF_INET6, &lease->addr6, daemon->addrbuff, ADDRSTRLEN);
-	 
-	      ourprintf(&err, "%s%u %s ", (lease->flags & LEASE_TA) ? "T" : "",
-			lease->iaid, daemon->addrbuff);
-	      ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	      
-	      if (lease->clid && lease->clid_len != 0)
-		{
-		  for (i = 0; i < lease->clid_len - 1; i++)
-		    ourprintf(&err, "%.2x:", lease->clid[i]);
-		  ourprintf(&err, "%.2x\n", lease->clid[i]);
-		}
-	      else
-		ourprintf(&err, "*\n");	  
-	    }
+	  journal_pid = pid;
+	  return 0;
 	}
-#endif      
-	  
-      if (fflush(daemon->lease_stream) != 0 ||
-	  fsync(fileno(daemon->lease_stream)) < 0)
-	err = errno;
+    }
+  
+  if ((err = write_leases()) == 0 && (err = journal_truncate(old)) == 0 && pid == -1)
+    err = journal_truncate(1 - old);
+  
+  if (pid == 0)
+    _exit(err ? EC_FILE : EC_GOOD);
+  
+  if (!err)
+    {
+      journal_rewrite = 0;
+      journal_start = 0;
+      journal_gen++;
+    }
+  
+  return err;
+}
+
+static void journal_init(time_t now)
+{
+  unsigned int gen[2];
+  int i, first = 0;
+  char *name = safe_malloc(strlen(daemon->lease_file) + 10);
+  
+  for (i = 0; i < 2; i++)
+    {
+      sprintf(name, "%s.journal%d", daemon->lease_file, i);
+      if (!(journal[i] = fopen(name, "a+")))
+	die(_("cannot open or create lease file %s: %s"), name, EC_FILE);
+      
+      rewind(journal[i]);
+      if (fscanf(journal[i], "gen %u", &gen[i]) != 1)
+	gen[i] = 0;
+      else if (gen[i] >= journal_gen)
+	journal_gen = gen[i] + 1;
+    }
+
+  /* replay the older journal first */
+  if (gen[0] > gen[1])
+    first = 1;
+  
+  for (i = 0; i < 2; i++)
+    {
+      FILE *f = journal[first ^ i];
+
+      rewind(f);
+      if (!read_leases(now, f, 1))
+	my_syslog(MS_DHCP | LOG_ERR, _("failed to parse lease database cleanly"));
+      
+      if (ferror(f))
+	die(_("failed to read lease file %s: %s"), name, EC_FILE);
+      
+      if (journal_size(first ^ i) != 0)
+	journal_rewrite = 1;
+    }
+
+  lease_sweep();
+  free(name);
+}
+
+void lease_update_file(time_t now)
+{
+  struct dhcp_lease *lease;
+  time_t next_event;
+  int err = 0;
+
+  if (file_dirty != 0 && daemon->lease_stream)
+    {
+      err = journal[0] ? journal_update(now) : write_leases();
       
       if (!err)
 	file_dirty = 0;
     }
+
+  if (!err && journal[0] &&
+      (journal_rewrite ||
+       journal_size(journal_active) > daemon->lease_journal_max ||
+       (journal_start != 0 && difftime(now, journal_start) >= LEASE_COMPACT_TIME)))
+    err = journal_compact();
   
   /* Set alarm for when the first lease expires. */
   next_event = 0;
 
+  /* and to compact the journal */
+  if (journal_pid != 0)
+    next_event = now + 1;
+  else if (journal_start != 0)
+    next_event = journal_start + LEASE_COMPACT_TIME;
+
 #ifdef HAVE_DHCP6
   /* do timed RAs and determine when the next is, also pings to potential SLAAC addresses */
   if (daemon->doing_ra)
@@ -486,6 +940,7 @@ void lease_make_duid(time_t now)
   if (!daemon->duid && daemon->doing_dhcp6)
     {
       file_dirty = 1;
+      journal_rewrite = 1; /* no journal record for the DUID */
       make_duid(now);
     }
 }
@@ -554,6 +1009,7 @@ void lease_update_dns(int force)
 void lease_prune(struct dhcp_lease *target, time_t now)
 {
   struct dhcp_lease *lease, *tmp, **up;
+  int h;
 
   for (lease = leases, up = &leases; lease; lease = tmp)
     {
@@ -564,9 +1020,20 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 	  if (lease->hostname)
 	    dns_dirty = 1;
 
+	  journal_del(lease, now);
+
 	  daemon->metrics[lease->addr.s_addr ? METRIC_LEASES_PRUNED_4 : METRIC_LEASES_PRUNED_6]++;
 
  	  *up = lease->next; /* unlink */
+
+	  for (h = 0; h < LEASE_HASHES; h++)
+	    lease_unhash(lease, h);
+	  
+#ifdef HAVE_DHCP6
+	  if (!(lease->flags & (LEASE_TA | LEASE_NA)))
+#endif
+	    if (!lease_find_by_addr(lease->addr))
+	      lease_map_set(lease->addr, 0);
 	  
 	  /* Put on old_leases list 'till we
 	     can run the script */
@@ -586,31 +1053,24 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
 {
   struct dhcp_lease *lease;
 
+  if (lease_hash_size == 0)
+    return NULL;
+  
   if (clid)
-    for (lease = leases; lease; lease = lease->next)
-      {
-#ifdef HAVE_DHCP6
-	if (lease->flags & (LEASE_TA | LEASE_NA))
-	  continue;
-#endif
-	if (lease->clid && clid_len == lease->clid_len &&
-	    memcmp(clid, lease->clid, clid_len) == 0)
-	  return lease;
-      }
+    for (lease = lease_hash_table[LEASE_HASH_CLID][hash_bytes(0, clid, clid_len) & (lease_hash_size - 1)];
+	 lease; lease = lease->hash_next[LEASE_HASH_CLID])
+      if (lease->clid && clid_len == lease->clid_len &&
+	  memcmp(clid, lease->clid, clid_len) == 0)
+	return lease;
   
-  for (lease = leases; lease; lease = lease->next)	
-    {
-#ifdef HAVE_DHCP6
-      if (lease->flags & (LEASE_TA | LEASE_NA))
-	continue;
-#endif   
+  if (hw_len > 0 && hw_len <= DHCP_CHADDR_MAX)
+    for (lease = lease_hash_table[LEASE_HASH_HWADDR][hash_bytes(hw_type, hwaddr, hw_len) & (lease_hash_size - 1)];
+	 lease; lease = lease->hash_next[LEASE_HASH_HWADDR])
       if ((!lease->clid || !clid) && 
-	  hw_len != 0 && 
 	  lease->hwaddr_len == hw_len &&
 	  lease->hwaddr_type == hw_type &&
 	  memcmp(hwaddr, lease->hwaddr, hw_len) == 0)
 	return lease;
-    }
 
   return NULL;
 }
@@ -619,7 +1079,11 @@ struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
   struct dhcp_lease *lease;
 
-  for (lease = leases; lease; lease = lease->next)
+  if (lease_hash_size == 0)
+    return NULL;
+  
+  for (lease = lease_hash_table[LEASE_HASH_ADDR][hash_bytes(0, (unsigned char *)&addr, INADDRSZ) & (lease_hash_size - 1)];
+       lease; lease = lease->hash_next[LEASE_HASH_ADDR])
     {
 #ifdef HAVE_DHCP6
       if (lease->flags & (LEASE_TA | LEASE_NA))
@@ -700,7 +1164,30 @@ struct dhcp_lease *lease6_find_by_client(struct dhcp_lease *first, int lease_typ
 struct dhcp_lease *lease6_find_by_addr(struct in6_addr *net, int prefix, u64 addr)
 {
   struct dhcp_lease *lease;
-    
+  struct in6_addr addr6;
+
+  /* With a prefix of 64 or more, net and addr give the whole address, so use the index. */
+  if (prefix >= 64)
+    {
+      addr6 = *net;
+      if (prefix != 128)
+	{
+	  setaddr6part(&addr6, addr);
+	  if (!is_same_net6(&addr6, net, prefix))
+	    return NULL;
+	}
+
+      if (lease_hash_size == 0)
+	return NULL;
+
+      for (lease = lease_hash_table[LEASE_HASH_ADDR][hash_bytes(0, addr6.s6_addr, IN6ADDRSZ) & (lease_hash_size - 1)];
+	   lease; lease = lease->hash_next[LEASE_HASH_ADDR])
+	if ((lease->flags & (LEASE_TA | LEASE_NA)) && IN6_ARE_ADDR_EQUAL(&lease->addr6, &addr6))
+	  return lease;
+
+      return NULL;
+    }
+  
   for (lease = leases; lease; lease = lease->next)
     {
       if (!(lease->flags & (LEASE_TA | LEASE_NA)))
@@ -743,8 +1230,25 @@ struct in_addr lease_find_max_addr(struct dhcp_context *context)
 {
   struct dhcp_lease *lease;
   struct in_addr addr = context->start;
-  
-  if (!(context->flags & (CONTEXT_STATIC | CONTEXT_PROXY)))
+  unsigned int w, bit;
+
+  if (context->lease_map)
+    {
+      for (w = (ntohl(context->end.s_addr) - ntohl(context->start.s_addr)) / 32; ; w--)
+	{
+	  if (context->lease_map[w] != 0)
+	    {
+	      for (bit = 31; !(context->lease_map[w] & (1u << bit)); bit--);
+	      if (w != 0 || bit != 0)
+		addr.s_addr = htonl(ntohl(context->start.s_addr) + w * 32 + bit);
+	      break;
+	    }
+	  
+	  if (w == 0)
+	    break;
+	}
+    }
+  else if (!(context->flags & (CONTEXT_STATIC | CONTEXT_PROXY)))
     for (lease = leases; lease; lease = lease->next)
       {
 #ifdef HAVE_DHCP6
@@ -760,10 +1264,51 @@ struct in_addr lease_find_max_addr(struct dhcp_context *context)
   return addr;
 }
 
+/* Step *addrp over addresses in context which have leases, wrapping from the
+   end of the range back to the start. Returns zero if that reaches stop,
+   ie every address from *addrp up to stop is leased. */
+int lease_skip_used(struct dhcp_context *context, struct in_addr *addrp, struct in_addr stop)
+{
+  unsigned int *map = context->lease_map;
+  unsigned int off, stop_off, size;
+  
+  if (!map)
+    return 1;
+
+  size = ntohl(context->end.s_addr) - ntohl(context->start.s_addr) + 1;
+  off = ntohl(addrp->s_addr) - ntohl(context->start.s_addr);
+  stop_off = ntohl(stop.s_addr) - ntohl(context->start.s_addr);
+
+  while (map[off / 32] & (1u << (off % 32)))
+    {
+      /* a word at a time when it's full and doesn't hold stop */
+      if (off % 32 == 0 && map[off / 32] == 0xffffffff && off / 32 != stop_off / 32)
+	off += 32;
+      else
+	off++;
+
+      if (off >= size)
+	off = 0;
+
+      if (off == stop_off)
+	return 0;
+    }
+
+  addrp->s_addr = htonl(ntohl(context->start.s_addr) + off);
+  return 1;
+}
+
 static struct dhcp_lease *lease_allocate(void)
 {
   struct dhcp_lease *lease;
-  if (!leases_left || !(lease = whine_malloc(sizeof(struct dhcp_lease))))
+  if (!leases_left)
+    return NULL;
+
+  if ((unsigned int)(daemon->dhcp_max - leases_left) >= lease_hash_size && 
+      !lease_hash_grow() && lease_hash_size == 0)
+    return NULL;
+  
+  if (!(lease = whine_malloc(sizeof(struct dhcp_lease))))
     return NULL;
 
   memset(lease, 0, sizeof(struct dhcp_lease));
@@ -773,10 +1318,11 @@ static struct dhcp_lease *lease_allocate(void)
   lease->length = 0xffffffff; /* illegal value */
 #endif
   lease->hwaddr_len = 256; /* illegal value */
+  lease->serial = ++lease_serial;
   lease->next = leases;
   leases = lease;
   
-  file_dirty = 1;
+  lease_dirty(lease);
   leases_left--;
 
   return lease;
@@ -788,6 +1334,8 @@ struct dhcp_lease *lease4_allocate(struct in_addr addr)
   if (lease)
     {
       lease->addr = addr;
+      lease_hash(lease, LEASE_HASH_ADDR);
+      lease_map_set(addr, 1);
       daemon->metrics[METRIC_LEASES_ALLOCATED_4]++;
     }
   
@@ -804,6 +1352,7 @@ struct dhcp_lease *lease6_allocate(struct in6_addr *addrp, int lease_type)
       lease->addr6 = *addrp;
       lease->flags |= lease_type;
       lease->iaid = 0;
+      lease_hash(lease, LEASE_HASH_ADDR);
 
       daemon->metrics[METRIC_LEASES_ALLOCATED_6]++;
     }
@@ -837,7 +1386,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
       lease->expires = exp;
 #ifndef HAVE_BROKEN_RTC
       lease->flags |= LEASE_AUX_CHANGED | LEASE_EXP_CHANGED;
-      file_dirty = 1;
+      lease_dirty(lease);
 #endif
     }
   
@@ -846,7 +1395,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
     {
       lease->length = len;
       lease->flags |= LEASE_AUX_CHANGED;
-      file_dirty = 1; 
+      lease_dirty(lease); 
     }
 #endif
 } 
@@ -857,7 +1406,7 @@ void lease_set_iaid(struct dhcp_lease *lease, unsigned int iaid)
   if (lease->iaid != iaid)
     {
       lease->iaid = iaid;
-      lease->flags |= LEASE_CHANGED;
+      lease->flags |= LEASE_CHANGED | LEASE_JOURNAL;
     }
 }
 #endif
@@ -878,12 +1427,14 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
     {
+      lease_unhash(lease, LEASE_HASH_HWADDR);
       if (hw_len != 0)
 	memcpy(lease->hwaddr, hwaddr, hw_len);
       lease->hwaddr_len = hw_len;
       lease->hwaddr_type = hw_type;
+      lease_hash(lease, LEASE_HASH_HWADDR);
       lease->flags |= LEASE_CHANGED;
-      file_dirty = 1; /* run script on change */
+      lease_dirty(lease); /* run script on change */
     }
 
   /* only update clid when one is available, stops packets
@@ -891,13 +1442,15 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
      clid_len == 0 for no clid. */
   if (clid_len != 0 && clid)
     {
+      lease_unhash(lease, LEASE_HASH_CLID);
+      
       if (!lease->clid)
 	lease->clid_len = 0;
 
       if (lease->clid_len != clid_len)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease);
 	  free(lease->clid);
 	  if (!(lease->clid = whine_malloc(clid_len)))
 	    return;
@@ -908,7 +1461,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       else if (memcmp(lease->clid, clid, clid_len) != 0)
 	{
 	  lease->flags |= LEASE_AUX_CHANGED;
-	  file_dirty = 1;
+	  lease_dirty(lease);
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	
@@ -916,6 +1469,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       
       lease->clid_len = clid_len;
       memcpy(lease->clid, clid, clid_len);
+      lease_hash(lease, LEASE_HASH_CLID);
     }
   
 #ifdef HAVE_DHCP6
@@ -1021,6 +1575,7 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
 	    }
 	
 	  kill_name(lease_tmp);
+	  lease_tmp->flags |= LEASE_JOURNAL;
 	  break;
 	}
     }
@@ -1034,7 +1589,7 @@ void lease_set_hostname(struct dhcp_lease *lease, const char *name, int auth, ch
   if (auth)
     lease->flags |= LEASE_AUTH_NAME;
   
-  file_dirty = 1;
+  lease_dirty(lease);
   dns_dirty = 1; 
   lease->flags |= LEASE_CHANGED; /* run script on change */
 }
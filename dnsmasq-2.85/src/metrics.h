@@ -21,6 +21,8 @@ enum {
   METRIC_DNS_QUERIES_FORWARDED,
   METRIC_DNS_AUTH_ANSWERED,
   METRIC_DNS_LOCAL_ANSWERED,
+  METRIC_DNS_PREFETCHED,
+  METRIC_DNS_STALE_ANSWERED,
   METRIC_BOOTP,
   METRIC_PXE,
   METRIC_DHCPACK,
@@ -674,11 +674,31 @@ static int release_listener(struct listener *l)
     }
 
   if (l->fd != -1)
-    close(l->fd);
+    {
+      poll_forget(l->fd);
+      close(l->fd);
+    }
   if (l->tcpfd != -1)
-    close(l->tcpfd);
+    {
+      poll_forget(l->tcpfd);
+      close(l->tcpfd);
+    }
   if (l->tftpfd != -1)
-    close(l->tftpfd);
+    {
+      poll_forget(l->tftpfd);
+      close(l->tftpfd);
+    }
+  if (l->workerfds)
+    {
+      int i;
+      
+      for (i = 0; i < daemon->dns_workers; i++)
+	close(l->workerfds[i]);
+      free(l->workerfds);
+#ifdef HAVE_LINUX_NETWORK
+      workers_restart();
+#endif
+    }
 
   free(l);
   return 1;
@@ -843,7 +863,7 @@ int fix_fd(int fd)
   return 1;
 }
 
-static int make_sock(union mysockaddr *addr, int type, int dienow)
+static int make_sock(union mysockaddr *addr, int type, int reuseport, int dienow)
 {
   int family = addr->sa.sa_family;
   int fd, rc, opt = 1;
@@ -886,6 +906,13 @@ static int make_sock(union mysockaddr *addr, int type, int dienow)
   
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 || !fix_fd(fd))
     goto err;
+
+#ifdef SO_REUSEPORT
+  if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+    goto err;
+#else
+  (void)reuseport;
+#endif
   
   if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1)
     goto err;
@@ -1026,6 +1053,25 @@ int tcp_interface(int fd, int af)
   return if_index;
 }
       
+/* One more UDP socket on addr for each of the --dns-workers processes.
+   With SO_REUSEPORT, the kernel shares the queries arriving on addr between
+   these and the listener's own socket. */
+static int *make_worker_socks(union mysockaddr *addr, int dienow)
+{
+  int i, *fds = safe_malloc(daemon->dns_workers * sizeof(int));
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if ((fds[i] = make_sock(addr, SOCK_DGRAM, 1, dienow)) == -1)
+      {
+	while (i--)
+	  close(fds[i]);
+	free(fds);
+	return NULL;
+      }
+
+  return fds;
+}
+
 static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, int dienow)
 {
   struct listener *l = NULL;
@@ -1035,8 +1081,8 @@ static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, in
 
   if (daemon->port != 0)
     {
-      fd = make_sock(addr, SOCK_DGRAM, dienow);
-      tcpfd = make_sock(addr, SOCK_STREAM, dienow);
+      fd = make_sock(addr, SOCK_DGRAM, daemon->dns_workers != 0, dienow);
+      tcpfd = make_sock(addr, SOCK_STREAM, 0, dienow);
     }
   
 #ifdef HAVE_TFTP
@@ -1047,14 +1093,14 @@ static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, in
 	  /* port must be restored to DNS port for TCP code */
 	  short save = addr->in.sin_port;
 	  addr->in.sin_port = htons(TFTP_PORT);
-	  tftpfd = make_sock(addr, SOCK_DGRAM, dienow);
+	  tftpfd = make_sock(addr, SOCK_DGRAM, 0, dienow);
 	  addr->in.sin_port = save;
 	}
       else
 	{
 	  short save = addr->in6.sin6_port;
 	  addr->in6.sin6_port = htons(TFTP_PORT);
-	  tftpfd = make_sock(addr, SOCK_DGRAM, dienow);
+	  tftpfd = make_sock(addr, SOCK_DGRAM, 0, dienow);
 	  addr->in6.sin6_port = save;
 	}  
     }
@@ -1070,6 +1116,15 @@ static struct listener *create_listeners(union mysockaddr *addr, int do_tftp, in
       l->addr = *addr;
       l->used = 1;
       l->iface = NULL;
+      l->workerfds = NULL;
+
+      if (fd != -1 && daemon->dns_workers != 0)
+	{
+	  l->workerfds = make_worker_socks(addr, dienow);
+#ifdef HAVE_LINUX_NETWORK
+	  workers_restart();
+#endif
+	}
     }
 
   return l;
@@ -1511,6 +1566,24 @@ void mark_servers(int flag)
     }
 }
 
+static void build_server_index(void)
+{
+  struct server *serv;
+  struct dom_index *idx = domain_index_new();
+
+  /* On failure, search_servers() falls back to walking the list. */
+  for (serv = daemon->servers; idx && serv; serv = serv->next)
+    if ((serv->flags & (SERV_HAS_DOMAIN | SERV_FOR_NODOTS)) &&
+	!domain_index_add(idx, (serv->flags & SERV_FOR_NODOTS) ? NULL : serv->domain, serv))
+      {
+	domain_index_free(idx);
+	idx = NULL;
+      }
+  
+  domain_index_free(daemon->server_index);
+  daemon->server_index = idx;
+}
+
 void cleanup_servers(void)
 {
   struct server *serv, *tmp, **up;
@@ -1531,6 +1604,8 @@ void cleanup_servers(void)
        up = &serv->next;
     }
 
+  build_server_index();
+  
 #ifdef HAVE_LOOP
   /* Now we have a new set of servers, test for loops. */
   loop_send_probes();
@@ -1628,6 +1703,12 @@ void check_servers(void)
   if (!option_bool(OPT_NOWILD))
     enumerate_interfaces(0);
 
+#ifdef HAVE_LINUX_NETWORK
+  /* The workers answer for --address and --local too. */
+  if (daemon->dns_workers != 0)
+    workers_restart();
+#endif
+
   /* don't garbage collect pre-allocated sfds. */
   for (sfd = daemon->sfds; sfd; sfd = sfd->next)
     sfd->used = sfd->preallocated;
@@ -1756,6 +1837,7 @@ void check_servers(void)
        if (!sfd->used) 
 	{
 	  *up = sfd->next;
+	  poll_forget(sfd->fd);
 	  close(sfd->fd);
 	  free(sfd);
 	} 
@@ -170,6 +170,12 @@ struct myoption {
 #define LOPT_PXE_VENDOR    361
 #define LOPT_DYNHOST       362
 #define LOPT_LOG_DEBUG     363
+#define LOPT_LEASE_JOURNAL 364
+#define LOPT_DNS_WORKERS   365
+#define LOPT_HOSTS_IMAGE   366
+#define LOPT_MAKE_IMAGE    367
+#define LOPT_PREFETCH      368
+#define LOPT_SERVE_STALE   369
  
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -251,6 +257,7 @@ static const struct myoption opts[] =
     { "leasefile-ro", 0, 0, '9' },
     { "script-on-renewal", 0, 0, LOPT_SCRIPT_TIME},
     { "dns-forward-max", 1, 0, '0' },
+    { "dns-workers", 1, 0, LOPT_DNS_WORKERS },
     { "clear-on-reload", 0, 0, LOPT_RELOAD },
     { "dhcp-ignore-names", 2, 0, LOPT_NO_NAMES },
     { "enable-tftp", 2, 0, LOPT_TFTP },
@@ -300,6 +307,10 @@ static const struct myoption opts[] =
     { "pxe-prompt", 1, 0, LOPT_PXE_PROMT },
     { "pxe-service", 1, 0, LOPT_PXE_SERV },
     { "test", 0, 0, LOPT_TEST },
+    { "hosts-image", 1, 0, LOPT_HOSTS_IMAGE },
+    { "make-hosts-image", 1, 0, LOPT_MAKE_IMAGE },
+    { "prefetch", 2, 0, LOPT_PREFETCH },
+    { "serve-stale", 2, 0, LOPT_SERVE_STALE },
     { "tag-if", 1, 0, LOPT_TAG_IF },
     { "dhcp-proxy", 2, 0, LOPT_PROXY },
     { "dhcp-generate-names", 2, 0, LOPT_GEN_NAMES },
@@ -345,6 +356,7 @@ static const struct myoption opts[] =
     { "dhcp-ignore-clid", 0, 0,  LOPT_IGNORE_CLID },
     { "dynamic-host", 1, 0, LOPT_DYNHOST },
     { "log-debug", 0, 0, LOPT_LOG_DEBUG },
+    { "leasefile-journal", 2, 0, LOPT_LEASE_JOURNAL },
     { NULL, 0, 0, 0 }
   };
 
@@ -383,6 +395,10 @@ static struct {
   { 'h', OPT_NO_HOSTS, NULL, gettext_noop("Do NOT load %s file."), HOSTSFILE },
   { 'H', ARG_DUP, "<path>", gettext_noop("Specify a hosts file to be read in addition to %s."), HOSTSFILE },
   { LOPT_HOST_INOTIFY, ARG_DUP, "<path>", gettext_noop("Read hosts files from a directory."), NULL },
+  { LOPT_HOSTS_IMAGE, ARG_DUP, "<path>", gettext_noop("Answer from a hosts image made by --make-hosts-image."), NULL },
+  { LOPT_MAKE_IMAGE, ARG_ONE, "<hostsfile>,<image>", gettext_noop("Write a hosts file as a hosts image and exit."), NULL },
+  { LOPT_PREFETCH, ARG_ONE, "[=<percent>[,<hits>]]", gettext_noop("Refresh much-used cache entries before they expire."), NULL },
+  { LOPT_SERVE_STALE, ARG_ONE, "[=<integer>]", gettext_noop("Answer from expired cache entries whilst refreshing them."), NULL },
   { 'i', ARG_DUP, "<interface>", gettext_noop("Specify interface(s) to listen on."), NULL },
   { 'I', ARG_DUP, "<interface>", gettext_noop("Specify interface(s) NOT to listen on.") , NULL },
   { 'j', ARG_DUP, "set:<tag>,<class>", gettext_noop("Map DHCP user class to tag."), NULL },
@@ -466,6 +482,7 @@ static struct {
   { LOPT_SINGLE_PORT, OPT_SINGLE_PORT, NULL, gettext_noop("Use only one port for TFTP server."), NULL },
   { LOPT_LOG_OPTS, OPT_LOG_OPTS, NULL, gettext_noop("Extra logging for DHCP."), NULL },
   { LOPT_MAX_LOGS, ARG_ONE, "[=<integer>]", gettext_noop("Enable async. logging; optionally set queue length."), NULL },
+  { LOPT_DNS_WORKERS, ARG_ONE, "<integer>", gettext_noop("Answer cached DNS queries in this many extra processes."), NULL },
   { LOPT_REBIND, OPT_NO_REBIND, NULL, gettext_noop("Stop DNS rebinding. Filter private IP ranges when resolving."), NULL },
   { LOPT_LOC_REBND, OPT_LOCAL_REBIND, NULL, gettext_noop("Allow rebinding of 127.0.0.0/8, for RBL servers."), NULL },
   { LOPT_NO_REBIND, ARG_DUP, "/<domain>/", gettext_noop("Inhibit DNS-rebind protection on this domain."), NULL },
@@ -527,6 +544,7 @@ static struct {
   { LOPT_DUMPFILE, ARG_ONE, "<path>", gettext_noop("Path to debug packet dump file"), NULL },
   { LOPT_DUMPMASK, ARG_ONE, "<hex>", gettext_noop("Mask which packets to dump"), NULL },
   { LOPT_SCRIPT_TIME, OPT_LEASE_RENEW, NULL, gettext_noop("Call dhcp-script when lease expiry changes."), NULL },
+  { LOPT_LEASE_JOURNAL, ARG_ONE, "[=<bytes>]", gettext_noop("Append lease changes to a journal; optionally set its compaction size."), NULL },
   { 0, 0, NULL, NULL, NULL }
 }; 
 
@@ -2027,6 +2045,7 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
     case LOPT_DHCP_INOTIFY:  /* --dhcp-hostsdir */
     case LOPT_DHOPT_INOTIFY: /* --dhcp-optsdir */
     case LOPT_HOST_INOTIFY:  /* --hostsdir */
+    case LOPT_HOSTS_IMAGE:   /* --hosts-image */
     case 'H':                /* --addn-hosts */
       {
 	struct hostsfile *new = opt_malloc(sizeof(struct hostsfile));
@@ -2039,6 +2058,11 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	    new->next = daemon->addn_hosts;
 	    daemon->addn_hosts = new;
 	  }
+	else if (option == LOPT_HOSTS_IMAGE)
+	  {
+	    new->next = daemon->hosts_images;
+	    daemon->hosts_images = new;
+	  }
 	else if (option == LOPT_DHCP_HOST)
 	  {
 	    new->next = daemon->dhcp_hosts_file;
@@ -2801,12 +2825,44 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	ret_err(gen_err);
       break;  
     
+    case LOPT_DNS_WORKERS: /* --dns-workers */
+      if (!atoi_check(arg, &daemon->dns_workers))
+	ret_err(gen_err);
+      else if (daemon->dns_workers > MAX_WORKERS)
+	daemon->dns_workers = MAX_WORKERS;
+      break;
+
+    case LOPT_PREFETCH: /* --prefetch */
+      daemon->prefetch = PREFETCH_PERCENT; /* defaults */
+      daemon->prefetch_hits = PREFETCH_HITS;
+      if (arg)
+	{
+	  comma = split(arg);
+	  if (!atoi_check(arg, &daemon->prefetch) ||
+	      daemon->prefetch == 0 || daemon->prefetch > 100 ||
+	      (comma && !atoi_check(comma, &daemon->prefetch_hits)))
+	    ret_err(gen_err);
+	}
+      break;
+
+    case LOPT_SERVE_STALE: /* --serve-stale */
+      daemon->serve_stale = SERVE_STALE; /* default */
+      if (arg && (!atoi_check(arg, &daemon->serve_stale) || daemon->serve_stale == 0))
+	ret_err(gen_err);
+      break;
+      
     case 'q': /* --log-queries */
       set_option_bool(OPT_LOG);
       if (arg && strcmp(arg, "extra") == 0)
 	set_option_bool(OPT_EXTRALOG);
       break;
 
+    case LOPT_LEASE_JOURNAL: /* --leasefile-journal */
+      daemon->lease_journal_max = LEASE_JOURNAL_MAX; /* default */
+      if (arg && (!atoi_check(arg, &daemon->lease_journal_max) || daemon->lease_journal_max == 0))
+	ret_err(gen_err);
+      break;
+      
     case LOPT_MAX_LOGS:  /* --log-async */
       daemon->max_logs = LOG_MAX; /* default */
       if (arg && !atoi_check(arg, &daemon->max_logs))
@@ -5130,6 +5186,16 @@ void read_opts(int argc, char **argv, char *compile_opts)
       /* command-line only stuff */
       if (option == LOPT_TEST)
 	testmode = 1;
+      else if (option == LOPT_MAKE_IMAGE)
+	{
+	  char *comma = split(arg);
+
+	  if (!comma || !*arg || !*comma)
+	    die(_("bad command line options: %s"), _("--make-hosts-image needs <hostsfile>,<image>"), EC_BADCONF);
+
+	  daemon->image_src = opt_string_alloc(arg);
+	  daemon->image_dst = opt_string_alloc(comma);
+	}
       else if (option == 'w')
 	{
 #ifdef HAVE_DHCP
@@ -16,6 +16,8 @@
 
 #include "dnsmasq.h"
 
+#ifndef HAVE_EPOLL
+
 /* Wrapper for poll(). Allocates and extends array of struct pollfds,
    keeps them in fd order so that we can set and test conditions on
    fd using a simple but efficient binary chop. */
@@ -37,6 +39,9 @@
     .
 
     event is OR of POLLIN, POLLOUT, POLLERR, etc
+
+   poll_forget(fd) must be called before closing an fd which may have
+   been given to poll_listen(). It's a no-op here, but not for epoll.
 */
 
 static struct pollfd *pollfds = NULL;
@@ -73,6 +78,11 @@ void poll_reset(void)
   nfds = 0;
 }
 
+void poll_forget(int fd)
+{
+  (void)fd;
+}
+
 int do_poll(int timeout)
 {
   return poll(pollfds, nfds, timeout);
@@ -123,3 +133,215 @@ void poll_listen(int fd, short event)
        nfds++;
      }
 }
+
+#else /* HAVE_EPOLL */
+
+#include <sys/epoll.h>
+
+/* The same interface, implemented with epoll. Registrations persist
+   between calls to do_poll(); poll_listen() just records which events are
+   wanted this time around, in a table indexed by fd, and do_poll() only
+   calls epoll_ctl() for fds whose wanted events have changed. The cost of
+   an idle fd is therefore a table update per loop, not a trip through
+   the kernel.
+
+   Registrations are level-triggered, as the callers expect. An fd which
+   is still registered but wasn't listened for this time, and becomes
+   ready, is removed from the epoll set when it first turns up, and
+   epoll_wait() is called again.
+
+   An fd must be removed with poll_forget() before it's closed:
+   the kernel drops closed fds from the epoll set only when no
+   copies remain (eg in a TCP child process) and a new fd with the same
+   number would otherwise look already registered. */
+
+#define NOT_REGISTERED -1
+#define ALWAYS_READY   -2 /* regular files can't be added to an epoll set */
+
+struct epfd {
+  int registered;        /* events in the epoll set, or NOT_REGISTERED, ALWAYS_READY */
+  unsigned int gen;      /* == poll_gen if listened for this time */
+  short events, revents;
+};
+
+static struct epfd *epfds = NULL;
+static int epfd = -1, epfds_size = 0;
+static int *listened = NULL, nlistened, listened_size = 0;
+static struct epoll_event *epevents = NULL;
+static int epevents_size = 0;
+static unsigned int poll_gen = 1;
+
+static int extend(void **array, int *size, int need, size_t elemsize)
+{
+  int new_size = (*size == 0) ? 64 : *size;
+  void *new;
+
+  while (new_size < need)
+    new_size *= 2;
+
+  if (!(new = whine_malloc(new_size * elemsize)))
+    return 0;
+
+  if (*array)
+    {
+      memcpy(new, *array, *size * elemsize);
+      free(*array);
+    }
+
+  *array = new;
+  *size = new_size;
+
+  return 1;
+}
+
+static int ep_ctl(int fd, int op, int events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  /* EPOLLIN etc have the same values as POLLIN etc. */
+  ev.events = events;
+  ev.data.fd = fd;
+
+  return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static int ep_register(int fd, int events)
+{
+  struct epfd *e = &epfds[fd];
+  int rc;
+
+  if (e->registered == NOT_REGISTERED)
+    {
+      if ((rc = ep_ctl(fd, EPOLL_CTL_ADD, events)) == -1 && errno == EEXIST)
+	rc = ep_ctl(fd, EPOLL_CTL_MOD, events);
+    }
+  else if ((rc = ep_ctl(fd, EPOLL_CTL_MOD, events)) == -1 && errno == ENOENT)
+    rc = ep_ctl(fd, EPOLL_CTL_ADD, events);
+
+  if (rc != -1)
+    e->registered = events;
+  else
+    e->registered = (errno == EPERM) ? ALWAYS_READY : NOT_REGISTERED;
+
+  return rc;
+}
+
+void poll_reset(void)
+{
+  /* Zero marks an fd never listened for. */
+  if (++poll_gen == 0)
+    poll_gen = 1;
+
+  nlistened = 0;
+}
+
+void poll_forget(int fd)
+{
+  if (fd >= 0 && fd < epfds_size)
+    {
+      if (epfds[fd].registered >= 0)
+	ep_ctl(fd, EPOLL_CTL_DEL, 0);
+
+      epfds[fd].registered = NOT_REGISTERED;
+      epfds[fd].revents = 0;
+    }
+}
+
+int do_poll(int timeout)
+{
+  int i, rc, hits, ready = 0;
+
+  if (epfd == -1 && (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    die(_("cannot create epoll instance: %s"), NULL, EC_MISC);
+
+  for (i = 0; i < nlistened; i++)
+    {
+      int fd = listened[i];
+      int events = epfds[fd].events & (POLLIN | POLLPRI | POLLOUT);
+
+      epfds[fd].revents = 0;
+
+      if (epfds[fd].registered != events && epfds[fd].registered != ALWAYS_READY)
+	ep_register(fd, events);
+
+      /* poll() says these are always ready, so don't wait. */
+      if (epfds[fd].registered == ALWAYS_READY)
+	{
+	  epfds[fd].revents = events;
+	  ready++;
+	  timeout = 0;
+	}
+    }
+
+  if (epevents_size < nlistened + 1 &&
+      !extend((void **)&epevents, &epevents_size, nlistened + 1, sizeof(struct epoll_event)))
+    return -1;
+
+  do
+    {
+      if ((rc = epoll_wait(epfd, epevents, epevents_size, timeout)) <= 0)
+	return (rc == 0) ? ready : rc;
+
+      for (hits = ready, i = 0; i < rc; i++)
+	{
+	  int fd = epevents[i].data.fd;
+
+	  if (epfds[fd].gen == poll_gen)
+	    {
+	      epfds[fd].revents = epevents[i].events;
+	      hits++;
+	    }
+	  else
+	    poll_forget(fd);
+	}
+    }
+  while (hits == 0);
+
+  return hits;
+}
+
+int poll_check(int fd, short event)
+{
+  if (fd >= 0 && fd < epfds_size && epfds[fd].gen == poll_gen)
+    return epfds[fd].revents & event;
+
+  return 0;
+}
+
+void poll_listen(int fd, short event)
+{
+  struct epfd *e;
+
+  if (fd < 0)
+    return;
+
+  if (fd >= epfds_size)
+    {
+      int i, old = epfds_size;
+
+      if (!extend((void **)&epfds, &epfds_size, fd + 1, sizeof(struct epfd)))
+	return;
+
+      for (i = old; i < epfds_size; i++)
+	epfds[i].registered = NOT_REGISTERED;
+    }
+
+  e = &epfds[fd];
+
+  if (e->gen == poll_gen)
+    e->events |= event;
+  else
+    {
+      if (nlistened == listened_size &&
+	  !extend((void **)&listened, &listened_size, nlistened + 1, sizeof(int)))
+	return;
+
+      listened[nlistened++] = fd;
+      e->gen = poll_gen;
+      e->events = event;
+      e->revents = 0;
+    }
+}
+
+#endif /* HAVE_EPOLL */
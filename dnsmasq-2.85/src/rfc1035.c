@@ -1227,6 +1227,22 @@ int add_resource_record(struct dns_header *header, char *limit, int *truncp, int
 #undef CHECK_LIMIT
 }
 
+/* The question being answered by answer_request(), to be asked upstream
+   again if an entry used in the answer is due for a refresh. */
+static struct dns_header *refresh_header;
+static size_t refresh_qlen;
+static unsigned char *refresh_q;
+static int refresh_done, stale_done;
+
+static void refresh_question(void)
+{
+  if (!refresh_done && refresh_q)
+    {
+      refresh_done = 1;
+      queue_refresh(refresh_header, refresh_qlen, refresh_q);
+    }
+}
+
 static unsigned long crec_ttl(struct crec *crecp, time_t now)
 {
   /* Return 0 ttl for DHCP entries, which might change
@@ -1247,6 +1263,38 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
   if (crecp->flags & F_IMMORTAL)
     return crecp->ttd;
 
+  /* --serve-stale: still here after expiry, so refresh it, and again in
+     each STALE_TTL seconds in case a refresh is lost. The hit count isn't
+     needed by --prefetch any more, so it keeps the last of these. */
+  if (difftime(now, crecp->ttd) >= 0)
+    {
+      unsigned int slot = 0x80000000u | (unsigned int)((now - crecp->ttd) / STALE_TTL);
+
+      if (!stale_done)
+	{
+	  stale_done = 1;
+	  daemon->metrics[METRIC_DNS_STALE_ANSWERED]++;
+	}
+
+      if (crecp->hits != slot)
+	{
+	  crecp->hits = slot;
+	  refresh_question();
+	}
+
+      return STALE_TTL;
+    }
+
+  /* --prefetch: refresh well-used entries in the last part of their TTL,
+     so that they don't expire whilst still in use. */
+  if (daemon->prefetch != 0 && !(crecp->flags & F_REFRESH) &&
+      ++crecp->hits >= (unsigned int)daemon->prefetch_hits &&
+      (crecp->ttd - now) * 100 < (time_t)crecp->ttl * daemon->prefetch)
+    {
+      crecp->flags |= F_REFRESH;
+      refresh_question();
+    }
+
   /* Return the Max TTL value if it is lower than the actual TTL */
   if (daemon->max_ttl == 0 || ((unsigned)(crecp->ttd - now) < daemon->max_ttl))
     return crecp->ttd - now;
@@ -1278,6 +1326,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   size_t len;
   int rd_bit = (header->hb3 & HB3_RD);
 
+  refresh_q = NULL;
+
   /* never answer queries with RD unset, to avoid cache snooping. */
   if (ntohs(header->ancount) != 0 ||
       ntohs(header->nscount) != 0 ||
@@ -1313,6 +1363,12 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
       /* save pointer to name for copying into answers */
       nameoffset = p - (unsigned char *)header;
 
+      /* and the question, for refreshing the entries used to answer it */
+      refresh_header = header;
+      refresh_qlen = qlen;
+      refresh_q = p;
+      refresh_done = stale_done = 0;
+
       /* now extract name as .-concatenated string into name */
       if (!extract_name(header, qlen, &p, name, 1, 4))
 	return 0; /* bad packet */
@@ -1904,6 +1960,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
       dryrun = 0;
       goto rerun;
     }
+
+  refresh_q = NULL;
   
   /* create an additional data section, for stuff in SRV and MX record replies. */
   for (rec = daemon->mxnames; rec; rec = rec->next)
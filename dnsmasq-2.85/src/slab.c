@@ -0,0 +1,267 @@
+/* dnsmasq is Copyright (c) 2000-2021 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Slab allocator for the small objects which come and go with the cache:
+   cache entries made from hosts files, config and DHCP, long names and
+   DNSSEC key data. Each type has its own pool of SLAB_SIZE blocks, aligned
+   on SLAB_SIZE, so that the block holding an object is found from its
+   address, and a free list in each block.
+
+   Objects are never moved, since pointers to them are everywhere, but
+   slab_compact() gives back blocks which have emptied, and makes the
+   fullest blocks the first to be reused, so that re-reading a large hosts
+   file doesn't leave the heap full of holes. */
+
+#include "dnsmasq.h"
+
+struct slab_pool;
+
+struct slab {
+  struct slab *next;       /* all blocks in the pool */
+  struct slab *avail_next; /* blocks with free objects */
+  struct slab_pool *pool;
+  void *free;
+  unsigned int in_use;
+};
+
+struct slab_pool {
+  char *name;
+  size_t size;
+  unsigned int per_slab, reserve;
+  unsigned int in_use, hwm, slabs_alloced;
+  struct slab *slabs, *avail;
+};
+
+#define SLAB_ALIGN 16
+#define SLAB_ROUND(x) (((x) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+#define SLAB_HEADER SLAB_ROUND(sizeof(struct slab))
+
+static struct slab_pool pools[] = {
+  { "crec",       SIZEOF_POINTER_CREC, 0, 0, 0, 0, 0, NULL, NULL },
+  { "crec/32",    SIZEOF_BARE_CREC + 32, 0, 0, 0, 0, 0, NULL, NULL },
+  { "crec/64",    SIZEOF_BARE_CREC + 64, 0, 0, 0, 0, 0, NULL, NULL },
+  { "crec/128",   SIZEOF_BARE_CREC + 128, 0, 0, 0, 0, 0, NULL, NULL },
+  { "crec/256",   SIZEOF_BARE_CREC + 256, 0, 0, 0, 0, 0, NULL, NULL },
+  { "crec/max",   SIZEOF_BARE_CREC + MAXDNAME + 1, 0, 0, 0, 0, 0, NULL, NULL },
+  { "bigname",    sizeof(union bigname), 0, 0, 0, 0, 0, NULL, NULL },
+  { "blockdata",  sizeof(struct blockdata), 0, 0, 0, 0, 0, NULL, NULL },
+};
+
+#define POOLS ((int)(sizeof(pools)/sizeof(struct slab_pool)))
+
+static struct slab *slab_of(void *obj)
+{
+  return (struct slab *)((size_t)obj & ~(size_t)(SLAB_SIZE - 1));
+}
+
+static int slab_expand(struct slab_pool *pool)
+{
+  struct slab *s;
+  void *mem;
+  char *obj;
+  unsigned int i;
+
+  if (pool->per_slab == 0)
+    {
+      pool->size = SLAB_ROUND(pool->size);
+      pool->per_slab = (SLAB_SIZE - SLAB_HEADER) / pool->size;
+    }
+
+  if (posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE) != 0)
+    {
+      my_syslog(LOG_ERR, _("failed to allocate %d bytes"), SLAB_SIZE);
+      return 0;
+    }
+
+  s = mem;
+  s->pool = pool;
+  s->in_use = 0;
+  s->free = NULL;
+
+  for (i = 0, obj = ((char *)s) + SLAB_HEADER; i < pool->per_slab; i++, obj += pool->size)
+    {
+      *((void **)obj) = s->free;
+      s->free = obj;
+    }
+
+  s->next = pool->slabs;
+  pool->slabs = s;
+  s->avail_next = pool->avail;
+  pool->avail = s;
+  pool->slabs_alloced++;
+
+  return 1;
+}
+
+static void *pool_alloc(struct slab_pool *pool)
+{
+  struct slab *s;
+  void *obj;
+
+  if (!pool->avail && !slab_expand(pool))
+    return NULL;
+
+  s = pool->avail;
+  obj = s->free;
+  s->free = *((void **)obj);
+  s->in_use++;
+
+  if (!s->free)
+    pool->avail = s->avail_next;
+
+  if (++pool->in_use > pool->hwm)
+    pool->hwm = pool->in_use;
+
+  /* like whine_malloc() */
+  memset(obj, 0, pool->size);
+
+  return obj;
+}
+
+void *slab_alloc(int type)
+{
+  return pool_alloc(&pools[type]);
+}
+
+/* A cache entry with room for a name of namelen characters in place. */
+struct crec *slab_alloc_crec(size_t namelen)
+{
+  int i;
+
+  for (i = SLAB_CREC; i <= SLAB_CREC_MAX; i++)
+    if (SIZEOF_BARE_CREC + namelen + 1 <= pools[i].size)
+      return pool_alloc(&pools[i]);
+
+  return NULL;
+}
+
+void slab_free(void *obj)
+{
+  struct slab *s;
+  struct slab_pool *pool;
+
+  if (!obj)
+    return;
+
+  s = slab_of(obj);
+  pool = s->pool;
+
+  if (!s->free)
+    {
+      s->avail_next = pool->avail;
+      pool->avail = s;
+    }
+
+  *((void **)obj) = s->free;
+  s->free = obj;
+  s->in_use--;
+  pool->in_use--;
+}
+
+/* Make sure that n objects of type can be had without another malloc. */
+void slab_reserve(int type, unsigned int n)
+{
+  struct slab_pool *pool = &pools[type];
+
+  pool->reserve = n;
+
+  while (pool->slabs_alloced * pool->per_slab < pool->in_use + n)
+    if (!slab_expand(pool))
+      break;
+}
+
+static int slab_cmp(const void *a, const void *b)
+{
+  const struct slab *s1 = *((struct slab * const *)a), *s2 = *((struct slab * const *)b);
+
+  /* fullest first */
+  return (int)s2->in_use - (int)s1->in_use;
+}
+
+/* Give back empty blocks beyond the reserve, and order the blocks with free
+   objects fullest first, so that new objects fill them before the others. */
+void slab_compact(void)
+{
+  int i;
+
+  for (i = 0; i < POOLS; i++)
+    {
+      struct slab_pool *pool = &pools[i];
+      struct slab *s, *tmp, **up, **sorted;
+      unsigned int n, count = 0;
+
+      for (up = &pool->slabs, s = pool->slabs; s; s = tmp)
+	{
+	  tmp = s->next;
+
+	  if (s->in_use == 0 &&
+	      (pool->slabs_alloced - 1) * pool->per_slab >= pool->in_use + pool->reserve)
+	    {
+	      *up = tmp;
+	      free(s);
+	      pool->slabs_alloced--;
+	    }
+	  else
+	    {
+	      if (s->free)
+		count++;
+	      up = &s->next;
+	    }
+	}
+
+      pool->avail = NULL;
+
+      if (count == 0)
+	continue;
+
+      if ((sorted = whine_malloc(count * sizeof(struct slab *))))
+	{
+	  for (n = 0, s = pool->slabs; s; s = s->next)
+	    if (s->free)
+	      sorted[n++] = s;
+
+	  qsort(sorted, count, sizeof(struct slab *), slab_cmp);
+
+	  while (n--)
+	    {
+	      sorted[n]->avail_next = pool->avail;
+	      pool->avail = sorted[n];
+	    }
+
+	  free(sorted);
+	}
+      else
+	for (s = pool->slabs; s; s = s->next)
+	  if (s->free)
+	    {
+	      s->avail_next = pool->avail;
+	      pool->avail = s;
+	    }
+    }
+}
+
+void slab_report(void)
+{
+  int i;
+
+  for (i = 0; i < POOLS; i++)
+    if (pools[i].slabs_alloced != 0)
+      my_syslog(LOG_INFO, _("%s memory in use %u, max %u, allocated %u"),
+		pools[i].name,
+		(unsigned int)(pools[i].in_use * pools[i].size),
+		(unsigned int)(pools[i].hwm * pools[i].size),
+		(unsigned int)(pools[i].slabs_alloced * SLAB_SIZE));
+}
@@ -140,5 +140,10 @@ int add_to_ipset(const char *setname, const union all_addr *ipaddr,
   return io.pfrio_nadd;
 }
 
+/* Additions go to pf as they are made, nothing is queued. */
+void ipset_flush(void)
+{
+}
+
 
 #endif
@@ -707,7 +707,10 @@ static void handle_tftp(time_t now, struct tftp_transfer *transfer, ssize_t len)
 static void free_transfer(struct tftp_transfer *transfer)
 {
   if (!option_bool(OPT_SINGLE_PORT))
-    close(transfer->sockfd);
+    {
+      poll_forget(transfer->sockfd);
+      close(transfer->sockfd);
+    }
 
   if (transfer->file && (--transfer->file->refcount) == 0)
     {
@@ -55,6 +55,8 @@ static void ubus_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj)
 
 static void ubus_destroy(struct ubus_context *ubus)
 {
+  poll_forget(ubus->sock.fd);
+
   // Forces re-initialization when we're reusing the same definitions later on.
   ubus_object.id = 0;
   ubus_object_type.id = 0;
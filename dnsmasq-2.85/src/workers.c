@@ -0,0 +1,231 @@
+/* dnsmasq is Copyright (c) 2000-2021 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* --dns-workers: extra processes which answer UDP queries from the cache.
+
+   Each worker is forked from the main process, so it has a copy-on-write
+   snapshot of the cache and configuration, and reads its own SO_REUSEPORT
+   socket on each listener, made by create_listeners(). Queries which it
+   can't answer from the snapshot are passed to the main process over a
+   socketpair, and handled there as if they had arrived directly.
+
+   Nothing in a worker is ever written back. When the cache is reloaded or
+   cleared, or the listeners change, a new set of workers is forked from the
+   current state at once and the old set is told to exit. New answers from
+   upstream only do the same when they amount to WORKER_CHURN percent of the
+   cache, and at most once every WORKER_REFRESH seconds: until then the
+   workers pass those names to the main process. */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_LINUX_NETWORK
+
+#include <sys/prctl.h>
+
+static pid_t worker_pids[MAX_WORKERS];
+static int handoff[2] = { -1, -1 }; /* main process reads [0], workers write [1] */
+static int restart = 1;
+static unsigned int worker_gen;
+static u32 worker_inserted;
+static time_t worker_time;
+
+void workers_init(void)
+{
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, handoff) == -1 ||
+      !fix_fd(handoff[0]) || !fix_fd(handoff[1]))
+    die(_("cannot create socket for --dns-workers: %s"), NULL, EC_MISC);
+}
+
+/* Start new workers on the next trip round the main loop. */
+void workers_restart(void)
+{
+  restart = 1;
+}
+
+static void worker_run(int index)
+{
+  struct listener *l, **listeners;
+  struct pollfd *fds;
+  sigset_t mask, wait_mask;
+  int i, nfds = 0;
+
+  for (l = daemon->listeners; l; l = l->next)
+    if (l->workerfds)
+      nfds++;
+
+  fds = safe_malloc(nfds * sizeof(struct pollfd));
+  listeners = safe_malloc(nfds * sizeof(struct listener *));
+
+  for (i = 0, l = daemon->listeners; l; l = l->next)
+    if (l->workerfds)
+      {
+	fds[i].fd = l->workerfds[index];
+	fds[i].events = POLLIN;
+	listeners[i++] = l;
+      }
+
+  /* SIGALRM tells us to exit: only take it whilst waiting,
+     not half way through a batch of answers. */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGALRM);
+  sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+  sigdelset(&wait_mask, SIGALRM);
+
+  while (1)
+    {
+      time_t now;
+
+      if (ppoll(fds, nfds, NULL, &wait_mask) == -1)
+	continue;
+
+      now = dnsmasq_time();
+
+      for (i = 0; i < nfds; i++)
+	if (fds[i].revents & POLLIN)
+	  worker_query(listeners[i], fds[i].fd, handoff[1], now);
+
+      send_refreshes(now);
+      check_log_writer(1);
+    }
+}
+
+static pid_t start_worker(int index)
+{
+  unsigned char a = 0;
+  int pipefd[2];
+  pid_t p;
+
+  if (pipe(pipefd) == -1)
+    return 0;
+
+  if ((p = fork()) != 0)
+    {
+      /* See the comment in check_dns_listeners() about the netlink socket. */
+      close(pipefd[1]);
+      if (p != -1)
+	read_write(pipefd[0], &a, 1, 1);
+      close(pipefd[0]);
+
+      if (p == -1)
+	{
+	  my_syslog(LOG_WARNING, _("cannot fork DNS worker: %s"), strerror(errno));
+	  return 0;
+	}
+
+      return p;
+    }
+
+  /* Exit with the main process, however it goes. */
+  prctl(PR_SET_PDEATHSIG, SIGALRM);
+
+  close(daemon->netlinkfd);
+  read_write(pipefd[1], &a, 1, 0);
+  close(pipefd[0]);
+  close(pipefd[1]);
+  close(handoff[0]);
+
+  /* Keep the ids of queries logged here apart from those of the main process. */
+  daemon->log_id = (index + 1) << 24;
+
+  worker_run(index);
+
+  return 0; /* not reached */
+}
+
+/* Start, refresh or replace workers as needed. Returns the number of seconds
+   after which we need to be called again, or zero. */
+int check_workers(time_t now)
+{
+  pid_t old[MAX_WORKERS];
+  struct listener *l;
+  int i, start = restart;
+
+  for (l = daemon->listeners; l; l = l->next)
+    if (l->workerfds)
+      break;
+
+  if (!l)
+    return 0;
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (worker_pids[i] == 0)
+      start = 1;
+
+  if (daemon->cache_gen != worker_gen)
+    start = 1;
+
+  /* Inserts alone only matter once enough of the cache is new. */
+  if (daemon->metrics[METRIC_DNS_CACHE_INSERTED] - worker_inserted >=
+      (u32)daemon->cachesize * WORKER_CHURN / 100 + 1)
+    start = 1;
+
+  if (!start)
+    return 0;
+
+  if (!restart && difftime(now, worker_time) < WORKER_REFRESH)
+    return WORKER_REFRESH;
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    {
+      old[i] = worker_pids[i];
+      worker_pids[i] = start_worker(i);
+    }
+
+  /* Old workers still answer from their sockets until the new ones are
+     ready, then finish their batch and exit. */
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (old[i] != 0)
+      kill(old[i], SIGALRM);
+
+  restart = 0;
+  worker_gen = daemon->cache_gen;
+  worker_inserted = daemon->metrics[METRIC_DNS_CACHE_INSERTED];
+  worker_time = now;
+
+  return 0;
+}
+
+void set_worker_listeners(void)
+{
+  if (handoff[0] != -1)
+    poll_listen(handoff[0], POLLIN);
+}
+
+void check_worker_listeners(time_t now)
+{
+  if (handoff[0] != -1 && poll_check(handoff[0], POLLIN))
+    receive_handoff(handoff[0], now);
+}
+
+void worker_reaped(pid_t pid)
+{
+  int i;
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (worker_pids[i] == pid)
+      worker_pids[i] = 0;
+}
+
+void kill_workers(void)
+{
+  int i;
+
+  for (i = 0; i < daemon->dns_workers; i++)
+    if (worker_pids[i] != 0)
+      kill(worker_pids[i], SIGALRM);
+}
+
+#endif
@@ -62,6 +62,7 @@
 #include "queue.h"
 #include "cjson.h"
 #include "iperf_time.h"
+#include "iperf_event.h"
 
 #if defined(HAVE_SSL)
 #include <openssl/bio.h>
@@ -72,6 +73,64 @@
 typedef uint64_t iperf_size_t;
 #endif // __IPERF_API_H
 
+/*
+ * Byte counters which a --threads worker adds to whilst the main thread
+ * reads and clears them for interval reports.  Taking the interval count
+ * is a single atomic exchange, so no bytes are lost or counted twice
+ * between the two.
+ */
+#if defined(__ATOMIC_RELAXED)
+#define iperf_counter_add(c, n) __atomic_fetch_add(&(c), (n), __ATOMIC_RELAXED)
+#define iperf_counter_take(c) __atomic_exchange_n(&(c), 0, __ATOMIC_RELAXED)
+#define iperf_counter_clear(c) __atomic_store_n(&(c), 0, __ATOMIC_RELAXED)
+#else
+#undef HAVE_PTHREAD		/* --threads needs atomic counters */
+#define iperf_counter_add(c, n) ((c) += (n))
+#define iperf_counter_take(c) iperf_counter_take_nonatomic(&(c))
+#define iperf_counter_clear(c) ((c) = 0)
+static inline iperf_size_t
+iperf_counter_take_nonatomic(iperf_size_t *c)
+{
+    iperf_size_t v = *c;
+    *c = 0;
+    return v;
+}
+#endif
+
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif /* HAVE_PTHREAD */
+
+/*
+ * Streams held back by -b wait for their credit in a two-level timer
+ * wheel, with one timer for the whole of it.  Level 0 has a slot for each
+ * of the next PACING_SLOTS ticks of --pacing-timer microseconds; level 1
+ * a slot for each of the PACING_SLOTS spans of PACING_SLOTS ticks after
+ * that, which is emptied into level 0 as its span comes round.
+ */
+#define PACING_SHIFT 8
+#define PACING_SLOTS (1 << PACING_SHIFT)
+#define PACING_MASK (PACING_SLOTS - 1)
+/* Ticks' worth of credit a stream may save up */
+#define PACING_DEPTH 4
+/* Percent over the -b rate for kernel pacing, which also counts headers */
+#define PACING_HEADROOM 5
+
+struct iperf_pacing
+{
+    struct iperf_test *test;
+    struct iperf_time start;	/* when tick 0 was */
+    int64_t   tick;		/* microseconds */
+    int64_t   now;		/* the last tick run */
+    int64_t   armed;		/* the tick the timer is set for, or -1 */
+    Timer    *timer;
+    int       count[2];		/* streams waiting in each level */
+    struct iperf_stream *slots[2][PACING_SLOTS];
+};
+
+/* Intervals of each stream's results kept for reporting */
+#define INTERVAL_RING 4
+
 struct iperf_interval_results
 {
     iperf_size_t bytes_transferred; /* bytes transfered in this interval */
@@ -99,7 +158,6 @@ struct iperf_interval_results
     int interval_retrans;
     int interval_sacks;
     int snd_cwnd;
-    TAILQ_ENTRY(iperf_interval_results) irlistentries;
     void     *custom_data;
     int rtt;
     int rttvar;
@@ -122,12 +180,17 @@ struct iperf_stream_result
     int stream_sum_rtt;
     int stream_count_rtt;
     int stream_max_snd_cwnd;
+    iperf_size_t zerocopy_sends;	/* --zerocopy=z sends made */
+    iperf_size_t zerocopy_completed;	/* ... and completed */
+    iperf_size_t zerocopy_copied;	/* ... of those, copied after all */
     struct iperf_time start_time;
     struct iperf_time end_time;
     struct iperf_time start_time_fixed;
     double sender_time;
     double receiver_time;
-    TAILQ_HEAD(irlisthead, iperf_interval_results) interval_results;
+    /* The latest INTERVAL_RING intervals, each overwriting the oldest. */
+    struct iperf_interval_results interval_results[INTERVAL_RING];
+    int       interval_count;		/* intervals added so far */
     void     *data;
 };
 
@@ -162,6 +225,10 @@ struct iperf_settings
 };
 
 struct iperf_test;
+struct iperf_udp_batch;
+struct iperf_zerocopy;
+struct iperf_latency;
+struct iperf_events;
 
 struct iperf_stream
 {
@@ -179,10 +246,25 @@ struct iperf_stream
 
     /* non configurable members */
     struct iperf_stream_result *result;	/* structure pointer to result */
-    Timer     *send_timer;
     int       green_light;
+    double    pacing_credit;	/* -b token bucket, in bits */
+    iperf_size_t pacing_sent;	/* bytes_sent when it was last topped up */
+    struct iperf_time pacing_time;	/* and when */
+    int64_t   pacing_due;	/* tick it waits for in the pacing wheel, or -1 */
+    struct iperf_stream *pacing_next;	/* next in the same slot of the wheel */
+#if defined(HAVE_PTHREAD)
+    pthread_t thread;		/* --threads worker */
+#endif /* HAVE_PTHREAD */
+    int       thread_started;
+    int       thread_cpu;	/* CPU the worker is bound to, or -1 */
+    volatile int thread_stop;	/* set by the main thread to stop the worker */
+    volatile int thread_error;	/* i_errno from a failed worker, or 0 */
+    int       thread_errno;	/* and its errno */
     int       buffer_fd;	/* data to send, file descriptor */
     char      *buffer;		/* data to send, mmapped */
+    struct iperf_udp_batch *batch;	/* --udp-batch buffers, or NULL */
+    struct iperf_zerocopy *zerocopy;	/* --zerocopy=z state, or NULL */
+    struct iperf_latency *latency;	/* --latency histogram, or NULL */
     int       diskfile_fd;	/* file to send, file descriptor */
     int	      diskfile_left;	/* remaining file data on disk */
 
@@ -267,6 +349,10 @@ struct iperf_test
 #if defined(HAVE_CPUSET_SETAFFINITY)
     cpuset_t cpumask;
 #endif /* HAVE_CPUSET_SETAFFINITY */
+    int       threads;				/* --threads option */
+    int      *thread_cpus;			/* CPUs for --threads=n,m,... */
+    int       thread_ncpus;
+    int       threads_running;
     char     *title;				/* -T option */
     char     *extra_data;			/* --extra-data */
     char     *congestion;			/* -C option */
@@ -291,15 +377,21 @@ struct iperf_test
     /* boolean variables for Options */
     int       daemon;                           /* -D option */
     int       one_off;                          /* -1 option */
+    int       max_clients;			/* --max-clients */
+    int       concurrent;			/* one of the tests of a --max-clients server */
+    int       client_moves;			/* the client follows DATA_PORT */
     int       no_delay;                         /* -N option */
     int       reverse;                          /* -R option */
     int       bidirectional;                    /* --bidirectional */
     int	      verbose;                          /* -V option - verbose mode */
     int	      json_output;                      /* -J option - JSON output */
-    int	      zerocopy;                         /* -Z option - use sendfile */
+    int	      json_stream;                      /* --json-stream - JSON output a line at a time */
+    int	      zerocopy;                         /* -Z option - ZEROCOPY_SENDFILE or ZEROCOPY_MSG */
     int       debug;				/* -d option - enable debug */
     int	      get_server_output;		/* --get-server-output */
     int	      udp_counters_64bit;		/* --use-64-bit-udp-counters */
+    int	      udp_batch;			/* --udp-batch */
+    int	      latency;				/* --latency */
     int       forceflush; /* --forceflush - flushing output at every interval */
     int	      multisend;
     int	      repeating_payload;                /* --repeating-payload */
@@ -307,10 +399,11 @@ struct iperf_test
     char     *timestamp_format;
 
     char     *json_output_string; /* rendered JSON output if json_output is set */
-    /* Select related parameters */
-    int       max_fd;
-    fd_set    read_set;                         /* set of read sockets */
-    fd_set    write_set;                        /* set of write sockets */
+    int       json_stream_started;		/* the "start" line is out */
+    /* Event loop related parameters */
+    int       event_backend;			/* --event-backend */
+    struct iperf_events *events;		/* sockets the main loop waits on */
+    struct iperf_pacing *pacing;		/* -b streams waiting to send */
 
     /* Interval related members */ 
     int       omitting;
@@ -390,15 +483,39 @@ struct iperf_test
 #define MIN_UDP_BLOCKSIZE (4 + 4 + 8)
 /* Maximum size UDP send is (64K - 1) - IP and UDP header sizes */
 #define MAX_UDP_BLOCKSIZE (65535 - 8 - 20)
+/* Most datagrams per system call with --udp-batch (UDP_MAX_SEGMENTS for GSO) */
+#define MAX_UDP_BATCH 64
+/* UDP datagrams in flight with --zerocopy=z (a power of two) */
+#define ZEROCOPY_SLOTS 256
+/* Sends between reading --zerocopy=z completions */
+#define ZEROCOPY_REAP 32
+/* Longest wait for completions, in milliseconds */
+#define ZEROCOPY_WAIT_MS 100
 #define MIN_INTERVAL 0.1
 #define MAX_INTERVAL 60.0
 #define MAX_TIME 86400
 #define MAX_BURST 1000
 #define MAX_MSS (9 * 1024)
 #define MAX_STREAMS 128
+/* Most tests a --max-clients server runs at once */
+#define MAX_CLIENTS 1024
 
 #define TIMESTAMP_FORMAT "%c "
 
-extern int gerror; /* error value from getaddrinfo(3), for use in internal error handling */
+/* How long a --threads worker waits for its socket, and the longest the
+   main thread waits for events whilst workers run, in microseconds. */
+#define THREAD_POLL_US 100000
+
+extern IPERF_TLS int gerror; /* error value from getaddrinfo(3), for use in internal error handling */
+
+/*
+ * i_errno is a plain global for users of libiperf (iperf_api.h).  Inside
+ * iperf it names the calling thread's own copy once the thread has asked
+ * for one, as the tests of a --max-clients server do.
+ */
+#include "iperf_api.h"
+int *iperf_errno_location(void);
+void iperf_errno_thread(void);
+#define i_errno (*iperf_errno_location())
 
 #endif /* !__IPERF_H */
@@ -58,6 +58,12 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <math.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif /* HAVE_POLL_H */
+#if defined(HAVE_MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#endif /* HAVE_MSG_ZEROCOPY */
 
 #if defined(HAVE_CPUSET_SETAFFINITY)
 #include <sys/param.h>
@@ -85,6 +91,7 @@
 #include "cjson.h"
 #include "units.h"
 #include "iperf_util.h"
+#include "iperf_latency.h"
 #include "iperf_locale.h"
 #include "version.h"
 #if defined(HAVE_SSL)
@@ -101,6 +108,7 @@ static int diskfile_send(struct iperf_stream *sp);
 static int diskfile_recv(struct iperf_stream *sp);
 static int JSON_write(int fd, cJSON *json);
 static void print_interval_results(struct iperf_test *test, struct iperf_stream *sp, cJSON *json_interval_streams);
+static int iperf_json_stream_event(struct iperf_test *test, const char *event, cJSON *data);
 static cJSON *JSON_read(int fd);
 
 
@@ -266,6 +274,18 @@ iperf_get_test_timestamps(struct iperf_test *ipt)
     return ipt->timestamps;
 }
 
+int
+iperf_get_test_threads(struct iperf_test *ipt)
+{
+    return ipt->threads;
+}
+
+int
+iperf_get_test_event_backend(struct iperf_test *ipt)
+{
+    return ipt->event_backend;
+}
+
 const char *
 iperf_get_test_timestamp_format(struct iperf_test *ipt)
 {
@@ -308,6 +328,12 @@ iperf_get_test_json_output(struct iperf_test *ipt)
     return ipt->json_output;
 }
 
+int
+iperf_get_test_json_stream(struct iperf_test *ipt)
+{
+    return ipt->json_stream;
+}
+
 char *
 iperf_get_test_json_output_string(struct iperf_test *ipt)
 {
@@ -344,12 +370,24 @@ iperf_get_test_udp_counters_64bit(struct iperf_test *ipt)
     return ipt->udp_counters_64bit;
 }
 
+int
+iperf_get_test_latency(struct iperf_test *ipt)
+{
+    return ipt->latency;
+}
+
 int
 iperf_get_test_one_off(struct iperf_test *ipt)
 {
     return ipt->one_off;
 }
 
+int
+iperf_get_test_max_clients(struct iperf_test *ipt)
+{
+    return ipt->max_clients;
+}
+
 int
 iperf_get_test_tos(struct iperf_test *ipt)
 {
@@ -521,6 +559,18 @@ iperf_set_test_timestamps(struct iperf_test *ipt, int timestamps)
     ipt->timestamps = timestamps;
 }
 
+void
+iperf_set_test_threads(struct iperf_test *ipt, int threads)
+{
+    ipt->threads = threads;
+}
+
+void
+iperf_set_test_event_backend(struct iperf_test *ipt, int event_backend)
+{
+    ipt->event_backend = event_backend;
+}
+
 void
 iperf_set_test_timestamp_format(struct iperf_test *ipt, const char *tf)
 {
@@ -592,6 +642,14 @@ iperf_set_test_json_output(struct iperf_test *ipt, int json_output)
     ipt->json_output = json_output;
 }
 
+void
+iperf_set_test_json_stream(struct iperf_test *ipt, int json_stream)
+{
+    ipt->json_stream = json_stream;
+    if (json_stream)
+	ipt->json_output = 1;
+}
+
 int
 iperf_has_zerocopy( void )
 {
@@ -601,7 +659,10 @@ iperf_has_zerocopy( void )
 void
 iperf_set_test_zerocopy(struct iperf_test *ipt, int zerocopy)
 {
-    ipt->zerocopy = (zerocopy && has_sendfile());
+    if (zerocopy == ZEROCOPY_MSG)
+	ipt->zerocopy = iperf_has_msg_zerocopy() ? ZEROCOPY_MSG : 0;
+    else
+	ipt->zerocopy = (zerocopy && has_sendfile()) ? ZEROCOPY_SENDFILE : 0;
 }
 
 void
@@ -660,12 +721,24 @@ iperf_set_test_udp_counters_64bit(struct iperf_test *ipt, int udp_counters_64bit
     ipt->udp_counters_64bit = udp_counters_64bit;
 }
 
+void
+iperf_set_test_latency(struct iperf_test *ipt, int latency)
+{
+    ipt->latency = latency;
+}
+
 void
 iperf_set_test_one_off(struct iperf_test *ipt, int one_off)
 {
     ipt->one_off = one_off;
 }
 
+void
+iperf_set_test_max_clients(struct iperf_test *ipt, int max_clients)
+{
+    ipt->max_clients = max_clients;
+}
+
 void
 iperf_set_test_tos(struct iperf_test *ipt, int tos)
 {
@@ -750,6 +823,8 @@ iperf_on_test_start(struct iperf_test *test)
 {
     if (test->json_output) {
 	cJSON_AddItemToObject(test->json_start, "test_start", iperf_json_printf("protocol: %s  num_streams: %d  blksize: %d  omit: %d  duration: %d  bytes: %d  blocks: %d  reverse: %d  tos: %d", test->protocol->name, (int64_t) test->num_streams, (int64_t) test->settings->blksize, (int64_t) test->omit, (int64_t) test->duration, (int64_t) test->settings->bytes, (int64_t) test->settings->blocks, test->reverse?(int64_t)1:(int64_t)0, (int64_t) test->settings->tos));
+	if (test->json_stream && iperf_json_stream_event(test, "start", test->json_start) == 0)
+	    test->json_stream_started = 1;
     } else {
 	if (test->verbose) {
 	    if (test->settings->bytes)
@@ -898,7 +973,7 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
 #if defined(HAVE_FLOWLABEL)
         {"flowlabel", required_argument, NULL, 'L'},
 #endif /* HAVE_FLOWLABEL */
-        {"zerocopy", no_argument, NULL, 'Z'},
+        {"zerocopy", optional_argument, NULL, 'Z'},
         {"omit", required_argument, NULL, 'O'},
         {"file", required_argument, NULL, 'F'},
         {"repeating-payload", no_argument, NULL, OPT_REPEATING_PAYLOAD},
@@ -906,6 +981,7 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
 #if defined(HAVE_CPU_AFFINITY)
         {"affinity", required_argument, NULL, 'A'},
 #endif /* HAVE_CPU_AFFINITY */
+        {"threads", optional_argument, NULL, OPT_THREADS},
         {"title", required_argument, NULL, 'T'},
 #if defined(HAVE_TCP_CONGESTION)
         {"congestion", required_argument, NULL, 'C'},
@@ -921,6 +997,11 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
 	{"forceflush", no_argument, NULL, OPT_FORCEFLUSH},
 	{"get-server-output", no_argument, NULL, OPT_GET_SERVER_OUTPUT},
 	{"udp-counters-64bit", no_argument, NULL, OPT_UDP_COUNTERS_64BIT},
+	{"udp-batch", required_argument, NULL, OPT_UDP_BATCH},
+	{"event-backend", required_argument, NULL, OPT_EVENT_BACKEND},
+	{"json-stream", no_argument, NULL, OPT_JSON_STREAM},
+	{"latency", no_argument, NULL, OPT_LATENCY},
+	{"max-clients", required_argument, NULL, OPT_MAX_CLIENTS},
  	{"no-fq-socket-pacing", no_argument, NULL, OPT_NO_FQ_SOCKET_PACING},
 #if defined(HAVE_SSL)
     {"username", required_argument, NULL, OPT_CLIENT_USERNAME},
@@ -1007,6 +1088,10 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
             case 'J':
                 test->json_output = 1;
                 break;
+	    case OPT_JSON_STREAM:
+		test->json_output = 1;
+		test->json_stream = 1;
+		break;
             case 'v':
                 printf("%s (cJSON %s)\n%s\n%s\n", version, cJSON_Version(), get_system_info(),
 		       get_optional_features());
@@ -1216,11 +1301,24 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
 		TAILQ_INSERT_TAIL(&test->xbind_addrs, xbe, link);
                 break;
             case 'Z':
+		if (optarg != NULL) {
+		    if (strcmp(optarg, "z") != 0) {
+			i_errno = IEZEROCOPY;
+			return -1;
+		    }
+		    if (!iperf_has_msg_zerocopy()) {
+			i_errno = IEUNIMP;
+			return -1;
+		    }
+		    test->zerocopy = ZEROCOPY_MSG;
+		    client_flag = 1;
+		    break;
+		}
                 if (!has_sendfile()) {
                     i_errno = IENOSENDFILE;
                     return -1;
                 }
-                test->zerocopy = 1;
+                test->zerocopy = ZEROCOPY_SENDFILE;
 		client_flag = 1;
                 break;
             case OPT_REPEATING_PAYLOAD:
@@ -1269,6 +1367,38 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
                 return -1;
 #endif /* HAVE_CPU_AFFINITY */
                 break;
+            case OPT_THREADS:
+#if defined(HAVE_PTHREAD)
+                test->threads = 1;
+		if (optarg) {
+		    int n = 1;
+
+		    for (comma = optarg; (comma = strchr(comma, ',')) != NULL; ++comma)
+			++n;
+		    free(test->thread_cpus);
+		    test->thread_cpus = (int *) malloc(n * sizeof(int));
+		    if (test->thread_cpus == NULL) {
+			i_errno = IENEWTEST;
+			return -1;
+		    }
+		    for (comma = optarg, n = 0; ; comma = endptr + 1) {
+			test->thread_cpus[n] = strtol(comma, &endptr, 0);
+			if (endptr == comma || (*endptr != ',' && *endptr != '\0') ||
+			    test->thread_cpus[n] < 0 || test->thread_cpus[n] > 1024) {
+			    i_errno = IEAFFINITY;
+			    return -1;
+			}
+			++n;
+			if (*endptr == '\0')
+			    break;
+		    }
+		    test->thread_ncpus = n;
+		}
+#else /* HAVE_PTHREAD */
+                i_errno = IEUNIMP;
+                return -1;
+#endif /* HAVE_PTHREAD */
+                break;
             case 'T':
                 test->title = strdup(optarg);
 		client_flag = 1;
@@ -1302,6 +1432,48 @@ iperf_parse_arguments(struct iperf_test *test, int argc, char **argv)
 	    case OPT_UDP_COUNTERS_64BIT:
 		test->udp_counters_64bit = 1;
 		break;
+	    case OPT_LATENCY:
+		test->latency = 1;
+		client_flag = 1;
+		break;
+	    case OPT_MAX_CLIENTS:
+#if defined(HAVE_PTHREAD) && defined(HAVE_THREAD_LOCAL)
+		test->max_clients = atoi(optarg);
+		if (test->max_clients < 1 || test->max_clients > MAX_CLIENTS) {
+		    i_errno = IEMAXCLIENTS;
+		    return -1;
+		}
+		server_flag = 1;
+#else /* HAVE_PTHREAD && HAVE_THREAD_LOCAL */
+		i_errno = IEUNIMP;
+		return -1;
+#endif /* HAVE_PTHREAD && HAVE_THREAD_LOCAL */
+		break;
+	    case OPT_UDP_BATCH:
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+		test->udp_batch = atoi(optarg);
+		if (test->udp_batch < 1 || test->udp_batch > MAX_UDP_BATCH) {
+		    i_errno = IEUDPBATCH;
+		    return -1;
+		}
+		client_flag = 1;
+#else /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+		i_errno = IEUNIMP;
+		return -1;
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+		break;
+	    case OPT_EVENT_BACKEND:
+		if ((test->event_backend = iperf_event_backend(optarg)) < 0) {
+		    i_errno = IEEVENTBACKEND;
+		    return -1;
+		}
+#if !defined(HAVE_EPOLL_CREATE1)
+		if (test->event_backend == IPERF_EVENTS_EPOLL) {
+		    i_errno = IEUNIMP;
+		    return -1;
+		}
+#endif /* HAVE_EPOLL_CREATE1 */
+		break;
 	    case OPT_NO_FQ_SOCKET_PACING:
 #if defined(HAVE_SO_MAX_PACING_RATE)
 		printf("Warning:  --no-fq-socket-pacing is deprecated\n");
@@ -1510,27 +1682,195 @@ iperf_set_send_state(struct iperf_test *test, signed char state)
     return 0;
 }
 
+/*
+ * -b: each sending stream has a token bucket, topped up at the rate for
+ * the time since it was last looked at, and drawn down by what has been
+ * sent since.  A stream may send whilst it has credit, so it goes a block
+ * (or a batch) into debt and then waits, in the pacing wheel or asleep in
+ * its --threads worker, for as long as the rate takes to pay that off.
+ * The credit is capped at a block and a few ticks' worth (a wakeup can
+ * be late by most of a millisecond), so a stream which has fallen behind
+ * doesn't catch up in one burst.
+ */
+
+/* Microseconds until sp has credit again. */
+static int64_t
+iperf_pacing_wait(struct iperf_stream *sp)
+{
+    if (sp->pacing_credit > 0)
+	return 0;
+    return (int64_t) (-sp->pacing_credit * 1000000.0 / sp->test->settings->rate) + 1;
+}
+
+/* Arm the wheel's timer for tick due. */
+static void pacing_timer_proc(TimerClientData client_data, struct iperf_time *nowP);
+
+static void
+pacing_arm(struct iperf_pacing *w, int64_t due)
+{
+    struct iperf_time now, at, d;
+    TimerClientData cd;
+    int64_t usecs;
+
+    if (w->timer != NULL)
+	tmr_cancel(w->timer);
+    at = w->start;
+    iperf_time_add_usecs(&at, due * w->tick);
+    iperf_time_now(&now);
+    usecs = iperf_time_diff(&at, &now, &d) ? 0 : iperf_time_in_usecs(&d);
+    cd.p = w;
+    w->timer = tmr_create(&now, pacing_timer_proc, cd, usecs, 0);
+    w->armed = w->timer != NULL ? due : -1;
+}
+
+/* The first tick after now with something to do. */
+static int64_t
+pacing_next(struct iperf_pacing *w)
+{
+    int64_t t, edge = ((w->now >> PACING_SHIFT) + 1) << PACING_SHIFT;
+
+    for (t = w->now + 1; t < w->now + PACING_SLOTS; ++t)
+	if (w->slots[0][t & PACING_MASK] != NULL)
+	    break;
+    if (w->count[1] > 0 && edge < t)
+	return edge;
+    return t;
+}
+
+static void
+pacing_insert(struct iperf_pacing *w, struct iperf_stream *sp, int64_t due)
+{
+    struct iperf_stream **slot;
+    int level;
+
+    if (due <= w->now)
+	due = w->now + 1;
+    /* Further off than level 1 reaches: it looks again then. */
+    if (due - w->now >= (PACING_SLOTS - 1) * PACING_SLOTS)
+	due = w->now + (PACING_SLOTS - 1) * PACING_SLOTS - 1;
+    level = due - w->now >= PACING_SLOTS;
+    slot = &w->slots[level][(level ? due >> PACING_SHIFT : due) & PACING_MASK];
+    sp->pacing_due = due;
+    sp->pacing_next = *slot;
+    *slot = sp;
+    ++w->count[level];
+    if (w->armed < 0 || due < w->armed)
+	pacing_arm(w, due);
+}
+
+static void
+pacing_timer_proc(TimerClientData client_data, struct iperf_time *nowP)
+{
+    struct iperf_pacing *w = client_data.p;
+    struct iperf_stream *sp, *next, **slot;
+    struct iperf_time d;
+    int64_t target, t;
+
+    w->timer = NULL;
+    w->armed = -1;
+    if (w->test->done)
+	return;
+
+    target = iperf_time_diff(nowP, &w->start, &d) ? 0 : iperf_time_in_usecs(&d) / w->tick;
+    while (w->now < target && w->count[0] + w->count[1] > 0) {
+	t = ++w->now;
+	if ((t & PACING_MASK) == 0) {
+	    /* Level 1's slot for the span starting now goes down a level. */
+	    slot = &w->slots[1][(t >> PACING_SHIFT) & PACING_MASK];
+	    for (sp = *slot; sp != NULL; sp = next) {
+		next = sp->pacing_next;
+		sp->pacing_next = w->slots[0][sp->pacing_due & PACING_MASK];
+		w->slots[0][sp->pacing_due & PACING_MASK] = sp;
+		--w->count[1];
+		++w->count[0];
+	    }
+	    *slot = NULL;
+	}
+	slot = &w->slots[0][t & PACING_MASK];
+	sp = *slot;
+	*slot = NULL;
+	for (; sp != NULL; sp = next) {
+	    next = sp->pacing_next;
+	    sp->pacing_due = -1;
+	    --w->count[0];
+	    iperf_check_throttle(sp, nowP);
+	}
+    }
+    if (w->now < target)
+	w->now = target;
+    if (w->count[0] + w->count[1] > 0)
+	pacing_arm(w, pacing_next(w));
+}
+
 void
 iperf_check_throttle(struct iperf_stream *sp, struct iperf_time *nowP)
 {
+    struct iperf_test *test = sp->test;
     struct iperf_time temp_time;
-    double seconds;
-    uint64_t bits_per_second;
+    double rate = test->settings->rate, depth;
+    int64_t due;
 
-    if (sp->test->done || sp->test->settings->rate == 0 || sp->test->settings->burst != 0)
+    if (test->done || test->settings->rate == 0 || test->settings->burst != 0)
         return;
-    iperf_time_diff(&sp->result->start_time_fixed, nowP, &temp_time);
-    seconds = iperf_time_in_secs(&temp_time);
-    bits_per_second = sp->result->bytes_sent * 8 / seconds;
-    if (bits_per_second < sp->test->settings->rate) {
+    if (sp->pacing_due >= 0)
+	return;		/* waiting in the wheel */
+
+    if (!iperf_time_diff(nowP, &sp->pacing_time, &temp_time)) {
+	sp->pacing_credit += iperf_time_in_usecs(&temp_time) * rate / 1000000.0;
+	sp->pacing_time = *nowP;
+    }
+    sp->pacing_credit -= (sp->result->bytes_sent - sp->pacing_sent) * 8.0;
+    sp->pacing_sent = sp->result->bytes_sent;
+    depth = sp->settings->blksize * 8.0 + rate * PACING_DEPTH * test->settings->pacing_timer / 1000000.0;
+    if (sp->pacing_credit > depth)
+	sp->pacing_credit = depth;
+
+    if (sp->pacing_credit > 0) {
         sp->green_light = 1;
-        FD_SET(sp->socket, &sp->test->write_set);
+        if (!test->threads)
+            (void) iperf_event_watch(test, sp->socket, IPERF_EV_WRITE);
     } else {
         sp->green_light = 0;
-        FD_CLR(sp->socket, &sp->test->write_set);
+        if (!test->threads) {
+            iperf_event_unwatch(test, sp->socket, IPERF_EV_WRITE);
+	    if (test->pacing != NULL) {
+		iperf_time_diff(nowP, &test->pacing->start, &temp_time);
+		due = iperf_time_in_usecs(&temp_time) + iperf_pacing_wait(sp);
+		pacing_insert(test->pacing, sp, (due + test->pacing->tick - 1) / test->pacing->tick);
+	    }
+	}
     }
 }
 
+/* Have the kernel pace a socket too, where it can: at --fq-rate if that
+** was given, else a little above the -b rate of a stream, so that each
+** block leaves as a train of packets rather than a burst.  fq counts the
+** headers as well as the payload, so pacing at exactly -b would hold the
+** goodput below it; the internal pacing still keeps the stream to -b.
+*/
+void
+iperf_socket_pacing(struct iperf_test *test, int s)
+{
+#if defined(HAVE_SO_MAX_PACING_RATE)
+    uint64_t rate = test->settings->fqrate;
+    unsigned int bytes;
+
+    if (rate == 0 && test->settings->burst == 0)
+	rate = test->settings->rate / 100 * (100 + PACING_HEADROOM);
+    /* Convert bits per second to bytes per second */
+    if (rate / 8 == 0)
+	return;
+    bytes = rate / 8 > UINT_MAX ? UINT_MAX : rate / 8;
+    if (test->debug) {
+	printf("Setting fair-queue socket pacing to %u\n", bytes);
+    }
+    if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes, sizeof(bytes)) < 0 &&
+	test->settings->fqrate) {
+	warning("Unable to set socket pacing");
+    }
+#endif /* HAVE_SO_MAX_PACING_RATE */
+}
+
 /* Verify that average traffic is not greater than the specifid limit */
 void
 iperf_check_total_rate(struct iperf_test *test, iperf_size_t last_interval_bytes_transferred)
@@ -1570,8 +1910,17 @@ iperf_check_total_rate(struct iperf_test *test, iperf_size_t last_interval_bytes
     }
 }
 
+/* Blocks moved by one call of a stream's send or receive routine: more
+** than one for batched UDP.
+*/
+static int
+iperf_blocks(struct iperf_stream *sp, int r)
+{
+    return r > sp->settings->blksize ? r / sp->settings->blksize : 1;
+}
+
 int
-iperf_send(struct iperf_test *test, fd_set *write_setP)
+iperf_send(struct iperf_test *test)
 {
     register int multisend, r, streams_active;
     register struct iperf_stream *sp;
@@ -1590,8 +1939,8 @@ iperf_send(struct iperf_test *test, fd_set *write_setP)
 	    iperf_time_now(&now);
 	streams_active = 0;
 	SLIST_FOREACH(sp, &test->streams, streams) {
-	    if ((sp->green_light && sp->sender &&
-		 (write_setP == NULL || FD_ISSET(sp->socket, write_setP)))) {
+	    if (sp->green_light && sp->sender &&
+		iperf_event_ready(test, sp->socket, IPERF_EV_WRITE)) {
 		if ((r = sp->snd(sp)) < 0) {
 		    if (r == NET_SOFTERROR)
 			break;
@@ -1600,7 +1949,7 @@ iperf_send(struct iperf_test *test, fd_set *write_setP)
 		}
 		streams_active = 1;
 		test->bytes_sent += r;
-		++test->blocks_sent;
+		test->blocks_sent += iperf_blocks(sp, r);
 		iperf_check_throttle(sp, &now);
 		if (multisend > 1 && test->settings->bytes != 0 && test->bytes_sent >= test->settings->bytes)
 		    break;
@@ -1617,33 +1966,248 @@ iperf_send(struct iperf_test *test, fd_set *write_setP)
 	    if (sp->sender)
 	        iperf_check_throttle(sp, &now);
     }
-    if (write_setP != NULL)
-	SLIST_FOREACH(sp, &test->streams, streams)
-	    if (FD_ISSET(sp->socket, write_setP))
-		FD_CLR(sp->socket, write_setP);
+    SLIST_FOREACH(sp, &test->streams, streams)
+	iperf_event_clear(test, sp->socket, IPERF_EV_WRITE);
 
     return 0;
 }
 
 int
-iperf_recv(struct iperf_test *test, fd_set *read_setP)
+iperf_recv(struct iperf_test *test)
 {
     int r;
     struct iperf_stream *sp;
 
     SLIST_FOREACH(sp, &test->streams, streams) {
-	if (FD_ISSET(sp->socket, read_setP) && !sp->sender) {
+	if (!sp->sender && iperf_event_ready(test, sp->socket, IPERF_EV_READ)) {
 	    if ((r = sp->rcv(sp)) < 0) {
 		i_errno = IESTREAMREAD;
 		return r;
 	    }
 	    test->bytes_received += r;
-	    ++test->blocks_received;
-	    FD_CLR(sp->socket, read_setP);
+	    test->blocks_received += iperf_blocks(sp, r);
+	    iperf_event_clear(test, sp->socket, IPERF_EV_READ);
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * --zerocopy=z: sends with MSG_ZEROCOPY, which hands the kernel our pages
+ * instead of copying them.  The kernel numbers each such send, and tells
+ * us on the socket's error queue when ranges of them are done with, and
+ * whether it had to copy them after all (over loopback, say).
+ *
+ * A TCP stream sends the same buffer every time, so it only needs to read
+ * the completions, to keep them from running the socket out of option
+ * memory, and to count them.  A UDP stream writes a sequence number and
+ * timestamp into each datagram, so it can't touch a buffer until the send
+ * from it has completed: it has a ring of ZEROCOPY_SLOTS buffers, one for
+ * each send in flight, and send number n always uses buffer n % slots.
+ */
+
+#if defined(HAVE_MSG_ZEROCOPY)
+struct iperf_zerocopy {
+    char     *ring;		/* UDP: a buffer for each send in flight */
+    unsigned char *busy;	/* UDP: which of them are still in flight */
+    int       slots;
+    uint32_t  next;		/* the kernel's number for our next send */
+    uint32_t  inflight;		/* sends not yet completed */
+    int       unreaped;		/* sends since we last read completions */
+};
+#endif /* HAVE_MSG_ZEROCOPY */
+
+int
+iperf_has_msg_zerocopy(void)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    return 1;
+#else /* HAVE_MSG_ZEROCOPY */
+    return 0;
+#endif /* HAVE_MSG_ZEROCOPY */
+}
+
+int
+iperf_zerocopy_init(struct iperf_stream *sp)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    struct iperf_zerocopy *zc;
+    int size = sp->settings->blksize;
+    int i, opt = 1;
+
+    if (setsockopt(sp->socket, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) < 0) {
+	i_errno = IESETZEROCOPY;
+	return -1;
+    }
+    if ((zc = (struct iperf_zerocopy *) calloc(1, sizeof(*zc))) == NULL) {
+	i_errno = IECREATESTREAM;
+	return -1;
+    }
+    if (sp->test->protocol->id == Pudp) {
+	zc->slots = ZEROCOPY_SLOTS;
+	zc->ring = (char *) malloc((size_t) zc->slots * size);
+	zc->busy = (unsigned char *) calloc(zc->slots, 1);
+	if (zc->ring == NULL || zc->busy == NULL) {
+	    free(zc->ring);
+	    free(zc->busy);
+	    free(zc);
+	    i_errno = IECREATESTREAM;
+	    return -1;
 	}
+	/* Send the same payload as sends from sp->buffer would. */
+	for (i = 0; i < zc->slots; i++)
+	    memcpy(zc->ring + (size_t) i * size, sp->buffer, size);
     }
+    sp->zerocopy = zc;
+    return 0;
+#else /* HAVE_MSG_ZEROCOPY */
+    i_errno = IEUNIMP;
+    return -1;
+#endif /* HAVE_MSG_ZEROCOPY */
+}
+
+void
+iperf_zerocopy_free(struct iperf_stream *sp)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    struct iperf_zerocopy *zc = sp->zerocopy;
+
+    if (zc == NULL)
+	return;
+    free(zc->ring);
+    free(zc->busy);
+    free(zc);
+    sp->zerocopy = NULL;
+#endif /* HAVE_MSG_ZEROCOPY */
+}
 
+/* Read the completions which have arrived, first waiting up to timeout
+** milliseconds for one if any sends are in flight.  Returns how many
+** sends were completed, or -1.
+*/
+int
+iperf_zerocopy_reap(struct iperf_stream *sp, int timeout)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    struct iperf_zerocopy *zc = sp->zerocopy;
+    struct sock_extended_err *ee;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char control[128];
+    uint32_t id, n;
+    int done = 0;
+
+    zc->unreaped = 0;
+    while (zc->inflight > 0) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(sp->socket, &msg, MSG_ERRQUEUE) < 0) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return -1;
+	    if (timeout > 0) {
+		/* An error queue with something in it polls as POLLERR. */
+		struct pollfd pfd;
+
+		pfd.fd = sp->socket;
+		pfd.events = 0;
+		if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLERR)) {
+		    timeout = 0;
+		    continue;
+		}
+	    }
+	    break;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+		!(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+		continue;
+	    ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+	    if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		continue;
+	    /* Sends ee_info to ee_data, inclusive, are done with. */
+	    n = ee->ee_data - ee->ee_info + 1;
+	    sp->result->zerocopy_completed += n;
+	    if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+		sp->result->zerocopy_copied += n;
+	    if (zc->busy != NULL)
+		for (id = ee->ee_info; id != ee->ee_data + 1; id++)
+		    zc->busy[id & (zc->slots - 1)] = 0;
+	    zc->inflight -= n;
+	    done += n;
+	}
+    }
+    return done;
+#else /* HAVE_MSG_ZEROCOPY */
     return 0;
+#endif /* HAVE_MSG_ZEROCOPY */
+}
+
+/* The UDP buffer for the next send, or NULL if it is still in flight. */
+char *
+iperf_zerocopy_buffer(struct iperf_stream *sp)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    struct iperf_zerocopy *zc = sp->zerocopy;
+    int slot = zc->next & (zc->slots - 1);
+
+    if (zc->busy[slot] && iperf_zerocopy_reap(sp, 0) >= 0 && zc->busy[slot])
+	(void) iperf_zerocopy_reap(sp, 1);
+    if (zc->busy[slot])
+	return NULL;
+    return zc->ring + (size_t) slot * sp->settings->blksize;
+#else /* HAVE_MSG_ZEROCOPY */
+    return NULL;
+#endif /* HAVE_MSG_ZEROCOPY */
+}
+
+/* Like Nwrite(), but with MSG_ZEROCOPY. */
+int
+iperf_zerocopy_send(struct iperf_stream *sp, char *buf, int count)
+{
+#if defined(HAVE_MSG_ZEROCOPY)
+    struct iperf_zerocopy *zc = sp->zerocopy;
+    int nleft = count;
+    ssize_t r;
+
+    if (zc->unreaped >= ZEROCOPY_REAP && iperf_zerocopy_reap(sp, 0) < 0)
+	return NET_HARDERROR;
+
+    while (nleft > 0) {
+	r = send(sp->socket, buf, nleft, MSG_ZEROCOPY);
+	if (r < 0) {
+	    switch (errno) {
+		case EINTR:
+		case EAGAIN:
+#if (EAGAIN != EWOULDBLOCK)
+		case EWOULDBLOCK:
+#endif
+		return count == nleft ? NET_SOFTERROR : count - nleft;
+
+		case ENOBUFS:
+		/* Out of option memory for completions: read some. */
+		(void) iperf_zerocopy_reap(sp, ZEROCOPY_WAIT_MS);
+		return count == nleft ? NET_SOFTERROR : count - nleft;
+
+		default:
+		return NET_HARDERROR;
+	    }
+	}
+	if (zc->busy != NULL)
+	    zc->busy[zc->next & (zc->slots - 1)] = 1;
+	zc->next++;
+	zc->inflight++;
+	zc->unreaped++;
+	sp->result->zerocopy_sends++;
+	nleft -= r;
+	buf += r;
+    }
+    return count;
+#else /* HAVE_MSG_ZEROCOPY */
+    errno = ENOSYS;
+    return NET_HARDERROR;
+#endif /* HAVE_MSG_ZEROCOPY */
 }
 
 int
@@ -1672,41 +2236,251 @@ iperf_init_test(struct iperf_test *test)
     return 0;
 }
 
-static void
-send_timer_proc(TimerClientData client_data, struct iperf_time *nowP)
-{
-    struct iperf_stream *sp = client_data.p;
-
-    /* All we do here is set or clear the flag saying that this stream may
-    ** be sent to.  The actual sending gets done in the send proc, after
-    ** checking the flag.
-    */
-    iperf_check_throttle(sp, nowP);
-}
-
 int
 iperf_create_send_timers(struct iperf_test * test)
 {
     struct iperf_time now;
     struct iperf_stream *sp;
-    TimerClientData cd;
 
     if (iperf_time_now(&now) < 0) {
 	i_errno = IEINITTEST;
 	return -1;
     }
+    iperf_free_send_timers(test);
+    /* --threads workers pace themselves */
+    if (test->settings->rate != 0 && test->settings->burst == 0 && !test->threads) {
+	test->pacing = (struct iperf_pacing *) calloc(1, sizeof(struct iperf_pacing));
+	if (test->pacing == NULL) {
+	    i_errno = IEINITTEST;
+	    return -1;
+	}
+	test->pacing->test = test;
+	test->pacing->start = now;
+	test->pacing->tick = test->settings->pacing_timer > 0 ? test->settings->pacing_timer : 1;
+	test->pacing->armed = -1;
+    }
     SLIST_FOREACH(sp, &test->streams, streams) {
         sp->green_light = 1;
-	if (test->settings->rate != 0 && sp->sender) {
-	    cd.p = sp;
-	    sp->send_timer = tmr_create(NULL, send_timer_proc, cd, test->settings->pacing_timer, 1);
-	    if (sp->send_timer == NULL) {
-		i_errno = IEINITTEST;
-		return -1;
+	/* The first block goes straight away, on green_light. */
+	sp->pacing_credit = 0;
+	sp->pacing_sent = sp->result->bytes_sent;
+	sp->pacing_time = now;
+	sp->pacing_due = -1;
+	sp->pacing_next = NULL;
+    }
+    return 0;
+}
+
+/* Stop pacing.  The timer has to be cancelled by the thread which runs
+** the test, as each thread has its own timers.
+*/
+void
+iperf_free_send_timers(struct iperf_test *test)
+{
+    if (test->pacing == NULL)
+	return;
+    if (test->pacing->timer != NULL)
+	tmr_cancel(test->pacing->timer);
+    free(test->pacing);
+    test->pacing = NULL;
+}
+
+/*
+ * --threads: each stream is driven by a worker thread of its own, instead
+ * of by iperf_send()/iperf_recv() from the main event loop.  The main
+ * thread keeps the control connection, the timers and the interval
+ * reports; the workers only add to the byte counters, with atomic
+ * operations, so the two never need a lock.
+ */
+
+#if defined(HAVE_PTHREAD)
+/* Bind the calling thread to one CPU. */
+static int
+iperf_thread_setaffinity(int cpu)
+{
+#if defined(HAVE_SCHED_SETAFFINITY)
+    cpu_set_t cpu_set;
+
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    return sched_setaffinity(0, sizeof(cpu_set_t), &cpu_set);
+#elif defined(HAVE_CPUSET_SETAFFINITY)
+    cpuset_t cpumask;
+
+    CPU_ZERO(&cpumask);
+    CPU_SET(cpu, &cpumask);
+    return cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+                              sizeof(cpuset_t), &cpumask);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Wait for a stream's socket to become ready, but not for so long that
+** the worker misses being told to stop.  Returns 1 if it is ready.
+*/
+static int
+iperf_thread_wait(struct iperf_stream *sp)
+{
+    struct pollfd pfd;
+
+    pfd.fd = sp->socket;
+    pfd.events = sp->sender ? POLLOUT : POLLIN;
+    return poll(&pfd, 1, THREAD_POLL_US / 1000) > 0;
+}
+
+static void *
+iperf_stream_thread(void *arg)
+{
+    struct iperf_stream *sp = arg;
+    struct iperf_test *test = sp->test;
+    struct iperf_time now;
+    int64_t wait;
+    int r, ready = 0;
+
+    if (sp->thread_cpu != -1 && iperf_thread_setaffinity(sp->thread_cpu) != 0) {
+	sp->thread_errno = errno;
+	sp->thread_error = IEAFFINITY;
+	return NULL;
+    }
+
+    while (!sp->thread_stop) {
+	if (sp->sender) {
+	    if ((test->settings->bytes != 0 && test->bytes_sent >= test->settings->bytes) ||
+		(test->settings->blocks != 0 && test->blocks_sent >= test->settings->blocks))
+		break;
+	    if (test->settings->rate != 0) {
+		iperf_time_now(&now);
+		iperf_check_throttle(sp, &now);
+		if (!sp->green_light) {
+		    wait = iperf_pacing_wait(sp);
+		    usleep(wait < THREAD_POLL_US ? wait : THREAD_POLL_US);
+		    continue;
+		}
 	    }
+	    if ((r = sp->snd(sp)) < 0 && r != NET_SOFTERROR) {
+		sp->thread_errno = errno;
+		sp->thread_error = IESTREAMWRITE;
+		break;
+	    }
+	    if (r > 0) {
+		iperf_counter_add(test->bytes_sent, r);
+		iperf_counter_add(test->blocks_sent, iperf_blocks(sp, r));
+	    } else
+		iperf_thread_wait(sp);
+	} else {
+	    if ((r = sp->rcv(sp)) < 0) {
+		sp->thread_errno = errno;
+		sp->thread_error = IESTREAMREAD;
+		break;
+	    }
+	    if (r > 0) {
+		iperf_counter_add(test->bytes_received, r);
+		iperf_counter_add(test->blocks_received, iperf_blocks(sp, r));
+		ready = 0;
+	    } else if (ready)
+		break;	/* readable but nothing to read: the peer has closed */
+	    else
+		ready = iperf_thread_wait(sp);
 	}
     }
+
+    return NULL;
+}
+#endif /* HAVE_PTHREAD */
+
+/* Take the streams out of the main loop's event set and start a worker for
+** each.  Called once the test is running.
+*/
+int
+iperf_start_stream_threads(struct iperf_test *test)
+{
+#if defined(HAVE_PTHREAD)
+    struct iperf_stream *sp;
+    int i = 0, err;
+
+    test->threads_running = 1;
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	iperf_event_unwatch(test, sp->socket, IPERF_EV_READ | IPERF_EV_WRITE);
+	/* Receivers must not block, or they could miss being stopped. */
+	if (!sp->sender && setnonblocking(sp->socket, 1) < 0) {
+	    i_errno = IENONBLOCKING;
+	    return -1;
+	}
+	sp->green_light = 1;
+	sp->thread_cpu = test->thread_ncpus > 0 ? test->thread_cpus[i++ % test->thread_ncpus] : -1;
+	sp->thread_stop = 0;
+	sp->thread_error = sp->thread_errno = 0;
+	if ((err = pthread_create(&sp->thread, NULL, iperf_stream_thread, sp)) != 0) {
+	    errno = err;
+	    i_errno = IETHREAD;
+	    return -1;
+	}
+	sp->thread_started = 1;
+    }
     return 0;
+#else /* HAVE_PTHREAD */
+    i_errno = IEUNIMP;
+    return -1;
+#endif /* HAVE_PTHREAD */
+}
+
+/* Report the first error from a worker, if any. */
+int
+iperf_check_stream_threads(struct iperf_test *test)
+{
+    struct iperf_stream *sp;
+
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	if (sp->thread_error != 0) {
+	    errno = sp->thread_errno;
+	    i_errno = sp->thread_error;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Stop and wait for the workers, and give the streams back to the main
+** loop.  Safe to call when none are running.
+*/
+int
+iperf_stop_stream_threads(struct iperf_test *test)
+{
+#if defined(HAVE_PTHREAD)
+    struct iperf_stream *sp;
+
+    if (!test->threads_running)
+	return 0;
+    SLIST_FOREACH(sp, &test->streams, streams)
+	sp->thread_stop = 1;
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	if (sp->thread_started) {
+	    pthread_join(sp->thread, NULL);
+	    sp->thread_started = 0;
+	}
+    }
+    test->threads_running = 0;
+    SLIST_FOREACH(sp, &test->streams, streams)
+	if (iperf_event_watch(test, sp->socket, sp->sender ? IPERF_EV_WRITE : IPERF_EV_READ) < 0)
+	    return -1;
+#endif /* HAVE_PTHREAD */
+    return iperf_check_stream_threads(test);
+}
+
+/* Whilst workers run, wake up often enough to see them finish or fail. */
+struct timeval *
+iperf_stream_threads_timeout(struct iperf_test *test, struct timeval *timeout)
+{
+    static IPERF_TLS struct timeval tv;
+
+    if (!test->threads_running ||
+	(timeout != NULL && timeout->tv_sec == 0 && timeout->tv_usec <= THREAD_POLL_US))
+	return timeout;
+    tv.tv_sec = 0;
+    tv.tv_usec = THREAD_POLL_US;
+    return &tv;
 }
 
 #if defined(HAVE_SSL)
@@ -1748,7 +2522,7 @@ int
 iperf_exchange_parameters(struct iperf_test *test)
 {
     int s;
-    int32_t err;
+    int32_t err, port;
 
     if (test->role == 'c') {
 
@@ -1774,6 +2548,37 @@ iperf_exchange_parameters(struct iperf_test *test)
         }
 #endif //HAVE_SSL
 
+	/*
+	 * Each test of a concurrent server has its streams made to a port
+	 * of its own, so the client has to be told which.
+	 */
+	if (test->concurrent) {
+	    if (!test->client_moves) {
+		if (iperf_set_send_state(test, SERVER_ERROR) != 0)
+		    return -1;
+		i_errno = IEDATAPORT;
+		err = htonl(i_errno);
+		if (Nwrite(test->ctrl_sck, (char*) &err, sizeof(err), Ptcp) < 0) {
+		    i_errno = IECTRLWRITE;
+		    return -1;
+		}
+		err = htonl(0);
+		if (Nwrite(test->ctrl_sck, (char*) &err, sizeof(err), Ptcp) < 0) {
+		    i_errno = IECTRLWRITE;
+		    return -1;
+		}
+		i_errno = IEDATAPORT;
+		return -1;
+	    }
+	    if (iperf_set_send_state(test, DATA_PORT) != 0)
+		return -1;
+	    port = htonl(test->server_port);
+	    if (Nwrite(test->ctrl_sck, (char*) &port, sizeof(port), Ptcp) < 0) {
+		i_errno = IECTRLWRITE;
+		return -1;
+	    }
+	}
+
         if ((s = test->protocol->listen(test)) < 0) {
 	        if (iperf_set_send_state(test, SERVER_ERROR) != 0)
                 return -1;
@@ -1790,8 +2595,8 @@ iperf_exchange_parameters(struct iperf_test *test)
             return -1;
         }
 
-        FD_SET(s, &test->read_set);
-        test->max_fd = (s > test->max_fd) ? s : test->max_fd;
+        if (iperf_event_watch(test, s, IPERF_EV_READ) < 0)
+            return -1;
         test->prot_listener = s;
 
         // Send the control message to create streams and start the test
@@ -1890,6 +2695,10 @@ send_parameters(struct iperf_test *test)
 	    cJSON_AddNumberToObject(j, "get_server_output", iperf_get_test_get_server_output(test));
 	if (test->udp_counters_64bit)
 	    cJSON_AddNumberToObject(j, "udp_counters_64bit", iperf_get_test_udp_counters_64bit(test));
+	if (test->udp_batch > 1)
+	    cJSON_AddNumberToObject(j, "udp_batch", test->udp_batch);
+	if (test->latency)
+	    cJSON_AddNumberToObject(j, "latency", iperf_get_test_latency(test));
 	if (test->repeating_payload)
 	    cJSON_AddNumberToObject(j, "repeating_payload", test->repeating_payload);
 #if defined(HAVE_SSL)
@@ -1907,6 +2716,8 @@ send_parameters(struct iperf_test *test)
 	}
 #endif // HAVE_SSL
 	cJSON_AddStringToObject(j, "client_version", IPERF_VERSION);
+	/* We can follow a concurrent server to another port. */
+	cJSON_AddTrueToObject(j, "data_port");
 
 	if (test->debug) {
 	    char *str = cJSON_Print(j);
@@ -1998,8 +2809,15 @@ get_parameters(struct iperf_test *test)
 	    iperf_set_test_get_server_output(test, 1);
 	if ((j_p = cJSON_GetObjectItem(j, "udp_counters_64bit")) != NULL)
 	    iperf_set_test_udp_counters_64bit(test, 1);
+	if ((j_p = cJSON_GetObjectItem(j, "udp_batch")) != NULL &&
+	    j_p->valueint >= 1 && j_p->valueint <= MAX_UDP_BATCH)
+	    test->udp_batch = j_p->valueint;
+	if ((j_p = cJSON_GetObjectItem(j, "latency")) != NULL)
+	    iperf_set_test_latency(test, 1);
 	if ((j_p = cJSON_GetObjectItem(j, "repeating_payload")) != NULL)
 	    test->repeating_payload = 1;
+	if ((j_p = cJSON_GetObjectItem(j, "data_port")) != NULL)
+	    test->client_moves = 1;
 #if defined(HAVE_SSL)
 	if ((j_p = cJSON_GetObjectItem(j, "authtoken")) != NULL)
         test->settings->authtoken = strdup(j_p->valuestring);
@@ -2095,6 +2913,9 @@ send_results(struct iperf_test *test)
 		    cJSON_AddNumberToObject(j_stream, "jitter", sp->jitter);
 		    cJSON_AddNumberToObject(j_stream, "errors", sp->cnt_error);
 		    cJSON_AddNumberToObject(j_stream, "packets", sp->packet_count);
+		    /* The receiver's latencies, for the sender to report too. */
+		    if (sp->latency != NULL && !sp->sender)
+			cJSON_AddItemToObject(j_stream, "latency", iperf_latency_to_json(sp->latency));
 
 		    iperf_time_diff(&sp->result->start_time, &sp->result->start_time, &temp_time);
 		    start_time = iperf_time_in_secs(&temp_time);
@@ -2142,6 +2963,7 @@ get_results(struct iperf_test *test)
     cJSON *j_jitter;
     cJSON *j_errors;
     cJSON *j_packets;
+    cJSON *j_latency;
     cJSON *j_server_output;
     cJSON *j_start_time, *j_end_time;
     int sid, cerror, pcount;
@@ -2219,6 +3041,12 @@ get_results(struct iperf_test *test)
 				if (sp->sender) {
 				    sp->jitter = jitter;
 				    sp->cnt_error = cerror;
+				    j_latency = cJSON_GetObjectItem(j_stream, "latency");
+				    if (sp->latency != NULL && j_latency != NULL &&
+					iperf_latency_from_json(sp->latency, j_latency) < 0) {
+					i_errno = IERECVRESULTS;
+					r = -1;
+				    }
 				    sp->peer_packet_count = pcount;
 				    sp->result->bytes_received = bytes_transferred;
 				    /*
@@ -2357,11 +3185,16 @@ JSON_read(int fd)
 void
 add_to_interval_list(struct iperf_stream_result * rp, struct iperf_interval_results * new)
 {
-    struct iperf_interval_results *irp;
+    memcpy(&rp->interval_results[rp->interval_count % INTERVAL_RING], new, sizeof(struct iperf_interval_results));
+    ++rp->interval_count;
+}
 
-    irp = (struct iperf_interval_results *) malloc(sizeof(struct iperf_interval_results));
-    memcpy(irp, new, sizeof(struct iperf_interval_results));
-    TAILQ_INSERT_TAIL(&rp->interval_results, irp, irlistentries);
+struct iperf_interval_results *
+iperf_interval_result(struct iperf_stream_result * rp, int ago)
+{
+    if (ago < 0 || ago >= INTERVAL_RING || ago >= rp->interval_count)
+	return NULL;
+    return &rp->interval_results[(rp->interval_count - 1 - ago) % INTERVAL_RING];
 }
 
 
@@ -2642,6 +3475,9 @@ iperf_free_test(struct iperf_test *test)
 	free(test->congestion);
     if (test->congestion_used)
 	free(test->congestion_used);
+    if (test->thread_cpus)
+	free(test->thread_cpus);
+    iperf_event_reset(test);
     if (test->remote_congestion_used)
 	free(test->remote_congestion_used);
     if (test->timestamp_format)
@@ -2654,6 +3490,7 @@ iperf_free_test(struct iperf_test *test)
 	tmr_cancel(test->stats_timer);
     if (test->reporter_timer != NULL)
 	tmr_cancel(test->reporter_timer);
+    iperf_free_send_timers(test);
 
     /* Free protocol list */
     while (!SLIST_EMPTY(&test->protocols)) {
@@ -2742,6 +3579,7 @@ iperf_reset_test(struct iperf_test *test)
 	tmr_cancel(test->reporter_timer);
 	test->reporter_timer = NULL;
     }
+    iperf_free_send_timers(test);
     test->done = 0;
 
     SLIST_INIT(&test->streams);
@@ -2783,8 +3621,7 @@ iperf_reset_test(struct iperf_test *test)
     test->bidirectional = 0;
     test->no_delay = 0;
 
-    FD_ZERO(&test->read_set);
-    FD_ZERO(&test->write_set);
+    iperf_event_reset(test);
     
     test->num_streams = 1;
     test->settings->socket_bufsize = 0;
@@ -2816,6 +3653,9 @@ iperf_reset_test(struct iperf_test *test)
     memset(test->cookie, 0, COOKIE_SIZE);
     test->multisend = 10;	/* arbitrary */
     test->udp_counters_64bit = 0;
+    test->udp_batch = 0;
+    test->latency = 0;
+    test->client_moves = 0;
     if (test->title) {
 	free(test->title);
 	test->title = NULL;
@@ -2846,8 +3686,8 @@ iperf_reset_stats(struct iperf_test *test)
     struct iperf_stream *sp;
     struct iperf_stream_result *rp;
 
-    test->bytes_sent = 0;
-    test->blocks_sent = 0;
+    iperf_counter_clear(test->bytes_sent);
+    iperf_counter_clear(test->blocks_sent);
     iperf_time_now(&now);
     SLIST_FOREACH(sp, &test->streams, streams) {
 	sp->omitted_packet_count = sp->packet_count;
@@ -2856,8 +3696,9 @@ iperf_reset_stats(struct iperf_test *test)
 	sp->jitter = 0;
 	rp = sp->result;
         rp->bytes_sent_omit = rp->bytes_sent;
-        rp->bytes_received = 0;
-        rp->bytes_sent_this_interval = rp->bytes_received_this_interval = 0;
+        iperf_counter_clear(rp->bytes_received);
+        iperf_counter_clear(rp->bytes_sent_this_interval);
+        iperf_counter_clear(rp->bytes_received_this_interval);
 	if (test->sender_has_retransmits == 1) {
 	    struct iperf_interval_results ir; /* temporary results structure */
 	    save_tcpinfo(sp, &ir);
@@ -2882,17 +3723,24 @@ iperf_stats_callback(struct iperf_test *test)
     struct iperf_stream_result *rp = NULL;
     struct iperf_interval_results *irp, temp;
     struct iperf_time temp_time;
+    iperf_size_t bytes_sent, bytes_received;
     iperf_size_t total_interval_bytes_transferred = 0;
 
     temp.omitted = test->omitting;
     SLIST_FOREACH(sp, &test->streams, streams) {
         rp = sp->result;
-	temp.bytes_transferred = sp->sender ? rp->bytes_sent_this_interval : rp->bytes_received_this_interval;
+	bytes_sent = iperf_counter_take(rp->bytes_sent_this_interval);
+	bytes_received = iperf_counter_take(rp->bytes_received_this_interval);
+	temp.bytes_transferred = sp->sender ? bytes_sent : bytes_received;
+
+	/* The last zero-copy sends complete once the data has been taken. */
+	if (test->done && sp->zerocopy != NULL)
+	    (void) iperf_zerocopy_reap(sp, ZEROCOPY_WAIT_MS);
 
         // Total bytes transferred this interval
-	total_interval_bytes_transferred += rp->bytes_sent_this_interval + rp->bytes_received_this_interval;
+	total_interval_bytes_transferred += bytes_sent + bytes_received;
     
-	irp = TAILQ_LAST(&rp->interval_results, irlisthead);
+	irp = iperf_interval_result(rp, 0);
         /* result->end_time contains timestamp of previous interval */
         if ( irp != NULL ) /* not the 1st interval */
             memcpy(&temp.interval_start_time, &rp->end_time, sizeof(struct iperf_time));
@@ -2948,7 +3796,6 @@ iperf_stats_callback(struct iperf_test *test)
 	    temp.cnt_error = sp->cnt_error;
 	}
         add_to_interval_list(rp, &temp);
-        rp->bytes_sent_this_interval = rp->bytes_received_this_interval = 0;
     }
 
     /* Verify that total server's throughput is not above specified limit */
@@ -2990,7 +3837,7 @@ iperf_print_intermediate(struct iperf_test *test)
      */
     int interval_ok = 0;
     SLIST_FOREACH(sp, &test->streams, streams) {
-	irp = TAILQ_LAST(&sp->result->interval_results, irlisthead);
+	irp = iperf_interval_result(sp->result, 0);
 	if (irp) {
 	    iperf_time_diff(&irp->interval_start_time, &irp->interval_end_time, &temp_time);
 	    double interval_len = iperf_time_in_secs(&temp_time);
@@ -3084,7 +3931,7 @@ iperf_print_intermediate(struct iperf_test *test)
             if (sp->sender == stream_must_be_sender) {
                 print_interval_results(test, sp, json_interval_streams);
                 /* sum up all streams */
-                irp = TAILQ_LAST(&sp->result->interval_results, irlisthead);
+                irp = iperf_interval_result(sp->result, 0);
                 if (irp == NULL) {
                     iperf_err(test,
                             "iperf_print_intermediate error: interval_results is NULL");
@@ -3108,7 +3955,7 @@ iperf_print_intermediate(struct iperf_test *test)
             sp = SLIST_FIRST(&test->streams); /* reset back to 1st stream */
             /* Only do this of course if there was a first stream */
             if (sp) {
-	    irp = TAILQ_LAST(&sp->result->interval_results, irlisthead);    /* use 1st stream for timing info */
+	    irp = iperf_interval_result(sp->result, 0);    /* use 1st stream for timing info */
 
 	    unit_snprintf(ubuf, UNIT_LEN, (double) bytes, 'A');
 	    bandwidth = (double) bytes / (double) irp->interval_duration;
@@ -3158,6 +4005,106 @@ iperf_print_intermediate(struct iperf_test *test)
     }
 }
 
+/* --latency: a summary of the latencies in h, in milliseconds. */
+static cJSON *
+iperf_latency_json_summary(const struct iperf_latency *h, int socket)
+{
+    cJSON *j;
+
+    j = iperf_json_printf("datagrams: %d  min_ms: %f  mean_ms: %f  p50_ms: %f  p99_ms: %f  p99_9_ms: %f  max_ms: %f  clock_skewed: %d  timestamps: %s",
+			  (int64_t) h->count, (double) h->min / 1000.0, iperf_latency_mean(h) / 1000.0,
+			  iperf_latency_percentile(h, 50.0) / 1000.0, iperf_latency_percentile(h, 99.0) / 1000.0,
+			  iperf_latency_percentile(h, 99.9) / 1000.0, (double) h->max / 1000.0,
+			  (int64_t) h->negative, iperf_latency_stamps_name(h->stamps));
+    if (j != NULL && socket >= 0)
+	cJSON_AddNumberToObject(j, "socket", socket);
+    return j;
+}
+
+/* --latency: the one-way latencies of the streams which we send on, if
+** sender, or receive on, if not, each and all together.
+*/
+static void
+iperf_print_latency(struct iperf_test *test, int sender, const char *mbuf)
+{
+    struct iperf_stream *sp;
+    struct iperf_latency *sum;
+    cJSON *json_latency = NULL, *json_streams = NULL;
+    int streams = 0;
+
+    if ((sum = (struct iperf_latency *) calloc(1, sizeof(*sum))) == NULL)
+	return;
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	/* A server may not have the client's half of the results yet. */
+	if (sp->latency == NULL || sp->sender != sender || sp->latency->count == 0)
+	    continue;
+	++streams;
+	iperf_latency_merge(sum, sp->latency);
+	if (test->json_output) {
+	    if (json_latency == NULL) {
+		json_latency = cJSON_CreateObject();
+		json_streams = cJSON_CreateArray();
+		if (json_latency == NULL || json_streams == NULL) {
+		    cJSON_Delete(json_latency);
+		    cJSON_Delete(json_streams);
+		    free(sum);
+		    return;
+		}
+		cJSON_AddItemToObject(json_latency, "streams", json_streams);
+		cJSON_AddItemToObject(test->json_end, sender ? "latency_sent" : "latency_received", json_latency);
+	    }
+	    cJSON_AddItemToArray(json_streams, iperf_latency_json_summary(sp->latency, sp->socket));
+	} else
+	    iperf_printf(test, report_latency, sp->socket, mbuf,
+			 iperf_latency_percentile(sp->latency, 50.0) / 1000.0,
+			 iperf_latency_percentile(sp->latency, 99.0) / 1000.0,
+			 iperf_latency_percentile(sp->latency, 99.9) / 1000.0,
+			 sp->latency->min / 1000.0, iperf_latency_mean(sp->latency) / 1000.0,
+			 sp->latency->max / 1000.0, iperf_latency_stamps_name(sp->latency->stamps));
+    }
+    if (streams > 0) {
+	if (test->json_output)
+	    cJSON_AddItemToObject(json_latency, "sum", iperf_latency_json_summary(sum, -1));
+	else {
+	    if (streams > 1)
+		iperf_printf(test, report_sum_latency, mbuf,
+			     iperf_latency_percentile(sum, 50.0) / 1000.0,
+			     iperf_latency_percentile(sum, 99.0) / 1000.0,
+			     iperf_latency_percentile(sum, 99.9) / 1000.0,
+			     sum->min / 1000.0, iperf_latency_mean(sum) / 1000.0,
+			     sum->max / 1000.0, iperf_latency_stamps_name(sum->stamps));
+	    if (sum->negative > 0)
+		iperf_printf(test, report_latency_skewed, mbuf, (unsigned long long) sum->negative);
+	}
+    }
+    free(sum);
+}
+
+/* How many of our --zerocopy=z sends went without being copied. */
+static void
+iperf_print_zerocopy(struct iperf_test *test)
+{
+    struct iperf_stream *sp;
+    iperf_size_t sends = 0, completed = 0, copied = 0;
+    int streams = 0;
+
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	if (sp->zerocopy == NULL)
+	    continue;
+	++streams;
+	sends += sp->result->zerocopy_sends;
+	completed += sp->result->zerocopy_completed;
+	copied += sp->result->zerocopy_copied;
+    }
+    if (streams == 0)
+	return;
+
+    if (test->json_output)
+	cJSON_AddItemToObject(test->json_end, "zerocopy", iperf_json_printf("sends: %d  zerocopy: %d  copied: %d  unconfirmed: %d", (int64_t) sends, (int64_t) (completed - copied), (int64_t) copied, (int64_t) (sends - completed)));
+    else
+	iperf_printf(test, report_zerocopy, (unsigned long long) sends, (unsigned long long) (completed - copied), (unsigned long long) copied, (unsigned long long) (sends - completed));
+}
+
 /**
  * Print overall summary statistics at the end of a test.
  */
@@ -3582,6 +4529,12 @@ iperf_print_results(struct iperf_test *test)
             }
         }
 
+        if (test->latency && test->protocol->id == Pudp)
+            iperf_print_latency(test, stream_must_be_sender, mbuf);
+
+        if (current_mode == upper_mode)
+            iperf_print_zerocopy(test);
+
         if (test->json_output && current_mode == upper_mode) {
             cJSON_AddItemToObject(test->json_end, "cpu_utilization_percent", iperf_json_printf("host_total: %f  host_user: %f  host_system: %f  remote_total: %f  remote_user: %f  remote_system: %f", (double) test->cpu_util[0], (double) test->cpu_util[1], (double) test->cpu_util[2], (double) test->remote_cpu_util[0], (double) test->remote_cpu_util[1], (double) test->remote_cpu_util[2]));
             if (test->protocol->id == Ptcp) {
@@ -3654,6 +4607,26 @@ iperf_print_results(struct iperf_test *test)
 
 /**************************************************************************/
 
+/*
+ * With --json-stream, each interval is written out as soon as it is
+ * reported, and then forgotten unless the client is to get it with the
+ * server output, so that a long test doesn't build up its whole report.
+ */
+static void
+iperf_report_intermediate(struct iperf_test *test)
+{
+    int n = 0;
+
+    if (test->json_stream)
+	n = cJSON_GetArraySize(test->json_intervals);
+    iperf_print_intermediate(test);
+    if (test->json_stream && cJSON_GetArraySize(test->json_intervals) > n) {
+	(void) iperf_json_stream_event(test, "interval", cJSON_GetArrayItem(test->json_intervals, n));
+	if (!(test->role == 's' && test->get_server_output))
+	    cJSON_DeleteItemFromArray(test->json_intervals, n);
+    }
+}
+
 /**
  * Main report-printing callback.
  * Prints results either during a test (interval report only) or 
@@ -3667,11 +4640,11 @@ iperf_reporter_callback(struct iperf_test *test)
         case TEST_RUNNING:
         case STREAM_RUNNING:
             /* print interval results for each stream */
-            iperf_print_intermediate(test);
+            iperf_report_intermediate(test);
             break;
         case TEST_END:
         case DISPLAY_RESULTS:
-            iperf_print_intermediate(test);
+            iperf_report_intermediate(test);
             iperf_print_results(test);
             break;
     } 
@@ -3703,7 +4676,7 @@ print_interval_results(struct iperf_test *test, struct iperf_stream *sp, cJSON *
         zbuf[0] = '\0';
     }
 
-    irp = TAILQ_LAST(&sp->result->interval_results, irlisthead); /* get last entry in linked list */
+    irp = iperf_interval_result(sp->result, 0); /* get the latest interval */
     if (irp == NULL) {
 	iperf_err(test, "print_interval_results error: interval_results is NULL");
         return;
@@ -3803,20 +4776,14 @@ print_interval_results(struct iperf_test *test, struct iperf_stream *sp, cJSON *
 void
 iperf_free_stream(struct iperf_stream *sp)
 {
-    struct iperf_interval_results *irp, *nirp;
-
-    /* XXX: need to free interval list too! */
     munmap(sp->buffer, sp->test->settings->blksize);
     close(sp->buffer_fd);
+    iperf_udp_batch_free(sp);
+    iperf_zerocopy_free(sp);
+    free(sp->latency);
     if (sp->diskfile_fd >= 0)
 	close(sp->diskfile_fd);
-    for (irp = TAILQ_FIRST(&sp->result->interval_results); irp != NULL; irp = nirp) {
-        nirp = TAILQ_NEXT(irp, irlistentries);
-        free(irp);
-    }
     free(sp->result);
-    if (sp->send_timer != NULL)
-	tmr_cancel(sp->send_timer);
     free(sp);
 }
 
@@ -3864,7 +4831,6 @@ iperf_new_stream(struct iperf_test *test, int s, int sender)
     }
 
     memset(sp->result, 0, sizeof(struct iperf_stream_result));
-    TAILQ_INIT(&sp->result->interval_results);
     
     /* Create and randomize the buffer */
     sp->buffer_fd = mkstemp(template);
@@ -3929,6 +4895,16 @@ iperf_new_stream(struct iperf_test *test, int s, int sender)
         free(sp);
         return NULL;
     }
+
+    /* -F reads each block into sp->buffer, which mustn't change under a zero-copy send. */
+    if (sender && test->zerocopy == ZEROCOPY_MSG && sp->diskfile_fd < 0 &&
+	iperf_zerocopy_init(sp) < 0) {
+        close(sp->buffer_fd);
+        munmap(sp->buffer, sp->test->settings->blksize);
+        free(sp->result);
+        free(sp);
+        return NULL;
+    }
     iperf_add_stream(test, sp);
 
     return sp;
@@ -4197,6 +5173,31 @@ iperf_json_start(struct iperf_test *test)
     if (test->json_end == NULL)
         return -1;
     cJSON_AddItemToObject(test->json_top, "end", test->json_end);
+    test->json_stream_started = 0;
+    return 0;
+}
+
+/* --json-stream: write one part of the report as a line of its own,
+** {"event": event, "data": data}.
+*/
+static int
+iperf_json_stream_event(struct iperf_test *test, const char *event, cJSON *data)
+{
+    cJSON *j;
+    char *str;
+
+    j = cJSON_CreateObject();
+    if (j == NULL)
+	return -1;
+    cJSON_AddStringToObject(j, "event", event);
+    cJSON_AddItemReferenceToObject(j, "data", data);
+    str = cJSON_PrintUnformatted(j);
+    cJSON_Delete(j);
+    if (str == NULL)
+	return -1;
+    fprintf(test->outfile, "%s\n", str);
+    iflush(test);
+    cJSON_free(str);
     return 0;
 }
 
@@ -4214,13 +5215,25 @@ iperf_json_finish(struct iperf_test *test)
     if (test->server_output_text) {
 	cJSON_AddStringToObject(test->json_top, "server_output_text", test->server_output_text);
     }
-    test->json_output_string = cJSON_Print(test->json_top);
-    if (test->json_output_string == NULL)
-        return -1;
-    fprintf(test->outfile, "%s\n", test->json_output_string);
-    iflush(test);
-    cJSON_free(test->json_output_string);
-    test->json_output_string = NULL;
+    if (test->json_stream) {
+	cJSON *j;
+
+	/* The rest of the report, each part as an event named for it. */
+	for (j = test->json_top->child; j != NULL; j = j->next) {
+	    if (j == test->json_intervals || (j == test->json_start && test->json_stream_started))
+		continue;
+	    if (iperf_json_stream_event(test, j->string, j) < 0)
+		return -1;
+	}
+    } else {
+	test->json_output_string = cJSON_Print(test->json_top);
+	if (test->json_output_string == NULL)
+	    return -1;
+	fprintf(test->outfile, "%s\n", test->json_output_string);
+	iflush(test);
+	cJSON_free(test->json_output_string);
+	test->json_output_string = NULL;
+    }
     cJSON_Delete(test->json_top);
     test->json_top = test->json_start = test->json_connected = test->json_intervals = test->json_server_output = test->json_end = NULL;
     return 0;
@@ -4314,7 +5327,7 @@ iperf_clearaffinity(struct iperf_test *test)
 #endif /* neither HAVE_SCHED_SETAFFINITY nor HAVE_CPUSET_SETAFFINITY nor HAVE_SETPROCESSAFFINITYMASK */
 }
 
-char iperf_timestr[100];
+IPERF_TLS char iperf_timestr[100];
 
 int
 iperf_printf(struct iperf_test *test, const char* format, ...)
@@ -4322,14 +5335,14 @@ iperf_printf(struct iperf_test *test, const char* format, ...)
     va_list argp;
     int r = -1;
     time_t now;
-    struct tm *ltm = NULL;
+    struct tm ltm;
     char *ct = NULL;
 
     /* Timestamp if requested */
     if (iperf_get_test_timestamps(test)) {
 	time(&now);
-	ltm = localtime(&now);
-	strftime(iperf_timestr, sizeof(iperf_timestr), iperf_get_test_timestamp_format(test), ltm);
+	localtime_r(&now, &ltm);
+	strftime(iperf_timestr, sizeof(iperf_timestr), iperf_get_test_timestamp_format(test), &ltm);
 	ct = iperf_timestr;
     }
 
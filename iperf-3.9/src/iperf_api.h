@@ -79,6 +79,16 @@ typedef uint64_t iperf_size_t;
 #define OPT_BIDIRECTIONAL 20
 #define OPT_SERVER_BITRATE_LIMIT 21
 #define OPT_TIMESTAMPS 22
+#define OPT_THREADS 23
+#define OPT_UDP_BATCH 24
+#define OPT_EVENT_BACKEND 25
+#define OPT_JSON_STREAM 26
+#define OPT_LATENCY 27
+#define OPT_MAX_CLIENTS 28
+
+/* -Z, --zerocopy methods */
+#define ZEROCOPY_SENDFILE 1
+#define ZEROCOPY_MSG 2	/* --zerocopy=z */
 
 /* states */
 #define TEST_START 1
@@ -97,6 +107,7 @@ typedef uint64_t iperf_size_t;
 #define DISPLAY_RESULTS 14
 #define IPERF_START 15
 #define IPERF_DONE 16
+#define DATA_PORT 17 /* followed by the port to make the streams to */
 #define ACCESS_DENIED (-1)
 #define SERVER_ERROR (-2)
 
@@ -120,18 +131,23 @@ double	iperf_get_test_stats_interval( struct iperf_test* ipt );
 int	iperf_get_test_num_streams( struct iperf_test* ipt );
 int	iperf_get_test_repeating_payload( struct iperf_test* ipt );
 int	iperf_get_test_timestamps( struct iperf_test* ipt );
+int	iperf_get_test_threads( struct iperf_test* ipt );
+int	iperf_get_test_event_backend( struct iperf_test* ipt );
 const char* iperf_get_test_timestamp_format( struct iperf_test* ipt );
 int	iperf_get_test_server_port( struct iperf_test* ipt );
 char*	iperf_get_test_server_hostname( struct iperf_test* ipt );
 char*	iperf_get_test_template( struct iperf_test* ipt );
 int	iperf_get_test_protocol_id( struct iperf_test* ipt );
 int	iperf_get_test_json_output( struct iperf_test* ipt );
+int	iperf_get_test_json_stream( struct iperf_test* ipt );
 char*	iperf_get_test_json_output_string ( struct iperf_test* ipt );
 int	iperf_get_test_zerocopy( struct iperf_test* ipt );
 int	iperf_get_test_get_server_output( struct iperf_test* ipt );
 char*	iperf_get_test_bind_address ( struct iperf_test* ipt );
 int	iperf_get_test_udp_counters_64bit( struct iperf_test* ipt );
+int	iperf_get_test_latency( struct iperf_test* ipt );
 int	iperf_get_test_one_off( struct iperf_test* ipt );
+int	iperf_get_test_max_clients( struct iperf_test* ipt );
 int iperf_get_test_tos( struct iperf_test* ipt );
 char*	iperf_get_extra_data( struct iperf_test* ipt );
 char*	iperf_get_iperf_version(void);
@@ -158,18 +174,24 @@ void	iperf_set_test_socket_bufsize( struct iperf_test* ipt, int socket_bufsize )
 void	iperf_set_test_num_streams( struct iperf_test* ipt, int num_streams );
 void	iperf_set_test_repeating_payload( struct iperf_test* ipt, int repeating_payload );
 void	iperf_set_test_timestamps( struct iperf_test* ipt, int timestamps );
+void	iperf_set_test_threads( struct iperf_test* ipt, int threads );
+void	iperf_set_test_event_backend( struct iperf_test* ipt, int event_backend );
 void	iperf_set_test_timestamp_format( struct iperf_test*, const char *tf );
 void	iperf_set_test_role( struct iperf_test* ipt, char role );
 void	iperf_set_test_server_hostname( struct iperf_test* ipt, const char* server_hostname );
 void    iperf_set_test_template( struct iperf_test *ipt, const char *tmp_template );
 void	iperf_set_test_reverse( struct iperf_test* ipt, int reverse );
 void	iperf_set_test_json_output( struct iperf_test* ipt, int json_output );
+void	iperf_set_test_json_stream( struct iperf_test* ipt, int json_stream );
 int	iperf_has_zerocopy( void );
+int	iperf_has_msg_zerocopy( void );
 void	iperf_set_test_zerocopy( struct iperf_test* ipt, int zerocopy );
 void	iperf_set_test_get_server_output( struct iperf_test* ipt, int get_server_output );
 void	iperf_set_test_bind_address( struct iperf_test* ipt, const char *bind_address );
 void	iperf_set_test_udp_counters_64bit( struct iperf_test* ipt, int udp_counters_64bit );
+void	iperf_set_test_latency( struct iperf_test* ipt, int latency );
 void	iperf_set_test_one_off( struct iperf_test* ipt, int one_off );
+void	iperf_set_test_max_clients( struct iperf_test* ipt, int max_clients );
 void    iperf_set_test_tos( struct iperf_test* ipt, int tos );
 void	iperf_set_test_extra_data( struct iperf_test* ipt, const char *dat );
 void    iperf_set_test_bidirectional( struct iperf_test* ipt, int bidirectional);
@@ -197,6 +219,13 @@ int      iperf_exchange_parameters(struct iperf_test * test);
  */
 void      add_to_interval_list(struct iperf_stream_result * rp, struct iperf_interval_results *temp);
 
+/**
+ * iperf_interval_result -- a stream's results for the interval ago intervals
+ * before its latest one, or NULL if that is gone or never was
+ *
+ */
+struct iperf_interval_results *iperf_interval_result(struct iperf_stream_result * rp, int ago);
+
 /**
  * connect_msg -- displays connection message
  * denoting senfer/receiver details
@@ -272,8 +301,14 @@ void build_tcpinfo_message(struct iperf_interval_results *r, char *message);
 
 int iperf_set_send_state(struct iperf_test *test, signed char state);
 void iperf_check_throttle(struct iperf_stream *sp, struct iperf_time *nowP);
-int iperf_send(struct iperf_test *, fd_set *) /* __attribute__((hot)) */;
-int iperf_recv(struct iperf_test *, fd_set *);
+void iperf_socket_pacing(struct iperf_test *test, int s);
+int iperf_send(struct iperf_test *) /* __attribute__((hot)) */;
+int iperf_recv(struct iperf_test *);
+int iperf_zerocopy_init(struct iperf_stream *sp);
+void iperf_zerocopy_free(struct iperf_stream *sp);
+char *iperf_zerocopy_buffer(struct iperf_stream *sp);
+int iperf_zerocopy_send(struct iperf_stream *sp, char *buf, int count);
+int iperf_zerocopy_reap(struct iperf_stream *sp, int timeout);
 void iperf_catch_sigend(void (*handler)(int));
 void iperf_got_sigend(struct iperf_test *test) __attribute__ ((noreturn));
 void usage(void);
@@ -282,6 +317,11 @@ void warning(const char *);
 int iperf_exchange_results(struct iperf_test *);
 int iperf_init_test(struct iperf_test *);
 int iperf_create_send_timers(struct iperf_test *);
+void iperf_free_send_timers(struct iperf_test *);
+int iperf_start_stream_threads(struct iperf_test *);
+int iperf_check_stream_threads(struct iperf_test *);
+int iperf_stop_stream_threads(struct iperf_test *);
+struct timeval *iperf_stream_threads_timeout(struct iperf_test *, struct timeval *);
 int iperf_parse_arguments(struct iperf_test *, int, char **);
 int iperf_open_logfile(struct iperf_test *);
 void iperf_reset_test(struct iperf_test *);
@@ -361,6 +401,10 @@ enum {
     IEBADPORT = 26,	    // Bad port number
     IETOTALRATE = 27,       // Total required bandwidth is larger than server's limit
     IETOTALINTERVAL = 28,   // Invalid time interval for calculating average data rate
+    IEUDPBATCH = 29,        // Invalid --udp-batch count. Maximum value = %dMAX_UDP_BATCH
+    IEEVENTBACKEND = 30,    // Unknown --event-backend
+    IEZEROCOPY = 31,        // Unknown --zerocopy method
+    IEMAXCLIENTS = 32,      // Invalid --max-clients count. Maximum value = %dMAX_CLIENTS
     /* Test errors */
     IENEWTEST = 100,        // Unable to create a new test (check perror)
     IEINITTEST = 101,       // Test initialization failed (check perror)
@@ -405,6 +449,10 @@ enum {
     IESETPACING= 140,       // Unable to set socket pacing rate
     IESETBUF2= 141,	    // Socket buffer size incorrect (written value != read value)
     IEAUTHTEST = 142,       // Test authorization failed
+    IETHREAD = 143,         // Unable to start a stream thread (check perror)
+    IEEVENT = 144,          // Unable to watch a socket for events (check perror)
+    IESETZEROCOPY = 145,    // Unable to set SO_ZEROCOPY (check perror)
+    IEDATAPORT = 146,       // The client can't be moved to a data port of its own
     /* Stream errors */
     IECREATESTREAM = 200,   // Unable to create a new stream (check herror/perror)
     IEINITSTREAM = 201,     // Unable to initialize stream (check herror/perror)
@@ -64,7 +64,8 @@ void sha256(const char *string, char outputBuffer[65])
 
 int check_authentication(const char *username, const char *password, const time_t ts, const char *filename){
     time_t t = time(NULL);
-    time_t utc_seconds = mktime(localtime(&t));
+    struct tm lt;
+    time_t utc_seconds = mktime(localtime_r(&t, &lt));
     if ( (utc_seconds - ts) > 10 || (utc_seconds - ts) < -10 ) {
         return 1;
     }
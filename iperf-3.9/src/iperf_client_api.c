@@ -98,11 +98,10 @@ iperf_create_streams(struct iperf_test *test, int sender)
 	}
 #endif /* HAVE_TCP_CONGESTION */
 
-	if (sender)
-	    FD_SET(s, &test->write_set);
-	else
-	    FD_SET(s, &test->read_set);
-	if (s > test->max_fd) test->max_fd = s;
+	if (iperf_event_watch(test, s, sender ? IPERF_EV_WRITE : IPERF_EV_READ) < 0) {
+	    close(s);
+	    return -1;
+	}
 
         sp = iperf_new_stream(test, s, sender);
         if (!sp)
@@ -251,6 +250,14 @@ iperf_handle_message_client(struct iperf_test *test)
             if (test->on_connect)
                 test->on_connect(test);
             break;
+        case DATA_PORT:
+            /* A concurrent server wants the streams on another port. */
+            if (Nread(test->ctrl_sck, (char*) &err, sizeof(err), Ptcp) < 0) {
+                i_errno = IECTRLREAD;
+                return -1;
+            }
+            test->server_port = ntohl(err);
+            break;
         case CREATE_STREAMS:
             if (test->mode == BIDIRECTIONAL)
             {
@@ -328,8 +335,7 @@ iperf_handle_message_client(struct iperf_test *test)
 int
 iperf_connect(struct iperf_test *test)
 {
-    FD_ZERO(&test->read_set);
-    FD_ZERO(&test->write_set);
+    iperf_event_reset(test);
 
     make_cookie(test->cookie);
 
@@ -347,8 +353,8 @@ iperf_connect(struct iperf_test *test)
         return -1;
     }
 
-    FD_SET(test->ctrl_sck, &test->read_set);
-    if (test->ctrl_sck > test->max_fd) test->max_fd = test->ctrl_sck;
+    if (iperf_event_watch(test, test->ctrl_sck, IPERF_EV_READ) < 0)
+        return -1;
 
     int opt;
     socklen_t len;
@@ -425,6 +431,8 @@ iperf_client_end(struct iperf_test *test)
 {
     struct iperf_stream *sp;
 
+    (void) iperf_stop_stream_threads(test);
+
     /* Close all stream sockets */
     SLIST_FOREACH(sp, &test->streams, streams) {
         close(sp->socket);
@@ -449,7 +457,6 @@ iperf_run_client(struct iperf_test * test)
 {
     int startup;
     int result = 0;
-    fd_set read_set, write_set;
     struct iperf_time now;
     struct timeval* timeout = NULL;
     struct iperf_stream *sp;
@@ -485,21 +492,19 @@ iperf_run_client(struct iperf_test * test)
 
     startup = 1;
     while (test->state != IPERF_DONE) {
-	memcpy(&read_set, &test->read_set, sizeof(fd_set));
-	memcpy(&write_set, &test->write_set, sizeof(fd_set));
 	iperf_time_now(&now);
-	timeout = tmr_timeout(&now);
-	result = select(test->max_fd + 1, &read_set, &write_set, NULL, timeout);
+	timeout = iperf_stream_threads_timeout(test, tmr_timeout(&now));
+	result = iperf_event_wait(test, timeout);
 	if (result < 0 && errno != EINTR) {
   	    i_errno = IESELECT;
 	    goto cleanup_and_fail;
 	}
 	if (result > 0) {
-	    if (FD_ISSET(test->ctrl_sck, &read_set)) {
+	    if (iperf_event_ready(test, test->ctrl_sck, IPERF_EV_READ)) {
  	        if (iperf_handle_message_client(test) < 0) {
 		    goto cleanup_and_fail;
 		}
-		FD_CLR(test->ctrl_sck, &read_set);
+		iperf_event_clear(test, test->ctrl_sck, IPERF_EV_READ);
 	    }
 	}
 
@@ -515,22 +520,30 @@ iperf_run_client(struct iperf_test * test)
 			setnonblocking(sp->socket, 1);
 		    }
 		}
+
+		if (test->threads)
+		    if (iperf_start_stream_threads(test) < 0)
+			goto cleanup_and_fail;
 	    }
 
 
-	    if (test->mode == BIDIRECTIONAL)
+	    if (test->threads_running) {
+		// Each stream has its own thread; just watch for errors.
+		if (iperf_check_stream_threads(test) < 0)
+		    goto cleanup_and_fail;
+	    } else if (test->mode == BIDIRECTIONAL)
 	    {
-                if (iperf_send(test, &write_set) < 0)
+                if (iperf_send(test) < 0)
                     goto cleanup_and_fail;
-                if (iperf_recv(test, &read_set) < 0)
+                if (iperf_recv(test) < 0)
                     goto cleanup_and_fail;
 	    } else if (test->mode == SENDER) {
                 // Regular mode. Client sends.
-                if (iperf_send(test, &write_set) < 0)
+                if (iperf_send(test) < 0)
                     goto cleanup_and_fail;
 	    } else {
                 // Reverse mode. Client receives.
-                if (iperf_recv(test, &read_set) < 0)
+                if (iperf_recv(test) < 0)
                     goto cleanup_and_fail;
 	    }
 
@@ -545,6 +558,9 @@ iperf_run_client(struct iperf_test * test)
 	         (test->settings->bytes != 0 && test->bytes_sent >= test->settings->bytes) ||
 	         (test->settings->blocks != 0 && test->blocks_sent >= test->settings->blocks))) {
 
+		if (iperf_stop_stream_threads(test) < 0)
+		    goto cleanup_and_fail;
+
 		// Unset non-blocking for non-UDP tests
 		if (test->protocol->id != Pudp) {
 		    SLIST_FOREACH(sp, &test->streams, streams) {
@@ -566,7 +582,7 @@ iperf_run_client(struct iperf_test * test)
 	// and gets blocked, so it can't receive state changes
 	// from the client side.
 	else if (test->mode == RECEIVER && test->state == TEST_END) {
-	    if (iperf_recv(test, &read_set) < 0)
+	    if (iperf_recv(test) < 0)
 		goto cleanup_and_fail;
 	}
     }
@@ -33,9 +33,10 @@
 #include "iperf.h"
 #include "iperf_api.h"
 
-int gerror;
+/* Per thread, for the tests of a concurrent server (--max-clients). */
+IPERF_TLS int gerror;
 
-char iperf_timestrerr[100];
+IPERF_TLS char iperf_timestrerr[100];
 
 /* Do a printf to stderr. */
 void
@@ -44,14 +45,14 @@ iperf_err(struct iperf_test *test, const char *format, ...)
     va_list argp;
     char str[1000];
     time_t now;
-    struct tm *ltm = NULL;
+    struct tm ltm;
     char *ct = NULL;
 
     /* Timestamp if requested */
     if (test != NULL && test->timestamps) {
 	time(&now);
-	ltm = localtime(&now);
-	strftime(iperf_timestrerr, sizeof(iperf_timestrerr), test->timestamp_format, ltm);
+	localtime_r(&now, &ltm);
+	strftime(iperf_timestrerr, sizeof(iperf_timestrerr), test->timestamp_format, &ltm);
 	ct = iperf_timestrerr;
     }
 
@@ -82,14 +83,14 @@ iperf_errexit(struct iperf_test *test, const char *format, ...)
     va_list argp;
     char str[1000];
     time_t now;
-    struct tm *ltm = NULL;
+    struct tm ltm;
     char *ct = NULL;
 
     /* Timestamp if requested */
     if (test != NULL && test->timestamps) {
 	time(&now);
-	ltm = localtime(&now);
-	strftime(iperf_timestrerr, sizeof(iperf_timestrerr), "%c ", ltm);
+	localtime_r(&now, &ltm);
+	strftime(iperf_timestrerr, sizeof(iperf_timestrerr), "%c ", &ltm);
 	ct = iperf_timestrerr;
     }
 
@@ -117,12 +118,30 @@ iperf_errexit(struct iperf_test *test, const char *format, ...)
     exit(1);
 }
 
+#undef i_errno
 int i_errno;
 
+static IPERF_TLS int thread_errno;
+static IPERF_TLS int thread_has_errno;
+
+int *
+iperf_errno_location(void)
+{
+    return thread_has_errno ? &thread_errno : &i_errno;
+}
+
+/* From now on, i_errno in the calling thread is its own. */
+void
+iperf_errno_thread(void)
+{
+    thread_has_errno = 1;
+    thread_errno = IENONE;
+}
+
 char *
 iperf_strerror(int int_errno)
 {
-    static char errstr[256];
+    static IPERF_TLS char errstr[256];
     int len, perr, herr;
     perr = herr = 0;
 
@@ -200,6 +219,18 @@ iperf_strerror(int int_errno)
         case IEBURST:
             snprintf(errstr, len, "invalid burst count (maximum = %d)", MAX_BURST);
             break;
+        case IEUDPBATCH:
+            snprintf(errstr, len, "invalid UDP batch count (maximum = %d)", MAX_UDP_BATCH);
+            break;
+        case IEEVENTBACKEND:
+            snprintf(errstr, len, "unknown event backend (select or epoll)");
+            break;
+        case IEZEROCOPY:
+            snprintf(errstr, len, "unknown zerocopy method (z for MSG_ZEROCOPY)");
+            break;
+        case IEMAXCLIENTS:
+            snprintf(errstr, len, "number of concurrent clients too large (maximum = %d, with data ports below 65536)", MAX_CLIENTS);
+            break;
         case IEENDCONDITIONS:
             snprintf(errstr, len, "only one test end condition (-t, -n, -k) may be specified");
             break;
@@ -341,6 +372,21 @@ iperf_strerror(int int_errno)
             snprintf(errstr, len, "unable to set CPU affinity");
             perr = 1;
             break;
+        case IETHREAD:
+            snprintf(errstr, len, "unable to start stream thread");
+            perr = 1;
+            break;
+        case IEEVENT:
+            snprintf(errstr, len, "unable to watch socket for events");
+            perr = 1;
+            break;
+        case IESETZEROCOPY:
+            snprintf(errstr, len, "unable to set SO_ZEROCOPY");
+            perr = 1;
+            break;
+        case IEDATAPORT:
+            snprintf(errstr, len, "client too old for a server with --max-clients");
+            break;
 	case IEDAEMON:
 	    snprintf(errstr, len, "unable to become a daemon");
 	    perr = 1;
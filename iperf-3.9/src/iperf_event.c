@@ -0,0 +1,395 @@
+/*
+ * iperf, Copyright (c) 2014-2020, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject
+ * to receipt of any required approvals from the U.S. Dept. of
+ * Energy).  All rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this
+ * software, please contact Berkeley Lab's Technology Transfer
+ * Department at TTD@lbl.gov.
+ *
+ * NOTICE.  This software is owned by the U.S. Department of Energy.
+ * As such, the U.S. Government has been granted for itself and others
+ * acting on its behalf a paid-up, nonexclusive, irrevocable,
+ * worldwide license in the Software to reproduce, prepare derivative
+ * works, and perform publicly and display publicly.  Beginning five
+ * (5) years after the date permission to assert copyright is obtained
+ * from the U.S. Department of Energy, and subject to any subsequent
+ * five (5) year renewals, the U.S. Government is granted for itself
+ * and others acting on its behalf a paid-up, nonexclusive,
+ * irrevocable, worldwide license in the Software to reproduce,
+ * prepare derivative works, distribute copies to the public, perform
+ * publicly and display publicly, and to permit others to do so.
+ *
+ * This code is distributed under a BSD style license, see the LICENSE
+ * file for complete information.
+ */
+
+/*
+ * The sockets the client and server loops wait on.  With select() every
+ * wait costs time in proportion to the highest descriptor, and no
+ * descriptor may be FD_SETSIZE or above; with epoll the kernel keeps the
+ * list, and a wait costs only as much as the sockets which are ready.
+ *
+ * Both are driven the same way: iperf_event_watch() and
+ * iperf_event_unwatch() say what we want to hear about, iperf_event_wait()
+ * waits, and iperf_event_ready() says what it found.  Changes to what is
+ * watched are only passed to epoll at the next wait, so that a rate
+ * limited sender, which is watched for writing and then not many times
+ * a second, doesn't pay a system call for each change.
+ *
+ * The catch is that epoll forgets a socket when it is closed, so a new
+ * socket which gets the same number must not be mistaken for the old one:
+ * call iperf_event_forget() before closing anything which is watched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "iperf_config.h"
+
+#if defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#endif /* HAVE_EPOLL_CREATE1 */
+
+#include "iperf.h"
+#include "iperf_api.h"
+#include "iperf_event.h"
+
+#define EV_PENDING	0x80	/* in want: on the pending list */
+
+struct iperf_events {
+    int       backend;		/* IPERF_EVENTS_SELECT or IPERF_EVENTS_EPOLL */
+    int       epfd;
+    int       max_fd;
+    int       size;		/* entries in each of the arrays below */
+    unsigned char *want;	/* events asked for, by descriptor */
+    unsigned char *have;	/* events epoll has been given */
+    unsigned char *ready;	/* events found by the last wait */
+    int      *pending;		/* descriptors whose want has changed */
+    int       npending;
+    int      *fired;		/* descriptors with something in ready */
+    int       nfired;
+#if defined(HAVE_EPOLL_CREATE1)
+    struct epoll_event *evs;
+#endif /* HAVE_EPOLL_CREATE1 */
+};
+
+/* Map a --event-backend name to its IPERF_EVENTS_ value, or -1. */
+int
+iperf_event_backend(const char *name)
+{
+    if (strcmp(name, "select") == 0)
+	return IPERF_EVENTS_SELECT;
+    if (strcmp(name, "epoll") == 0)
+	return IPERF_EVENTS_EPOLL;
+    return -1;
+}
+
+const char *
+iperf_event_backend_name(struct iperf_test *test)
+{
+    int backend = test->events != NULL ? test->events->backend : test->event_backend;
+
+#if defined(HAVE_EPOLL_CREATE1)
+    if (backend == IPERF_EVENTS_DEFAULT)
+	backend = IPERF_EVENTS_EPOLL;
+#endif /* HAVE_EPOLL_CREATE1 */
+    return backend == IPERF_EVENTS_EPOLL ? "epoll" : "select";
+}
+
+static void
+iperf_events_free(struct iperf_events *ev)
+{
+    if (ev->epfd >= 0)
+	close(ev->epfd);
+    free(ev->want);
+    free(ev->have);
+    free(ev->ready);
+    free(ev->pending);
+    free(ev->fired);
+#if defined(HAVE_EPOLL_CREATE1)
+    free(ev->evs);
+#endif /* HAVE_EPOLL_CREATE1 */
+    free(ev);
+}
+
+static struct iperf_events *
+iperf_events_new(int backend)
+{
+    struct iperf_events *ev;
+
+    if ((ev = (struct iperf_events *) calloc(1, sizeof(*ev))) == NULL)
+	return NULL;
+    ev->epfd = -1;
+    ev->max_fd = -1;
+    ev->backend = IPERF_EVENTS_SELECT;
+
+#if defined(HAVE_EPOLL_CREATE1)
+    if (backend != IPERF_EVENTS_SELECT) {
+	if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0)
+	    ev->backend = IPERF_EVENTS_EPOLL;
+	else if (backend == IPERF_EVENTS_EPOLL) {
+	    free(ev);
+	    return NULL;
+	}
+    }
+#endif /* HAVE_EPOLL_CREATE1 */
+
+    return ev;
+}
+
+/* Make room for descriptor fd in the arrays. */
+static int
+iperf_events_grow(struct iperf_events *ev, int fd)
+{
+    int size = ev->size < 64 ? 64 : ev->size;
+    void *p;
+
+    while (size <= fd)
+	size *= 2;
+
+#define GROW(field, n)							\
+    do {								\
+	if ((p = realloc(ev->field, (n) * sizeof(*ev->field))) == NULL)	\
+	    return -1;							\
+	ev->field = p;							\
+    } while (0)
+
+    GROW(want, size);
+    GROW(have, size);
+    GROW(ready, size);
+    GROW(pending, size);
+    GROW(fired, size);
+#if defined(HAVE_EPOLL_CREATE1)
+    GROW(evs, size);
+#endif /* HAVE_EPOLL_CREATE1 */
+#undef GROW
+
+    memset(ev->want + ev->size, 0, size - ev->size);
+    memset(ev->have + ev->size, 0, size - ev->size);
+    memset(ev->ready + ev->size, 0, size - ev->size);
+    ev->size = size;
+    return 0;
+}
+
+/* Note that fd's events have changed, for the next epoll wait. */
+static void
+iperf_events_touch(struct iperf_events *ev, int fd)
+{
+    if (ev->backend == IPERF_EVENTS_EPOLL && !(ev->want[fd] & EV_PENDING)) {
+	ev->want[fd] |= EV_PENDING;
+	ev->pending[ev->npending++] = fd;
+    }
+}
+
+int
+iperf_event_watch(struct iperf_test *test, int fd, int events)
+{
+    struct iperf_events *ev;
+
+    if (test->events == NULL) {
+	if ((test->events = iperf_events_new(test->event_backend)) == NULL) {
+	    i_errno = IEEVENT;
+	    return -1;
+	}
+	if (test->debug)
+	    printf("Waiting for events with %s\n", iperf_event_backend_name(test));
+    }
+    ev = test->events;
+
+    if (fd < 0 || (ev->backend == IPERF_EVENTS_SELECT && fd >= FD_SETSIZE)) {
+	errno = EINVAL;
+	i_errno = IEEVENT;
+	return -1;
+    }
+    if (fd >= ev->size && iperf_events_grow(ev, fd) < 0) {
+	i_errno = IEEVENT;
+	return -1;
+    }
+
+    if ((ev->want[fd] & events) != events) {
+	ev->want[fd] |= events;
+	iperf_events_touch(ev, fd);
+    }
+    if (fd > ev->max_fd)
+	ev->max_fd = fd;
+    return 0;
+}
+
+void
+iperf_event_unwatch(struct iperf_test *test, int fd, int events)
+{
+    struct iperf_events *ev = test->events;
+
+    if (ev == NULL || fd < 0 || fd >= ev->size || !(ev->want[fd] & events))
+	return;
+    ev->want[fd] &= ~events;
+    ev->ready[fd] &= ~events;
+    iperf_events_touch(ev, fd);
+}
+
+/* Stop watching fd at once, before it is closed. */
+void
+iperf_event_forget(struct iperf_test *test, int fd)
+{
+    struct iperf_events *ev = test->events;
+
+    if (ev == NULL || fd < 0 || fd >= ev->size)
+	return;
+#if defined(HAVE_EPOLL_CREATE1)
+    if (ev->have[fd] != 0)
+	(void) epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif /* HAVE_EPOLL_CREATE1 */
+    /* Left on the pending list if it was, but with nothing to do. */
+    ev->want[fd] &= EV_PENDING;
+    ev->have[fd] = 0;
+    ev->ready[fd] = 0;
+}
+
+#if defined(HAVE_EPOLL_CREATE1)
+/* Give epoll the changes made since the last wait. */
+static int
+iperf_events_flush(struct iperf_events *ev)
+{
+    struct epoll_event e;
+    int i, fd, want, r;
+
+    for (i = 0; i < ev->npending; i++) {
+	fd = ev->pending[i];
+	if (!(ev->want[fd] & EV_PENDING))
+	    continue;
+	want = ev->want[fd] &= ~EV_PENDING;
+	if (want == ev->have[fd])
+	    continue;
+
+	if (want == 0)
+	    r = epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT && errno != EBADF ? -1 : 0;
+	else {
+	    memset(&e, 0, sizeof(e));
+	    e.events = ((want & IPERF_EV_READ) ? EPOLLIN : 0) | ((want & IPERF_EV_WRITE) ? EPOLLOUT : 0);
+	    e.data.fd = fd;
+	    r = epoll_ctl(ev->epfd, ev->have[fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &e);
+	    if (r < 0 && errno == ENOENT)
+		r = epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e);
+	    else if (r < 0 && errno == EEXIST)
+		r = epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &e);
+	}
+	if (r < 0) {
+	    ev->want[fd] |= EV_PENDING;
+	    memmove(ev->pending, ev->pending + i, (ev->npending - i) * sizeof(int));
+	    ev->npending -= i;
+	    return -1;
+	}
+	ev->have[fd] = want;
+    }
+    ev->npending = 0;
+    return 0;
+}
+#endif /* HAVE_EPOLL_CREATE1 */
+
+static void
+iperf_events_fire(struct iperf_events *ev, int fd, int events)
+{
+    events &= ev->want[fd];
+    if (events == 0)
+	return;
+    if (ev->ready[fd] == 0)
+	ev->fired[ev->nfired++] = fd;
+    ev->ready[fd] |= events;
+}
+
+/* Wait for something watched to be ready, or for the timeout.  Returns
+** like select(): the number of descriptors ready, 0 on timeout, or -1.
+*/
+int
+iperf_event_wait(struct iperf_test *test, struct timeval *timeout)
+{
+    struct iperf_events *ev = test->events;
+    int i, n;
+
+    if (ev == NULL)
+	return select(0, NULL, NULL, NULL, timeout);
+
+    for (i = 0; i < ev->nfired; i++)
+	ev->ready[ev->fired[i]] = 0;
+    ev->nfired = 0;
+
+#if defined(HAVE_EPOLL_CREATE1)
+    if (ev->backend == IPERF_EVENTS_EPOLL) {
+	int ms = -1;
+
+	if (iperf_events_flush(ev) < 0)
+	    return -1;
+	if (ev->size == 0 && iperf_events_grow(ev, 0) < 0)
+	    return -1;
+	/* Round up, or a timer due in under a millisecond would spin. */
+	if (timeout != NULL)
+	    ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+	if ((n = epoll_wait(ev->epfd, ev->evs, ev->size, ms)) <= 0)
+	    return n;
+	for (i = 0; i < n; i++) {
+	    uint32_t e = ev->evs[i].events;
+
+	    /* As select() would, count errors and hangups as readiness. */
+	    iperf_events_fire(ev, ev->evs[i].data.fd,
+			      ((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? IPERF_EV_READ : 0) |
+			      ((e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ? IPERF_EV_WRITE : 0));
+	}
+	return ev->nfired;
+    }
+#endif /* HAVE_EPOLL_CREATE1 */
+
+    {
+	fd_set read_set, write_set;
+	int fd;
+
+	FD_ZERO(&read_set);
+	FD_ZERO(&write_set);
+	for (fd = 0; fd <= ev->max_fd; fd++) {
+	    if (ev->want[fd] & IPERF_EV_READ)
+		FD_SET(fd, &read_set);
+	    if (ev->want[fd] & IPERF_EV_WRITE)
+		FD_SET(fd, &write_set);
+	}
+	if ((n = select(ev->max_fd + 1, &read_set, &write_set, NULL, timeout)) <= 0)
+	    return n;
+	for (fd = 0; fd <= ev->max_fd; fd++)
+	    iperf_events_fire(ev, fd,
+			      (FD_ISSET(fd, &read_set) ? IPERF_EV_READ : 0) |
+			      (FD_ISSET(fd, &write_set) ? IPERF_EV_WRITE : 0));
+	return ev->nfired;
+    }
+}
+
+/* Did the last wait find fd ready for any of events? */
+int
+iperf_event_ready(struct iperf_test *test, int fd, int events)
+{
+    struct iperf_events *ev = test->events;
+
+    return ev != NULL && fd >= 0 && fd < ev->size && (ev->ready[fd] & events) != 0;
+}
+
+/* Mark events on fd as dealt with until the next wait. */
+void
+iperf_event_clear(struct iperf_test *test, int fd, int events)
+{
+    struct iperf_events *ev = test->events;
+
+    if (ev != NULL && fd >= 0 && fd < ev->size)
+	ev->ready[fd] &= ~events;
+}
+
+/* Forget everything, for a new test. */
+void
+iperf_event_reset(struct iperf_test *test)
+{
+    if (test->events != NULL) {
+	iperf_events_free(test->events);
+	test->events = NULL;
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * iperf, Copyright (c) 2014-2020, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject
+ * to receipt of any required approvals from the U.S. Dept. of
+ * Energy).  All rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this
+ * software, please contact Berkeley Lab's Technology Transfer
+ * Department at TTD@lbl.gov.
+ *
+ * NOTICE.  This software is owned by the U.S. Department of Energy.
+ * As such, the U.S. Government has been granted for itself and others
+ * acting on its behalf a paid-up, nonexclusive, irrevocable,
+ * worldwide license in the Software to reproduce, prepare derivative
+ * works, and perform publicly and display publicly.  Beginning five
+ * (5) years after the date permission to assert copyright is obtained
+ * from the U.S. Department of Energy, and subject to any subsequent
+ * five (5) year renewals, the U.S. Government is granted for itself
+ * and others acting on its behalf a paid-up, nonexclusive,
+ * irrevocable, worldwide license in the Software to reproduce,
+ * prepare derivative works, distribute copies to the public, perform
+ * publicly and display publicly, and to permit others to do so.
+ *
+ * This code is distributed under a BSD style license, see the LICENSE
+ * file for complete information.
+ */
+#ifndef __IPERF_EVENT_H
+#define __IPERF_EVENT_H
+
+#include <sys/time.h>
+
+struct iperf_test;
+
+/* What a socket can be watched for. */
+#define IPERF_EV_READ	1
+#define IPERF_EV_WRITE	2
+
+/* How the main loop waits, for --event-backend. */
+#define IPERF_EVENTS_DEFAULT	0	/* epoll where there is one, else select */
+#define IPERF_EVENTS_SELECT	1
+#define IPERF_EVENTS_EPOLL	2
+
+int iperf_event_backend(const char *name);
+
+const char *iperf_event_backend_name(struct iperf_test *test);
+
+int iperf_event_watch(struct iperf_test *test, int fd, int events);
+
+void iperf_event_unwatch(struct iperf_test *test, int fd, int events);
+
+void iperf_event_forget(struct iperf_test *test, int fd);
+
+int iperf_event_wait(struct iperf_test *test, struct timeval *timeout);
+
+int iperf_event_ready(struct iperf_test *test, int fd, int events);
+
+void iperf_event_clear(struct iperf_test *test, int fd, int events);
+
+void iperf_event_reset(struct iperf_test *test);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * iperf, Copyright (c) 2014-2020, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject
+ * to receipt of any required approvals from the U.S. Dept. of
+ * Energy).  All rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this
+ * software, please contact Berkeley Lab's Technology Transfer
+ * Department at TTD@lbl.gov.
+ *
+ * NOTICE.  This software is owned by the U.S. Department of Energy.
+ * As such, the U.S. Government has been granted for itself and others
+ * acting on its behalf a paid-up, nonexclusive, irrevocable,
+ * worldwide license in the Software to reproduce, prepare derivative
+ * works, and perform publicly and display publicly.  Beginning five
+ * (5) years after the date permission to assert copyright is obtained
+ * from the U.S. Department of Energy, and subject to any subsequent
+ * five (5) year renewals, the U.S. Government is granted for itself
+ * and others acting on its behalf a paid-up, nonexclusive,
+ * irrevocable, worldwide license in the Software to reproduce,
+ * prepare derivative works, distribute copies to the public, perform
+ * publicly and display publicly, and to permit others to do so.
+ *
+ * This code is distributed under a BSD style license, see the LICENSE
+ * file for complete information.
+ */
+/*
+ * One-way latency histograms for --latency.  Like an HDR histogram, each
+ * power of two of microseconds is split into LATENCY_SUB buckets, so a
+ * histogram has a fixed size, recording a latency costs a few shifts, and
+ * any percentile is good to a few percent however long the test runs.
+ *
+ * The receiver of each stream keeps the histogram, and passes it to the
+ * sender with the results, as the buckets which aren't empty.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "iperf_config.h"
+
+#include "iperf_latency.h"
+
+static int
+bucket_of(uint64_t v)
+{
+    int m;
+
+    if (v >= (uint64_t) 1 << LATENCY_MAX_BITS)
+	v = ((uint64_t) 1 << LATENCY_MAX_BITS) - 1;
+    if (v < 2 * LATENCY_SUB)
+	return (int) v;
+    for (m = LATENCY_SUB_BITS + 1; (v >> (m + 1)) != 0; m++)
+	;
+    m -= LATENCY_SUB_BITS;
+    return m * LATENCY_SUB + (int) (v >> m);
+}
+
+/* The lowest latency in bucket i, and how many it covers. */
+static void
+bucket_range(int i, uint64_t *low, uint64_t *width)
+{
+    int shift;
+
+    if (i < 2 * LATENCY_SUB) {
+	*low = i;
+	*width = 1;
+	return;
+    }
+    shift = i / LATENCY_SUB - 1;
+    *low = (uint64_t) (i - shift * LATENCY_SUB) << shift;
+    *width = (uint64_t) 1 << shift;
+}
+
+void
+iperf_latency_record(struct iperf_latency *h, int64_t usecs, int stamps)
+{
+    uint64_t v;
+
+    /* Only clocks out of step can make a datagram arrive before it left. */
+    if (usecs < 0) {
+	h->negative++;
+	usecs = 0;
+    }
+    v = usecs;
+    if (h->count == 0 || v < h->min)
+	h->min = v;
+    if (v > h->max)
+	h->max = v;
+    h->sum += v;
+    h->count++;
+    h->buckets[bucket_of(v)]++;
+    if (stamps > h->stamps)
+	h->stamps = stamps;
+}
+
+void
+iperf_latency_merge(struct iperf_latency *h, const struct iperf_latency *from)
+{
+    int i;
+
+    if (from->count == 0)
+	return;
+    if (h->count == 0 || from->min < h->min)
+	h->min = from->min;
+    if (from->max > h->max)
+	h->max = from->max;
+    h->sum += from->sum;
+    h->count += from->count;
+    h->negative += from->negative;
+    if (from->stamps > h->stamps)
+	h->stamps = from->stamps;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+	h->buckets[i] += from->buckets[i];
+}
+
+/* The latency which percent of those recorded are at or below, in
+** microseconds, as the middle of the bucket it falls in.
+*/
+double
+iperf_latency_percentile(const struct iperf_latency *h, double percent)
+{
+    uint64_t rank, seen = 0, low, width;
+    double v;
+    int i;
+
+    if (h->count == 0)
+	return 0.0;
+    rank = (uint64_t) ceil(h->count * percent / 100.0);
+    if (rank < 1)
+	rank = 1;
+    if (rank >= h->count)
+	return h->max;
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+	seen += h->buckets[i];
+	if (seen >= rank)
+	    break;
+    }
+    bucket_range(i, &low, &width);
+    v = low + (width - 1) / 2.0;
+    if (v < h->min)
+	v = h->min;
+    if (v > h->max)
+	v = h->max;
+    return v;
+}
+
+double
+iperf_latency_mean(const struct iperf_latency *h)
+{
+    return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+const char *
+iperf_latency_stamps_name(int stamps)
+{
+    switch (stamps) {
+	case LATENCY_STAMP_HARDWARE:
+	return "hardware";
+	case LATENCY_STAMP_KERNEL:
+	return "kernel";
+	default:
+	return "user";
+    }
+}
+
+cJSON *
+iperf_latency_to_json(const struct iperf_latency *h)
+{
+    cJSON *j, *b;
+    int i;
+
+    j = cJSON_CreateObject();
+    b = cJSON_CreateArray();
+    if (j == NULL || b == NULL) {
+	cJSON_Delete(j);
+	cJSON_Delete(b);
+	return NULL;
+    }
+    cJSON_AddNumberToObject(j, "count", h->count);
+    cJSON_AddNumberToObject(j, "negative", h->negative);
+    cJSON_AddNumberToObject(j, "min", h->min);
+    cJSON_AddNumberToObject(j, "max", h->max);
+    cJSON_AddNumberToObject(j, "sum", h->sum);
+    cJSON_AddNumberToObject(j, "stamps", h->stamps);
+    /* Bucket number, count, for each bucket with anything in it. */
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+	if (h->buckets[i] != 0) {
+	    cJSON_AddItemToArray(b, cJSON_CreateNumber(i));
+	    cJSON_AddItemToArray(b, cJSON_CreateNumber(h->buckets[i]));
+	}
+    cJSON_AddItemToObject(j, "buckets", b);
+    return j;
+}
+
+int
+iperf_latency_from_json(struct iperf_latency *h, cJSON *j)
+{
+    cJSON *j_count, *j_negative, *j_min, *j_max, *j_sum, *j_stamps, *j_buckets, *b;
+    int i;
+
+    j_count = cJSON_GetObjectItem(j, "count");
+    j_negative = cJSON_GetObjectItem(j, "negative");
+    j_min = cJSON_GetObjectItem(j, "min");
+    j_max = cJSON_GetObjectItem(j, "max");
+    j_sum = cJSON_GetObjectItem(j, "sum");
+    j_stamps = cJSON_GetObjectItem(j, "stamps");
+    j_buckets = cJSON_GetObjectItem(j, "buckets");
+    if (j_count == NULL || j_negative == NULL || j_min == NULL || j_max == NULL ||
+	j_sum == NULL || j_stamps == NULL || j_buckets == NULL)
+	return -1;
+
+    memset(h, 0, sizeof(*h));
+    h->count = j_count->valuedouble;
+    h->negative = j_negative->valuedouble;
+    h->min = j_min->valuedouble;
+    h->max = j_max->valuedouble;
+    h->sum = j_sum->valuedouble;
+    h->stamps = j_stamps->valueint;
+    for (b = j_buckets->child; b != NULL && b->next != NULL; b = b->next->next) {
+	i = b->valueint;
+	if (i < 0 || i >= LATENCY_BUCKETS)
+	    return -1;
+	h->buckets[i] = b->next->valuedouble;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * iperf, Copyright (c) 2014-2020, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject
+ * to receipt of any required approvals from the U.S. Dept. of
+ * Energy).  All rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this
+ * software, please contact Berkeley Lab's Technology Transfer
+ * Department at TTD@lbl.gov.
+ *
+ * NOTICE.  This software is owned by the U.S. Department of Energy.
+ * As such, the U.S. Government has been granted for itself and others
+ * acting on its behalf a paid-up, nonexclusive, irrevocable,
+ * worldwide license in the Software to reproduce, prepare derivative
+ * works, and perform publicly and display publicly.  Beginning five
+ * (5) years after the date permission to assert copyright is obtained
+ * from the U.S. Department of Energy, and subject to any subsequent
+ * five (5) year renewals, the U.S. Government is granted for itself
+ * and others acting on its behalf a paid-up, nonexclusive,
+ * irrevocable, worldwide license in the Software to reproduce,
+ * prepare derivative works, distribute copies to the public, perform
+ * publicly and display publicly, and to permit others to do so.
+ *
+ * This code is distributed under a BSD style license, see the LICENSE
+ * file for complete information.
+ */
+#ifndef __IPERF_LATENCY_H
+#define __IPERF_LATENCY_H
+
+#include <stdint.h>
+
+#include "cjson.h"
+
+/*
+ * Latencies are kept in microseconds, exactly below 2 * LATENCY_SUB and
+ * to within one part in LATENCY_SUB above that, up to 2^LATENCY_MAX_BITS.
+ */
+#define LATENCY_SUB_BITS	5
+#define LATENCY_SUB		(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS	32
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/* Where receive times came from, worst first. */
+#define LATENCY_STAMP_USER	0	/* read the clock after the datagram */
+#define LATENCY_STAMP_KERNEL	1	/* SO_TIMESTAMPING software stamp */
+#define LATENCY_STAMP_HARDWARE	2	/* SO_TIMESTAMPING raw hardware stamp */
+
+/* A histogram of one-way latencies, for --latency. */
+struct iperf_latency {
+    uint64_t  count;
+    uint64_t  negative;		/* stamped as arriving before being sent */
+    uint64_t  min, max, sum;
+    int       stamps;		/* the best LATENCY_STAMP_* seen */
+    uint64_t  buckets[LATENCY_BUCKETS];
+};
+
+void iperf_latency_record(struct iperf_latency *h, int64_t usecs, int stamps);
+
+void iperf_latency_merge(struct iperf_latency *h, const struct iperf_latency *from);
+
+double iperf_latency_percentile(const struct iperf_latency *h, double percent);
+
+double iperf_latency_mean(const struct iperf_latency *h);
+
+const char *iperf_latency_stamps_name(int stamps);
+
+cJSON *iperf_latency_to_json(const struct iperf_latency *h);
+
+int iperf_latency_from_json(struct iperf_latency *h, cJSON *j);
+
+#endif
@@ -104,9 +104,19 @@ const char usage_longstr[] = "Usage: iperf3 [-s|-c host] [options]\n"
 #if defined(HAVE_CPU_AFFINITY)
                            "  -A, --affinity n/n,m      set CPU affinity\n"
 #endif /* HAVE_CPU_AFFINITY */
+#if defined(HAVE_PTHREAD)
+                           "  --threads [n,m,...]       run each stream in its own thread,\n"
+                           "                            optionally bound to CPUs n,m,... in turn\n"
+#endif /* HAVE_PTHREAD */
+#if defined(HAVE_EPOLL_CREATE1)
+                           "  --event-backend {select|epoll}\n"
+                           "                            how to wait for sockets (default epoll)\n"
+#endif /* HAVE_EPOLL_CREATE1 */
                            "  -B, --bind      <host>    bind to the interface associated with the address <host>\n"
                            "  -V, --verbose             more detailed output\n"
                            "  -J, --json                output in JSON format\n"
+                           "  --json-stream             output in JSON format, a line for each interval\n"
+                           "                            as it is reported, and for each other part\n"
                            "  --logfile f               send output to a log file\n"
                            "  --forceflush              force flushing output at every interval\n"
                            "  --timestamps    <format>  emit a timestamp at the start of each output line\n"
@@ -120,6 +130,10 @@ const char usage_longstr[] = "Usage: iperf3 [-s|-c host] [options]\n"
                            "  -D, --daemon              run the server as a daemon\n"
                            "  -I, --pidfile file        write PID file\n"
                            "  -1, --one-off             handle one client connection then exit\n"
+#if defined(HAVE_PTHREAD)
+                           "  --max-clients #           run up to # tests at once, each with its data\n"
+                           "                            streams on its own port above -p\n"
+#endif /* HAVE_PTHREAD */
 			   "  --server-bitrate-limit #[KMG][/#]   server's total bit rate limit (default 0 = no limit)\n"
 			   "                            (optional slash and number of secs interval for averaging\n"
 			   "                            total data rate.  Default is 5 seconds)\n"
@@ -174,12 +188,18 @@ const char usage_longstr[] = "Usage: iperf3 [-s|-c host] [options]\n"
 #if defined(HAVE_FLOWLABEL)
                            "  -L, --flowlabel N         set the IPv6 flow label (only supported on Linux)\n"
 #endif /* HAVE_FLOWLABEL */
-                           "  -Z, --zerocopy            use a 'zero copy' method of sending data\n"
+                           "  -Z, --zerocopy[=z]        use a 'zero copy' method of sending data:\n"
+                           "                            sendfile(2), or MSG_ZEROCOPY sends with =z\n"
                            "  -O, --omit N              omit the first n seconds\n"
                            "  -T, --title str           prefix every output line with this string\n"
                            "  --extra-data str          data string to include in client and server JSON\n"
                            "  --get-server-output       get results from server\n"
                            "  --udp-counters-64bit      use 64-bit counters in UDP test packets\n"
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+                           "  --udp-batch #             send and receive UDP datagrams # at a time\n"
+                           "  --latency                 measure one-way UDP latency (p50/p99/p99.9);\n"
+                           "                            needs the clocks of both hosts in step\n"
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
                            "  --repeating-payload       use repeating pattern in payload, instead of\n"
                            "                            randomized payload (like in iperf2)\n"
 #if defined(HAVE_SSL)
@@ -412,6 +432,18 @@ const char reportCSV_peer[] =
 const char report_cpu[] =
 "CPU Utilization: %s/%s %.1f%% (%.1f%%u/%.1f%%s), %s/%s %.1f%% (%.1f%%u/%.1f%%s)\n";
 
+const char report_latency[] =
+"[%3d]%s latency  p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  min/mean/max %.3f/%.3f/%.3f ms  (%s timestamps)\n";
+
+const char report_sum_latency[] =
+"[SUM]%s latency  p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  min/mean/max %.3f/%.3f/%.3f ms  (%s timestamps)\n";
+
+const char report_latency_skewed[] =
+"%s%llu datagrams arrived before they were sent: are the clocks in step?\n";
+
+const char report_zerocopy[] =
+"MSG_ZEROCOPY sends: %llu, %llu zero-copy, %llu copied, %llu unconfirmed\n";
+
 const char report_local[] = "local";
 const char report_remote[] = "remote";
 const char report_sender[] = "sender";
@@ -96,6 +96,10 @@ extern const char server_reporting[] ;
 extern const char reportCSV_peer[] ;
 
 extern const char report_cpu[] ;
+extern const char report_latency[] ;
+extern const char report_sum_latency[] ;
+extern const char report_latency_skewed[] ;
+extern const char report_zerocopy[] ;
 extern const char report_local[] ;
 extern const char report_remote[] ;
 extern const char report_sender[] ;
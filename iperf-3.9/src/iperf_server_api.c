@@ -47,6 +47,7 @@
 #include <sys/resource.h>
 #include <sched.h>
 #include <setjmp.h>
+#include <signal.h>
 
 #include "iperf.h"
 #include "iperf_api.h"
@@ -86,18 +87,45 @@ iperf_server_listen(struct iperf_test *test)
 	}
     }
 
-    if (!test->json_output) {
+    if (!test->json_output && !test->concurrent) {
 	iperf_printf(test, "-----------------------------------------------------------\n");
-	iperf_printf(test, "Server listening on %d\n", test->server_port);
+	if (test->max_clients > 0)
+	    iperf_printf(test, "Server listening on %d, data ports %d-%d\n", test->server_port,
+			 test->server_port + 1, test->server_port + test->max_clients);
+	else
+	    iperf_printf(test, "Server listening on %d\n", test->server_port);
 	iperf_printf(test, "-----------------------------------------------------------\n");
 	if (test->forceflush)
 	    iflush(test);
     }
 
-    FD_ZERO(&test->read_set);
-    FD_ZERO(&test->write_set);
-    FD_SET(test->listener, &test->read_set);
-    if (test->listener > test->max_fd) test->max_fd = test->listener;
+    iperf_event_reset(test);
+    if (iperf_event_watch(test, test->listener, IPERF_EV_READ) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Start the test of the client on test->ctrl_sck. */
+static int
+iperf_accept_client(struct iperf_test *test)
+{
+    if (Nread(test->ctrl_sck, test->cookie, COOKIE_SIZE, Ptcp) < 0) {
+        i_errno = IERECVCOOKIE;
+        return -1;
+    }
+    if (iperf_event_watch(test, test->ctrl_sck, IPERF_EV_READ) < 0)
+	return -1;
+
+    if (iperf_set_send_state(test, PARAM_EXCHANGE) != 0)
+        return -1;
+    if (iperf_exchange_parameters(test) < 0)
+        return -1;
+    if (test->server_affinity != -1) 
+	if (iperf_setaffinity(test, test->server_affinity) != 0)
+	    return -1;
+    if (test->on_connect)
+        test->on_connect(test);
 
     return 0;
 }
@@ -119,22 +147,8 @@ iperf_accept(struct iperf_test *test)
     if (test->ctrl_sck == -1) {
         /* Server free, accept new client */
         test->ctrl_sck = s;
-        if (Nread(test->ctrl_sck, test->cookie, COOKIE_SIZE, Ptcp) < 0) {
-            i_errno = IERECVCOOKIE;
-            return -1;
-        }
-	FD_SET(test->ctrl_sck, &test->read_set);
-	if (test->ctrl_sck > test->max_fd) test->max_fd = test->ctrl_sck;
-
-	if (iperf_set_send_state(test, PARAM_EXCHANGE) != 0)
+        if (iperf_accept_client(test) < 0)
             return -1;
-        if (iperf_exchange_parameters(test) < 0)
-            return -1;
-	if (test->server_affinity != -1) 
-	    if (iperf_setaffinity(test, test->server_affinity) != 0)
-		return -1;
-        if (test->on_connect)
-            test->on_connect(test);
     } else {
 	/*
 	 * Don't try to read from the socket.  It could block an ongoing test. 
@@ -175,12 +189,13 @@ iperf_handle_message_server(struct iperf_test *test)
         case TEST_START:
             break;
         case TEST_END:
+	    if (iperf_stop_stream_threads(test) < 0)
+		return -1;
 	    test->done = 1;
             cpu_util(test->cpu_util);
             test->stats_callback(test);
             SLIST_FOREACH(sp, &test->streams, streams) {
-                FD_CLR(sp->socket, &test->read_set);
-                FD_CLR(sp->socket, &test->write_set);
+                iperf_event_forget(test, sp->socket);
                 close(sp->socket);
             }
             test->reporter_callback(test);
@@ -201,6 +216,7 @@ iperf_handle_message_server(struct iperf_test *test)
 	    // Temporarily be in DISPLAY_RESULTS phase so we can get
 	    // ending summary statistics.
 	    signed char oldstate = test->state;
+	    (void) iperf_stop_stream_threads(test);
 	    cpu_util(test->cpu_util);
 	    test->state = DISPLAY_RESULTS;
 	    test->reporter_callback(test);
@@ -209,8 +225,7 @@ iperf_handle_message_server(struct iperf_test *test)
             // XXX: Remove this line below!
 	    iperf_err(test, "the client has terminated");
             SLIST_FOREACH(sp, &test->streams, streams) {
-                FD_CLR(sp->socket, &test->read_set);
-                FD_CLR(sp->socket, &test->write_set);
+                iperf_event_forget(test, sp->socket);
                 close(sp->socket);
             }
             test->state = IPERF_DONE;
@@ -233,6 +248,7 @@ server_timer_proc(TimerClientData client_data, struct iperf_time *nowP)
     if (test->done)
         return;
     test->done = 1;
+    (void) iperf_stop_stream_threads(test);
     /* Free streams */
     while (!SLIST_EMPTY(&test->streams)) {
         sp = SLIST_FIRST(&test->streams);
@@ -356,10 +372,11 @@ cleanup_server(struct iperf_test *test)
 {
     struct iperf_stream *sp;
 
+    (void) iperf_stop_stream_threads(test);
+
     /* Close open streams */
     SLIST_FOREACH(sp, &test->streams, streams) {
-	FD_CLR(sp->socket, &test->read_set);
-	FD_CLR(sp->socket, &test->write_set);
+	iperf_event_forget(test, sp->socket);
 	close(sp->socket);
     }
 
@@ -392,7 +409,252 @@ cleanup_server(struct iperf_test *test)
         tmr_cancel(test->timer);
         test->timer = NULL;
     }
+    iperf_free_send_timers(test);
+}
+
+/* Set streams number */
+static void
+server_stream_counts(struct iperf_test *test, int *streams_to_send, int *streams_to_rec)
+{
+    if (test->mode == BIDIRECTIONAL) {
+        *streams_to_send = test->num_streams;
+        *streams_to_rec = test->num_streams;
+    } else if (test->mode == RECEIVER) {
+        *streams_to_rec = test->num_streams;
+        *streams_to_send = 0;
+    } else {
+        *streams_to_send = test->num_streams;
+        *streams_to_rec = 0;
+    }
+}
+
+
+/**************************************************************************/
+
+/*
+ * --max-clients: run that many tests at once, each with a struct
+ * iperf_test and a thread of its own.  The listener on -p only takes
+ * control connections.  The test in slot n listens on -p + 1 + n, and
+ * moves its client there (DATA_PORT) before the streams are made, so no
+ * test ever sees the connections or datagrams of another.  Timers,
+ * i_errno and the like are per thread.
+ */
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_THREAD_LOCAL)
+struct server_slot {
+    struct iperf_test *test;	/* NULL if the slot is free */
+    pthread_t thread;
+    int index;
+    int done_fd;		/* the dispatcher reads our index here when we finish */
+};
+
+/* Tell a client handed over by the dispatcher why its test can't start. */
+static void
+server_refuse(struct iperf_test *test)
+{
+    int32_t err[2];
+    int saved_errno = i_errno;
+
+    err[0] = htonl(i_errno);
+    err[1] = htonl(errno);
+    if (iperf_set_send_state(test, SERVER_ERROR) == 0)
+	(void) Nwrite(test->ctrl_sck, (char*) err, sizeof(err), Ptcp);
+    close(test->ctrl_sck);
+    i_errno = saved_errno;
+}
+
+static void *
+server_slot_run(void *arg)
+{
+    struct server_slot *slot = arg;
+
+    iperf_errno_thread();
+    if (iperf_run_server(slot->test) < 0)
+	iperf_err(slot->test, "error - %s", iperf_strerror(i_errno));
+    (void) Nwrite(slot->done_fd, (char*) &slot->index, sizeof(slot->index), Ptcp);
+    return NULL;
+}
+
+/* A test for the client on s, with the server's own settings. */
+static struct iperf_test *
+server_slot_test(struct iperf_test *test, int s, int port)
+{
+    struct iperf_test *t;
+
+    if ((t = iperf_new_test()) == NULL)
+	return NULL;
+    iperf_defaults(t);
+    iperf_set_test_role(t, 's');
+    t->concurrent = 1;
+    t->server_port = port;
+    t->ctrl_sck = s;
+
+    t->settings->domain = test->settings->domain;
+    t->settings->unit_format = test->settings->unit_format;
+    t->settings->bitrate_limit = test->settings->bitrate_limit;
+    t->settings->bitrate_limit_interval = test->settings->bitrate_limit_interval;
+    t->settings->bitrate_limit_stats_per_interval = test->settings->bitrate_limit_stats_per_interval;
+    if (test->bind_address)
+	t->bind_address = strdup(test->bind_address);
+    t->diskfile_name = test->diskfile_name;
+    t->stats_interval = test->stats_interval;
+    t->reporter_interval = test->reporter_interval;
+    t->verbose = test->verbose;
+    t->json_output = test->json_output;
+    t->json_stream = test->json_stream;
+    t->debug = test->debug;
+    t->forceflush = test->forceflush;
+    t->udp_counters_64bit = test->udp_counters_64bit;
+    t->timestamps = test->timestamps;
+    if (test->timestamp_format)
+	t->timestamp_format = strdup(test->timestamp_format);
+    t->event_backend = test->event_backend;
+    t->threads = test->threads;
+    if (test->thread_ncpus > 0 &&
+	(t->thread_cpus = (int *) malloc(test->thread_ncpus * sizeof(int))) != NULL) {
+	memcpy(t->thread_cpus, test->thread_cpus, test->thread_ncpus * sizeof(int));
+	t->thread_ncpus = test->thread_ncpus;
+    }
+    /* Borrowed: the server's logfile, if any, stays open for the next test. */
+    t->outfile = test->outfile;
+#if defined(HAVE_SSL)
+    t->server_authorized_users = test->server_authorized_users;
+    t->server_rsa_private_key = test->server_rsa_private_key;
+#endif /* HAVE_SSL */
+
+    return t;
+}
+
+static void
+server_slot_free(struct server_slot *slot)
+{
+#if defined(HAVE_SSL)
+    slot->test->server_rsa_private_key = NULL;
+#endif /* HAVE_SSL */
+    iperf_free_test(slot->test);
+    slot->test = NULL;
+}
+
+static int
+iperf_run_concurrent_server(struct iperf_test *test)
+{
+    struct server_slot *slots;
+    sigset_t mask, saved;
+    signed char rbuf = ACCESS_DENIED;
+    int done[2], i, s, err, running = 0, accepting = 1, result = 0;
+
+    if (test->server_port + test->max_clients > 65535) {
+	i_errno = IEMAXCLIENTS;
+	return -2;
+    }
+    if (iperf_server_listen(test) < 0)
+	return -2;
+    if (pipe(done) < 0) {
+	i_errno = IEINITTEST;
+	return -2;
+    }
+    if ((slots = (struct server_slot *) calloc(test->max_clients, sizeof(*slots))) == NULL) {
+	i_errno = IEINITTEST;
+	result = -2;
+	goto cleanup;
+    }
+    if (iperf_event_watch(test, done[0], IPERF_EV_READ) < 0) {
+	result = -2;
+	goto cleanup;
+    }
+
+    /* Termination signals are for this thread alone. */
+    sigemptyset(&mask);
+#ifdef SIGINT
+    sigaddset(&mask, SIGINT);
+#endif
+#ifdef SIGTERM
+    sigaddset(&mask, SIGTERM);
+#endif
+#ifdef SIGHUP
+    sigaddset(&mask, SIGHUP);
+#endif
+
+    while (accepting || running > 0) {
+	if (iperf_event_wait(test, NULL) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    i_errno = IESELECT;
+	    result = -2;
+	    break;
+	}
+
+	if (iperf_event_ready(test, done[0], IPERF_EV_READ)) {
+	    if (Nread(done[0], (char*) &i, sizeof(i), Ptcp) == sizeof(i)) {
+		pthread_join(slots[i].thread, NULL);
+		server_slot_free(&slots[i]);
+		--running;
+	    }
+	    iperf_event_clear(test, done[0], IPERF_EV_READ);
+	}
+
+	if (!accepting || !iperf_event_ready(test, test->listener, IPERF_EV_READ))
+	    continue;
+	iperf_event_clear(test, test->listener, IPERF_EV_READ);
+	if ((s = accept(test->listener, NULL, NULL)) < 0) {
+	    i_errno = IEACCEPT;
+	    iperf_err(test, "error - %s", iperf_strerror(i_errno));
+	    continue;
+	}
+
+	for (i = 0; i < test->max_clients && slots[i].test != NULL; ++i)
+	    ;
+	if (i == test->max_clients) {
+	    /* As busy as we are allowed to be. */
+	    (void) Nwrite(s, (char*) &rbuf, sizeof(rbuf), Ptcp);
+	    close(s);
+	    continue;
+	}
+	if ((slots[i].test = server_slot_test(test, s, test->server_port + 1 + i)) == NULL) {
+	    iperf_err(test, "error - %s", iperf_strerror(i_errno));
+	    close(s);
+	    continue;
+	}
+	slots[i].index = i;
+	slots[i].done_fd = done[1];
+
+	pthread_sigmask(SIG_BLOCK, &mask, &saved);
+	err = pthread_create(&slots[i].thread, NULL, server_slot_run, &slots[i]);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (err != 0) {
+	    errno = err;
+	    i_errno = IETHREAD;
+	    iperf_err(test, "error - %s", iperf_strerror(i_errno));
+	    close(s);
+	    server_slot_free(&slots[i]);
+	    continue;
+	}
+	++running;
+
+	if (test->one_off) {
+	    iperf_event_forget(test, test->listener);
+	    close(test->listener);
+	    test->listener = 0;
+	    accepting = 0;
+	}
+    }
+
+    /* After an error, tests still running keep their slots and the pipe
+       until they finish. */
+    for (i = 0; i < test->max_clients; ++i)
+	if (slots[i].test != NULL) {
+	    pthread_join(slots[i].thread, NULL);
+	    server_slot_free(&slots[i]);
+	}
+    iperf_event_forget(test, done[0]);
+
+cleanup:
+    free(slots);
+    close(done[0]);
+    close(done[1]);
+    return result;
 }
+#endif /* HAVE_PTHREAD && HAVE_THREAD_LOCAL */
 
 
 int
@@ -404,7 +666,6 @@ iperf_run_server(struct iperf_test *test)
 #if defined(HAVE_TCP_CONGESTION)
     int saved_errno;
 #endif /* HAVE_TCP_CONGESTION */
-    fd_set read_set, write_set;
     struct iperf_stream *sp;
     struct iperf_time now;
     struct timeval* timeout;
@@ -418,6 +679,11 @@ iperf_run_server(struct iperf_test *test)
 	if (iperf_setaffinity(test, test->affinity) != 0)
 	    return -2;
 
+#if defined(HAVE_PTHREAD) && defined(HAVE_THREAD_LOCAL)
+    if (test->max_clients > 0)
+	return iperf_run_concurrent_server(test);
+#endif /* HAVE_PTHREAD && HAVE_THREAD_LOCAL */
+
     if (test->json_output)
 	if (iperf_json_start(test) < 0)
 	    return -2;
@@ -434,6 +700,10 @@ iperf_run_server(struct iperf_test *test)
 
     // Open socket and listen
     if (iperf_server_listen(test) < 0) {
+#if defined(HAVE_PTHREAD) && defined(HAVE_THREAD_LOCAL)
+	if (test->concurrent)
+	    server_refuse(test);
+#endif /* HAVE_PTHREAD && HAVE_THREAD_LOCAL */
         return -2;
     }
 
@@ -444,6 +714,15 @@ iperf_run_server(struct iperf_test *test)
     send_streams_accepted = 0;
     rec_streams_accepted = 0;
 
+    /* A concurrent server has accepted our client already. */
+    if (test->concurrent) {
+	if (iperf_accept_client(test) < 0) {
+	    cleanup_server(test);
+	    return -1;
+	}
+	server_stream_counts(test, &streams_to_send, &streams_to_rec);
+    }
+
     while (test->state != IPERF_DONE) {
 
         // Check if average transfer rate was exceeded (condition set in the callback routines)
@@ -453,12 +732,9 @@ iperf_run_server(struct iperf_test *test)
             return -1;	
 	}
 
-        memcpy(&read_set, &test->read_set, sizeof(fd_set));
-        memcpy(&write_set, &test->write_set, sizeof(fd_set));
-
 	iperf_time_now(&now);
-	timeout = tmr_timeout(&now);
-        result = select(test->max_fd + 1, &read_set, &write_set, NULL, timeout);
+	timeout = iperf_stream_threads_timeout(test, tmr_timeout(&now));
+        result = iperf_event_wait(test, timeout);
 
         if (result < 0 && errno != EINTR) {
 	    cleanup_server(test);
@@ -466,37 +742,26 @@ iperf_run_server(struct iperf_test *test)
             return -1;
         }
 	if (result > 0) {
-            if (FD_ISSET(test->listener, &read_set)) {
+            if (iperf_event_ready(test, test->listener, IPERF_EV_READ)) {
                 if (test->state != CREATE_STREAMS) {
                     if (iperf_accept(test) < 0) {
 			cleanup_server(test);
                         return -1;
                     }
-                    FD_CLR(test->listener, &read_set);
-
-                    // Set streams number
-                    if (test->mode == BIDIRECTIONAL) {
-                        streams_to_send = test->num_streams;
-                        streams_to_rec = test->num_streams;
-                    } else if (test->mode == RECEIVER) {
-                        streams_to_rec = test->num_streams;
-                        streams_to_send = 0;
-                    } else {
-                        streams_to_send = test->num_streams;
-                        streams_to_rec = 0;
-                    }
+                    iperf_event_clear(test, test->listener, IPERF_EV_READ);
+                    server_stream_counts(test, &streams_to_send, &streams_to_rec);
                 }
             }
-            if (FD_ISSET(test->ctrl_sck, &read_set)) {
+            if (iperf_event_ready(test, test->ctrl_sck, IPERF_EV_READ)) {
                 if (iperf_handle_message_server(test) < 0) {
 		    cleanup_server(test);
                     return -1;
 		}
-                FD_CLR(test->ctrl_sck, &read_set);                
+                iperf_event_clear(test, test->ctrl_sck, IPERF_EV_READ);
             }
 
             if (test->state == CREATE_STREAMS) {
-                if (FD_ISSET(test->prot_listener, &read_set)) {
+                if (iperf_event_ready(test, test->prot_listener, IPERF_EV_READ)) {
     
                     if ((s = test->protocol->accept(test)) < 0) {
 			cleanup_server(test);
@@ -565,12 +830,10 @@ iperf_run_server(struct iperf_test *test)
                                 return -1;
                             }
 
-                            if (sp->sender)
-                                FD_SET(s, &test->write_set);
-                            else
-                                FD_SET(s, &test->read_set);
-
-                            if (s > test->max_fd) test->max_fd = s;
+                            if (iperf_event_watch(test, s, sp->sender ? IPERF_EV_WRITE : IPERF_EV_READ) < 0) {
+                                cleanup_server(test);
+                                return -1;
+                            }
 
                             /*
                              * If the protocol isn't UDP, or even if it is but
@@ -589,17 +852,17 @@ iperf_run_server(struct iperf_test *test)
                             flag = -1;
                         }
                     }
-                    FD_CLR(test->prot_listener, &read_set);
+                    iperf_event_clear(test, test->prot_listener, IPERF_EV_READ);
                 }
 
 
                 if (rec_streams_accepted == streams_to_rec && send_streams_accepted == streams_to_send) {
                     if (test->protocol->id != Ptcp) {
-                        FD_CLR(test->prot_listener, &test->read_set);
+                        iperf_event_forget(test, test->prot_listener);
                         close(test->prot_listener);
                     } else { 
                         if (test->no_delay || test->settings->mss || test->settings->socket_bufsize) {
-                            FD_CLR(test->listener, &test->read_set);
+                            iperf_event_forget(test, test->listener);
                             close(test->listener);
 			    test->listener = 0;
                             if ((s = netannounce(test->settings->domain, Ptcp, test->bind_address, test->server_port)) < 0) {
@@ -608,8 +871,10 @@ iperf_run_server(struct iperf_test *test)
                                 return -1;
                             }
                             test->listener = s;
-                            FD_SET(test->listener, &test->read_set);
-			    if (test->listener > test->max_fd) test->max_fd = test->listener;
+                            if (iperf_event_watch(test, test->listener, IPERF_EV_READ) < 0) {
+				cleanup_server(test);
+				return -1;
+			    }
                         }
                     }
                     test->prot_listener = -1;
@@ -649,28 +914,33 @@ iperf_run_server(struct iperf_test *test)
 			cleanup_server(test);
                         return -1;
 		    }
+		    if (test->threads)
+			if (iperf_start_stream_threads(test) < 0) {
+			    cleanup_server(test);
+			    return -1;
+			}
                 }
             }
 
-            if (test->state == TEST_RUNNING) {
+            if (test->state == TEST_RUNNING && !test->threads_running) {
                 if (test->mode == BIDIRECTIONAL) {
-                    if (iperf_recv(test, &read_set) < 0) {
+                    if (iperf_recv(test) < 0) {
                         cleanup_server(test);
                         return -1;
                     }
-                    if (iperf_send(test, &write_set) < 0) {
+                    if (iperf_send(test) < 0) {
                         cleanup_server(test);
                         return -1;
                     }
                 } else if (test->mode == SENDER) {
                     // Reverse mode. Server sends.
-                    if (iperf_send(test, &write_set) < 0) {
+                    if (iperf_send(test) < 0) {
 			cleanup_server(test);
                         return -1;
 		    }
                 } else {
                     // Regular mode. Server receives.
-                    if (iperf_recv(test, &read_set) < 0) {
+                    if (iperf_recv(test) < 0) {
 			cleanup_server(test);
                         return -1;
 		    }
@@ -678,6 +948,11 @@ iperf_run_server(struct iperf_test *test)
 	    }
         }
 
+	if (test->threads_running && iperf_check_stream_threads(test) < 0) {
+	    cleanup_server(test);
+	    return -1;
+	}
+
 	if (result == 0 ||
 	    (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_usec == 0)) {
 	    /* Run the timers. */
@@ -64,8 +64,8 @@ iperf_tcp_recv(struct iperf_stream *sp)
 
     /* Only count bytes received while we're in the correct state. */
     if (sp->test->state == TEST_RUNNING) {
-	sp->result->bytes_received += r;
-	sp->result->bytes_received_this_interval += r;
+	iperf_counter_add(sp->result->bytes_received, r);
+	iperf_counter_add(sp->result->bytes_received_this_interval, r);
     }
     else {
 	if (sp->test->debug)
@@ -85,16 +85,18 @@ iperf_tcp_send(struct iperf_stream *sp)
 {
     int r;
 
-    if (sp->test->zerocopy)
+    if (sp->test->zerocopy == ZEROCOPY_SENDFILE)
 	r = Nsendfile(sp->buffer_fd, sp->socket, sp->buffer, sp->settings->blksize);
+    else if (sp->zerocopy != NULL)
+	r = iperf_zerocopy_send(sp, sp->buffer, sp->settings->blksize);
     else
 	r = Nwrite(sp->socket, sp->buffer, sp->settings->blksize, Ptcp);
 
     if (r < 0)
         return r;
 
-    sp->result->bytes_sent += r;
-    sp->result->bytes_sent_this_interval += r;
+    iperf_counter_add(sp->result->bytes_sent, r);
+    iperf_counter_add(sp->result->bytes_sent_this_interval, r);
 
     if (sp->test->debug)
 	printf("sent %d bytes of %d, total %" PRIu64 "\n", r, sp->settings->blksize, sp->result->bytes_sent);
@@ -127,6 +129,8 @@ iperf_tcp_accept(struct iperf_test * test)
         return -1;
     }
 
+    iperf_socket_pacing(test, s);
+
     if (strcmp(test->cookie, cookie) != 0) {
         if (Nwrite(s, (char*) &rbuf, sizeof(rbuf), Ptcp) < 0) {
             i_errno = IESENDMESSAGE;
@@ -166,7 +170,7 @@ iperf_tcp_listen(struct iperf_test *test)
 	struct addrinfo hints, *res;
 	char portstr[6];
 
-        FD_CLR(s, &test->read_set);
+        iperf_event_forget(test, s);
         close(s);
 
         snprintf(portstr, 6, "%d", test->server_port);
@@ -236,21 +240,6 @@ iperf_tcp_listen(struct iperf_test *test)
                 return -1;
             }
         }
-#if defined(HAVE_SO_MAX_PACING_RATE)
-    /* If fq socket pacing is specified, enable it. */
-    if (test->settings->fqrate) {
-	/* Convert bits per second to bytes per second */
-	unsigned int fqrate = test->settings->fqrate / 8;
-	if (fqrate > 0) {
-	    if (test->debug) {
-		printf("Setting fair-queue socket pacing to %u\n", fqrate);
-	    }
-	    if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &fqrate, sizeof(fqrate)) < 0) {
-		warning("Unable to set socket pacing");
-	    }
-	}
-    }
-#endif /* HAVE_SO_MAX_PACING_RATE */
     {
 	unsigned int rate = test->settings->rate / 8;
 	if (rate > 0) {
@@ -590,21 +579,7 @@ iperf_tcp_connect(struct iperf_test *test)
     }
 #endif /* HAVE_FLOWLABEL */
 
-#if defined(HAVE_SO_MAX_PACING_RATE)
-    /* If socket pacing is specified try to enable it. */
-    if (test->settings->fqrate) {
-	/* Convert bits per second to bytes per second */
-	unsigned int fqrate = test->settings->fqrate / 8;
-	if (fqrate > 0) {
-	    if (test->debug) {
-		printf("Setting fair-queue socket pacing to %u\n", fqrate);
-	    }
-	    if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &fqrate, sizeof(fqrate)) < 0) {
-		warning("Unable to set socket pacing");
-	    }
-	}
-    }
-#endif /* HAVE_SO_MAX_PACING_RATE */
+    iperf_socket_pacing(test, s);
     {
 	unsigned int rate = test->settings->rate / 8;
 	if (rate > 0) {
@@ -27,6 +27,7 @@
 
 
 #include <stddef.h>
+#include <sys/time.h>
 
 #include "iperf_config.h"
 #include "iperf_time.h"
@@ -65,6 +66,22 @@ iperf_time_now(struct iperf_time *time1)
 
 #endif
 
+/* iperf_time_now_wallclock
+ *
+ * The time of day, which unlike iperf_time_now() means the same on both
+ * hosts, as far as their clocks are in step.
+ */
+int
+iperf_time_now_wallclock(struct iperf_time *time1)
+{
+    struct timeval tv;
+    int result;
+    result = gettimeofday(&tv, NULL);
+    time1->secs = tv.tv_sec;
+    time1->usecs = tv.tv_usec;
+    return result;
+}
+
 /* iperf_time_add_usecs
  *
  * Add a number of microseconds to a iperf_time.
@@ -24,6 +24,12 @@
  * This code is distributed under a BSD style license, see the LICENSE
  * file for complete information.
  */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include "iperf_config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,15 +40,23 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#if defined(HAVE_UDP_SEGMENT) || defined(HAVE_UDP_GRO)
+#include <netinet/udp.h>
+#endif /* HAVE_UDP_SEGMENT || HAVE_UDP_GRO */
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
 #include <sys/time.h>
 #include <sys/select.h>
+#include <time.h>
+#if defined(HAVE_SO_TIMESTAMPING)
+#include <linux/net_tstamp.h>
+#endif /* HAVE_SO_TIMESTAMPING */
 
 #include "iperf.h"
 #include "iperf_api.h"
 #include "iperf_util.h"
+#include "iperf_latency.h"
 #include "iperf_udp.h"
 #include "timer.h"
 #include "net.h"
@@ -61,31 +75,85 @@
 # endif
 #endif
 
-/* iperf_udp_recv
+/* Room for the SCM_TIMESTAMPING message which --latency asks for. */
+#define UDP_STAMP_CONTROL	CMSG_SPACE(3 * sizeof(struct timespec))
+
+/*
+ * --udp-batch state for a stream: count datagrams go out or come in with
+ * each system call, through sendmmsg()/recvmmsg() or, where the kernel
+ * can do it, as one UDP_SEGMENT send or UDP_GRO receive.
+ */
+struct iperf_udp_batch
+{
+    int       count;		/* datagrams per system call */
+    int       gso;		/* sending with UDP_SEGMENT */
+    int       gro;		/* receiving with UDP_GRO */
+    char     *buffer;
+    size_t    size;
+    char     *control;		/* --latency: a timestamp per datagram */
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+};
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+static int iperf_udp_recv_batch(struct iperf_stream *sp);
+static int iperf_udp_send_batch(struct iperf_stream *sp);
+static int iperf_udp_batch_init(struct iperf_stream *sp);
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+
+/* iperf_udp_arrival
  *
- * receives the data for UDP
+ * when a datagram arrived, for --latency: from the hardware or kernel
+ * receive timestamp where there is one, or else from the clock now
  */
-int
-iperf_udp_recv(struct iperf_stream *sp)
+static int
+iperf_udp_arrival(struct msghdr *msg, struct iperf_time *arrival)
+{
+#if defined(HAVE_SO_TIMESTAMPING)
+    struct cmsghdr *cmsg;
+    struct timespec ts[3];
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+	    continue;
+	/*
+	 * ts[0] is the kernel's stamp, ts[2] the NIC's, which is only
+	 * there if the NIC has been told to stamp (by ptp4l, say), and
+	 * only any use if its clock is kept in step with ours.
+	 */
+	memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+	if (ts[2].tv_sec != 0 || ts[2].tv_nsec != 0) {
+	    arrival->secs = ts[2].tv_sec;
+	    arrival->usecs = ts[2].tv_nsec / 1000;
+	    return LATENCY_STAMP_HARDWARE;
+	}
+	if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+	    arrival->secs = ts[0].tv_sec;
+	    arrival->usecs = ts[0].tv_nsec / 1000;
+	    return LATENCY_STAMP_KERNEL;
+	}
+    }
+#endif /* HAVE_SO_TIMESTAMPING */
+    iperf_time_now_wallclock(arrival);
+    return LATENCY_STAMP_USER;
+}
+
+/* iperf_udp_account
+ *
+ * accounts for one received datagram: loss, reordering and jitter, and
+ * with --latency, how long it took to arrive
+ */
+static void
+iperf_udp_account(struct iperf_stream *sp, const char *buf, int r, const struct iperf_time *arrival, int stamps)
 {
     uint32_t  sec, usec;
     uint64_t  pcount;
-    int       r;
-    int       size = sp->settings->blksize;
     int       first_packet = 0;
     double    transit = 0, d = 0;
     struct iperf_time sent_time, arrival_time, temp_time;
 
-    r = Nread(sp->socket, sp->buffer, size, Pudp);
-
-    /*
-     * If we got an error in the read, or if we didn't read anything
-     * because the underlying read(2) got a EAGAIN, then skip packet
-     * processing.
-     */
-    if (r <= 0)
-        return r;
-
     /* Only count bytes received while we're in the correct state. */
     if (sp->test->state == TEST_RUNNING) {
 
@@ -97,14 +165,14 @@ iperf_udp_recv(struct iperf_stream *sp)
 	    first_packet = 1;
 	}
 
-	sp->result->bytes_received += r;
-	sp->result->bytes_received_this_interval += r;
+	iperf_counter_add(sp->result->bytes_received, r);
+	iperf_counter_add(sp->result->bytes_received_this_interval, r);
 
 	/* Dig the various counters out of the incoming UDP packet */
 	if (sp->test->udp_counters_64bit) {
-	    memcpy(&sec, sp->buffer, sizeof(sec));
-	    memcpy(&usec, sp->buffer+4, sizeof(usec));
-	    memcpy(&pcount, sp->buffer+8, sizeof(pcount));
+	    memcpy(&sec, buf, sizeof(sec));
+	    memcpy(&usec, buf+4, sizeof(usec));
+	    memcpy(&pcount, buf+8, sizeof(pcount));
 	    sec = ntohl(sec);
 	    usec = ntohl(usec);
 	    pcount = be64toh(pcount);
@@ -113,9 +181,9 @@ iperf_udp_recv(struct iperf_stream *sp)
 	}
 	else {
 	    uint32_t pc;
-	    memcpy(&sec, sp->buffer, sizeof(sec));
-	    memcpy(&usec, sp->buffer+4, sizeof(usec));
-	    memcpy(&pc, sp->buffer+8, sizeof(pc));
+	    memcpy(&sec, buf, sizeof(sec));
+	    memcpy(&usec, buf+4, sizeof(usec));
+	    memcpy(&pc, buf+8, sizeof(pc));
 	    sec = ntohl(sec);
 	    usec = ntohl(usec);
 	    pcount = ntohl(pc);
@@ -181,7 +249,16 @@ iperf_udp_recv(struct iperf_stream *sp)
 	 * computation does not require knowing the round-trip
 	 * time.
 	 */
-	iperf_time_now(&arrival_time);
+	if (arrival != NULL)
+	    arrival_time = *arrival;
+	else
+	    iperf_time_now(&arrival_time);
+
+	/* Both times are from the clock of day, see iperf_udp_stamp(). */
+	if (sp->latency != NULL && arrival != NULL)
+	    iperf_latency_record(sp->latency,
+		((int64_t) arrival_time.secs - sent_time.secs) * 1000000 +
+		((int64_t) arrival_time.usecs - sent_time.usecs), stamps);
 
 	iperf_time_diff(&arrival_time, &sent_time, &temp_time);
 	transit = iperf_time_in_secs(&temp_time);
@@ -200,23 +277,74 @@ iperf_udp_recv(struct iperf_stream *sp)
 	if (sp->test->debug)
 	    printf("Late receive, state = %d\n", sp->test->state);
     }
+}
+
+/* iperf_udp_recv
+ *
+ * receives the data for UDP
+ */
+int
+iperf_udp_recv(struct iperf_stream *sp)
+{
+    int       r;
+    int       size = sp->settings->blksize;
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    if (sp->batch != NULL)
+	return iperf_udp_recv_batch(sp);
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+
+    if (sp->latency != NULL) {
+	struct msghdr msg;
+	struct iovec iov;
+	char control[UDP_STAMP_CONTROL];
+	struct iperf_time arrival;
+	int stamps;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = sp->buffer;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if ((r = recvmsg(sp->socket, &msg, 0)) < 0)
+	    return (errno == EAGAIN || errno == EINTR) ? 0 : NET_HARDERROR;
+	stamps = iperf_udp_arrival(&msg, &arrival);
+	iperf_udp_account(sp, sp->buffer, r, &arrival, stamps);
+	return r;
+    }
+
+    r = Nread(sp->socket, sp->buffer, size, Pudp);
+
+    /*
+     * If we got an error in the read, or if we didn't read anything
+     * because the underlying read(2) got a EAGAIN, then skip packet
+     * processing.
+     */
+    if (r <= 0)
+        return r;
+
+    iperf_udp_account(sp, sp->buffer, r, NULL, 0);
 
     return r;
 }
 
 
-/* iperf_udp_send
+/* iperf_udp_stamp
  *
- * sends the data for UDP
+ * numbers the next datagram and puts the time it is sent in it
  */
-int
-iperf_udp_send(struct iperf_stream *sp)
+static void
+iperf_udp_stamp(struct iperf_stream *sp, char *buf)
 {
-    int r;
-    int       size = sp->settings->blksize;
     struct iperf_time before;
 
-    iperf_time_now(&before);
+    /* --latency needs a time which means the same to the receiver. */
+    if (sp->test->latency)
+	iperf_time_now_wallclock(&before);
+    else
+	iperf_time_now(&before);
 
     ++sp->packet_count;
 
@@ -228,11 +356,11 @@ iperf_udp_send(struct iperf_stream *sp)
 	sec = htonl(before.secs);
 	usec = htonl(before.usecs);
 	pcount = htobe64(sp->packet_count);
-	
-	memcpy(sp->buffer, &sec, sizeof(sec));
-	memcpy(sp->buffer+4, &usec, sizeof(usec));
-	memcpy(sp->buffer+8, &pcount, sizeof(pcount));
-	
+
+	memcpy(buf, &sec, sizeof(sec));
+	memcpy(buf+4, &usec, sizeof(usec));
+	memcpy(buf+8, &pcount, sizeof(pcount));
+
     }
     else {
 
@@ -241,20 +369,50 @@ iperf_udp_send(struct iperf_stream *sp)
 	sec = htonl(before.secs);
 	usec = htonl(before.usecs);
 	pcount = htonl(sp->packet_count);
-	
-	memcpy(sp->buffer, &sec, sizeof(sec));
-	memcpy(sp->buffer+4, &usec, sizeof(usec));
-	memcpy(sp->buffer+8, &pcount, sizeof(pcount));
-	
+
+	memcpy(buf, &sec, sizeof(sec));
+	memcpy(buf+4, &usec, sizeof(usec));
+	memcpy(buf+8, &pcount, sizeof(pcount));
+
     }
+}
 
-    r = Nwrite(sp->socket, sp->buffer, size, Pudp);
+
+/* iperf_udp_send
+ *
+ * sends the data for UDP
+ */
+int
+iperf_udp_send(struct iperf_stream *sp)
+{
+    int r;
+    int       size = sp->settings->blksize;
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    if (sp->batch != NULL)
+	return iperf_udp_send_batch(sp);
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+
+    if (sp->zerocopy != NULL) {
+	/* Each send in flight has a buffer of its own, see iperf_zerocopy_send(). */
+	char *buf = iperf_zerocopy_buffer(sp);
+
+	if (buf == NULL)
+	    return NET_SOFTERROR;
+	iperf_udp_stamp(sp, buf);
+	r = iperf_zerocopy_send(sp, buf, size);
+	if (r < 0)
+	    --sp->packet_count;
+    } else {
+	iperf_udp_stamp(sp, sp->buffer);
+	r = Nwrite(sp->socket, sp->buffer, size, Pudp);
+    }
 
     if (r < 0)
 	return r;
 
-    sp->result->bytes_sent += r;
-    sp->result->bytes_sent_this_interval += r;
+    iperf_counter_add(sp->result->bytes_sent, r);
+    iperf_counter_add(sp->result->bytes_sent_this_interval, r);
 
     if (sp->test->debug)
 	printf("sent %d bytes of %d, total %" PRIu64 "\n", r, sp->settings->blksize, sp->result->bytes_sent);
@@ -263,6 +421,215 @@ iperf_udp_send(struct iperf_stream *sp)
 }
 
 
+/**************************************************************************/
+
+/*
+ * Batched UDP I/O for --udp-batch.  Every datagram still carries its own
+ * sequence number and send time, and is accounted for one at a time by
+ * iperf_udp_account(), so loss, reordering and jitter come out just as
+ * they do without batching.
+ */
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+static int
+iperf_udp_recv_batch(struct iperf_stream *sp)
+{
+    struct iperf_udp_batch *b = sp->batch;
+    int i, n, r = 0;
+
+#if defined(HAVE_UDP_GRO)
+    if (b->gro) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int)) + UDP_STAMP_CONTROL];
+	struct iperf_time arrival;
+	int seg, stamps = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = b->buffer;
+	iov.iov_len = b->size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if ((n = recvmsg(sp->socket, &msg, 0)) < 0)
+	    return (errno == EAGAIN || errno == EINTR) ? 0 : NET_HARDERROR;
+
+	/* A coalesced read says how long each of its datagrams was. */
+	seg = n;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+		memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+	if (seg <= 0)
+	    seg = n;
+	/* The datagrams of a coalesced read share its timestamp. */
+	if (sp->latency != NULL)
+	    stamps = iperf_udp_arrival(&msg, &arrival);
+	for (i = 0; i < n; i += seg)
+	    iperf_udp_account(sp, b->buffer + i, n - i < seg ? n - i : seg,
+			      sp->latency != NULL ? &arrival : NULL, stamps);
+	return n;
+    }
+#endif /* HAVE_UDP_GRO */
+
+    /* The kernel says how much of each control buffer it used. */
+    if (b->control != NULL)
+	for (i = 0; i < b->count; i++)
+	    b->msgs[i].msg_hdr.msg_controllen = UDP_STAMP_CONTROL;
+    if ((n = recvmmsg(sp->socket, b->msgs, b->count, MSG_WAITFORONE, NULL)) < 0)
+	return (errno == EAGAIN || errno == EINTR) ? 0 : NET_HARDERROR;
+    for (i = 0; i < n; i++) {
+	if (b->control != NULL) {
+	    struct iperf_time arrival;
+	    int stamps = iperf_udp_arrival(&b->msgs[i].msg_hdr, &arrival);
+
+	    iperf_udp_account(sp, b->iov[i].iov_base, b->msgs[i].msg_len, &arrival, stamps);
+	} else
+	    iperf_udp_account(sp, b->iov[i].iov_base, b->msgs[i].msg_len, NULL, 0);
+	r += b->msgs[i].msg_len;
+    }
+    return r;
+}
+
+static int
+iperf_udp_send_batch(struct iperf_stream *sp)
+{
+    struct iperf_udp_batch *b = sp->batch;
+    struct iperf_test *test = sp->test;
+    int       size = sp->settings->blksize;
+    int i, n = b->count, r;
+
+    /* Don't overshoot -k by most of a batch. */
+    if (test->settings->blocks != 0) {
+	if (test->blocks_sent >= test->settings->blocks)
+	    return 0;
+	if (test->settings->blocks - test->blocks_sent < (iperf_size_t) n)
+	    n = test->settings->blocks - test->blocks_sent;
+    }
+
+    for (i = 0; i < n; i++)
+	iperf_udp_stamp(sp, b->buffer + i * size);
+
+#if defined(HAVE_UDP_SEGMENT)
+    if (b->gso) {
+	r = send(sp->socket, b->buffer, n * size, 0) < 0 ? -1 : n;
+	if (r < 0 && errno == EIO) {
+	    /* No checksum offload on this path, so no GSO either. */
+	    int opt = 0;
+
+	    b->gso = 0;
+	    (void) setsockopt(sp->socket, IPPROTO_UDP, UDP_SEGMENT, &opt, sizeof(opt));
+	    r = sendmmsg(sp->socket, b->msgs, n, 0);
+	}
+    } else
+#endif /* HAVE_UDP_SEGMENT */
+	r = sendmmsg(sp->socket, b->msgs, n, 0);
+
+    if (r < 0) {
+	sp->packet_count -= n;
+	if (errno == ENOBUFS)
+	    return NET_SOFTERROR;
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	return NET_HARDERROR;
+    }
+
+    /* The sequence numbers of datagrams which didn't go are used again. */
+    sp->packet_count -= n - r;
+    r *= size;
+
+    iperf_counter_add(sp->result->bytes_sent, r);
+    iperf_counter_add(sp->result->bytes_sent_this_interval, r);
+
+    if (sp->test->debug)
+	printf("sent %d bytes in %d datagrams, total %" PRIu64 "\n", r, r / size, sp->result->bytes_sent);
+
+    return r;
+}
+
+static int
+iperf_udp_batch_init(struct iperf_stream *sp)
+{
+    struct iperf_udp_batch *b;
+    int size = sp->settings->blksize;
+    int i, opt;
+
+    if ((b = (struct iperf_udp_batch *) calloc(1, sizeof(*b))) == NULL)
+	return -1;
+    b->count = sp->test->udp_batch;
+
+#if defined(HAVE_UDP_SEGMENT)
+    /* A GSO send has to fit in one datagram before it is split up. */
+    if (sp->sender && MAX_UDP_BLOCKSIZE / size >= 2) {
+	opt = size;
+	if (setsockopt(sp->socket, IPPROTO_UDP, UDP_SEGMENT, &opt, sizeof(opt)) == 0) {
+	    b->gso = 1;
+	    if (b->count > MAX_UDP_BLOCKSIZE / size)
+		b->count = MAX_UDP_BLOCKSIZE / size;
+	}
+    }
+#endif /* HAVE_UDP_SEGMENT */
+    b->size = b->count * size;
+#if defined(HAVE_UDP_GRO)
+    if (!sp->sender) {
+	opt = 1;
+	if (setsockopt(sp->socket, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt)) == 0) {
+	    b->gro = 1;
+	    b->size = 65536;	/* the largest coalesced read */
+	}
+    }
+#endif /* HAVE_UDP_GRO */
+
+    b->buffer = (char *) malloc(b->size);
+    b->msgs = (struct mmsghdr *) calloc(b->count, sizeof(struct mmsghdr));
+    b->iov = (struct iovec *) calloc(b->count, sizeof(struct iovec));
+    if (sp->latency != NULL && !sp->sender)
+	b->control = (char *) malloc(b->count * UDP_STAMP_CONTROL);
+    if (b->buffer == NULL || b->msgs == NULL || b->iov == NULL ||
+	(sp->latency != NULL && !sp->sender && b->control == NULL)) {
+	free(b->buffer);
+	free(b->msgs);
+	free(b->iov);
+	free(b->control);
+	free(b);
+	return -1;
+    }
+    for (i = 0; i < b->count; i++) {
+	/* Send the same payload as unbatched sends would. */
+	if (sp->sender)
+	    memcpy(b->buffer + i * size, sp->buffer, size);
+	b->iov[i].iov_base = b->buffer + i * size;
+	b->iov[i].iov_len = size;
+	b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+	if (b->control != NULL)
+	    b->msgs[i].msg_hdr.msg_control = b->control + i * UDP_STAMP_CONTROL;
+    }
+
+    sp->batch = b;
+    return 0;
+}
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+
+void
+iperf_udp_batch_free(struct iperf_stream *sp)
+{
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    struct iperf_udp_batch *b = sp->batch;
+
+    if (b == NULL)
+	return;
+    free(b->buffer);
+    free(b->msgs);
+    free(b->iov);
+    free(b->control);
+    free(b);
+    sp->batch = NULL;
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
+}
+
+
 /**************************************************************************/
 
 /*
@@ -413,21 +780,7 @@ iperf_udp_accept(struct iperf_test *test)
 	}
     }
 	
-#if defined(HAVE_SO_MAX_PACING_RATE)
-    /* If socket pacing is specified, try it. */
-    if (test->settings->fqrate) {
-	/* Convert bits per second to bytes per second */
-	unsigned int fqrate = test->settings->fqrate / 8;
-	if (fqrate > 0) {
-	    if (test->debug) {
-		printf("Setting fair-queue socket pacing to %u\n", fqrate);
-	    }
-	    if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &fqrate, sizeof(fqrate)) < 0) {
-		warning("Unable to set socket pacing");
-	    }
-	}
-    }
-#endif /* HAVE_SO_MAX_PACING_RATE */
+    iperf_socket_pacing(test, s);
     {
 	unsigned int rate = test->settings->rate / 8;
 	if (rate > 0) {
@@ -446,8 +799,8 @@ iperf_udp_accept(struct iperf_test *test)
         return -1;
     }
 
-    FD_SET(test->prot_listener, &test->read_set);
-    test->max_fd = (test->max_fd < test->prot_listener) ? test->prot_listener : test->max_fd;
+    if (iperf_event_watch(test, test->prot_listener, IPERF_EV_READ) < 0)
+	return -1;
 
     /* Let the client know we're ready "accept" another UDP "stream" */
     buf = 987654321;		/* any content will work here */
@@ -525,21 +878,7 @@ iperf_udp_connect(struct iperf_test *test)
 	}
     }
 	
-#if defined(HAVE_SO_MAX_PACING_RATE)
-    /* If socket pacing is available and not disabled, try it. */
-    if (test->settings->fqrate) {
-	/* Convert bits per second to bytes per second */
-	unsigned int fqrate = test->settings->fqrate / 8;
-	if (fqrate > 0) {
-	    if (test->debug) {
-		printf("Setting fair-queue socket pacing to %u\n", fqrate);
-	    }
-	    if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &fqrate, sizeof(fqrate)) < 0) {
-		warning("Unable to set socket pacing");
-	    }
-	}
-    }
-#endif /* HAVE_SO_MAX_PACING_RATE */
+    iperf_socket_pacing(test, s);
     {
 	unsigned int rate = test->settings->rate / 8;
 	if (rate > 0) {
@@ -586,5 +925,44 @@ iperf_udp_connect(struct iperf_test *test)
 int
 iperf_udp_init(struct iperf_test *test)
 {
+    struct iperf_stream *sp;
+
+    /*
+     * --latency: the receiver of each stream records its latencies, and
+     * the sender is given them with the results.
+     */
+    if (test->latency) {
+	SLIST_FOREACH(sp, &test->streams, streams) {
+	    if (sp->latency == NULL &&
+		(sp->latency = (struct iperf_latency *) calloc(1, sizeof(struct iperf_latency))) == NULL) {
+		i_errno = IEINITTEST;
+		return -1;
+	    }
+#if defined(HAVE_SO_TIMESTAMPING)
+	    /* Without the kernel's stamps, we read the clock ourselves. */
+	    if (!sp->sender) {
+		int opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		    SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+		(void) setsockopt(sp->socket, SOL_SOCKET, SO_TIMESTAMPING, &opt, sizeof(opt));
+	    }
+#endif /* HAVE_SO_TIMESTAMPING */
+	}
+    }
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    /* -F sends and receives through sp->buffer, one block at a time. */
+    if (test->udp_batch > 1 && test->diskfile_name == NULL) {
+	SLIST_FOREACH(sp, &test->streams, streams) {
+	    /* --zerocopy=z sends one datagram at a time, from its own ring. */
+	    if (sp->zerocopy != NULL)
+		continue;
+	    if (sp->batch == NULL && iperf_udp_batch_init(sp) < 0) {
+		i_errno = IEINITTEST;
+		return -1;
+	    }
+	}
+    }
+#endif /* HAVE_SENDMMSG && HAVE_RECVMMSG */
     return 0;
 }
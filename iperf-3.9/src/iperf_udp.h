@@ -60,5 +60,10 @@ int iperf_udp_connect(struct iperf_test *);
 
 int iperf_udp_init(struct iperf_test *);
 
+/**
+ * iperf_udp_batch_free -- frees a stream's --udp-batch buffers
+ */
+void iperf_udp_batch_free(struct iperf_stream *);
+
 
 #endif
@@ -137,15 +137,8 @@ make_cookie(const char *cookie)
 int
 is_closed(int fd)
 {
-    struct timeval tv;
-    fd_set readset;
-
-    FD_ZERO(&readset);
-    FD_SET(fd, &readset);
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-
-    if (select(fd+1, &readset, NULL, NULL, &tv) < 0) {
+    /* Not select(), which can't take descriptors above FD_SETSIZE. */
+    if (fcntl(fd, F_GETFL) < 0) {
         if (errno == EBADF)
             return 1;
     }
@@ -189,9 +182,9 @@ timeval_diff(struct timeval * tv0, struct timeval * tv1)
 void
 cpu_util(double pcpu[3])
 {
-    static struct iperf_time last;
-    static clock_t clast;
-    static struct rusage rlast;
+    static IPERF_TLS struct iperf_time last;
+    static IPERF_TLS clock_t clast;
+    static IPERF_TLS struct rusage rlast;
     struct iperf_time now, temp_time;
     clock_t ctemp;
     struct rusage rtemp;
@@ -297,6 +290,16 @@ get_optional_features(void)
     numfeatures++;
 #endif /* HAVE_SENDFILE */
 
+#if defined(HAVE_MSG_ZEROCOPY)
+    if (numfeatures > 0) {
+	strncat(features, ", ",
+		sizeof(features) - strlen(features) - 1);
+    }
+    strncat(features, "MSG_ZEROCOPY",
+	sizeof(features) - strlen(features) - 1);
+    numfeatures++;
+#endif /* HAVE_MSG_ZEROCOPY */
+
 #if defined(HAVE_SO_MAX_PACING_RATE)
     if (numfeatures > 0) {
 	strncat(features, ", ",
@@ -70,7 +70,7 @@
  * by including "iperf.h", but net.c lives "below" this layer.  Clearly the
  * presence of this declaration is a sign we need to revisit this layering.
  */
-extern int gerror;
+extern IPERF_TLS int gerror;
 
 /*
  * timeout_connect adapted from netcat, via OpenBSD and FreeBSD
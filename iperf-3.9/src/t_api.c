@@ -35,6 +35,7 @@
 
 #include "iperf.h"
 #include "iperf_api.h"
+#include "iperf_latency.h"
 
 #include "version.h"
 
@@ -61,5 +62,58 @@ main(int argc, char **argv)
     gint = iperf_get_test_connect_timeout(test);
     assert(sint == gint);
 
+    sint = IPERF_EVENTS_SELECT;
+    iperf_set_test_event_backend(test, sint);
+    gint = iperf_get_test_event_backend(test);
+    assert(sint == gint);
+
+    iperf_set_test_json_stream(test, 1);
+    assert(iperf_get_test_json_stream(test) == 1);
+    assert(iperf_get_test_json_output(test) == 1);
+
+    /* The interval ring keeps only the latest INTERVAL_RING intervals. */
+    {
+	struct iperf_stream_result rp;
+	struct iperf_interval_results ir;
+	int i;
+
+	memset(&rp, 0, sizeof(rp));
+	memset(&ir, 0, sizeof(ir));
+	assert(iperf_interval_result(&rp, 0) == NULL);
+	for (i = 1; i <= INTERVAL_RING + 2; i++) {
+	    ir.bytes_transferred = i;
+	    add_to_interval_list(&rp, &ir);
+	}
+	assert(iperf_interval_result(&rp, 0)->bytes_transferred == INTERVAL_RING + 2);
+	assert(iperf_interval_result(&rp, INTERVAL_RING - 1)->bytes_transferred == 3);
+	assert(iperf_interval_result(&rp, INTERVAL_RING) == NULL);
+    }
+
+    /* Latency percentiles are good to within a bucket. */
+    {
+	struct iperf_latency h, h2;
+	cJSON *j;
+	double p;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	for (i = 1; i <= 1000; i++)
+	    iperf_latency_record(&h, i * 100, LATENCY_STAMP_KERNEL);
+	iperf_latency_record(&h, -5, LATENCY_STAMP_USER);
+	assert(h.count == 1001 && h.negative == 1 && h.min == 0 && h.max == 100000);
+	p = iperf_latency_percentile(&h, 50.0);
+	assert(p > 50000 * 0.97 && p < 50000 * 1.03);
+	p = iperf_latency_percentile(&h, 99.0);
+	assert(p > 99000 * 0.97 && p < 99000 * 1.03);
+	assert(iperf_latency_percentile(&h, 100.0) == 100000);
+	assert(strcmp(iperf_latency_stamps_name(h.stamps), "kernel") == 0);
+
+	j = iperf_latency_to_json(&h);
+	assert(j != NULL);
+	assert(iperf_latency_from_json(&h2, j) == 0);
+	assert(memcmp(&h, &h2, sizeof(h)) == 0);
+	cJSON_Delete(j);
+    }
+
     return 0;
 }
@@ -0,0 +1,224 @@
+/*
+ * iperf, Copyright (c) 2017-2020, The Regents of the University of
+ * California, through Lawrence Berkeley National Laboratory (subject
+ * to receipt of any required approvals from the U.S. Dept. of
+ * Energy).  All rights reserved.
+ *
+ * If you have questions about your rights to use or distribute this
+ * software, please contact Berkeley Lab's Technology Transfer
+ * Department at TTD@lbl.gov.
+ *
+ * NOTICE.  This software is owned by the U.S. Department of Energy.
+ * As such, the U.S. Government has been granted for itself and others
+ * acting on its behalf a paid-up, nonexclusive, irrevocable,
+ * worldwide license in the Software to reproduce, prepare derivative
+ * works, and perform publicly and display publicly.  Beginning five
+ * (5) years after the date permission to assert copyright is obtained
+ * from the U.S. Department of Energy, and subject to any subsequent
+ * five (5) year renewals, the U.S. Government is granted for itself
+ * and others acting on its behalf a paid-up, nonexclusive,
+ * irrevocable, worldwide license in the Software to reproduce,
+ * prepare derivative works, distribute copies to the public, perform
+ * publicly and display publicly, and to permit others to do so.
+ *
+ * This code is distributed under a BSD style license, see the LICENSE
+ * file for complete information.
+ */
+
+
+#include "iperf_config.h"
+
+#include <assert.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/select.h>
+
+#include "iperf.h"
+#include "iperf_api.h"
+#include "iperf_time.h"
+#include "timer.h"
+
+/*
+ * -b pacing of many slow streams: the timer wheel against the timer list
+ * it replaced, where each stream had a periodic timer of --pacing-timer
+ * microseconds which let it send whilst its average rate since the start
+ * was below the target.  Both run the same loop of fake streams, which
+ * "send" a block whenever they have the green light, for the same time.
+ * The wheel has to hold every stream to the rate, and to do so with no
+ * more CPU time spent in the timers and the checks after each send.
+ */
+
+#define STREAMS 100
+#define RATE (2 * 1000 * 1000)	/* bits per second, per stream */
+#define BLKSIZE 1024
+#define TICK 1000		/* --pacing-timer */
+#define RUN_TIME 1000000	/* microseconds */
+#define MAX_ERROR 0.02		/* of the rate, for any one stream */
+
+static struct iperf_time start;
+
+
+static double
+cpu_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The check before the wheel: is the average rate below the target? */
+static void
+list_throttle(struct iperf_stream *sp, struct iperf_time *nowP)
+{
+    struct iperf_time temp_time;
+    double seconds;
+
+    iperf_time_diff(&start, nowP, &temp_time);
+    seconds = iperf_time_in_secs(&temp_time);
+    sp->green_light = seconds <= 0 ||
+	sp->result->bytes_sent * 8 / seconds < sp->test->settings->rate;
+}
+
+static void
+list_timer_proc(TimerClientData client_data, struct iperf_time *nowP)
+{
+    list_throttle(client_data.p, nowP);
+}
+
+/*
+ * Run the streams for RUN_TIME, with the wheel or the list.  Returns the
+ * CPU time spent in the timers and in the checks after each send, and the
+ * worst error of a stream's rate in *errorP.
+ */
+static double
+run(struct iperf_test *test, int wheel, double *errorP)
+{
+    struct iperf_stream *sp;
+    struct iperf_time now, end, temp_time;
+    struct timeval zero, *tv;
+    TimerClientData cd;
+    double cost = 0, t0, rate, error;
+    int green;
+
+    iperf_time_now(&start);
+    end = start;
+    iperf_time_add_usecs(&end, RUN_TIME);
+    SLIST_FOREACH(sp, &test->streams, streams)
+	sp->result->bytes_sent = 0;
+    if (wheel) {
+	assert(iperf_create_send_timers(test) == 0);
+	assert(test->pacing != NULL);
+    } else {
+	SLIST_FOREACH(sp, &test->streams, streams) {
+	    sp->green_light = 1;
+	    cd.p = sp;
+	    assert(tmr_create(&start, list_timer_proc, cd, TICK, 1) != NULL);
+	}
+    }
+
+    now = start;
+    green = 1;
+    while (iperf_time_compare(&now, &end) < 0) {
+	if (green) {
+	    zero.tv_sec = zero.tv_usec = 0;
+	    tv = &zero;
+	} else if ((tv = tmr_timeout(&now)) == NULL) {
+	    zero.tv_sec = 0;
+	    zero.tv_usec = TICK;
+	    tv = &zero;
+	}
+	(void) select(0, NULL, NULL, NULL, tv);
+	iperf_time_now(&now);
+
+	t0 = cpu_secs();
+	tmr_run(&now);
+	green = 0;
+	SLIST_FOREACH(sp, &test->streams, streams) {
+	    if (!sp->green_light)
+		continue;
+	    sp->result->bytes_sent += BLKSIZE;
+	    if (wheel)
+		iperf_check_throttle(sp, &now);
+	    else
+		list_throttle(sp, &now);
+	    green |= sp->green_light;
+	}
+	cost += cpu_secs() - t0;
+    }
+
+    if (wheel)
+	iperf_free_send_timers(test);
+    else
+	tmr_destroy();
+
+    iperf_time_diff(&now, &start, &temp_time);
+    *errorP = 0;
+    SLIST_FOREACH(sp, &test->streams, streams) {
+	rate = sp->result->bytes_sent * 8 / iperf_time_in_secs(&temp_time);
+	error = rate > RATE ? (rate - RATE) / RATE : (RATE - rate) / RATE;
+	if (error > *errorP)
+	    *errorP = error;
+    }
+    return cost;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    struct iperf_test *test;
+    struct iperf_stream *sp, streams[STREAMS];
+    struct iperf_stream_result results[STREAMS];
+    double wheel_cost, list_cost, wheel_error, list_error;
+    int i;
+
+    test = iperf_new_test();
+    assert(test != NULL);
+    iperf_defaults(test);
+    iperf_set_test_role(test, 'c');
+    iperf_set_test_rate(test, RATE);
+    iperf_set_test_blksize(test, BLKSIZE);
+    iperf_set_test_pacing_timer(test, TICK);
+
+    /* Streams enough for the pacing; the sockets are never used. */
+    memset(streams, 0, sizeof(streams));
+    memset(results, 0, sizeof(results));
+    for (i = 0; i < STREAMS; ++i) {
+	sp = &streams[i];
+	sp->test = test;
+	sp->settings = test->settings;
+	sp->result = &results[i];
+	sp->socket = 1000 + i;
+	sp->id = i + 1;
+	sp->sender = 1;
+	SLIST_INSERT_HEAD(&test->streams, sp, streams);
+    }
+
+    list_cost = run(test, 0, &list_error);
+    wheel_cost = run(test, 1, &wheel_error);
+    printf("%d streams at %d bit/s for %.1f s, --pacing-timer %d:\n",
+	   STREAMS, RATE, RUN_TIME / 1e6, TICK);
+    printf("  timer list:  %6.1f ms CPU, worst stream %5.2f%% off the rate\n",
+	   list_cost * 1000, list_error * 100);
+    printf("  timer wheel: %6.1f ms CPU, worst stream %5.2f%% off the rate\n",
+	   wheel_cost * 1000, wheel_error * 100);
+
+    SLIST_INIT(&test->streams);
+    iperf_free_test(test);
+
+    if (wheel_error > MAX_ERROR) {
+	printf("timer wheel does not hold the streams to the rate\n");
+	exit(-1);
+    }
+    if (wheel_cost > list_cost) {
+	printf("timer wheel costs more than the timer list\n");
+	exit(-2);
+    }
+    exit(0);
+}
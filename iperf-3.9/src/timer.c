@@ -27,14 +27,18 @@
  * Based on timers.c by Jef Poskanzer. Used with permission.
  */
 
+#include "iperf_config.h"
+
 #include <sys/types.h>
 #include <stdlib.h>
 
 #include "timer.h"
 #include "iperf_time.h"
 
-static Timer* timers = NULL;
-static Timer* free_timers = NULL;
+/* Each thread has its own timers: the tests of a concurrent server
+** (--max-clients) run one to a thread. */
+static IPERF_TLS Timer* timers = NULL;
+static IPERF_TLS Timer* free_timers = NULL;
 
 TimerClientData JunkClientData;
 
@@ -156,7 +160,7 @@ tmr_timeout( struct iperf_time* nowP )
     struct iperf_time now, diff;
     int64_t usecs;
     int past;
-    static struct timeval timeout;
+    static IPERF_TLS struct timeval timeout;
 
     getnow( nowP, &now );
     /* Since the list is sorted, we only need to look at the first timer. */
@@ -148,6 +148,11 @@ int ip6tc_set_counter(const xt_chainlabel chain,
 /* Makes the actual changes. */
 int ip6tc_commit(struct xtc_handle *handle);
 
+/* Re-reads the table after ip6tc_commit(), keeping the cache if it is
+ * still current.  Returns 0 on error, after which only ip6tc_free() is
+ * allowed. */
+int ip6tc_refresh(struct xtc_handle *handle);
+
 /* Get raw socket. */
 int ip6tc_get_raw_socket(void);
 
@@ -154,6 +154,11 @@ int iptc_set_counter(const xt_chainlabel chain,
 /* Makes the actual changes. */
 int iptc_commit(struct xtc_handle *handle);
 
+/* Re-reads the table after iptc_commit(), keeping the cache if it is
+ * still current.  Returns 0 on error, after which only iptc_free() is
+ * allowed. */
+int iptc_refresh(struct xtc_handle *handle);
+
 /* Get raw socket. */
 int iptc_get_raw_socket(void);
 
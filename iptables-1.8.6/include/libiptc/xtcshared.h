@@ -20,6 +20,7 @@ struct xtc_ops {
 	int (*set_policy)(const xt_chainlabel, const xt_chainlabel,
 			  struct xt_counters *, struct xtc_handle *);
 	const char *(*strerror)(int);
+	int (*refresh)(struct xtc_handle *);
 };
 
 #endif /* _LIBXTC_SHARED_H */
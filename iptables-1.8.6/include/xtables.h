@@ -643,6 +643,12 @@ const char *xt_xlate_get(struct xt_xlate *xl);
 
 extern void _init(void);
 
+/* Registry exported by the extension bundle, sorted by name */
+struct xtables_bundle_entry {
+	const char *name;
+	void (*init)(void);
+};
+
 #endif
 
 #ifdef __cplusplus
@@ -98,6 +98,7 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 	char buffer[10240];
 	int c, lock;
 	char curtable[XT_TABLE_MAXNAMELEN + 1] = {};
+	char handletable[XT_TABLE_MAXNAMELEN + 1] = {};
 	FILE *in;
 	int in_table = 0, testing = 0;
 	const char *tablename = NULL;
@@ -187,8 +188,9 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 			if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = cb->ops->commit(handle);
-				cb->ops->free(handle);
-				handle = NULL;
+				/* Keep the handle: if the same table comes
+				 * again, refreshing it is much cheaper than
+				 * parsing it all over. */
 			} else {
 				DEBUGP("Not calling commit, testing\n");
 				ret = 1;
@@ -225,10 +227,24 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 				}
 				continue;
 			}
-			if (handle)
-				cb->ops->free(handle);
+			if (handle && strcmp(handletable, table) == 0) {
+				if (!cb->ops->refresh(handle)) {
+					const char *err = cb->ops->strerror(errno);
+
+					cb->ops->free(handle);
+					xtables_error(OTHER_PROBLEM,
+						"%s: unable to refresh table "
+						"'%s': %s\n",
+						xt_params->program_name, table,
+						err);
+				}
+			} else {
+				if (handle)
+					cb->ops->free(handle);
 
-			handle = create_handle(cb, table);
+				handle = create_handle(cb, table);
+				strcpy(handletable, curtable);
+			}
 			if (noflush == 0) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
@@ -346,9 +362,13 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 		if (!ret) {
 			fprintf(stderr, "%s: line %u failed\n",
 					xt_params->program_name, line);
+			if (handle)
+				cb->ops->free(handle);
 			exit(1);
 		}
 	}
+	if (handle)
+		cb->ops->free(handle);
 	if (in_table) {
 		fprintf(stderr, "%s: COMMIT expected at line %u\n",
 				xt_params->program_name, line + 1);
@@ -168,6 +168,7 @@ static int fetch_table_cache(struct nft_handle *h)
 struct nftnl_chain_list_cb_data {
 	struct nft_handle *h;
 	const struct builtin_table *t;
+	unsigned int acks;
 };
 
 static int nftnl_chain_list_cb(const struct nlmsghdr *nlh, void *data)
@@ -342,6 +343,10 @@ static int fetch_set_cache(struct nft_handle *h,
 	return ret;
 }
 
+static int __flush_chain_cache(struct nftnl_chain *c, void *data);
+static void flush_rule_index(struct nft_rule_index **head,
+			     const struct nftnl_chain *c);
+
 static int __fetch_chain_cache(struct nft_handle *h,
 			       const struct builtin_table *t,
 			       const struct nftnl_chain *c)
@@ -366,6 +371,119 @@ static int __fetch_chain_cache(struct nft_handle *h,
 	return ret;
 }
 
+/* Number of GETCHAIN requests sent in one go before their replies are
+ * drained. Each request yields the chain plus an ack, all of which have to
+ * fit into the socket receive buffer until they are read.
+ */
+#define CHAIN_FETCH_WINDOW	32
+
+static int chain_fetch_ack_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nftnl_chain_list_cb_data *d = data;
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+
+	/* errors (e.g. ENOENT for chains which don't exist yet) are
+	 * not fatal, the chain is simply not cached
+	 */
+	d->acks++;
+	return MNL_CB_OK;
+}
+
+static int chain_fetch_flush(struct nft_handle *h, struct mnl_nlmsg_batch *b,
+			     unsigned int count,
+			     struct nftnl_chain_list_cb_data *d)
+{
+	static const mnl_cb_t cb_ctl[NLMSG_MIN_TYPE] = {
+		[NLMSG_ERROR]	= chain_fetch_ack_cb,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int ret;
+
+	if (mnl_socket_sendto(h->nl, mnl_nlmsg_batch_head(b),
+			      mnl_nlmsg_batch_size(b)) < 0)
+		return -1;
+
+	d->acks = 0;
+	while (d->acks < count) {
+		ret = mnl_socket_recvfrom(h->nl, buf, sizeof(buf));
+		if (ret == -1)
+			return -1;
+
+		ret = mnl_cb_run2(buf, ret, h->seq, h->portid,
+				  nftnl_chain_list_cb, d,
+				  cb_ctl, MNL_ARRAY_SIZE(cb_ctl));
+		if (ret == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Fetch the given chains with one GETCHAIN request each, but put up to
+ * CHAIN_FETCH_WINDOW of them on the wire at once instead of waiting for
+ * every reply before sending the next request.
+ */
+static int fetch_chain_cache_pipelined(struct nft_handle *h,
+				       const struct builtin_table *t,
+				       struct list_head *chains)
+{
+	struct nftnl_chain_list_cb_data d = {
+		.h = h,
+		.t = t,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE * 2];
+	struct mnl_nlmsg_batch *b;
+	unsigned int queued = 0;
+	struct cache_chain *cc;
+	struct nftnl_chain *c;
+	struct nlmsghdr *nlh;
+	int ret = 0;
+
+	c = nftnl_chain_alloc();
+	if (!c)
+		return -1;
+
+	b = mnl_nlmsg_batch_start(buf, MNL_SOCKET_BUFFER_SIZE);
+	if (!b) {
+		nftnl_chain_free(c);
+		return -1;
+	}
+
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, t->name);
+
+	list_for_each_entry(cc, chains, head) {
+		nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, cc->name);
+		nlh = nftnl_chain_nlmsg_build_hdr(mnl_nlmsg_batch_current(b),
+						  NFT_MSG_GETCHAIN, h->family,
+						  NLM_F_ACK, h->seq);
+		nftnl_chain_nlmsg_build_payload(nlh, c);
+
+		if (!mnl_nlmsg_batch_next(b)) {
+			/* last request did not fit, reset carries it over */
+			ret = chain_fetch_flush(h, b, queued, &d);
+			mnl_nlmsg_batch_reset(b);
+			queued = 1;
+		} else if (++queued == CHAIN_FETCH_WINDOW) {
+			ret = chain_fetch_flush(h, b, queued, &d);
+			mnl_nlmsg_batch_reset(b);
+			queued = 0;
+		}
+		if (ret < 0)
+			goto out;
+	}
+
+	if (queued)
+		ret = chain_fetch_flush(h, b, queued, &d);
+out:
+	mnl_nlmsg_batch_stop(b);
+	nftnl_chain_free(c);
+
+	return ret;
+}
+
 static int fetch_chain_cache(struct nft_handle *h,
 			     const struct builtin_table *t,
 			     struct list_head *chains)
@@ -379,6 +497,18 @@ static int fetch_chain_cache(struct nft_handle *h,
 
 	assert(t);
 
+	if (fetch_chain_cache_pipelined(h, t, chains) == 0)
+		return 0;
+
+	/* Replies may have been lost (e.g. ENOBUFS) or still be queued,
+	 * start over on a fresh socket and fall back to one request at
+	 * a time.
+	 */
+	assert(nft_restart(h) >= 0);
+	flush_rule_index(&h->cache->table[t->type].rule_index, NULL);
+	nftnl_chain_list_foreach(h->cache->table[t->type].chains,
+				 __flush_chain_cache, NULL);
+
 	c = nftnl_chain_alloc();
 	if (!c)
 		return -1;
@@ -450,29 +580,127 @@ static int nft_rule_list_update(struct nftnl_chain *c, void *data)
 	return 0;
 }
 
-static int fetch_rule_cache(struct nft_handle *h,
-			    const struct builtin_table *t)
+struct nftnl_rule_list_cb_data {
+	struct nft_handle *h;
+	const struct builtin_table *t;
+};
+
+static int nftnl_rule_table_list_cb(const struct nlmsghdr *nlh, void *data)
 {
-	int i;
+	struct nftnl_rule_list_cb_data *d = data;
+	const struct builtin_table *t = d->t;
+	struct nftnl_chain_list *list;
+	struct nft_handle *h = d->h;
+	const char *tname, *cname;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) < 0)
+		goto out;
+
+	tname = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+
+	if (!t)
+		t = nft_table_builtin_find(h, tname);
+	else if (strcmp(t->name, tname))
+		goto out;
+
+	if (!t)
+		goto out;
+
+	list = h->cache->table[t->type].chains;
+	if (!list)
+		goto out;
+
+	cname = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+	c = nftnl_chain_list_lookup_byname(list, cname);
+	if (!c)
+		goto out;
+
+	nftnl_chain_rule_add_tail(r, c);
+	return MNL_CB_OK;
+out:
+	nftnl_rule_free(r);
+	return MNL_CB_OK;
+}
+
+static int nft_rule_list_postprocess(struct nftnl_chain *c, void *data)
+{
+	struct nft_handle *h = data;
+
+	nft_bridge_chain_postprocess(h, c);
+	return 0;
+}
+
+/* Fetch the rules of all cached chains in a single dump, the kernel hands
+ * them out grouped by chain and in order. This replaces one dump per chain
+ * which is what dominates cache population time with many chains.
+ */
+static int __fetch_rule_cache(struct nft_handle *h,
+			      const struct builtin_table *t)
+{
+	struct nftnl_rule_list_cb_data d = {
+		.h = h,
+		.t = t,
+	};
+	struct nftnl_rule *rule = NULL;
+	struct nlmsghdr *nlh;
+	char buf[16536];
+	int i, ret;
 
 	if (t) {
-		struct nftnl_chain_list *list =
-			h->cache->table[t->type].chains;
+		rule = nftnl_rule_alloc();
+		if (!rule)
+			return -1;
 
-		return nftnl_chain_list_foreach(list, nft_rule_list_update, h);
+		nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, t->name);
 	}
 
+	nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
+					NLM_F_DUMP, h->seq);
+	if (rule) {
+		nftnl_rule_nlmsg_build_payload(nlh, rule);
+		nftnl_rule_free(rule);
+	}
+
+	ret = mnl_talk(h, nlh, nftnl_rule_table_list_cb, &d);
+	if (ret < 0 && errno == EINTR)
+		assert(nft_restart(h) >= 0);
+
+	if (h->family != NFPROTO_BRIDGE)
+		return ret;
+
 	for (i = 0; i < NFT_TABLE_MAX; i++) {
 		enum nft_table_type type = h->tables[i].type;
 
 		if (!h->tables[i].name)
 			continue;
+		if (t && t->type != type)
+			continue;
 
-		if (nftnl_chain_list_foreach(h->cache->table[type].chains,
-					     nft_rule_list_update, h))
-			return -1;
+		nftnl_chain_list_foreach(h->cache->table[type].chains,
+					 nft_rule_list_postprocess, h);
 	}
-	return 0;
+	return ret;
+}
+
+static int fetch_rule_cache(struct nft_handle *h,
+			    const struct builtin_table *t,
+			    struct list_head *chains)
+{
+	/* With a restricted chain list (e.g. restore --noflush), the table
+	 * may hold many more rules than those of the chains in cache, so
+	 * dump just these.
+	 */
+	if (chains)
+		return nftnl_chain_list_foreach(h->cache->table[t->type].chains,
+						nft_rule_list_update, h);
+
+	return __fetch_rule_cache(h, t);
 }
 
 static int flush_cache(struct nft_handle *h, struct nft_cache *c,
@@ -508,7 +736,7 @@ retry:
 	if (req->level >= NFT_CL_SETS)
 		fetch_set_cache(h, t, NULL);
 	if (req->level >= NFT_CL_RULES)
-		fetch_rule_cache(h, t);
+		fetch_rule_cache(h, t, chains);
 genid_check:
 	mnl_genid_get(h, &genid_check);
 	if (h->nft_genid != genid_check) {
@@ -517,6 +745,323 @@ genid_check:
 	}
 }
 
+/* Rule index: the rules of a chain, hashed by their iptables representation
+ * (see hash_matches() and the family's rule_hash callback), so nft_rule_find()
+ * doesn't have to decode every rule of a chain for each -C/-D/-R by rule
+ * spec. Each rule is decoded once, when the index is built. That happens on
+ * the second lookup in a chain only, a single lookup is cheaper done as a
+ * scan which may stop early. Whoever adds rules to or removes them from a
+ * cached chain keeps it in sync via nft_rule_index_add()/_del().
+ */
+#define RULE_INDEX_MIN_BUCKETS	64
+
+struct nft_rule_index_entry {
+	struct nft_rule_index_entry	*next;
+	struct nftnl_rule		*r;
+	uint32_t			hash;
+	bool				hit;
+};
+
+struct nft_rule_index {
+	struct nft_rule_index		*next;
+	const struct nftnl_chain	*c;
+	unsigned int			lookups;
+	unsigned int			size;
+	unsigned int			count;
+	/* NULL until built */
+	struct nft_rule_index_entry	**buckets;
+};
+
+static struct nft_rule_index **
+rule_index_slot(struct nft_handle *h, const struct nftnl_chain *c)
+{
+	const struct builtin_table *t;
+	struct nft_rule_index **pos;
+
+	t = nft_table_builtin_find(h, nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE));
+	if (!t)
+		return NULL;
+
+	pos = &h->cache->table[t->type].rule_index;
+	while (*pos && (*pos)->c != c)
+		pos = &(*pos)->next;
+
+	return pos;
+}
+
+static void rule_index_clear(struct nft_rule_index *idx)
+{
+	struct nft_rule_index_entry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < idx->size; i++) {
+		for (e = idx->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(idx->buckets);
+	idx->buckets = NULL;
+	idx->size = 0;
+	idx->count = 0;
+}
+
+static void flush_rule_index(struct nft_rule_index **head,
+			     const struct nftnl_chain *c)
+{
+	struct nft_rule_index *idx;
+
+	while ((idx = *head)) {
+		if (c && idx->c != c) {
+			head = &idx->next;
+			continue;
+		}
+		*head = idx->next;
+		rule_index_clear(idx);
+		free(idx);
+	}
+}
+
+static uint32_t rule_cs_hash(struct nft_handle *h,
+			     const struct iptables_command_state *cs)
+{
+	uint32_t hash = NFT_HASH_INIT;
+
+	if (h->ops->rule_hash)
+		hash = h->ops->rule_hash(cs);
+
+	hash = hash_matches(hash, cs->matches);
+	if (cs->target)
+		return hash_target(hash, cs->target);
+	if (cs->jumpto)
+		hash = hash_data(hash, cs->jumpto, strlen(cs->jumpto));
+
+	return hash;
+}
+
+static uint32_t rule_hash(struct nft_handle *h, const struct nftnl_rule *r)
+{
+	struct iptables_command_state cs = {};
+	uint32_t hash;
+
+	h->ops->rule_to_cs(h, r, &cs);
+	hash = rule_cs_hash(h, &cs);
+	h->ops->clear_cs(&cs);
+
+	return hash;
+}
+
+static int rule_index_insert(struct nft_rule_index *idx,
+			     struct nftnl_rule *r, uint32_t hash)
+{
+	struct nft_rule_index_entry *e, **buckets;
+	unsigned int i, size;
+
+	if (idx->count >= idx->size) {
+		size = idx->size ? idx->size * 2 : RULE_INDEX_MIN_BUCKETS;
+		buckets = calloc(size, sizeof(*buckets));
+		if (!buckets)
+			return -1;
+
+		for (i = 0; i < idx->size; i++) {
+			while ((e = idx->buckets[i])) {
+				idx->buckets[i] = e->next;
+				e->next = buckets[e->hash & (size - 1)];
+				buckets[e->hash & (size - 1)] = e;
+			}
+		}
+		free(idx->buckets);
+		idx->buckets = buckets;
+		idx->size = size;
+	}
+
+	e = malloc(sizeof(*e));
+	if (!e)
+		return -1;
+
+	e->r = r;
+	e->hash = hash;
+	e->hit = false;
+	e->next = idx->buckets[hash & (idx->size - 1)];
+	idx->buckets[hash & (idx->size - 1)] = e;
+	idx->count++;
+
+	return 0;
+}
+
+static int rule_index_build(struct nft_handle *h, struct nft_rule_index *idx,
+			    struct nftnl_chain *c)
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+	int ret = 0;
+
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return -1;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		if (rule_index_insert(idx, r, rule_hash(h, r)) < 0) {
+			rule_index_clear(idx);
+			ret = -1;
+			break;
+		}
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return ret;
+}
+
+static struct nftnl_rule *
+rule_scan(struct nft_handle *h, struct nftnl_chain *c,
+	  const struct iptables_command_state *cs,
+	  bool (*cmp)(struct nft_handle *h, struct nftnl_rule *r,
+		      const struct iptables_command_state *cs))
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return NULL;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		if (cmp(h, r, cs))
+			break;
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return r;
+}
+
+/* return the first rule in @c which @cmp considers equal to @cs */
+struct nftnl_rule *
+nft_rule_index_find(struct nft_handle *h, struct nftnl_chain *c,
+		    const struct iptables_command_state *cs,
+		    bool (*cmp)(struct nft_handle *h, struct nftnl_rule *r,
+				const struct iptables_command_state *cs))
+{
+	struct nft_rule_index_entry *e, *bucket;
+	struct nft_rule_index **pos, *idx;
+	struct nftnl_rule *r, *found = NULL;
+	struct nftnl_rule_iter *iter;
+	unsigned int hits = 0;
+	uint32_t hash;
+
+	pos = rule_index_slot(h, c);
+	if (!pos)
+		return rule_scan(h, c, cs, cmp);
+
+	idx = *pos;
+	if (!idx) {
+		idx = calloc(1, sizeof(*idx));
+		if (!idx)
+			return rule_scan(h, c, cs, cmp);
+		idx->c = c;
+		*pos = idx;
+	}
+
+	if (!idx->buckets) {
+		if (++idx->lookups < 2 || rule_index_build(h, idx, c) < 0)
+			return rule_scan(h, c, cs, cmp);
+		if (!idx->buckets)	/* empty chain */
+			return NULL;
+	}
+
+	hash = rule_cs_hash(h, cs);
+	bucket = idx->buckets[hash & (idx->size - 1)];
+
+	for (e = bucket; e; e = e->next) {
+		if (e->hash != hash || !cmp(h, e->r, cs))
+			continue;
+		e->hit = true;
+		found = e->r;
+		hits++;
+	}
+
+	if (hits > 1) {
+		/* duplicates, the first one in chain order wins */
+		iter = nftnl_rule_iter_create(c);
+		r = iter ? nftnl_rule_iter_next(iter) : NULL;
+		while (r != NULL) {
+			for (e = bucket; e; e = e->next) {
+				if (e->hit && e->r == r)
+					break;
+			}
+			if (e) {
+				found = r;
+				break;
+			}
+			r = nftnl_rule_iter_next(iter);
+		}
+		if (iter)
+			nftnl_rule_iter_destroy(iter);
+	}
+
+	for (e = bucket; e; e = e->next)
+		e->hit = false;
+
+	return found;
+}
+
+void nft_rule_index_add(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r)
+{
+	struct nft_rule_index **pos = rule_index_slot(h, c);
+	struct nft_rule_index *idx = pos ? *pos : NULL;
+
+	if (!idx || !idx->buckets)
+		return;
+
+	/* on failure, the index is rebuilt by the next lookup */
+	if (rule_index_insert(idx, r, rule_hash(h, r)) < 0)
+		rule_index_clear(idx);
+}
+
+void nft_rule_index_del(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r)
+{
+	struct nft_rule_index_entry **e, *tmp;
+	struct nft_rule_index **pos, *idx;
+	uint32_t hash;
+
+	if (!c)
+		return;
+
+	pos = rule_index_slot(h, c);
+	idx = pos ? *pos : NULL;
+	if (!idx || !idx->buckets)
+		return;
+
+	hash = rule_hash(h, r);
+	for (e = &idx->buckets[hash & (idx->size - 1)]; *e; e = &(*e)->next) {
+		if ((*e)->r != r)
+			continue;
+
+		tmp = *e;
+		*e = tmp->next;
+		free(tmp);
+		idx->count--;
+		return;
+	}
+
+	/* not indexed under its current hash, start over */
+	rule_index_clear(idx);
+}
+
+/* forget @c's index, before the chain itself goes away */
+void nft_rule_index_flush(struct nft_handle *h, struct nftnl_chain *c)
+{
+	struct nft_rule_index **pos = rule_index_slot(h, c);
+
+	if (pos && *pos)
+		flush_rule_index(pos, c);
+}
+
 static void __nft_flush_cache(struct nft_handle *h)
 {
 	if (!h->cache_index) {
@@ -545,13 +1090,19 @@ int flush_rule_cache(struct nft_handle *h, const char *table,
 {
 	const struct builtin_table *t;
 
-	if (c)
+	t = nft_table_builtin_find(h, table);
+
+	if (c) {
+		if (t)
+			flush_rule_index(&h->cache->table[t->type].rule_index,
+					 c);
 		return __flush_rule_cache(c, NULL);
+	}
 
-	t = nft_table_builtin_find(h, table);
 	if (!t || !h->cache->table[t->type].chains)
 		return 0;
 
+	flush_rule_index(&h->cache->table[t->type].rule_index, NULL);
 	return nftnl_chain_list_foreach(h->cache->table[t->type].chains,
 					__flush_rule_cache, NULL);
 }
@@ -582,6 +1133,7 @@ static int flush_cache(struct nft_handle *h, struct nft_cache *c,
 		table = nft_table_builtin_find(h, tablename);
 		if (!table)
 			return 0;
+		flush_rule_index(&c->table[table->type].rule_index, NULL);
 		if (c->table[table->type].chains)
 			nftnl_chain_list_foreach(c->table[table->type].chains,
 						 __flush_chain_cache, NULL);
@@ -595,6 +1147,7 @@ static int flush_cache(struct nft_handle *h, struct nft_cache *c,
 		if (h->tables[i].name == NULL)
 			continue;
 
+		flush_rule_index(&c->table[i].rule_index, NULL);
 		if (c->table[i].chains) {
 			nftnl_chain_list_free(c->table[i].chains);
 			c->table[i].chains = NULL;
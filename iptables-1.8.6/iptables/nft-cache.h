@@ -3,6 +3,7 @@
 
 struct nft_handle;
 struct nft_cmd;
+struct iptables_command_state;
 
 void nft_cache_level_set(struct nft_handle *h, int level,
 			 const struct nft_cmd *cmd);
@@ -13,6 +14,17 @@ int flush_rule_cache(struct nft_handle *h, const char *table,
 		     struct nftnl_chain *c);
 void nft_cache_build(struct nft_handle *h);
 
+struct nftnl_rule *
+nft_rule_index_find(struct nft_handle *h, struct nftnl_chain *c,
+		    const struct iptables_command_state *cs,
+		    bool (*cmp)(struct nft_handle *h, struct nftnl_rule *r,
+				const struct iptables_command_state *cs));
+void nft_rule_index_add(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r);
+void nft_rule_index_del(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r);
+void nft_rule_index_flush(struct nft_handle *h, struct nftnl_chain *c);
+
 struct nftnl_chain_list *
 nft_chain_list_get(struct nft_handle *h, const char *table, const char *chain);
 struct nftnl_set_list *
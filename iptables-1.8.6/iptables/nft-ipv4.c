@@ -114,6 +114,26 @@ static bool nft_ipv4_is_same(const void *data_a,
 				  b->fw.ip.iniface_mask, b->fw.ip.outiface_mask);
 }
 
+/* covers the fields compared by nft_ipv4_is_same() */
+static uint32_t nft_ipv4_rule_hash(const void *data)
+{
+	const struct iptables_command_state *cs = data;
+	uint32_t hash = NFT_HASH_INIT;
+
+	hash = hash_data(hash, &cs->fw.ip.src, sizeof(cs->fw.ip.src));
+	hash = hash_data(hash, &cs->fw.ip.dst, sizeof(cs->fw.ip.dst));
+	hash = hash_data(hash, &cs->fw.ip.smsk, sizeof(cs->fw.ip.smsk));
+	hash = hash_data(hash, &cs->fw.ip.dmsk, sizeof(cs->fw.ip.dmsk));
+	hash = hash_data(hash, &cs->fw.ip.proto, sizeof(cs->fw.ip.proto));
+	hash = hash_data(hash, &cs->fw.ip.flags, sizeof(cs->fw.ip.flags));
+	hash = hash_data(hash, &cs->fw.ip.invflags,
+			 sizeof(cs->fw.ip.invflags));
+
+	return hash_interfaces(hash, cs->fw.ip.iniface, cs->fw.ip.outiface,
+			       cs->fw.ip.iniface_mask,
+			       cs->fw.ip.outiface_mask);
+}
+
 static void get_frag(struct nft_xt_ctx *ctx, struct nftnl_expr *e, bool *inv)
 {
 	uint8_t op;
@@ -456,5 +476,6 @@ struct nft_family_ops nft_family_ops_ipv4 = {
 	.parse_target		= nft_ipv46_parse_target,
 	.rule_to_cs		= nft_rule_to_iptables_command_state,
 	.clear_cs		= nft_clear_iptables_command_state,
+	.rule_hash		= nft_ipv4_rule_hash,
 	.xlate			= nft_ipv4_xlate,
 };
@@ -105,6 +105,27 @@ static bool nft_ipv6_is_same(const void *data_a,
 				  b->fw6.ipv6.outiface_mask);
 }
 
+/* covers the fields compared by nft_ipv6_is_same() */
+static uint32_t nft_ipv6_rule_hash(const void *data)
+{
+	const struct iptables_command_state *cs = data;
+	uint32_t hash = NFT_HASH_INIT;
+
+	hash = hash_data(hash, &cs->fw6.ipv6.src, sizeof(cs->fw6.ipv6.src));
+	hash = hash_data(hash, &cs->fw6.ipv6.dst, sizeof(cs->fw6.ipv6.dst));
+	hash = hash_data(hash, &cs->fw6.ipv6.proto,
+			 sizeof(cs->fw6.ipv6.proto));
+	hash = hash_data(hash, &cs->fw6.ipv6.flags,
+			 sizeof(cs->fw6.ipv6.flags));
+	hash = hash_data(hash, &cs->fw6.ipv6.invflags,
+			 sizeof(cs->fw6.ipv6.invflags));
+
+	return hash_interfaces(hash, cs->fw6.ipv6.iniface,
+			       cs->fw6.ipv6.outiface,
+			       cs->fw6.ipv6.iniface_mask,
+			       cs->fw6.ipv6.outiface_mask);
+}
+
 static void nft_ipv6_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e,
 				void *data)
 {
@@ -408,5 +429,6 @@ struct nft_family_ops nft_family_ops_ipv6 = {
 	.parse_target		= nft_ipv46_parse_target,
 	.rule_to_cs		= nft_rule_to_iptables_command_state,
 	.clear_cs		= nft_clear_iptables_command_state,
+	.rule_hash		= nft_ipv6_rule_hash,
 	.xlate			= nft_ipv6_xlate,
 };
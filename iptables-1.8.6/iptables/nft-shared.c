@@ -228,6 +228,27 @@ bool is_same_interfaces(const char *a_iniface, const char *a_outiface,
 	return true;
 }
 
+uint32_t hash_interfaces(uint32_t hash,
+			 const char *iniface, const char *outiface,
+			 unsigned const char *iniface_mask,
+			 unsigned const char *outiface_mask)
+{
+	unsigned char c;
+	int i;
+
+	/* same bytes as is_same_interfaces() looks at */
+	for (i = 0; i < IFNAMSIZ; i++) {
+		hash = hash_data(hash, &iniface_mask[i], 1);
+		c = iniface[i] & iniface_mask[i];
+		hash = hash_data(hash, &c, 1);
+		hash = hash_data(hash, &outiface_mask[i], 1);
+		c = outiface[i] & outiface_mask[i];
+		hash = hash_data(hash, &c, 1);
+	}
+
+	return hash;
+}
+
 static void parse_ifname(const char *name, unsigned int len, char *dst, unsigned char *mask)
 {
 	if (len == 0)
@@ -974,6 +995,41 @@ bool compare_targets(struct xtables_target *tg1, struct xtables_target *tg2)
 	return true;
 }
 
+uint32_t hash_data(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+uint32_t hash_matches(uint32_t hash, struct xtables_rule_match *matches)
+{
+	struct xtables_rule_match *mp;
+
+	for (mp = matches; mp; mp = mp->next) {
+		struct xt_entry_match *m = mp->match->m;
+
+		hash = hash_data(hash, m->u.user.name, strlen(m->u.user.name));
+		hash = hash_data(hash, &m->u.user.match_size,
+				 sizeof(m->u.user.match_size));
+		hash = hash_data(hash, m->data, mp->match->userspacesize);
+	}
+	return hash;
+}
+
+uint32_t hash_target(uint32_t hash, struct xtables_target *t)
+{
+	if (!t)
+		return hash;
+
+	hash = hash_data(hash, t->t->u.user.name, strlen(t->t->u.user.name));
+	return hash_data(hash, t->t->data, t->userspacesize);
+}
+
 void nft_ipv46_parse_target(struct xtables_target *t, void *data)
 {
 	struct iptables_command_state *cs = data;
@@ -108,6 +108,7 @@ struct nft_family_ops {
 	void (*rule_to_cs)(struct nft_handle *h, const struct nftnl_rule *r,
 			   struct iptables_command_state *cs);
 	void (*clear_cs)(struct iptables_command_state *cs);
+	uint32_t (*rule_hash)(const void *data);
 	int (*xlate)(const void *data, struct xt_xlate *xl);
 };
 
@@ -134,6 +135,10 @@ bool is_same_interfaces(const char *a_iniface, const char *a_outiface,
 			const char *b_iniface, const char *b_outiface,
 			unsigned const char *b_iniface_mask,
 			unsigned const char *b_outiface_mask);
+uint32_t hash_interfaces(uint32_t hash,
+			 const char *iniface, const char *outiface,
+			 unsigned const char *iniface_mask,
+			 unsigned const char *outiface_mask);
 
 int parse_meta(struct nftnl_expr *e, uint8_t key, char *iniface,
 		unsigned char *iniface_mask, char *outiface,
@@ -171,6 +176,13 @@ void nft_ipv46_parse_target(struct xtables_target *t, void *data);
 bool compare_matches(struct xtables_rule_match *mt1, struct xtables_rule_match *mt2);
 bool compare_targets(struct xtables_target *tg1, struct xtables_target *tg2);
 
+/* FNV-1a, used to hash the fields the compare functions above look at */
+#define NFT_HASH_INIT	2166136261U
+
+uint32_t hash_data(uint32_t hash, const void *data, size_t len);
+uint32_t hash_matches(uint32_t hash, struct xtables_rule_match *matches);
+uint32_t hash_target(uint32_t hash, struct xtables_target *t);
+
 struct addr_mask {
 	union {
 		struct in_addr	*v4;
@@ -1411,18 +1411,21 @@ nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
 	if (verbose)
 		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
 
+	c = nft_chain_find(h, table, chain);
 	if (ref) {
+		nft_rule_index_del(h, c, ref);
 		nftnl_chain_rule_insert_at(r, ref);
 		nftnl_chain_rule_del(ref);
 		nftnl_rule_free(ref);
 	} else {
-		c = nft_chain_find(h, table, chain);
 		if (!c) {
 			errno = ENOENT;
 			return 0;
 		}
 		nftnl_chain_rule_add_tail(r, c);
 	}
+	if (c)
+		nft_rule_index_add(h, c, r);
 
 	return 1;
 }
@@ -1532,6 +1535,7 @@ void nft_bridge_chain_postprocess(struct nft_handle *h,
 	}
 
 	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, verdict);
+	nft_rule_index_del(h, c, last);
 	if (batch_rule_add(h, NFT_COMPAT_RULE_DELETE, last) == NULL)
 		fprintf(stderr, "Failed to delete old policy rule\n");
 	nftnl_chain_rule_del(last);
@@ -1816,6 +1820,8 @@ static int __nft_chain_user_del(struct nftnl_chain *c, void *data)
 	if (!batch_chain_add(h, NFT_COMPAT_CHAIN_USER_DEL, c))
 		return -1;
 
+	/* the batch frees c, don't leave an index pointing at it */
+	nft_rule_index_flush(h, c);
 	nftnl_chain_list_del(c);
 	return 0;
 }
@@ -1997,10 +2003,12 @@ int nft_table_flush(struct nft_handle *h, const char *table)
 	return ret == 0 ? 1 : 0;
 }
 
-static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule *r)
+static int __nft_rule_del(struct nft_handle *h, struct nftnl_chain *c,
+			  struct nftnl_rule *r)
 {
 	struct obj_update *obj;
 
+	nft_rule_index_del(h, c, r);
 	nftnl_rule_list_del(r);
 
 	if (!nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE))
@@ -2015,13 +2023,12 @@ static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule *r)
 }
 
 static bool nft_rule_cmp(struct nft_handle *h, struct nftnl_rule *r,
-			 struct nftnl_rule *rule)
+			 const struct iptables_command_state *cs)
 {
-	struct iptables_command_state _cs = {}, this = {}, *cs = &_cs;
+	struct iptables_command_state this = {};
 	bool ret = false;
 
 	h->ops->rule_to_cs(h, r, &this);
-	h->ops->rule_to_cs(h, rule, cs);
 
 	DEBUGP("comparing with... ");
 #ifdef DEBUG_DEL
@@ -2049,7 +2056,6 @@ static bool nft_rule_cmp(struct nft_handle *h, struct nftnl_rule *r,
 	ret = true;
 out:
 	h->ops->clear_cs(&this);
-	h->ops->clear_cs(cs);
 	return ret;
 }
 
@@ -2057,29 +2063,19 @@ static struct nftnl_rule *
 nft_rule_find(struct nft_handle *h, struct nftnl_chain *c,
 	      struct nftnl_rule *rule, int rulenum)
 {
+	struct iptables_command_state cs = {};
 	struct nftnl_rule *r;
-	struct nftnl_rule_iter *iter;
-	bool found = false;
 
 	if (rulenum >= 0)
 		/* Delete by rule number case */
 		return nftnl_rule_lookup_byindex(c, rulenum);
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 0;
-
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		found = nft_rule_cmp(h, r, rule);
-		if (found)
-			break;
-		r = nftnl_rule_iter_next(iter);
-	}
-
-	nftnl_rule_iter_destroy(iter);
+	/* decode the rule to look for once, not per rule compared */
+	h->ops->rule_to_cs(h, rule, &cs);
+	r = nft_rule_index_find(h, c, &cs, nft_rule_cmp);
+	h->ops->clear_cs(&cs);
 
-	return found ? r : NULL;
+	return r;
 }
 
 int nft_rule_check(struct nft_handle *h, const char *chain,
@@ -2124,7 +2120,7 @@ int nft_rule_delete(struct nft_handle *h, const char *chain,
 
 	r = nft_rule_find(h, c, rule, -1);
 	if (r != NULL) {
-		ret =__nft_rule_del(h, r);
+		ret =__nft_rule_del(h, c, r);
 		if (ret < 0)
 			errno = ENOMEM;
 		if (verbose)
@@ -2208,6 +2204,7 @@ int nft_rule_insert(struct nft_handle *h, const char *chain,
 		nftnl_chain_rule_insert_at(new_rule, r);
 	else
 		nftnl_chain_rule_add(new_rule, c);
+	nft_rule_index_add(h, c, new_rule);
 
 	return 1;
 err:
@@ -2232,7 +2229,7 @@ int nft_rule_delete_num(struct nft_handle *h, const char *chain,
 	r = nft_rule_find(h, c, NULL, rulenum);
 	if (r != NULL) {
 		DEBUGP("deleting rule by number %d\n", rulenum);
-		ret = __nft_rule_del(h, r);
+		ret = __nft_rule_del(h, c, r);
 		if (ret < 0)
 			errno = ENOMEM;
 	} else
@@ -2918,6 +2915,7 @@ static int ebt_add_policy_rule(struct nftnl_chain *c, void *data)
 
 	/* add the rule to chain so it is freed later */
 	nftnl_chain_rule_add_tail(r, c);
+	nft_rule_index_add(h, c, r);
 
 	return 0;
 err_free_rule:
@@ -37,10 +37,13 @@ enum nft_cache_level {
 	NFT_CL_FAKE	/* must be last entry */
 };
 
+struct nft_rule_index;
+
 struct nft_cache {
 	struct {
 		struct nftnl_chain_list *chains;
 		struct nftnl_set_list	*sets;
+		struct nft_rule_index	*rule_index;
 		bool			exists;
 	} table[NFT_TABLE_MAX];
 };
@@ -86,6 +86,7 @@ typedef unsigned int socklen_t;
 #define TC_GET_RAW_SOCKET	iptc_get_raw_socket
 #define TC_INIT			iptc_init
 #define TC_FREE			iptc_free
+#define TC_REFRESH		iptc_refresh
 #define TC_COMMIT		iptc_commit
 #define TC_STRERROR		iptc_strerror
 #define TC_NUM_RULES		iptc_num_rules
@@ -209,6 +210,30 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 	return mptr;
 }
 
+/* Hash of the head fields is_same() compares, for the rule index */
+static uint32_t
+head_hash(const STRUCT_ENTRY *e)
+{
+	uint32_t h = IPTCC_HASH_INIT;
+
+	h = iptcc_hash(h, &e->ip.src, sizeof(e->ip.src));
+	h = iptcc_hash(h, &e->ip.dst, sizeof(e->ip.dst));
+	h = iptcc_hash(h, &e->ip.smsk, sizeof(e->ip.smsk));
+	h = iptcc_hash(h, &e->ip.dmsk, sizeof(e->ip.dmsk));
+	h = iptcc_hash(h, &e->ip.proto, sizeof(e->ip.proto));
+	h = iptcc_hash(h, &e->ip.flags, sizeof(e->ip.flags));
+	h = iptcc_hash(h, &e->ip.invflags, sizeof(e->ip.invflags));
+	h = iptcc_hash(h, e->ip.iniface_mask, IFNAMSIZ);
+	h = iptcc_hash_masked(h, (unsigned char *)e->ip.iniface,
+			      e->ip.iniface_mask, IFNAMSIZ);
+	h = iptcc_hash(h, e->ip.outiface_mask, IFNAMSIZ);
+	h = iptcc_hash_masked(h, (unsigned char *)e->ip.outiface,
+			      e->ip.outiface_mask, IFNAMSIZ);
+	h = iptcc_hash(h, &e->target_offset, sizeof(e->target_offset));
+
+	return h;
+}
+
 #if 0
 /***************************** DEBUGGING ********************************/
 static inline int
@@ -84,6 +84,7 @@ typedef unsigned int socklen_t;
 #define TC_GET_RAW_SOCKET	ip6tc_get_raw_socket
 #define TC_INIT			ip6tc_init
 #define TC_FREE			ip6tc_free
+#define TC_REFRESH		ip6tc_refresh
 #define TC_COMMIT		ip6tc_commit
 #define TC_STRERROR		ip6tc_strerror
 #define TC_NUM_RULES		ip6tc_num_rules
@@ -244,6 +245,31 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	return mptr;
 }
 
+/* Hash of the head fields is_same() compares, for the rule index */
+static uint32_t
+head_hash(const STRUCT_ENTRY *e)
+{
+	uint32_t h = IPTCC_HASH_INIT;
+
+	h = iptcc_hash(h, &e->ipv6.src, sizeof(e->ipv6.src));
+	h = iptcc_hash(h, &e->ipv6.dst, sizeof(e->ipv6.dst));
+	h = iptcc_hash(h, &e->ipv6.smsk, sizeof(e->ipv6.smsk));
+	h = iptcc_hash(h, &e->ipv6.dmsk, sizeof(e->ipv6.dmsk));
+	h = iptcc_hash(h, &e->ipv6.proto, sizeof(e->ipv6.proto));
+	h = iptcc_hash(h, &e->ipv6.tos, sizeof(e->ipv6.tos));
+	h = iptcc_hash(h, &e->ipv6.flags, sizeof(e->ipv6.flags));
+	h = iptcc_hash(h, &e->ipv6.invflags, sizeof(e->ipv6.invflags));
+	h = iptcc_hash(h, e->ipv6.iniface_mask, IFNAMSIZ);
+	h = iptcc_hash_masked(h, (unsigned char *)e->ipv6.iniface,
+			      e->ipv6.iniface_mask, IFNAMSIZ);
+	h = iptcc_hash(h, e->ipv6.outiface_mask, IFNAMSIZ);
+	h = iptcc_hash_masked(h, (unsigned char *)e->ipv6.outiface,
+			      e->ipv6.outiface_mask, IFNAMSIZ);
+	h = iptcc_hash(h, &e->target_offset, sizeof(e->target_offset));
+
+	return h;
+}
+
 #if 0
 /* All zeroes == unconditional rule. */
 static inline int
@@ -100,13 +100,27 @@ struct rule_head
 	enum iptcc_rule_type type;
 	struct chain_head *jump;	/* jump target, if IPTCC_R_JUMP */
 
+	struct rule_head *hash_next;	/* next in rule index bucket */
+	uint32_t hash;			/* hash under rule index mask */
+
 	unsigned int size;		/* size of entry data */
 	STRUCT_ENTRY entry[0];
 };
 
+/* Hash of the rules of a chain, for finding rules by content */
+struct rule_index
+{
+	unsigned char *mask;		/* matchmask the hashes are for */
+	unsigned int mask_len;		/* size of rules in the index */
+	unsigned int size;		/* number of buckets, power of 2 */
+	unsigned int count;		/* number of rules in the index */
+	struct rule_head **buckets;
+};
+
 struct chain_head
 {
 	struct list_head list;
+	struct chain_head *hash_next;	/* next in chain hash bucket */
 	char name[TABLE_MAXNAMELEN];
 	unsigned int hooknum;		/* hook number+1 if builtin */
 	unsigned int references;	/* how many jumps reference us */
@@ -122,6 +136,8 @@ struct chain_head
 	unsigned int head_offset;	/* offset in rule blob */
 	unsigned int foot_index;	/* index (needed for counter_map) */
 	unsigned int foot_offset;	/* offset in rule blob */
+
+	struct rule_index *rule_index;	/* built by delete_entry() */
 };
 
 struct xtc_handle {
@@ -138,6 +154,9 @@ struct xtc_handle {
 	struct chain_head **chain_index;   /* array for fast chain list access*/
 	unsigned int        chain_index_sz;/* size of chain index array */
 
+	struct chain_head **chain_hash;    /* chains hashed by name */
+	unsigned int        chain_hash_sz; /* number of buckets, power of 2 */
+
 	int sorted_offsets; /* if chains are received sorted from kernel,
 			     * then the offsets are also sorted. Says if its
 			     * possible to bsearch offsets using chain_index.
@@ -188,6 +207,32 @@ set_changed(struct xtc_handle *h)
 	h->changed = 1;
 }
 
+/* FNV-1a, for chain names and rule contents */
+#define IPTCC_HASH_INIT		2166136261U
+
+static inline uint32_t iptcc_hash(uint32_t h, const void *data,
+				  unsigned int len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static inline uint32_t iptcc_hash_masked(uint32_t h, const unsigned char *p,
+					 const unsigned char *mask,
+					 unsigned int len)
+{
+	while (len--) {
+		h ^= *p++ & *mask++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
 /**********************************************************************
  * iptc blob utility functions (iptcb_*)
  **********************************************************************/
@@ -445,38 +490,6 @@ iptcc_bsearch_chain_offset(unsigned int offset, unsigned int *idx,
 }
 
 
-#ifdef DEBUG
-/* Trivial linear search of chain index. Function used for verifying
-   the output of bsearch function */
-static struct list_head *
-iptcc_linearly_search_chain_index(const char *name, struct xtc_handle *handle)
-{
-	unsigned int i=0;
-	int res=0;
-
-	struct list_head *list_pos;
-	list_pos = &handle->chains;
-
-	if (handle->chain_index_sz)
-		list_pos = &handle->chain_index[0]->list;
-
-	/* Linearly walk of chain index array */
-
-	for (i=0; i < handle->chain_index_sz; i++) {
-		if (handle->chain_index[i]) {
-			res = strcmp(handle->chain_index[i]->name, name);
-			if (res > 0)
-				break; // One step too far
-			list_pos = &handle->chain_index[i]->list;
-			if (res == 0)
-				break; // Direct hit
-		}
-	}
-
-	return list_pos;
-}
-#endif
-
 static int iptcc_chain_index_alloc(struct xtc_handle *h)
 {
 	unsigned int list_length = CHAIN_INDEX_BUCKET_LEN;
@@ -506,6 +519,7 @@ static void iptcc_chain_index_free(struct xtc_handle *h)
 {
 	h->chain_index_sz = 0;
 	free(h->chain_index);
+	h->chain_index = NULL;
 }
 
 
@@ -627,6 +641,91 @@ static int iptcc_chain_index_delete_chain(struct chain_head *c, struct xtc_handl
 }
 
 
+/**********************************************************************
+ * Chain hash (cache utility) functions
+ **********************************************************************
+ * Chain lookups by name go through a hash table, chained through
+ * chain_head->hash_next.  The chain index above is still used for
+ * inserting chains sorted and for looking up jump targets by offset
+ * while parsing.
+ */
+#ifndef CHAIN_HASH_MIN
+#define CHAIN_HASH_MIN 64
+#endif
+
+static inline unsigned int
+iptcc_chain_hash_bucket(struct xtc_handle *h, const char *name)
+{
+	return iptcc_hash(IPTCC_HASH_INIT, name, strlen(name))
+		& (h->chain_hash_sz - 1);
+}
+
+/* (Re)build the chain hash with at least `chains' buckets */
+static int iptcc_chain_hash_build(struct xtc_handle *h, unsigned int chains)
+{
+	struct chain_head **hash, *c;
+	unsigned int size = CHAIN_HASH_MIN;
+
+	while (size < chains)
+		size <<= 1;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -ENOMEM;
+
+	free(h->chain_hash);
+	h->chain_hash = hash;
+	h->chain_hash_sz = size;
+
+	list_for_each_entry(c, &h->chains, list) {
+		unsigned int b = iptcc_chain_hash_bucket(h, c->name);
+
+		c->hash_next = hash[b];
+		hash[b] = c;
+	}
+	return 1;
+}
+
+/* Put a chain in its bucket, without growing the hash */
+static void iptcc_chain_hash_link(struct xtc_handle *h, struct chain_head *c)
+{
+	unsigned int b = iptcc_chain_hash_bucket(h, c->name);
+
+	c->hash_next = h->chain_hash[b];
+	h->chain_hash[b] = c;
+}
+
+/* Add a chain, which has to be on the chain list already */
+static int iptcc_chain_hash_add(struct xtc_handle *h, struct chain_head *c)
+{
+	if (h->num_chains + NUMHOOKS > h->chain_hash_sz)
+		return iptcc_chain_hash_build(h, 2 * h->chain_hash_sz);
+
+	iptcc_chain_hash_link(h, c);
+	return 1;
+}
+
+static void iptcc_chain_hash_del(struct xtc_handle *h, struct chain_head *c)
+{
+	struct chain_head **cp;
+
+	cp = &h->chain_hash[iptcc_chain_hash_bucket(h, c->name)];
+	for (; *cp; cp = &(*cp)->hash_next) {
+		if (*cp == c) {
+			*cp = c->hash_next;
+			return;
+		}
+	}
+}
+
+static void iptcc_chain_hash_free(struct xtc_handle *h)
+{
+	h->chain_hash_sz = 0;
+	free(h->chain_hash);
+	h->chain_hash = NULL;
+}
+
+
 /**********************************************************************
  * iptc cache utility functions (iptcc_*)
  **********************************************************************/
@@ -703,77 +802,190 @@ iptcc_find_chain_by_offset(struct xtc_handle *handle, unsigned int offset)
 static struct chain_head *
 iptcc_find_label(const char *name, struct xtc_handle *handle)
 {
-	struct list_head *pos;
-	struct list_head *list_start_pos;
-	unsigned int i=0;
-	int res;
+	struct chain_head *c;
 
-	if (list_empty(&handle->chains))
+	if (!handle->chain_hash_sz)
 		return NULL;
 
-	/* First look at builtin chains */
-	list_for_each(pos, &handle->chains) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
-		if (!iptcc_is_builtin(c))
-			break;
+	c = handle->chain_hash[iptcc_chain_hash_bucket(handle, name)];
+	for (; c; c = c->hash_next) {
 		if (!strcmp(c->name, name))
 			return c;
 	}
 
-	/* Find a smart place to start the search via chain index */
-  	//list_start_pos = iptcc_linearly_search_chain_index(name, handle);
-  	list_start_pos = iptcc_bsearch_chain_index(name, &i, handle);
+	debug("Hash search NOT found name:%s\n", name);
+	return NULL;
+}
 
-	/* Handel if bsearch bails out early */
-	if (list_start_pos == &handle->chains) {
-		list_start_pos = pos;
+/**********************************************************************
+ * Rule index (cache utility) functions
+ **********************************************************************
+ * delete_entry() compares rules under a caller supplied mask, which
+ * only the extensions know how to build.  So a chain's rule index is
+ * built for the mask of the first lookup that needs it, and rebuilt
+ * when a lookup comes with a different mask.  Only rules the size of
+ * the mask can compare equal, so only those are put into the index.
+ */
+#ifndef RULE_INDEX_MIN_RULES
+#define RULE_INDEX_MIN_RULES 32
+#endif
+
+static uint32_t head_hash(const STRUCT_ENTRY *e);
+
+/* Hash of everything is_same() and target_same() compare */
+static uint32_t iptcc_rule_hash(const struct rule_head *r,
+				const unsigned char *mask)
+{
+	const STRUCT_ENTRY *e = r->entry;
+	const STRUCT_ENTRY_TARGET *t;
+	unsigned int off = sizeof(STRUCT_ENTRY);
+	uint32_t h = head_hash(e);
+
+	while (off < e->target_offset) {
+		const STRUCT_ENTRY_MATCH *m = (const void *)e + off;
+
+		if (m->u.match_size < ALIGN(sizeof(*m)))
+			break;
+		h = iptcc_hash(h, &m->u.match_size, sizeof(m->u.match_size));
+		h = iptcc_hash(h, m->u.user.name,
+			       strnlen(m->u.user.name, sizeof(m->u.user.name)));
+		h = iptcc_hash_masked(h, m->data, mask + off + ALIGN(sizeof(*m)),
+				      m->u.match_size - ALIGN(sizeof(*m)));
+		off += m->u.match_size;
 	}
-#ifdef DEBUG
-	else {
-		/* Verify result of bsearch against linearly index search */
-		struct list_head *test_pos;
-		struct chain_head *test_c, *tmp_c;
-		test_pos = iptcc_linearly_search_chain_index(name, handle);
-		if (list_start_pos != test_pos) {
-			debug("BUG in chain_index search\n");
-			test_c=list_entry(test_pos,      struct chain_head,list);
-			tmp_c =list_entry(list_start_pos,struct chain_head,list);
-			debug("Verify search found:\n");
-			debug(" Chain:%s\n", test_c->name);
-			debug("BSearch found:\n");
-			debug(" Chain:%s\n", tmp_c->name);
-			exit(42);
-		}
+
+	t = (const void *)e + e->target_offset;
+	h = iptcc_hash(h, &r->type, sizeof(r->type));
+	switch (r->type) {
+	case IPTCC_R_FALLTHROUGH:
+		break;
+	case IPTCC_R_JUMP:
+		h = iptcc_hash(h, &r->jump, sizeof(r->jump));
+		break;
+	case IPTCC_R_STANDARD:
+		h = iptcc_hash(h, &((STRUCT_STANDARD_TARGET *)t)->verdict,
+			       sizeof(int));
+		break;
+	case IPTCC_R_MODULE:
+		h = iptcc_hash(h, &t->u.target_size, sizeof(t->u.target_size));
+		h = iptcc_hash(h, t->u.user.name,
+			       strnlen(t->u.user.name, sizeof(t->u.user.name)));
+		h = iptcc_hash_masked(h, t->data, mask + e->target_offset
+				      + ALIGN(sizeof(STRUCT_ENTRY_TARGET)),
+				      t->u.target_size - sizeof(*t));
+		break;
 	}
-#endif
+	return h;
+}
 
-	/* Initial/special case, no user defined chains */
-	if (handle->num_chains == 0)
-		return NULL;
+static void iptcc_rule_index_free(struct chain_head *c)
+{
+	if (!c->rule_index)
+		return;
 
-	/* Start searching through the chain list */
-	list_for_each(pos, list_start_pos->prev) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
-		res = strcmp(c->name, name);
-		debug("List search name:%s == %s res:%d\n", name, c->name, res);
-		if (res==0)
-			return c;
+	free(c->rule_index->buckets);
+	free(c->rule_index->mask);
+	free(c->rule_index);
+	c->rule_index = NULL;
+}
+
+static int iptcc_rule_index_grow(struct rule_index *ri)
+{
+	struct rule_head **buckets;
+	unsigned int size = ri->size * 2;
+	unsigned int i;
 
-		/* We can stop earlier as we know list is sorted */
-		if (res>0 && !iptcc_is_builtin(c)) { /* Walked too far*/
-			debug(" Not in list, walked too far, sorted list\n");
-			return NULL;
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets)
+		return -ENOMEM;
+
+	for (i = 0; i < ri->size; i++) {
+		struct rule_head *r, *next;
+
+		for (r = ri->buckets[i]; r; r = next) {
+			next = r->hash_next;
+			r->hash_next = buckets[r->hash & (size - 1)];
+			buckets[r->hash & (size - 1)] = r;
 		}
+	}
+
+	free(ri->buckets);
+	ri->buckets = buckets;
+	ri->size = size;
+	return 1;
+}
+
+/* Called for every rule added to a chain */
+static void iptcc_rule_index_add(struct chain_head *c, struct rule_head *r)
+{
+	struct rule_index *ri = c->rule_index;
+	unsigned int b;
+
+	if (!ri || r->size != ri->mask_len)
+		return;
 
-		/* Stop on wrap around, if list head is reached */
-		if (pos == &handle->chains) {
-			debug("Stop, list head reached\n");
-			return NULL;
+	if (ri->count >= 2 * ri->size && iptcc_rule_index_grow(ri) < 0) {
+		iptcc_rule_index_free(c);
+		return;
+	}
+
+	r->hash = iptcc_rule_hash(r, ri->mask);
+	b = r->hash & (ri->size - 1);
+	r->hash_next = ri->buckets[b];
+	ri->buckets[b] = r;
+	ri->count++;
+}
+
+static void iptcc_rule_index_del(struct chain_head *c, struct rule_head *r)
+{
+	struct rule_index *ri = c->rule_index;
+	struct rule_head **rp;
+
+	if (!ri || r->size != ri->mask_len)
+		return;
+
+	for (rp = &ri->buckets[r->hash & (ri->size - 1)]; *rp;
+	     rp = &(*rp)->hash_next) {
+		if (*rp == r) {
+			*rp = r->hash_next;
+			ri->count--;
+			return;
 		}
 	}
+}
 
-	debug("List search NOT found name:%s\n", name);
-	return NULL;
+static int iptcc_rule_index_build(struct chain_head *c,
+				  const unsigned char *mask,
+				  unsigned int mask_len)
+{
+	struct rule_index *ri;
+	struct rule_head *r;
+
+	iptcc_rule_index_free(c);
+
+	ri = calloc(1, sizeof(*ri));
+	if (!ri)
+		return -ENOMEM;
+
+	ri->size = 16;
+	while (ri->size < c->num_rules)
+		ri->size <<= 1;
+	ri->buckets = calloc(ri->size, sizeof(*ri->buckets));
+	ri->mask = malloc(mask_len);
+	if (!ri->buckets || !ri->mask) {
+		free(ri->buckets);
+		free(ri->mask);
+		free(ri);
+		return -ENOMEM;
+	}
+	memcpy(ri->mask, mask, mask_len);
+	ri->mask_len = mask_len;
+
+	c->rule_index = ri;
+	list_for_each_entry(r, &c->rules, list)
+		iptcc_rule_index_add(c, r);
+
+	return c->rule_index ? 1 : -ENOMEM;
 }
 
 /* called when rule is to be removed from cache */
@@ -785,6 +997,8 @@ static void iptcc_delete_rule(struct rule_head *r)
 	    && r->jump)
 		r->jump->references--;
 
+	iptcc_rule_index_del(r->chain, r);
+
 	list_del(&r->list);
 	free(r);
 }
@@ -1048,6 +1262,10 @@ static int parse_table(struct xtc_handle *h)
 		return -ENOMEM;
 	iptcc_chain_index_build(h);
 
+	/* ... and the chain hash, for lookups by name */
+	if (iptcc_chain_hash_build(h, 2 * (h->num_chains + NUMHOOKS)) < 0)
+		return -ENOMEM;
+
 	/* Second pass: fixup parsed data from first pass */
 	list_for_each_entry(c, &h->chains, list) {
 		struct rule_head *r;
@@ -1071,6 +1289,33 @@ static int parse_table(struct xtc_handle *h)
 }
 
 
+/* drop all chains and rules from the cache */
+static void iptcc_cache_free(struct xtc_handle *h)
+{
+	struct chain_head *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &h->chains, list) {
+		struct rule_head *r, *rtmp;
+
+		list_for_each_entry_safe(r, rtmp, &c->rules, list) {
+			free(r);
+		}
+
+		iptcc_rule_index_free(c);
+		free(c);
+	}
+	INIT_LIST_HEAD(&h->chains);
+
+	iptcc_chain_index_free(h);
+	iptcc_chain_hash_free(h);
+
+	h->num_chains = 0;
+	h->chain_iterator_cur = NULL;
+	h->rule_iterator_cur = NULL;
+	h->changed = 0;
+}
+
+
 /**********************************************************************
  * RULESET COMPILATION (cache -> blob)
  **********************************************************************/
@@ -1137,6 +1382,7 @@ static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl, struc
 	if (!iptcc_is_builtin(c)) {
 		/* put chain header in place */
 		head = (void *)repl->entries + c->head_offset;
+		memset(head, 0, IPTCB_CHAIN_START_SIZE);
 		head->e.target_offset = sizeof(STRUCT_ENTRY);
 		head->e.next_offset = IPTCB_CHAIN_START_SIZE;
 		strcpy(head->name.target.u.user.name, ERROR_TARGET);
@@ -1158,6 +1404,7 @@ static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl, struc
 
 	/* put chain footer in place */
 	foot = (void *)repl->entries + c->foot_offset;
+	memset(foot, 0, IPTCB_CHAIN_FOOT_SIZE);
 	foot->e.target_offset = sizeof(STRUCT_ENTRY);
 	foot->e.next_offset = IPTCB_CHAIN_FOOT_SIZE;
 	strcpy(foot->target.target.u.user.name, STANDARD_TARGET);
@@ -1247,6 +1494,7 @@ static int iptcc_compile_table(struct xtc_handle *h, STRUCT_REPLACE *repl)
 
 	/* Append error rule at end of chain */
 	error = (void *)repl->entries + repl->size - IPTCB_CHAIN_ERROR_SIZE;
+	memset(error, 0, IPTCB_CHAIN_ERROR_SIZE);
 	error->entry.target_offset = sizeof(STRUCT_ENTRY);
 	error->entry.next_offset = IPTCB_CHAIN_ERROR_SIZE;
 	error->target.target.u.user.target_size =
@@ -1257,6 +1505,101 @@ static int iptcc_compile_table(struct xtc_handle *h, STRUCT_REPLACE *repl)
 	return 1;
 }
 
+/**********************************************************************
+ * RULESET REVALIDATION (blob <-> cache)
+ **********************************************************************/
+
+/* Entries come back from the kernel as they were committed, except for
+ * the counters and the hook mask (comefrom) it keeps in them. */
+static inline int iptcb_entry_same(const STRUCT_ENTRY *a,
+				   const STRUCT_ENTRY *b, unsigned int size)
+{
+	if (memcmp(a, b, offsetof(STRUCT_ENTRY, comefrom)) != 0)
+		return 0;
+	return memcmp(a + 1, b + 1, size - sizeof(STRUCT_ENTRY)) == 0;
+}
+
+/* Check whether a freshly read blob is the table the cache describes,
+ * and pick up its counters on the way, so that the cache ends up as
+ * parse_table() would have left it.  This walks the cache in blob
+ * order and allocates nothing, which is much cheaper than a re-parse.
+ * On mismatch the cache is half-updated and has to be thrown away. */
+static int iptcc_cache_revalidate(struct xtc_handle *h,
+				  const STRUCT_GETINFO *info,
+				  STRUCT_GET_ENTRIES *entries)
+{
+	struct chain_head *c;
+	unsigned int num = 0;
+	unsigned int i;
+
+	if (h->changed
+	    || info->valid_hooks != h->info.valid_hooks
+	    || info->num_entries != h->info.num_entries
+	    || info->size != h->info.size)
+		return 0;
+
+	for (i = 0; i < NUMHOOKS; i++) {
+		if (!(info->valid_hooks & (1 << i)))
+			continue;
+		if (info->hook_entry[i] != h->info.hook_entry[i]
+		    || info->underflow[i] != h->info.underflow[i])
+			return 0;
+	}
+
+	list_for_each_entry(c, &h->chains, list) {
+		struct iptcb_chain_start *head;
+		struct iptcb_chain_foot *foot;
+		struct rule_head *r;
+		int verdict;
+
+		if (!iptcc_is_builtin(c)) {
+			head = (void *)entries->entrytable + c->head_offset;
+			if (head->e.next_offset != IPTCB_CHAIN_START_SIZE
+			    || strcmp(head->name.target.u.user.name,
+				      ERROR_TARGET) != 0
+			    || strncmp(head->name.errorname, c->name,
+				       XT_FUNCTION_MAXNAMELEN) != 0)
+				return 0;
+			num++;
+		}
+
+		list_for_each_entry(r, &c->rules, list) {
+			STRUCT_ENTRY *e = (void *)entries->entrytable
+					  + r->offset;
+
+			if (r->index != num
+			    || !iptcb_entry_same(e, r->entry, r->size))
+				return 0;
+
+			r->entry->counters = e->counters;
+			r->entry->comefrom = e->comefrom;
+			r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+			r->counter_map.mappos = num;
+			num++;
+		}
+
+		foot = (void *)entries->entrytable + c->foot_offset;
+		verdict = iptcc_is_builtin(c) ? c->verdict : RETURN;
+		if (foot->e.next_offset != IPTCB_CHAIN_FOOT_SIZE
+		    || foot->e.target_offset != sizeof(STRUCT_ENTRY)
+		    || strcmp(foot->target.target.u.user.name,
+			      STANDARD_TARGET) != 0
+		    || foot->target.verdict != verdict)
+			return 0;
+
+		c->foot_index = num;
+		if (iptcc_is_builtin(c)) {
+			c->counters = foot->e.counters;
+			c->counter_map.maptype = COUNTER_MAP_ZEROED;
+			c->counter_map.mappos = num;
+		}
+		num++;
+	}
+
+	/* ... and the ERROR entry closing the table */
+	return num + 1 == info->num_entries;
+}
+
 /**********************************************************************
  * EXTERNAL API (operates on cache only)
  **********************************************************************/
@@ -1276,7 +1619,8 @@ alloc_handle(STRUCT_GETINFO *infop)
 	INIT_LIST_HEAD(&h->chains);
 	strcpy(h->info.name, infop->name);
 
-	h->entries = malloc(sizeof(STRUCT_GET_ENTRIES) + infop->size);
+	/* zeroed, see TC_REFRESH */
+	h->entries = calloc(1, sizeof(STRUCT_GET_ENTRIES) + infop->size);
 	if (!h->entries)
 		goto out_free_handle;
 
@@ -1374,25 +1718,71 @@ error:
 void
 TC_FREE(struct xtc_handle *h)
 {
-	struct chain_head *c, *tmp;
-
 	iptc_fn = TC_FREE;
 	close(h->sockfd);
 
-	list_for_each_entry_safe(c, tmp, &h->chains, list) {
-		struct rule_head *r, *rtmp;
+	iptcc_cache_free(h);
 
-		list_for_each_entry_safe(r, rtmp, &c->rules, list) {
-			free(r);
-		}
+	free(h->entries);
+	free(h);
+}
 
-		free(c);
+/* Bring a handle back in sync with the kernel, e.g. after TC_COMMIT
+ * and before the next round of changes.  As long as nobody else
+ * touched the table, only the counters are taken over; otherwise (or
+ * if there are uncommitted changes) the cache is rebuilt from
+ * scratch.  On failure the handle can only be freed. */
+int
+TC_REFRESH(struct xtc_handle *h)
+{
+	STRUCT_GETINFO info;
+	STRUCT_GET_ENTRIES *entries;
+	unsigned int tmp;
+	socklen_t s;
+
+retry:
+	iptc_fn = TC_REFRESH;
+
+	s = sizeof(info);
+	strcpy(info.name, h->info.name);
+	if (getsockopt(h->sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+		return 0;
+
+	/* The cache is checked against the new blob, not the old one, so
+	 * read right into the old buffer: its pages are already mapped.
+	 * The kernel does not write the tail of match and target names,
+	 * which have to compare equal, hence the memset. */
+	tmp = sizeof(STRUCT_GET_ENTRIES) + info.size;
+	entries = realloc(h->entries, tmp);
+	if (!entries) {
+		errno = ENOMEM;
+		return 0;
 	}
+	h->entries = entries;
+	memset(entries, 0, tmp);
+	strcpy(entries->name, info.name);
+	entries->size = info.size;
 
-	iptcc_chain_index_free(h);
+	if (getsockopt(h->sockfd, TC_IPPROTO, SO_GET_ENTRIES, entries,
+		       &tmp) < 0) {
+		/* A different process changed the ruleset size, retry */
+		if (errno == EAGAIN)
+			goto retry;
+		return 0;
+	}
 
-	free(h->entries);
-	free(h);
+	if (iptcc_cache_revalidate(h, &info, entries)) {
+		h->info = info;
+		return 1;
+	}
+
+	DEBUGP("table changed, re-parsing\n");
+	h->info = info;
+	iptcc_cache_free(h);
+	if (parse_table(h) < 0)
+		return 0;
+
+	return 1;
 }
 
 static inline int
@@ -1783,6 +2173,7 @@ TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
 
 	list_add_tail(&r->list, prev);
 	c->num_rules++;
+	iptcc_rule_index_add(c, r);
 
 	set_changed(handle);
 
@@ -1833,6 +2224,7 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 
 	list_add(&r->list, &old->list);
 	iptcc_delete_rule(old);
+	iptcc_rule_index_add(c, r);
 
 	set_changed(handle);
 
@@ -1873,6 +2265,7 @@ TC_APPEND_ENTRY(const IPT_CHAINLABEL chain,
 
 	list_add_tail(&r->list, &c->rules);
 	c->num_rules++;
+	iptcc_rule_index_add(c, r);
 
 	set_changed(handle);
 
@@ -1948,6 +2341,67 @@ is_same(const STRUCT_ENTRY *a,
 	unsigned char *matchmask);
 
 
+/* Look up the rule matching `r' under `matchmask' in the rule index of
+ * its chain.  Returns 0 if the chain has to be scanned instead: if the
+ * index cannot be built, or if more than one rule matches, as the
+ * first of them in the chain has to win. */
+static int iptcc_rule_index_lookup(struct chain_head *c, struct rule_head *r,
+				   unsigned char *matchmask,
+				   struct rule_head **found)
+{
+	struct rule_index *ri = c->rule_index;
+	struct rule_head *i;
+	uint32_t hash;
+
+	if (!ri || ri->mask_len != r->size
+	    || memcmp(ri->mask, matchmask, r->size) != 0) {
+		if (iptcc_rule_index_build(c, matchmask, r->size) < 0)
+			return 0;
+		ri = c->rule_index;
+	}
+
+	hash = iptcc_rule_hash(r, matchmask);
+
+	*found = NULL;
+	for (i = ri->buckets[hash & (ri->size - 1)]; i; i = i->hash_next) {
+		unsigned char *mask;
+
+		if (i->hash != hash)
+			continue;
+
+		mask = is_same(r->entry, i->entry, matchmask);
+		if (!mask || !target_same(r, i, mask))
+			continue;
+
+		if (*found)
+			return 0;
+		*found = i;
+	}
+	return 1;
+}
+
+/* find the first rule in `chain' which matches `r' the hard way */
+static struct rule_head *iptcc_rule_scan(struct chain_head *c,
+					 struct rule_head *r,
+					 unsigned char *matchmask)
+{
+	struct rule_head *i;
+
+	list_for_each_entry(i, &c->rules, list) {
+		unsigned char *mask;
+
+		mask = is_same(r->entry, i->entry, matchmask);
+		if (!mask)
+			continue;
+
+		if (!target_same(r, i, mask))
+			continue;
+
+		return i;
+	}
+	return NULL;
+}
+
 /* find the first rule in `chain' which matches `fw' and remove it unless dry_run is set */
 static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
 			unsigned char *matchmask, struct xtc_handle *handle,
@@ -1985,42 +2439,35 @@ static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
 			r->jump->references--;
 	}
 
-	list_for_each_entry(i, &c->rules, list) {
-		unsigned char *mask;
+	/* Long chains are searched via their rule index */
+	if (c->num_rules < RULE_INDEX_MIN_RULES
+	    || !iptcc_rule_index_lookup(c, r, matchmask, &i))
+		i = iptcc_rule_scan(c, r, matchmask);
 
-		mask = is_same(r->entry, i->entry, matchmask);
-		if (!mask)
-			continue;
-
-		if (!target_same(r, i, mask))
-			continue;
-
-		/* if we are just doing a dry run, we simply skip the rest */
-		if (dry_run){
-			free(r);
-			return 1;
-		}
-
-		/* If we are about to delete the rule that is the
-		 * current iterator, move rule iterator back.  next
-		 * pointer will then point to real next node */
-		if (i == handle->rule_iterator_cur) {
-			handle->rule_iterator_cur =
-				list_entry(handle->rule_iterator_cur->list.prev,
-					   struct rule_head, list);
-		}
-
-		c->num_rules--;
-		iptcc_delete_rule(i);
+	free(r);
+	if (!i) {
+		errno = ENOENT;
+		return 0;
+	}
 
-		set_changed(handle);
-		free(r);
+	/* if we are just doing a dry run, we simply skip the rest */
+	if (dry_run)
 		return 1;
+
+	/* If we are about to delete the rule that is the
+	 * current iterator, move rule iterator back.  next
+	 * pointer will then point to real next node */
+	if (i == handle->rule_iterator_cur) {
+		handle->rule_iterator_cur =
+			list_entry(handle->rule_iterator_cur->list.prev,
+				   struct rule_head, list);
 	}
 
-	free(r);
-	errno = ENOENT;
-	return 0;
+	c->num_rules--;
+	iptcc_delete_rule(i);
+
+	set_changed(handle);
+	return 1;
 }
 
 /* check whether a specified rule is present */
@@ -2096,6 +2543,7 @@ TC_FLUSH_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 		return 0;
 	}
 
+	iptcc_rule_index_free(c);
 	list_for_each_entry_safe(r, tmp, &c->rules, list) {
 		iptcc_delete_rule(r);
 	}
@@ -2258,6 +2706,14 @@ TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 	DEBUGP("Creating chain `%s'\n", chain);
 	iptc_insert_chain(handle, c); /* Insert sorted */
 
+	if (iptcc_chain_hash_add(handle, c) < 0) {
+		iptcc_chain_index_delete_chain(c, handle);
+		handle->num_chains--;
+		free(c);
+		errno = ENOMEM;
+		return 0;
+	}
+
 	/* Inserting chains don't change the correctness of the chain
 	 * index (except if its smaller than index[0], but that
 	 * handled by iptc_insert_chain).  It only causes longer lists
@@ -2342,6 +2798,8 @@ TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 
 	//list_del(&c->list); /* Done in iptcc_chain_index_delete_chain() */
 	iptcc_chain_index_delete_chain(c, handle);
+	iptcc_chain_hash_del(handle, c);
+	iptcc_rule_index_free(c);
 	free(c);
 
 	DEBUGP("chain `%s' deleted\n", chain);
@@ -2357,6 +2815,7 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname,
 		    struct xtc_handle *handle)
 {
 	struct chain_head *c;
+	char name[TABLE_MAXNAMELEN];
 	iptc_fn = TC_RENAME_CHAIN;
 
 	/* find_label doesn't cover built-in targets: DROP, ACCEPT,
@@ -2383,12 +2842,23 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname,
 
 	/* This only unlinks "c" from the list, thus no free(c) */
 	iptcc_chain_index_delete_chain(c, handle);
+	iptcc_chain_hash_del(handle, c);
 
-	/* Change the name of the chain */
+	/* Change the name of the chain; oldname may be c->name itself */
+	memcpy(name, c->name, sizeof(name));
 	strncpy(c->name, newname, sizeof(IPT_CHAINLABEL) - 1);
 
 	/* Insert sorted into to list again */
 	iptc_insert_chain(handle, c);
+	if (iptcc_chain_hash_add(handle, c) < 0) {
+		/* The hash is as it was, less c: put c back as it was */
+		iptcc_chain_index_delete_chain(c, handle);
+		memcpy(c->name, name, sizeof(name));
+		iptc_insert_chain(handle, c);
+		iptcc_chain_hash_link(handle, c);
+		errno = ENOMEM;
+		return 0;
+	}
 
 	set_changed(handle);
 
@@ -2505,6 +2975,36 @@ static void counters_map_set(STRUCT_COUNTERS_INFO *newcounters,
 	DEBUGP_C("SET\n");
 }
 
+/* The kernel now has the table the cache describes: record its layout
+ * and map the counters to their new positions, so that the handle can
+ * take further changes and be committed again (see TC_REFRESH). */
+static void iptcc_commit_done(struct xtc_handle *h, STRUCT_REPLACE *repl,
+			      STRUCT_COUNTERS_INFO *newcounters)
+{
+	struct chain_head *c;
+
+	list_for_each_entry(c, &h->chains, list) {
+		struct rule_head *r;
+
+		if (iptcc_is_builtin(c)) {
+			c->counters = newcounters->counters[c->foot_index];
+			c->counter_map.maptype = COUNTER_MAP_ZEROED;
+			c->counter_map.mappos = c->foot_index;
+		}
+
+		list_for_each_entry(r, &c->rules, list) {
+			r->entry->counters = newcounters->counters[r->index];
+			r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+			r->counter_map.mappos = r->index;
+		}
+	}
+
+	h->info.num_entries = repl->num_entries;
+	h->info.size = repl->size;
+	memcpy(h->info.hook_entry, repl->hook_entry, sizeof(repl->hook_entry));
+	memcpy(h->info.underflow, repl->underflow, sizeof(repl->underflow));
+	h->changed = 0;
+}
 
 int
 TC_COMMIT(struct xtc_handle *handle)
@@ -2535,7 +3035,8 @@ TC_COMMIT(struct xtc_handle *handle)
 		errno = ENOMEM;
 		goto out_zero;
 	}
-	memset(repl, 0, sizeof(*repl) + new_size);
+	/* iptcc_compile_table() writes every byte of the entries */
+	memset(repl, 0, sizeof(*repl));
 
 #if 0
 	TC_DUMP_ENTRIES(*handle);
@@ -2668,6 +3169,8 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (ret < 0)
 		goto out_free_newcounters;
 
+	iptcc_commit_done(handle, repl, newcounters);
+
 	free(repl->counters);
 	free(repl);
 	free(newcounters);
@@ -2739,6 +3242,7 @@ const struct xtc_ops TC_OPS = {
 	.commit        = TC_COMMIT,
 	.init          = TC_INIT,
 	.free          = TC_FREE,
+	.refresh       = TC_REFRESH,
 	.builtin       = TC_BUILTIN,
 	.is_chain      = TC_IS_CHAIN,
 	.flush_entries = TC_FLUSH_ENTRIES,
@@ -240,6 +240,110 @@ static void dlreg_free(void)
 		dlreg = next;
 	}
 }
+
+/*
+ * All extensions linked into one shared object (--enable-extension-bundle).
+ * It is looked up once in the search path and takes precedence over the
+ * single-extension files in the same directory.
+ */
+#define XTABLES_BUNDLE	"libext_bundle.so"
+
+static struct {
+	bool probed;
+	char *dir;
+	const struct xtables_bundle_entry *entries;
+	unsigned int size;
+	bool *done;
+} bundle;
+
+static void bundle_free(void)
+{
+	/* the handle itself is closed along with the dlreg list */
+	free(bundle.dir);
+	free(bundle.done);
+	memset(&bundle, 0, sizeof(bundle));
+}
+
+static void bundle_probe(const char *search_path)
+{
+	const char *dir = search_path, *next;
+	const unsigned int *size;
+	bool found = false;
+	void *handle;
+	char path[256];
+
+	bundle.probed = true;
+	do {
+		next = strchr(dir, ':');
+		if (next == NULL)
+			next = dir + strlen(dir);
+
+		snprintf(path, sizeof(path), "%.*s/%s",
+			 (unsigned int)(next - dir), dir, XTABLES_BUNDLE);
+		if (access(path, F_OK) == 0) {
+			found = true;
+			break;
+		}
+		dir = next + 1;
+	} while (*next != '\0');
+
+	if (!found)
+		return;
+
+	handle = dlopen(path, RTLD_NOW);
+	if (handle == NULL) {
+		fprintf(stderr, "%s: %s\n", path, dlerror());
+		return;
+	}
+	bundle.entries = dlsym(handle, "xtables_bundle");
+	size = dlsym(handle, "xtables_bundle_size");
+	bundle.dir = strndup(dir, next - dir);
+	if (size != NULL)
+		bundle.done = calloc(*size, sizeof(*bundle.done));
+	if (bundle.entries == NULL || bundle.done == NULL ||
+	    bundle.dir == NULL) {
+		fprintf(stderr, "%s: not a valid extension bundle\n", path);
+		dlclose(handle);
+		bundle_free();
+		bundle.probed = true;
+		return;
+	}
+	dlreg_add(handle);
+	bundle.size = *size;
+}
+
+/* Whether @dir (not NUL-terminated) is where the bundle was found. */
+static bool bundle_in(const char *dir, const char *next)
+{
+	return bundle.entries != NULL &&
+	       strlen(bundle.dir) == (size_t)(next - dir) &&
+	       strncmp(bundle.dir, dir, next - dir) == 0;
+}
+
+static int bundle_cmp(const void *key, const void *entry)
+{
+	return strcmp(key, ((const struct xtables_bundle_entry *)entry)->name);
+}
+
+/* Run the init function of the bundled extension file @name, at most once. */
+static bool bundle_load(const char *name)
+{
+	const struct xtables_bundle_entry *e;
+	unsigned int i;
+
+	e = bsearch(name, bundle.entries, bundle.size, sizeof(*e), bundle_cmp);
+	if (e == NULL)
+		return false;
+
+	/* aliases share the init function of the file they point to */
+	for (i = 0; i < bundle.size; ++i)
+		if (bundle.entries[i].init == e->init && bundle.done[i])
+			return true;
+
+	bundle.done[e - bundle.entries] = true;
+	e->init();
+	return true;
+}
 #endif
 
 void xtables_init(void)
@@ -272,6 +376,7 @@ void xtables_init(void)
 void xtables_fini(void)
 {
 #ifndef NO_SHARED_LIBS
+	bundle_free();
 	dlreg_free();
 #endif
 }
@@ -594,16 +699,35 @@ void xtables_parse_interface(const char *arg, char *vianame,
 }
 
 #ifndef NO_SHARED_LIBS
+/* Look up an extension whose shared object was just loaded. */
+static void *load_registered(const char *name, bool is_target)
+{
+	void *ptr;
+
+	if (is_target)
+		ptr = xtables_find_target(name, XTF_DONT_LOAD);
+	else
+		ptr = xtables_find_match(name, XTF_DONT_LOAD, NULL);
+
+	if (ptr != NULL)
+		return ptr;
+
+	errno = ENOENT;
+	return NULL;
+}
+
 static void *load_extension(const char *search_path, const char *af_prefix,
     const char *name, bool is_target)
 {
 	const char *all_prefixes[] = {af_prefix, "libxt_", NULL};
 	const char **prefix;
 	const char *dir = search_path, *next;
-	void *ptr = NULL;
 	struct stat sb;
 	char path[256];
 
+	if (!bundle.probed)
+		bundle_probe(search_path);
+
 	do {
 		next = strchr(dir, ':');
 		if (next == NULL)
@@ -612,6 +736,13 @@ static void *load_extension(const char *search_path, const char *af_prefix,
 		for (prefix = all_prefixes; *prefix != NULL; ++prefix) {
 			void *handle;
 
+			if (bundle_in(dir, next)) {
+				snprintf(path, sizeof(path), "%s%s",
+					 *prefix, name);
+				if (bundle_load(path))
+					return load_registered(name, is_target);
+			}
+
 			snprintf(path, sizeof(path), "%.*s/%s%s.so",
 			         (unsigned int)(next - dir), dir,
 			         *prefix, name);
@@ -630,18 +761,7 @@ static void *load_extension(const char *search_path, const char *af_prefix,
 			}
 
 			dlreg_add(handle);
-
-			if (is_target)
-				ptr = xtables_find_target(name, XTF_DONT_LOAD);
-			else
-				ptr = xtables_find_match(name,
-				      XTF_DONT_LOAD, NULL);
-
-			if (ptr != NULL)
-				return ptr;
-
-			errno = ENOENT;
-			return NULL;
+			return load_registered(name, is_target);
 		}
 		dir = next + 1;
 	} while (*next != '\0');